@@ -0,0 +1,569 @@
+/** @file bench.c
+ *  @author T J Atherton
+ *
+ *  @brief Microbenchmarks for the cli's hot paths
+*/
+
+#define _XOPEN_SOURCE 700 // posix_openpt, mkdtemp
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include "cli.h"
+#include "help.h"
+#include "linedit.h"
+
+/** @brief Usage: morpho6-bench [-filter=text] [-save=file] [-baseline=file] [-scripts=folder]
+ *  @details Each benchmark is repeated until it has run for at least BENCH_MINTIME seconds, and the
+ *  mean time per operation is reported along with the number of allocations made per operation.
+ *  Results may be saved and later compared against as a baseline. Allocations are counted by wrapping
+ *  malloc, calloc and realloc at link time where the linker supports it; this only sees calls made from
+ *  the cli's own code, not those made within libmorpho, which is linked as a separate library. */
+
+#define BENCH_MINTIME 0.25
+#define BENCH_MAXBENCHMARKS 256
+#define BENCH_LINES 2000
+#define BENCH_LARGEFILE (64*1024*1024)
+
+/* Functions internal to linedit that are benchmarked */
+void linedit_syntaxcolorstring(lineditor *edit, linedit_string *in, linedit_string *out);
+void linedit_stringdisplaycoordinates(lineditor *edit, linedit_string *string, int posn, int *xout, int *yout);
+void linedit_stringaddcstring(linedit_string *string, char *s);
+void linedit_stringinit(linedit_string *string);
+void linedit_stringclear(linedit_string *string);
+int linedit_stringlength(linedit_string *string);
+bool linedit_layout(lineditor *edit, linedit_string *output);
+void linedit_plainstring(lineditor *edit, linedit_string *in, linedit_string *out);
+void linedit_startscreen(lineditor *edit);
+void linedit_redraw(lineditor *edit);
+void linedit_setposition(lineditor *edit, int posn);
+void linedit_stringlistinit(linedit_stringlist *list);
+void linedit_stringlistclear(linedit_stringlist *list);
+
+/* **********************************************************************
+ * Allocation counting
+ * ********************************************************************** */
+
+static size_t bench_nallocations = 0;
+
+#ifdef BENCH_COUNTALLOCATIONS
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size) { bench_nallocations++; return __real_malloc(size); }
+void *__wrap_calloc(size_t n, size_t size) { bench_nallocations++; return __real_calloc(n, size); }
+void *__wrap_realloc(void *ptr, size_t size) { bench_nallocations++; return __real_realloc(ptr, size); }
+#endif
+
+/* **********************************************************************
+ * Benchmark runner
+ * ********************************************************************** */
+
+typedef void (*benchfn) (void *ref);
+
+/** Result of a benchmark */
+typedef struct {
+    char name[128];
+    double ns;      // Time per operation in nanoseconds
+    double allocs;  // Allocations per operation
+} benchresult;
+
+static benchresult bench_results[BENCH_MAXBENCHMARKS];
+static int bench_nresults = 0;
+
+static benchresult bench_baseline[BENCH_MAXBENCHMARKS];
+static int bench_nbaseline = 0;
+
+static const char *bench_filter = NULL;
+
+/** Returns the time on a monotonic clock in seconds */
+static double bench_now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec+t.tv_nsec*1e-9;
+}
+
+/** Finds a benchmark in the baseline */
+static benchresult *bench_findbaseline(const char *name) {
+    for (int i=0; i<bench_nbaseline; i++) if (strcmp(bench_baseline[i].name, name)==0) return &bench_baseline[i];
+    return NULL;
+}
+
+/** Runs a benchmark repeatedly, doubling the number of repetitions until it runs for long enough */
+static void bench_run(const char *name, benchfn fn, void *ref) {
+    if (bench_filter && !strstr(name, bench_filter)) return;
+    if (bench_nresults>=BENCH_MAXBENCHMARKS) return;
+
+    fn(ref); // Warm up
+
+    double elapsed=0;
+    size_t n, nallocs=0;
+    for (n=1; ; n*=2) {
+        size_t allocs=bench_nallocations;
+        double start=bench_now();
+        for (size_t i=0; i<n; i++) fn(ref);
+        elapsed=bench_now()-start;
+        nallocs=bench_nallocations-allocs;
+        if (elapsed>=BENCH_MINTIME) break;
+    }
+
+    benchresult *r=&bench_results[bench_nresults++];
+    snprintf(r->name, sizeof(r->name), "%s", name);
+    r->ns=elapsed*1e9/n;
+    r->allocs=(double) nallocs/n;
+
+    fprintf(stderr, "%-40s %14.1f ns/op", r->name, r->ns);
+#ifdef BENCH_COUNTALLOCATIONS
+    fprintf(stderr, " %10.1f cli allocs/op", r->allocs);
+#endif
+    benchresult *b=bench_findbaseline(name);
+    if (b && b->ns>0) fprintf(stderr, " %+8.1f%%", 100.0*(r->ns-b->ns)/b->ns);
+    fprintf(stderr, "\n");
+}
+
+/** Loads a baseline saved with -save */
+static bool bench_loadbaseline(const char *file) {
+    FILE *f=fopen(file, "r");
+    if (!f) return false;
+    benchresult r;
+    while (bench_nbaseline<BENCH_MAXBENCHMARKS && fscanf(f, "%127s %lf %lf", r.name, &r.ns, &r.allocs)==3) {
+        bench_baseline[bench_nbaseline++]=r;
+    }
+    fclose(f);
+    return true;
+}
+
+/** Saves results so that they can be used as a baseline */
+static bool bench_save(const char *file) {
+    FILE *f=fopen(file, "w");
+    if (!f) return false;
+    for (int i=0; i<bench_nresults; i++) {
+        fprintf(f, "%s %.3f %.3f\n", bench_results[i].name, bench_results[i].ns, bench_results[i].allocs);
+    }
+    fclose(f);
+    return true;
+}
+
+/* **********************************************************************
+ * Test data
+ * ********************************************************************** */
+
+/** Generates a block of morpho source with a given number of lines */
+static void bench_source(linedit_string *out, int nlines) {
+    char line[256];
+    for (int i=0; i<nlines; i++) {
+        switch (i%4) {
+            case 0: snprintf(line, sizeof(line), "fn f%i(x, y) { return x^2 + %i*y // comment\n", i, i); break;
+            case 1: snprintf(line, sizeof(line), "    var s = \"string $(x) with interpolation\", l = [1, 2.5, 3e%i]\n", i%10); break;
+            case 2: snprintf(line, sizeof(line), "    for (i in 1..%i) if (i>2 && s!=nil) print i\n", i); break;
+            default: snprintf(line, sizeof(line), "}\n"); break;
+        }
+        linedit_stringaddcstring(out, line);
+    }
+}
+
+/** Discards anything written to the pseudo-terminal */
+static void bench_drain(int fd) {
+    char buffer[65536];
+    while (read(fd, buffer, sizeof(buffer))>0);
+}
+
+/* **********************************************************************
+ * linedit benchmarks
+ * ********************************************************************** */
+
+typedef struct {
+    lineditor edit;
+    clilexer lexer;
+    linedit_string in;
+    int pty;
+} benchlinedit;
+
+static void bench_lineditinit(benchlinedit *b, int nlines) {
+    linedit_init(&b->edit);
+    cli_lexerinit(&b->lexer);
+    linedit_resumablesyntaxcolor(&b->edit, cli_lex, &b->lexer, cli_tokencolors);
+    linedit_stringinit(&b->in);
+    bench_source(&b->in, nlines);
+    b->edit.ncols=80;
+    b->pty=-1;
+}
+
+static void bench_lineditclear(benchlinedit *b) {
+    linedit_stringclear(&b->in);
+    linedit_clear(&b->edit);
+    cli_lexerclear(&b->lexer);
+}
+
+static void bench_syntaxcolor(void *ref) {
+    benchlinedit *b=ref;
+    linedit_string out;
+    linedit_stringinit(&out);
+    linedit_syntaxcolorstring(&b->edit, &b->in, &out);
+    linedit_stringclear(&out);
+}
+
+/** Syntax colors after changing a digit within one of the last lines, as happens while typing */
+static void bench_syntaxcoloredit(void *ref) {
+    benchlinedit *b=ref;
+    char *c=b->in.string+b->in.length-1;
+    while (c>b->in.string && !isdigit(*c)) c--; // The last lines end in "}\n", so don't just step back from the end
+    *c=(*c=='1' ? '2' : '1');
+    bench_syntaxcolor(ref);
+}
+
+static void bench_displaycoordinates(void *ref) {
+    benchlinedit *b=ref;
+    int x, y;
+    linedit_stringdisplaycoordinates(&b->edit, &b->in, linedit_stringlength(&b->in), &x, &y);
+}
+
+static void bench_layout(void *ref) {
+    benchlinedit *b=ref;
+    linedit_string out;
+    linedit_stringinit(&out);
+    linedit_plainstring(&b->edit, &b->in, &out);
+    linedit_layout(&b->edit, &out);
+    linedit_stringclear(&out);
+}
+
+/** Redraws the whole buffer to the pseudo-terminal */
+static void bench_redrawfull(void *ref) {
+    benchlinedit *b=ref;
+    linedit_startscreen(&b->edit);
+    linedit_redraw(&b->edit);
+    bench_drain(b->pty);
+}
+
+/** Redraws after a keystroke at the end of the buffer */
+static void bench_redrawkey(void *ref) {
+    benchlinedit *b=ref;
+    if (b->edit.current.length>0) {
+        char *c=b->edit.current.string+b->edit.current.length-1;
+        *c=(*c=='a' ? 'b' : 'a');
+    }
+    linedit_redraw(&b->edit);
+    bench_drain(b->pty);
+}
+
+/** Opens a pseudo-terminal and redirects stdout to it; returns the master side, or -1 */
+static int bench_openpty(int *saved) {
+    int master=posix_openpt(O_RDWR | O_NOCTTY);
+    if (master<0 || grantpt(master)!=0 || unlockpt(master)!=0) return -1;
+
+    int slave=open(ptsname(master), O_RDWR | O_NOCTTY);
+    if (slave<0) { close(master); return -1; }
+
+    struct winsize ws = { .ws_row = 50, .ws_col = 80 };
+    ioctl(slave, TIOCSWINSZ, &ws);
+
+    fflush(stdout);
+    *saved=dup(STDOUT_FILENO);
+    dup2(slave, STDOUT_FILENO);
+    close(slave);
+
+    fcntl(master, F_SETFL, fcntl(master, F_GETFL) | O_NONBLOCK);
+    return master;
+}
+
+static void bench_closepty(int master, int saved) {
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+    close(master);
+}
+
+static void bench_linedit(void) {
+    benchlinedit b;
+    bench_lineditinit(&b, BENCH_LINES);
+    bench_run("linedit_syntaxcolorstring", bench_syntaxcolor, &b);
+    bench_run("linedit_syntaxcolorstring/edit", bench_syntaxcoloredit, &b);
+    bench_run("linedit_stringdisplaycoordinates", bench_displaycoordinates, &b);
+    bench_run("linedit_renderstring/layout", bench_layout, &b);
+    bench_lineditclear(&b);
+
+    /* Redraw a smaller buffer, which fits on the terminal, to a pseudo-terminal */
+    int saved;
+    bench_lineditinit(&b, 40);
+    b.pty=bench_openpty(&saved);
+    if (b.pty>=0) {
+        linedit_stringaddcstring(&b.edit.current, b.in.string);
+        linedit_setposition(&b.edit, -1);
+        bench_run("linedit_redraw/full", bench_redrawfull, &b);
+        linedit_startscreen(&b.edit);
+        bench_run("linedit_redraw/keystroke", bench_redrawkey, &b);
+        bench_closepty(b.pty, saved);
+    } else fprintf(stderr, "Couldn't open a pseudo-terminal; skipping redraw benchmarks.\n");
+    bench_lineditclear(&b);
+}
+
+/* **********************************************************************
+ * Help benchmarks
+ * ********************************************************************** */
+
+static void bench_helpbuild(void *ref) {
+    help_initialize(NULL);
+    help_finalize();
+}
+
+static void bench_helpmap(void *ref) {
+    help_initialize((char *) ref);
+    help_finalize();
+}
+
+static void bench_helpsearch(void *ref) {
+    char *queries[] = { "help", "mesh", "list append", "matrix inverse", "functionals", "nonexistent", NULL };
+    for (int i=0; queries[i]; i++) help_search(queries[i]);
+}
+
+static void bench_helpsearchtext(void *ref) {
+    helptopic *results[HELP_MAXRESULTS];
+    help_searchtext("how do I refine a mesh", results, HELP_MAXRESULTS);
+    help_searchtext("sparce matrix", results, HELP_MAXRESULTS);
+}
+
+static void bench_help(const char *folder) {
+    char indexfile[PATH_MAX];
+    snprintf(indexfile, sizeof(indexfile), "%s/%s", folder, HELP_INDEXFILE);
+
+    bench_run("help_initialize/build", bench_helpbuild, NULL);
+    if (help_buildindex(indexfile)) bench_run("help_initialize/mapped", bench_helpmap, indexfile);
+
+    help_initialize(indexfile);
+    bench_run("help_search", bench_helpsearch, NULL);
+    bench_run("help_searchtext", bench_helpsearchtext, NULL);
+    help_finalize();
+
+    unlink(indexfile);
+}
+
+/* **********************************************************************
+ * Completion benchmarks
+ * ********************************************************************** */
+
+#define BENCH_SYMBOLS 5000
+
+static void bench_completeadd(void *ref) {
+    clicompleter c;
+    clicomplete_init(&c);
+    clicomplete_addkeywords(&c);
+    clicomplete_addsource(&c, (char *) ref);
+    clicomplete_clear(&c);
+}
+
+static void bench_completekeystrokes(void *ref) {
+    char *typed="var total = symbol1234.method(pri";
+    linedit_stringlist suggestions;
+    linedit_stringlistinit(&suggestions);
+    for (size_t n=1; n<=strlen(typed); n++) {
+        char in[n+1];
+        memcpy(in, typed, n);
+        in[n]='\0';
+        linedit_stringlistclear(&suggestions);
+        cli_complete(in, ref, &suggestions);
+    }
+    linedit_stringlistclear(&suggestions);
+}
+
+static void bench_complete(void) {
+    /* A session that has declared many globals and methods */
+    linedit_string src;
+    linedit_stringinit(&src);
+    char line[128];
+    for (int i=0; i<BENCH_SYMBOLS; i++) {
+        snprintf(line, sizeof(line), "var symbol%i = %i\n", i, i);
+        linedit_stringaddcstring(&src, line);
+        if (i%10==0) {
+            snprintf(line, sizeof(line), "class Class%i { method%i(x) { return x } }\nfn function%i(a) { return a }\n", i, i, i);
+            linedit_stringaddcstring(&src, line);
+        }
+    }
+
+    bench_run("clicomplete_addsource", bench_completeadd, src.string);
+
+    clicompleter c;
+    clicomplete_init(&c);
+    clicomplete_addkeywords(&c);
+    clicomplete_addsource(&c, src.string);
+    c.helpadded=true; // Builtins from the help index are covered by the help benchmarks
+    bench_run("cli_complete/keystrokes", bench_completekeystrokes, &c);
+    clicomplete_clear(&c);
+
+    linedit_stringclear(&src);
+}
+
+/* **********************************************************************
+ * Source loading benchmarks
+ * ********************************************************************** */
+
+static void bench_loadsource(void *ref) {
+    clisource src;
+    if (cli_loadsource((char *) ref, &src)) {
+        volatile char c=src.data[src.length/2]; // Touch the source
+        (void) c;
+        cli_sourceclear(&src);
+    }
+}
+
+static void bench_source_loading(const char *folder) {
+    char file[PATH_MAX];
+    snprintf(file, sizeof(file), "%s/large.morpho", folder);
+
+    FILE *f=fopen(file, "w");
+    if (!f) return;
+    linedit_string src;
+    linedit_stringinit(&src);
+    bench_source(&src, BENCH_LINES);
+    for (size_t n=0; n<BENCH_LARGEFILE; n+=src.length) fwrite(src.string, 1, src.length, f);
+    fclose(f);
+    linedit_stringclear(&src);
+
+    bench_run("cli_loadsource/64MB", bench_loadsource, file);
+    unlink(file);
+}
+
+/* **********************************************************************
+ * Output benchmarks
+ * ********************************************************************** */
+
+#define BENCH_PRINTS 100000
+
+static void bench_print(void *ref) {
+    cli_outputreset(0);
+    for (int i=0; i<BENCH_PRINTS; i++) cli_outputprint((char *) ref);
+    cli_outputflush();
+}
+
+/** Prints many short lines, as a script printing mesh vertices does, with output discarded */
+static void bench_output(void) {
+    int null=open("/dev/null", O_WRONLY);
+    fflush(stdout);
+    int saved=dup(STDOUT_FILENO);
+    dup2(null, STDOUT_FILENO);
+
+    bench_run("cli_outputprint/100k", bench_print, "0.25 0.5 0.75\n");
+
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+    close(null);
+}
+
+/* **********************************************************************
+ * End to end scripts
+ * ********************************************************************** */
+
+typedef struct {
+    const char *file;
+    clioptions opt;
+} benchscript;
+
+static void bench_script(void *ref) {
+    benchscript *s=ref;
+    cli_run(s->file, s->opt);
+}
+
+/** Runs every script in a folder compile only, run and disassembled, with output discarded */
+static void bench_scripts(const char *folder) {
+    DIR *dir=opendir(folder);
+    if (!dir) {
+        fprintf(stderr, "Couldn't open script folder '%s'.\n", folder);
+        return;
+    }
+
+    int null=open("/dev/null", O_WRONLY);
+    fflush(stdout);
+    int saved=dup(STDOUT_FILENO);
+    dup2(null, STDOUT_FILENO);
+
+    struct dirent *entry;
+    while ((entry=readdir(dir))) {
+        size_t length=strlen(entry->d_name);
+        if (length<7 || strcmp(entry->d_name+length-7, ".morpho")!=0) continue;
+
+        char path[PATH_MAX], name[128];
+        snprintf(path, sizeof(path), "%s/%s", folder, entry->d_name);
+
+        struct { char *label; clioptions opt; } modes[] = {
+            { "compile", 0 }, { "run", CLI_RUN }, { "disassemble", CLI_DISASSEMBLE }, { NULL, 0 }
+        };
+        for (int i=0; modes[i].label; i++) {
+            benchscript s = { .file = path, .opt = modes[i].opt };
+            snprintf(name, sizeof(name), "script/%s/%s", modes[i].label, entry->d_name);
+            bench_run(name, bench_script, &s);
+        }
+    }
+
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+    close(null);
+    closedir(dir);
+}
+
+/* **********************************************************************
+ * Main
+ * ********************************************************************** */
+
+/** Finds the value of an option given as -name=value */
+static const char *bench_option(const char *arg, const char *name) {
+    size_t length=strlen(name);
+    if (arg[0]=='-' && strncmp(arg+1, name, length)==0 && arg[length+1]=='=') return arg+length+2;
+    return NULL;
+}
+
+int main(int argc, const char *argv[]) {
+    const char *save=NULL, *baseline=NULL, *scripts=NULL, *value;
+
+    for (int i=1; i<argc; i++) {
+        if ((value=bench_option(argv[i], "filter"))) bench_filter=value;
+        else if ((value=bench_option(argv[i], "save"))) save=value;
+        else if ((value=bench_option(argv[i], "baseline"))) baseline=value;
+        else if ((value=bench_option(argv[i], "scripts"))) scripts=value;
+        else {
+            fprintf(stderr, "Usage: morpho6-bench [-filter=text] [-save=file] [-baseline=file] [-scripts=folder]\n");
+            return 1;
+        }
+    }
+
+    if (baseline && !bench_loadbaseline(baseline)) {
+        fprintf(stderr, "Couldn't read baseline '%s'.\n", baseline);
+        return 1;
+    }
+
+    char folder[]="/tmp/morpho6-benchXXXXXX";
+    if (!mkdtemp(folder)) {
+        fprintf(stderr, "Couldn't create a temporary folder: %s\n", strerror(errno));
+        return 1;
+    }
+
+    morpho_initialize();
+
+#ifdef BENCH_COUNTALLOCATIONS
+    fprintf(stderr, "Allocations are counted in the cli's own code only; those made within libmorpho are not included.\n");
+#endif
+    bench_linedit();
+    bench_help(folder);
+    bench_complete();
+    bench_source_loading(folder);
+    bench_output();
+    if (scripts) bench_scripts(scripts);
+
+    morpho_finalize();
+    rmdir(folder);
+
+    if (save && !bench_save(save)) {
+        fprintf(stderr, "Couldn't save results to '%s'.\n", save);
+        return 1;
+    }
+    return 0;
+}
@@ -6,8 +6,22 @@
 
 #include <time.h>
 #include <stdio.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <poll.h>
+#include <pthread.h>
 #include <parse.h>
 #include <file.h>
+#include <compile.h>
+#include <debug.h>
+#include <vm.h>
 
 #include "cli.h"
 #include "debugger.h"
@@ -21,6 +35,7 @@
 #endif
 
 char *cli_globalsrc=NULL;
+clisession *cli_globalsession=NULL; /* Input of the interactive session, which supersedes cli_globalsrc */
 
 #define CLI_BUFFERSIZE 1024
 
@@ -29,8 +44,289 @@ char *cli_globalsrc=NULL;
 #define GRY   "\x1B[38;2;128;128;128m"
 #define RESET "\x1B[0m"
 
+/* **********************************************************************
+ * Output
+ * ********************************************************************** */
+
+/** @brief Output printed by programs is collected in a buffer and written to stdout in large writes.
+ *  Whether the terminal supports styled text is checked once per session, and the control sequences
+ *  that style printed output are emitted once for each run of prints rather than for every print.
+ *  The buffer is flushed before anything else is displayed, before input is read and at exit. On a
+ *  terminal, it is also flushed at the end of each line printed, so that the progress of a long
+ *  computation remains visible, and by a print made more than CLI_OUTPUTLATENCY after the last flush.
+ *  Output to pipes and files is coalesced fully. */
+
+#define CLI_OUTPUTBUFFERSIZE 65536
+#define CLI_OUTPUTLATENCY 0.05 // Longest that output to a terminal is held back, in seconds
+
+/** Buffered output */
+typedef struct {
+    bool checked;                   /** Whether the terminal has been checked this session */
+    bool tty;                       /** Whether stdout is a terminal */
+    bool styled;                    /** Whether output is styled */
+    bool open;                      /** Whether the style has been set for output in the buffer */
+    char start[LINEDIT_STYLESIZE];  /** Control sequence that sets the style */
+    char end[LINEDIT_STYLESIZE];    /** Control sequence that restores default text */
+    double flushed;                 /** Time of the last flush */
+    bool jsonl;                     /** Whether output is written as JSON records, one per line */
+    varray_char record;             /** Record being constructed */
+    size_t count;                   /** Bytes in the buffer */
+    char buffer[CLI_OUTPUTBUFFERSIZE];
+} clioutput;
+
+static clioutput cli_output = { .checked = false, .open = false, .jsonl = false, .count = 0 };
+
+/** Returns the time on a monotonic clock in seconds */
+static double cli_now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec+t.tv_nsec*1e-9;
+}
+
+/** Adds bytes to the output buffer, writing it out if it fills */
+static void cli_outputadd(const char *data, size_t length) {
+    if (cli_output.count+length>CLI_OUTPUTBUFFERSIZE) {
+        fwrite(cli_output.buffer, sizeof(char), cli_output.count, stdout);
+        cli_output.count=0;
+        if (length>CLI_OUTPUTBUFFERSIZE) {
+            fwrite(data, sizeof(char), length, stdout);
+            return;
+        }
+    }
+    memcpy(cli_output.buffer+cli_output.count, data, length);
+    cli_output.count+=length;
+}
+
+/** @brief Writes out buffered output */
+void cli_outputflush(void) {
+    if (cli_output.open) {
+        cli_outputadd(cli_output.end, strlen(cli_output.end));
+        cli_output.open=false;
+    }
+    if (cli_output.count) {
+        fwrite(cli_output.buffer, sizeof(char), cli_output.count, stdout);
+        cli_output.count=0;
+    }
+    fflush(stdout);
+    if (cli_output.tty) cli_output.flushed=cli_now();
+}
+
+/** @brief Flushes output and begins a new session, whose terminal is checked afresh
+ *  @param[in] opt - options for the session; CLI_JSONL selects JSON records */
+void cli_outputreset(clioptions opt) {
+    cli_outputflush();
+    cli_output.checked=false;
+    cli_output.jsonl=(opt & CLI_JSONL);
+}
+
+/** Checks the terminal at the start of a session; JSON records are never styled */
+static void cli_outputcheck(void) {
+    if (cli_output.checked) return;
+    
+    static bool registered=false;
+    if (!registered) registered=(atexit(cli_outputflush)==0);
+    
+    if (cli_output.jsonl) {
+        cli_output.styled=cli_output.tty=false;
+    } else {
+        cli_output.styled=linedit_stylesequences(CLI_DEFAULTCOLOR, LINEDIT_BOLD, cli_output.start, cli_output.end, LINEDIT_STYLESIZE);
+        cli_output.tty=isatty(STDOUT_FILENO);
+    }
+    cli_output.flushed=cli_now();
+    cli_output.checked=true;
+}
+
+/** @brief Displays output printed by a program */
+void cli_outputprint(const char *string) {
+    cli_outputcheck();
+    
+    if (cli_output.styled && !cli_output.open) {
+        cli_outputadd(cli_output.start, strlen(cli_output.start));
+        cli_output.open=true;
+    }
+    cli_outputadd(string, strlen(string));
+    
+    if (cli_output.tty &&
+        (strchr(string, '\n') || cli_now()-cli_output.flushed>CLI_OUTPUTLATENCY)) cli_outputflush();
+}
+
+/* ----------------------------------------
+ * JSON records
+ * ---------------------------------------- */
+
+/** @brief With -output=jsonl, prints, warnings, errors, statistics and the result of a run are each written
+ *  as a single line JSON object whose "type" identifies the record. Records are assembled in a varray_char,
+ *  which lets jobs capture them like any other output, and are written through the output buffer. */
+
+/** Writes a string as a JSON string literal */
+static void cli_jsonescape(varray_char *out, const char *str) {
+    varray_charwrite(out, '"');
+    const char *run=str; // Characters that need no escaping are added in runs
+    for (const char *c=str; *c!='\0'; c++) {
+        unsigned char ch=(unsigned char) *c;
+        if (ch>=0x20 && ch!='"' && ch!='\\') continue;
+        
+        varray_charadd(out, (char *) run, (int) (c-run));
+        char code[8];
+        switch (ch) {
+            case '\n': strcpy(code, "\\n"); break;
+            case '\t': strcpy(code, "\\t"); break;
+            case '\r': strcpy(code, "\\r"); break;
+            case '"': case '\\': code[0]='\\'; code[1]=(char) ch; code[2]='\0'; break;
+            default: snprintf(code, sizeof(code), "\\u%04x", ch); break;
+        }
+        varray_charadd(out, code, (int) strlen(code));
+        run=c+1;
+    }
+    varray_charadd(out, (char *) run, (int) strlen(run));
+    varray_charwrite(out, '"');
+}
+
+/** Begins a value, separating it from the previous one and adding its key if within an object */
+static void cli_jsonkey(varray_char *out, const char *key) {
+    if (out->count && out->data[out->count-1]!='{' && out->data[out->count-1]!='[') varray_charwrite(out, ',');
+    if (key) {
+        cli_jsonescape(out, key);
+        varray_charwrite(out, ':');
+    }
+}
+
+/** @brief Opens an object or array
+ *  @param[in] out - record being constructed
+ *  @param[in] key - key within the enclosing object, or NULL
+ *  @param[in] bracket - '{' or '[' */
+void cli_jsonopen(varray_char *out, const char *key, char bracket) {
+    cli_jsonkey(out, key);
+    varray_charwrite(out, bracket);
+}
+
+/** @brief Closes an object or array with '}' or ']' */
+void cli_jsonclose(varray_char *out, char bracket) {
+    varray_charwrite(out, bracket);
+}
+
+/** @brief Adds a string, or null if str is NULL */
+void cli_jsonstring(varray_char *out, const char *key, const char *str) {
+    cli_jsonkey(out, key);
+    if (str) cli_jsonescape(out, str);
+    else varray_charadd(out, "null", 4);
+}
+
+/** @brief Adds an integer */
+void cli_jsoninteger(varray_char *out, const char *key, long n) {
+    char buffer[32];
+    int length=snprintf(buffer, sizeof(buffer), "%li", n);
+    cli_jsonkey(out, key);
+    varray_charadd(out, buffer, length);
+}
+
+/** @brief Adds a number */
+void cli_jsonnumber(varray_char *out, const char *key, double x) {
+    char buffer[32];
+    int length=snprintf(buffer, sizeof(buffer), "%.9g", x);
+    cli_jsonkey(out, key);
+    varray_charadd(out, buffer, length);
+}
+
+/** @brief Adds a boolean */
+void cli_jsonbool(varray_char *out, const char *key, bool b) {
+    cli_jsonkey(out, key);
+    if (b) varray_charadd(out, "true", 4);
+    else varray_charadd(out, "false", 5);
+}
+
+/** @brief Begins a record of a given type */
+void cli_jsonrecord(varray_char *out, const char *type) {
+    varray_charwrite(out, '{'); // Records follow one another in a buffer without a separator
+    cli_jsonstring(out, "type", type);
+}
+
+/** @brief Ends a record */
+void cli_jsonrecordend(varray_char *out) {
+    cli_jsonclose(out, '}');
+    varray_charwrite(out, '\n');
+}
+
+/** Adds the call stack of a vm that stopped with an error, innermost frame first */
+static void cli_jsonstack(varray_char *out, vm *v) {
+    cli_jsonopen(out, "stack", '[');
+    program *p=v->current;
+    for (callframe *frame=v->fp; p && frame && frame>=v->frame; frame--) {
+        instructionindx indx=(frame==v->fp ? vm_previnstruction(v) : (instructionindx) (frame->pc-p->code.data)-1);
+        value module=MORPHO_NIL;
+        int line=0, posn=0;
+        objectfunction *func=NULL;
+        objectclass *klass=NULL;
+        bool found=debug_infofromindx(p, indx, &module, &line, &posn, &func, &klass);
+        
+        char name[CLI_BUFFERSIZE];
+        objectfunction *fn=frame->function;
+        if (frame==v->frame) snprintf(name, sizeof(name), "(global)");
+        else if (found && klass && MORPHO_ISSTRING(klass->name) && fn && MORPHO_ISSTRING(fn->name)) {
+            snprintf(name, sizeof(name), "%s.%s", MORPHO_GETCSTRING(klass->name), MORPHO_GETCSTRING(fn->name));
+        } else snprintf(name, sizeof(name), "%s", (fn && MORPHO_ISSTRING(fn->name) ? MORPHO_GETCSTRING(fn->name) : "(anonymous)"));
+        
+        cli_jsonopen(out, NULL, '{');
+        cli_jsonstring(out, "function", name);
+        cli_jsonstring(out, "file", (found && MORPHO_ISSTRING(module) ? MORPHO_GETCSTRING(module) : NULL));
+        if (found) cli_jsoninteger(out, "line", line);
+        cli_jsonclose(out, '}');
+    }
+    cli_jsonclose(out, ']');
+}
+
+/** @brief Adds a record describing an error or warning
+ *  @param[in] out - output
+ *  @param[in] type - "error" or "warning"
+ *  @param[in] err - the error
+ *  @param[in] v - vm whose call stack describes a runtime error, or NULL */
+void cli_jsonerror(varray_char *out, const char *type, error *err, vm *v) {
+    bool located=(!ERROR_ISRUNTIMEERROR(*err) && err->line!=ERROR_POSNUNIDENTIFIABLE && err->posn!=ERROR_POSNUNIDENTIFIABLE);
+    
+    cli_jsonrecord(out, type);
+    cli_jsonstring(out, "id", err->id);
+    cli_jsonstring(out, "message", err->msg);
+    cli_jsonstring(out, "file", err->file);
+    if (located) {
+        cli_jsoninteger(out, "line", err->line);
+        cli_jsoninteger(out, "posn", err->posn+1);
+    }
+    if (v && ERROR_ISRUNTIMEERROR(*err)) cli_jsonstack(out, v);
+    cli_jsonrecordend(out);
+}
+
+/** Writes the record that has been constructed to the output */
+static void cli_outputrecord(void) {
+    cli_outputcheck();
+    cli_outputadd(cli_output.record.data, cli_output.record.count);
+    cli_output.record.count=0;
+}
+
+/** @brief Begins a record written directly to the output; finish it with cli_outputrecordend
+ *  @returns the record being constructed */
+varray_char *cli_outputrecordbegin(const char *type) {
+    cli_output.record.count=0;
+    cli_jsonrecord(&cli_output.record, type);
+    return &cli_output.record;
+}
+
+/** @brief Ends a record begun by cli_outputrecordbegin and writes it */
+void cli_outputrecordend(void) {
+    cli_jsonrecordend(&cli_output.record);
+    cli_outputrecord();
+}
+
+/** @brief Checks whether output is written as JSON records */
+bool cli_outputisjsonl(void) {
+    return cli_output.jsonl;
+}
+
+/* ---------------------------------------- */
+
 /** Displays several strings with a specified style using linedit */
 void cli_displaywithstyle(lineditor *edit, linedit_color col, linedit_emphasis emph, int n, ...) {
+    cli_outputflush(); // Keep anything displayed in order with output
+    
     va_list args;
     va_start(args, n);
     for (int i=0; i<n; i++) {
@@ -42,33 +338,39 @@ void cli_displaywithstyle(lineditor *edit, linedit_color col, linedit_emphasis e
 
 /** Report an error if one has occurred. */
 void cli_reporterror(error *err, vm *v) {
-    lineditor linedit;
-    linedit_init(&linedit);
+    if (cli_output.jsonl) {
+        if (err->cat!=ERROR_NONE) {
+            cli_jsonerror(&cli_output.record, "error", err, v);
+            cli_outputrecord();
+        }
+        return;
+    }
+    
+    cli_outputflush();
+    lineditor *linedit=NULL; // Styled text is displayed without reference to an editor
     
     if (err->cat!=ERROR_NONE) {
-        cli_displaywithstyle(&linedit, CLI_ERRORCOLOR, CLI_NOEMPHASIS, 3, "Error '", err->id, "'");
+        cli_displaywithstyle(linedit, CLI_ERRORCOLOR, CLI_NOEMPHASIS, 3, "Error '", err->id, "'");
         
         if (ERROR_ISRUNTIMEERROR(*err)) {
-            cli_displaywithstyle(&linedit, CLI_ERRORCOLOR, CLI_NOEMPHASIS, 3, ": ", err->msg, "\n");
+            cli_displaywithstyle(linedit, CLI_ERRORCOLOR, CLI_NOEMPHASIS, 3, ": ", err->msg, "\n");
             morpho_stacktrace(v);
         } else {
             if (err->line!=ERROR_POSNUNIDENTIFIABLE && err->posn!=ERROR_POSNUNIDENTIFIABLE) {
                 char posnbuffer[CLI_BUFFERSIZE];
                 snprintf(posnbuffer, CLI_BUFFERSIZE, " [line %u char %u", err->line, err->posn+1);
-                linedit_displaywithstyle(&linedit, posnbuffer, CLI_ERRORCOLOR, CLI_NOEMPHASIS);
+                linedit_displaywithstyle(linedit, posnbuffer, CLI_ERRORCOLOR, CLI_NOEMPHASIS);
                 
                 if (err->file) {
-                    cli_displaywithstyle(&linedit, CLI_ERRORCOLOR, CLI_NOEMPHASIS, 3, " in module '", err->file, "'");
+                    cli_displaywithstyle(linedit, CLI_ERRORCOLOR, CLI_NOEMPHASIS, 3, " in module '", err->file, "'");
                 }
                 
-                linedit_displaywithstyle(&linedit, "] ", CLI_ERRORCOLOR, CLI_NOEMPHASIS);
+                linedit_displaywithstyle(linedit, "] ", CLI_ERRORCOLOR, CLI_NOEMPHASIS);
             }
             
-            cli_displaywithstyle(&linedit, CLI_ERRORCOLOR, CLI_NOEMPHASIS, 3, ": ", err->msg, "\n");
+            cli_displaywithstyle(linedit, CLI_ERRORCOLOR, CLI_NOEMPHASIS, 3, ": ", err->msg, "\n");
         }
     }
-    
-    linedit_clear(&linedit);
 }
 
 /* **********************************************************************
@@ -77,13 +379,16 @@ void cli_reporterror(error *err, vm *v) {
 
 /** Print callback */
 void cli_printcallbackfn(vm *v, void *ref, char *string) {
-    lineditor *l = (lineditor *) ref;
-
-    cli_displaywithstyle(l, CLI_DEFAULTCOLOR, LINEDIT_BOLD, 1, string);
+    if (cli_output.jsonl) {
+        cli_jsonstring(cli_outputrecordbegin("print"), "text", string);
+        cli_outputrecordend();
+    } else cli_outputprint(string);
 }
 
 /** Input callback */
 void cli_inputcallbackfn(vm *v, void *ref, morphoinputmode mode, varray_char *str) {
+    cli_outputflush(); // Show any prompt the program printed
+    
     if (mode==MORPHO_INPUT_KEYPRESS) {
         int key = getchar();
         if (key!=EOF) varray_charwrite(str, (char) key);
@@ -101,14 +406,178 @@ void cli_inputcallbackfn(vm *v, void *ref, morphoinputmode mode, varray_char *st
 void cli_warningcallbackfn(vm *v, void *ref, error *err) {
     lineditor *l = (lineditor *) ref;
     
+    if (cli_output.jsonl) {
+        cli_jsonerror(&cli_output.record, "warning", err, NULL);
+        cli_outputrecord();
+        return;
+    }
+    
     cli_displaywithstyle(l, CLI_WARNINGCOLOR, CLI_NOEMPHASIS, 5, "Warning '", err->id, "': ", err->msg, "\n");
 }
 
-/** Warning callback */
+static volatile sig_atomic_t cli_interrupted = 0; /* Set once the user has asked for an evaluation to stop */
+static error cli_interrupterror;
+
+/** Debugger callback */
 void cli_debuggercallbackfn(vm *v, void *ref) {
+    if (cli_interrupted) { // Stop at this instruction rather than entering the debugger
+        debugger *d=vm_getdebugger(v);
+        debugger_setsinglestep(d, false);
+        error_init(&cli_interrupterror);
+        debugger_seterror(d, &cli_interrupterror);
+        debugger_quit(d);
+        return;
+    }
     clidebugger_enter(v);
 }
 
+/* **********************************************************************
+ * Interruptible evaluation
+ * ********************************************************************** */
+
+/** The REPL runs each evaluation on a worker thread while it waits on a pipe for either the evaluation to
+ *  finish or the user to press Ctrl-C. The SIGINT handler only writes to the pipe; the waiting thread then
+ *  sends CLI_INTERRUPTSIGNAL to the worker, whose handler sets the debugger to single step so that the vm
+ *  calls cli_debuggercallbackfn at the next instruction boundary and is stopped there. The debugger is thus
+ *  only ever changed from the thread running the vm; we rely on debugger_setsinglestep doing no more than
+ *  set a flag, as it does, so that it is safe to call from a handler that interrupts the vm mid instruction.
+ *  The vm and program are left intact, so the session carries on. A second Ctrl-C before the vm responds,
+ *  e.g. while it is within a long running builtin, terminates morpho. */
+
+#define CLI_EVALSTACKSIZE (16*1024*1024) // Generous, as the default on some platforms is small
+
+#define CLI_WAKEINTERRUPT 'i'
+#define CLI_WAKEDONE      'd'
+
+#define CLI_INTERRUPTED "Interrupted.\n"
+
+#define CLI_INTERRUPTSIGNAL SIGUSR1 // Sent to the worker to ask the vm to stop
+
+static int cli_wakepipe[2] = { -1, -1 };
+
+static vm *cli_evaluationvm = NULL; /* The vm being run by the worker */
+static volatile sig_atomic_t cli_evaluationrunning = 0; /* Set by the worker while the vm runs */
+
+/** An evaluation running on a worker thread */
+typedef struct {
+    vm *v;
+    program *p;
+    bool success;
+} clievaluation;
+
+/** SIGINT handler used while an evaluation is running */
+static void cli_sigint(int sig) {
+    char c=CLI_WAKEINTERRUPT;
+    ssize_t n=write(cli_wakepipe[1], &c, 1); // Only async signal safe calls may be made here
+    (void) n;
+}
+
+/** CLI_INTERRUPTSIGNAL handler, which runs on the worker thread */
+static void cli_interruptworker(int sig) {
+    if (cli_evaluationrunning) debugger_setsinglestep(vm_getdebugger(cli_evaluationvm), true);
+}
+
+/** Worker thread that runs an evaluation */
+static void *cli_evaluationworker(void *ref) {
+    clievaluation *eval = (clievaluation *) ref;
+    cli_evaluationrunning=1;
+    eval->success=morpho_debug(eval->v, eval->p);
+    cli_evaluationrunning=0;
+
+    char c=CLI_WAKEDONE;
+    while (write(cli_wakepipe[1], &c, 1)<0 && errno==EINTR);
+    return NULL;
+}
+
+/** Waits for an evaluation to finish, asking it to stop if the user presses Ctrl-C */
+static void cli_evaluationwait(pthread_t worker) {
+    int ninterrupts=0;
+    for (;;) {
+        char c;
+        ssize_t n=read(cli_wakepipe[0], &c, 1);
+        if (n<0 && errno==EINTR) continue;
+        if (n<=0 || c==CLI_WAKEDONE) break;
+
+        if (ninterrupts++) { // The vm hasn't responded to the first request
+            signal(SIGINT, SIG_DFL);
+            raise(SIGINT);
+        }
+        cli_interrupted=1;
+        pthread_kill(worker, CLI_INTERRUPTSIGNAL);
+    }
+}
+
+/** Creates the wake pipe, which isn't inherited by programs that morpho runs
+ *  @returns true on success */
+static bool cli_wakepipeinit(void) {
+    if (cli_wakepipe[0]>=0) return true;
+    if (pipe(cli_wakepipe)!=0) return false;
+    for (int i=0; i<2; i++) fcntl(cli_wakepipe[i], F_SETFD, FD_CLOEXEC);
+    return true;
+}
+
+/** Runs a program on a worker thread so that the user may interrupt it with Ctrl-C
+ *  @param[in] v - the vm
+ *  @param[in] p - program to run
+ *  @param[out] interrupted - set to whether the evaluation was interrupted
+ *  @returns true on success */
+bool cli_evaluate(vm *v, program *p, bool *interrupted) {
+    clievaluation eval = { .v = v, .p = p, .success = false };
+    cli_interrupted=0;
+    *interrupted=false;
+
+    if (!cli_wakepipeinit()) return morpho_debug(v, p);
+    cli_evaluationvm=v;
+
+    /* Install the handlers, and keep SIGINT off the worker so that its system calls aren't interrupted */
+    struct sigaction sa, old, oldinterrupt;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler=cli_sigint;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, &old);
+
+    sa.sa_handler=cli_interruptworker;
+    sa.sa_flags=SA_RESTART;
+    sigaction(CLI_INTERRUPTSIGNAL, &sa, &oldinterrupt);
+
+    sigset_t mask, saved;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &mask, &saved);
+    sigemptyset(&mask);
+    sigaddset(&mask, CLI_INTERRUPTSIGNAL);
+    pthread_sigmask(SIG_UNBLOCK, &mask, NULL); // The worker inherits this mask
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, CLI_EVALSTACKSIZE);
+
+    pthread_t worker;
+    bool started=(pthread_create(&worker, &attr, cli_evaluationworker, &eval)==0);
+    pthread_attr_destroy(&attr);
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+
+    if (started) {
+        cli_evaluationwait(worker);
+        pthread_join(worker, NULL);
+    }
+    sigaction(SIGINT, &old, NULL);
+    sigaction(CLI_INTERRUPTSIGNAL, &oldinterrupt, NULL);
+    if (!started) return morpho_debug(v, p);
+
+    /* An interrupt that arrived as the vm finished may have left it single stepping */
+    if (cli_interrupted) debugger_setsinglestep(vm_getdebugger(v), false);
+
+    /* Discard any interrupt that arrived too late to matter */
+    int pending=0;
+    ioctl(cli_wakepipe[0], FIONREAD, &pending);
+    for (char c; pending>0 && read(cli_wakepipe[0], &c, 1)==1; pending--);
+
+    *interrupted=(cli_interrupted && !eval.success);
+    cli_interrupted=0;
+    return eval.success;
+}
+
 /* **********************************************************************
  * Interactive cli
  * ********************************************************************** */
@@ -202,79 +671,169 @@ linedit_colormap cli_tokencolors[] = {
     { LINEDIT_ENDCOLORMAP,      LINEDIT_DEFAULTCOLOR }
 };
 
-/** A tokenizer for syntax coloring that uses the morpho lexer */
-bool cli_lex(char *in, void *ref, linedit_token *out) {
+/** Initializes a lexer for syntax coloring */
+void cli_lexerinit(clilexer *l) {
+    l->next=NULL;
+    l->ground=NULL;
+    l->depth=0;
+}
+
+/** Clears a lexer used for syntax coloring */
+void cli_lexerclear(clilexer *l) {
+    if (l->next) lex_clear(&l->l);
+    cli_lexerinit(l);
+}
+
+/* The state of a syntax coloring lexer packs the depth of string interpolation into the low bits,
+   and the distance back to the last point outside any interpolation into the remainder */
+#define CLI_LEXDEPTHBITS 8
+#define CLI_LEXDEPTHMASK ((1L<<CLI_LEXDEPTHBITS)-1)
+
+/** Starts the morpho lexer afresh at a given point */
+static void cli_lexerstart(clilexer *l, char *in) {
+    cli_lexerclear(l);
+    lex_init(&l->l, in, 0);
+    l->next=in;
+    l->ground=in;
+}
+
+/** Follows string interpolation across a token, e.g. "a ${x} b" lexes as "a ${, x and } b" */
+static void cli_lextrack(clilexer *l, token *tok) {
+    bool continuation=(tok->length>0 && tok->start[0]!='"' && tok->start[0]!='\'');
+    if (tok->type==TOKEN_INTERPOLATION && !continuation) l->depth++;
+    else if (tok->type==TOKEN_STRING && continuation && l->depth>0) l->depth--;
+    
+    l->next=(char *) tok->start+tok->length;
+    if (l->depth==0) l->ground=l->next;
+}
+
+/** Packs the current state of the lexer */
+static linedit_tokenizerstate cli_lexstate(clilexer *l) {
+    if (l->depth==0) return 0;
+    return ((linedit_tokenizerstate) (l->next-l->ground) << CLI_LEXDEPTHBITS) | (l->depth & CLI_LEXDEPTHMASK);
+}
+
+/** Restores the lexer to a state previously saved at in, by replaying the tokens since the last point outside
+ *  any interpolation; the text before in must therefore be unchanged since the state was saved. */
+static void cli_lexresume(clilexer *l, char *in, linedit_tokenizerstate state) {
+    cli_lexerstart(l, in-(state >> CLI_LEXDEPTHBITS));
+    
+    while (l->next<in) {
+        token tok;
+        error err;
+        error_init(&err);
+        if (!lex(&l->l, &tok, &err) || tok.type==TOKEN_EOF) break;
+        cli_lextrack(l, &tok);
+    }
+    
+    if (l->next!=in) cli_lexerstart(l, in); // The replay didn't arrive at in, so start afresh
+}
+
+/** A tokenizer for syntax coloring that uses the morpho lexer.
+ *  The lexer continues from the end of the previous token if the state matches; otherwise it is restored
+ *  to the state given, which is updated after each token. */
+bool cli_lex(char *in, void *ref, linedit_tokenizerstate *state, linedit_token *out) {
     bool success=false;
-    lexer *l=(lexer *) ref;
+    clilexer *l=(clilexer *) ref;
     if (!l) return false;
-    lex_init(l, in, 0);
+    
+    if (in!=l->next || cli_lexstate(l)!=*state) {
+        if (*state==0) cli_lexerstart(l, in);
+        else cli_lexresume(l, in, *state);
+    }
     
     token tok;
     error err;
     error_init(&err);
     
-    if (lex(l, &tok, &err)) {
+    if (lex(&l->l, &tok, &err)) {
         out->start=(char *) tok.start;
         out->length=tok.length;
         out->type=(linedit_tokentype) tok.type;
         success=(tok.type!=TOKEN_EOF);
     }
     
-    lex_clear(l);
+    if (success) {
+        cli_lextrack(l, &tok);
+        *state=cli_lexstate(l);
+    } else cli_lexerclear(l);
     
     return success;
 }
 
-/** Autocomplete function */
+/** Tracks the state of the help system, which is only initialized once it's needed */
+typedef enum {
+    CLI_HELPUNINITIALIZED,
+    CLI_HELPAVAILABLE,
+    CLI_HELPUNAVAILABLE
+} clihelpstate;
+
+static clihelpstate cli_helpstate = CLI_HELPUNINITIALIZED;
+
+/** Initializes the help system on first use
+ *  @returns true if help is available */
+bool cli_helpinitialize(void) {
+    if (cli_helpstate==CLI_HELPUNINITIALIZED) {
+        char helpindex[PATH_MAX];
+        bool avail=help_initialize(cli_userpath(HELP_INDEXFILE, helpindex, PATH_MAX) ? helpindex : NULL);
+        cli_helpstate=(avail ? CLI_HELPAVAILABLE : CLI_HELPUNAVAILABLE);
+    }
+    return (cli_helpstate==CLI_HELPAVAILABLE);
+}
+
+/** Finalizes the help system if it was used */
+void cli_helpfinalize(void) {
+    if (cli_helpstate!=CLI_HELPUNINITIALIZED) help_finalize();
+    cli_helpstate=CLI_HELPUNINITIALIZED;
+}
+
+/** Autocomplete function; ref is the session's completer */
 bool cli_complete(char *in, void *ref, linedit_stringlist *c) {
-    size_t len=strlen(in);
+    clicompleter *completer=(clicompleter *) ref;
+    if (!completer) return false;
     
-    /* First find the last token in the input */
-    char *tok = in+len;
-    /* Scan backwards from end of string over alphanumeric tokens */
-    while (tok>in && !isspace(*(tok-1))) tok--;
+    /* First find the symbol at the end of the input */
+    char *end = in+strlen(in), *tok = end;
+    while (tok>in && (isalnum((unsigned char) *(tok-1)) || *(tok-1)=='_' || (unsigned char) *(tok-1)>=0x80)) tok--;
     
     /* Ensure we have at least one character */
-    if (iscntrl(*tok)) return false;
-    
-    /* Now try to match the token against a library of words */
-    len=strlen(tok);
-    char *words[] = {"as", "and", "break", "class", "continue", "do", "else", "for", "false", "fn", "help", "if", "in", "import", "nil", "or", "print", "return", "true", "var", "while", "quit", "self", "super", "this", "try", "catch", NULL};
-    int success=false;
-    
-    for (unsigned int i=0; words[i]!=NULL; i++) {
-        if ( (len<strlen(words[i])) &&
-             (strncmp(tok, words[i], len)==0)) {
-            linedit_addsuggestion(c, words[i]+len);
-            success=true;
-        }
-    }
+    if (tok==end) return false;
     
-    return success;
+    /* Names of builtins come from the help index, which is only loaded when first needed */
+    if (!completer->helpadded && cli_helpinitialize()) clicomplete_addhelp(completer);
+    
+    /* Only methods are offered after a '.' */
+    unsigned int kinds=(tok>in && *(tok-1)=='.' ? CLICOMPLETE_METHOD : CLICOMPLETE_KEYWORD | CLICOMPLETE_GLOBAL);
+    
+    return clicomplete_suggest(completer, tok, (size_t) (end-tok), kinds, c);
+}
+
+/** Change in bracket balance due to a character */
+static inline int cli_bracket(char c) {
+    switch (c) {
+        case '(': case '{': case '[': return 1;
+        case ')': case '}': case ']': return -1;
+        default: return 0;
+    }
 }
 
 /** Multiline function */
 bool cli_multiline(char *in, void *ref) {
     int nb=0; 
 
-    for (char *c=in; *c!='\0'; c++) {
-        switch (*c) {
-            case '(': nb+=1; break; 
-            case ')': nb-=1; break;
-            case '{': nb+=1; break;
-            case '}': nb-=1; break;
-            case '[': nb+=1; break;
-            case ']': nb-=1; break;
-            default: break; 
-        }
-    }
+    for (char *c=in; *c!='\0'; c++) nb+=cli_bracket(*c);
 
     return (nb>0);
 }
 
 /** Interactive help */
-void cli_help(lineditor *edit, char *query, error *err, bool avail) {
+void cli_help(lineditor *edit, char *query, error *err) {
     char *q=query;
+    if (!cli_helpinitialize()) { // Don't consult an index that failed to load
+        printf("Help is not available; the help files couldn't be found or indexed.\n");
+        return;
+    }
+    
     if (help_querylength(q, NULL)==0) {
         if (err->cat!=ERROR_NONE) {
             q=err->id;
@@ -284,7 +843,7 @@ void cli_help(lineditor *edit, char *query, error *err, bool avail) {
         }
     }
     
-    objecthelptopic *topic = help_search(q);
+    helptopic *topic = help_search(q);
     if (topic) {
         help_display(edit, topic);
     } else {
@@ -293,6 +852,42 @@ void cli_help(lineditor *edit, char *query, error *err, bool avail) {
     }
 }
 
+/** Searches the text of the help system */
+void cli_searchhelp(lineditor *edit, char *query) {
+    helptopic *results[HELP_MAXRESULTS];
+    int n=0;
+    
+    while (isspace(*query) && *query!='\0') query++;
+    if (cli_helpinitialize()) n=help_searchtext(query, results, HELP_MAXRESULTS);
+    
+    if (n>0) {
+        help_displayresults(edit, results, n);
+    } else {
+        printf(HELP_NORESULTS, query);
+    }
+}
+
+/* **********************************************************************
+ * User directory
+ * ********************************************************************** */
+
+/** @brief Finds the path of a file in the user's morpho directory, creating the directory if necessary
+ *  @param[in] file - name of the file
+ *  @param[out] out - buffer to hold the path
+ *  @param[in] size - size of the buffer
+ *  @returns true if the path could be constructed */
+bool cli_userpath(const char *file, char *out, size_t size) {
+    char *home=getenv("HOME");
+    if (!home || *home=='\0') return false;
+    
+    int n=snprintf(out, size, "%s/%s", home, CLI_USERDIR);
+    if (n<0 || (size_t) n>=size) return false;
+    if (mkdir(out, 0700)!=0 && errno!=EEXIST) return false;
+    
+    n=snprintf(out, size, "%s/%s/%s", home, CLI_USERDIR, file);
+    return (n>=0 && (size_t) n<size);
+}
+
 #ifdef CLI_USELIBUNISTRING
 size_t libunistring_graphemefn(const char *in, const char *end) {
     char *next = (char *) u8_grapheme_next((uint8_t *) in, (uint8_t *) end);
@@ -307,15 +902,28 @@ size_t libgrapheme_graphemefn(const char *in, const char *end) {
 }
 #endif
 
-/** @brief Provide a command line interface */
-void cli(clioptions opt) {
+/** Bytes of session input to keep in memory, or 0 for no limit */
+static size_t cli_sessionlimit = 0;
+
+/** @brief Limits the input of an interactive session kept in memory; older input is spilled to disk
+ *  @param[in] limit - limit in bytes, or 0 for no limit */
+void cli_setsessionlimit(size_t limit) {
+    cli_sessionlimit=limit;
+}
+
+/** @brief Provide a command line interface
+ *  @returns exit status */
+int cli(clioptions opt) {
     bool tty=linedit_checktty();
+    if (!tty) return cli_batch(opt);
+    cli_outputreset(opt);
+    
     version morphoversion;
     morpho_version(&morphoversion);
     char morphoversionstring[VERSION_MAXSTRINGLENGTH];
     version_tostring(&morphoversion, VERSION_MAXSTRINGLENGTH, morphoversionstring);
     
-    if (tty) {
+    {
     #ifdef MORPHO_LONG_BANNER
         // Original ASCII art source - https://www.asciiart.eu/animals/insects/butterflies
         printf(BLU " ___   ___ \n" RESET);
@@ -326,29 +934,37 @@ void cli(clioptions opt) {
         printf("\U0001F98B morpho %s | \U0001F44B Type 'help' or '?' for help\n", morphoversionstring);
     #endif
     }
+    cli_startupspan("banner");
     
     /* Set up program and compiler */
     program *p = morpho_newprogram();
     compiler *c = morpho_newcompiler(p);
+    cli_startupspan("compiler");
     
-    bool help = help_initialize();
+    /* Every line entered is kept once, as both history and source */
+    clisession session;
+    clisession_init(&session, cli_sessionlimit);
+    cli_globalsession=&session;
     
-    /* Keep the line by line src as a varray */
-    varray_char src;
-    varray_charinit(&src);
-    varray_charwrite(&src, '\0'); // Begin with zero string
+    /* Completions are drawn from keywords, builtins and whatever the session declares */
+    clicompleter completer;
+    clicomplete_init(&completer);
+    clicomplete_addkeywords(&completer);
     
     /* Set up VM */
     vm *v = morpho_newvm();
+    cli_startupspan("vm");
     
     /* Line editor */
     lineditor edit;
-    lexer l;
+    clilexer l;
+    cli_lexerinit(&l);
     linedit_init(&edit);
     linedit_setprompt(&edit, CLI_PROMPT);
-    linedit_syntaxcolor(&edit, cli_lex, &l, cli_tokencolors);
+    linedit_resumablesyntaxcolor(&edit, cli_lex, &l, cli_tokencolors);
     linedit_multiline(&edit, cli_multiline, NULL, CLI_CONTINUATIONPROMPT);
-    linedit_autocomplete(&edit, cli_complete, NULL);
+    linedit_autocomplete(&edit, cli_complete, &completer);
+    linedit_history(&edit, clisession_history, &session);
 #ifdef CLI_USELIBUNISTRING
     linedit_setgraphemesplitter(&edit, libunistring_graphemefn);
 #endif
@@ -356,6 +972,16 @@ void cli(clioptions opt) {
     linedit_setgraphemesplitter(&edit, libgrapheme_graphemefn);
 #endif
 
+    /* Reuse grapheme widths measured in earlier sessions */
+    char graphemefile[PATH_MAX];
+    bool graphemes=(cli_userpath(CLI_GRAPHEMEFILE, graphemefile, PATH_MAX));
+    if (graphemes) linedit_loadgraphemewidths(graphemefile);
+
+    /* History persists between sessions */
+    char historyfile[PATH_MAX];
+    if (cli_userpath(CLI_HISTORYFILE, historyfile, PATH_MAX)) linedit_historyfile(&edit, historyfile);
+    cli_startupspan("line editor");
+
     morpho_setinputfn(v, cli_inputcallbackfn, NULL);
     morpho_setprintfn(v, cli_printcallbackfn, &edit);
     morpho_setwarningfn(v, cli_warningcallbackfn, &edit);
@@ -367,40 +993,56 @@ void cli(clioptions opt) {
     /* Initialize the error struct */
     error_init(&err);
     
+    cli_startupreport("first prompt");
+    
     /* Read-evaluate-print loop */
-    for (int n=0;;n++) {
-        if (!tty && n>0) break;
+    for (;;) {
         char *input=NULL;
         
+        cli_outputflush();
         while (!input) input=linedit(&edit);
         
         /* Check for CLI commands. */
         /* Let the user quit by typing 'quit'. */
         if (strncmp(input, CLI_QUIT, strlen(CLI_QUIT))==0) {
 			break;
-        } else if (strncmp(input, CLI_HELP, strlen(CLI_HELP))==0) {
-            cli_help(&edit, input+strlen(CLI_HELP), &err, help); continue;
+        } 
+        
+        bool command=true;
+        if (strncmp(input, CLI_HELP, strlen(CLI_HELP))==0) {
+            cli_help(&edit, input+strlen(CLI_HELP), &err);
+        } else if (strncmp(input, CLI_SEARCH, strlen(CLI_SEARCH))==0) {
+            cli_searchhelp(&edit, input+strlen(CLI_SEARCH));
         } else if (strncmp(input, CLI_SHORT_HELP, strlen(CLI_SHORT_HELP))==0) {
-            cli_help(&edit, input+strlen(CLI_SHORT_HELP), &err, help); continue;
+            cli_help(&edit, input+strlen(CLI_SHORT_HELP), &err);
+        } else command=false;
+        
+        if (command) {
+            clisession_add(&session, input, CLISESSION_HISTORY); // Commands are kept only as history
+            continue;
         }
         
         /* Compile code */
         success=morpho_compile(input, c, false, &err);
         
+        /** Retain input in the session; input that compiled also becomes part of the source */
+        unsigned int flags=(success ? CLISESSION_SOURCE : 0);
+        if (*input!='\0') flags|=CLISESSION_HISTORY;
+        if (flags) clisession_add(&session, input, flags);
+        
+        if (success) clicomplete_addsource(&completer, input);
+        
         if (success) { /** If compilation was successful, and we're in interactive mode, execute... */
-            /** Retain input in interactive session */
-            src.count--; // Remove zero terminator
-            varray_charadd(&src, input, (int) strlen(input));
-            varray_charwrite(&src, '\n');
-            varray_charwrite(&src, '\0'); // Ensure zero terminated
-            cli_globalsrc=src.data;
-            
             if (opt & CLI_DISASSEMBLE) {
                 morpho_disassemble(v, p, NULL);
             }
             if (opt & CLI_RUN) {
-                success=morpho_debug(v, p);
-                if (!success) {
+                bool interrupted;
+                success=cli_evaluate(v, p, &interrupted);
+                if (interrupted) {
+                    cli_displaywithstyle(&edit, CLI_WARNINGCOLOR, CLI_NOEMPHASIS, 1, CLI_INTERRUPTED);
+                    err=*morpho_geterror(v);
+                } else if (!success) {
                     cli_reporterror(morpho_geterror(v), v);
                     err=*morpho_geterror(v);
                 }
@@ -411,40 +1053,478 @@ void cli(clioptions opt) {
         } 
     }
     
+    if (graphemes) linedit_savegraphemewidths(graphemefile);
+    
     linedit_clear(&edit);
+    cli_lexerclear(&l);
     morpho_freevm(v);
     
-    varray_charclear(&src);
+    cli_helpfinalize();
+    cli_sourcecacheclear();
+    
+    cli_globalsession=NULL;
+    clisession_clear(&session);
+    clicomplete_clear(&completer);
+    
+    morpho_freecompiler(c);
+    morpho_freeprogram(p);
+    
+    cli_outputflush();
+    return 0;
+}
+
+/* **********************************************************************
+ * Batch mode
+ * ********************************************************************** */
+
+#define CLI_BATCHBUFFERSIZE 65536
+#define CLI_BATCHWAIT 250 // Time in ms to wait for the next line of a statement that may continue onto it
+
+/** Input read from a pipe, to be split into complete statements */
+typedef struct {
+    varray_char buffer; /** Input read but not yet compiled */
+    unsigned int start; /** Start of the next statement */
+    unsigned int scan;  /** Input up to here has been scanned for the end of the statement */
+    int nb;             /** Bracket balance of the scanned part of the statement */
+    unsigned int line;  /** Line at which the next statement begins */
+    bool eof;
+} clibatchinput;
+
+/** What follows a newline at which all brackets are closed */
+typedef enum {
+    CLI_BATCHEND,       // The statement ends at the newline
+    CLI_BATCHCONTINUES, // The next line continues the statement, e.g. with { or else
+    CLI_BATCHMORE       // More input is needed to tell
+} clibatchboundary;
+
+/** Initializes batch input */
+static void cli_batchinit(clibatchinput *in) {
+    varray_charinit(&in->buffer);
+    in->start=in->scan=0;
+    in->nb=0;
+    in->line=1;
+    in->eof=false;
+}
+
+/** Clears batch input */
+static void cli_batchclear(clibatchinput *in) {
+    varray_charclear(&in->buffer);
+}
+
+/** Reads whatever input has arrived, waiting until there is some, and discards input that has already been compiled */
+static void cli_batchread(clibatchinput *in) {
+    if (in->start>0) {
+        memmove(in->buffer.data, in->buffer.data+in->start, in->buffer.count-in->start);
+        in->buffer.count-=in->start;
+        in->scan-=in->start;
+        in->start=0;
+    }
+    
+    if (!varray_charresize(&in->buffer, in->buffer.count+CLI_BATCHBUFFERSIZE+1)) { in->eof=true; return; }
+    
+    cli_outputflush(); // Show the results so far before waiting for the producer
+    
+    ssize_t n;
+    do n=read(STDIN_FILENO, in->buffer.data+in->buffer.count, CLI_BATCHBUFFERSIZE);
+    while (n<0 && errno==EINTR);
     
-    help_finalize();
+    if (n>0) in->buffer.count+=(unsigned int) n;
+    else in->eof=true; // End of the input, or an error
+}
+
+/** Checks whether more input arrives on stdin within a given time in ms */
+static bool cli_batchready(int wait) {
+    struct pollfd fd = { .fd=STDIN_FILENO, .events=POLLIN };
+    int n;
+    do n=poll(&fd, 1, wait);
+    while (n<0 && errno==EINTR);
+    return (n>0);
+}
+
+/** Checks whether text [c, end) begins with a given keyword */
+static bool cli_batchkeyword(const char *c, const char *end, const char *word) {
+    size_t length=strlen(word);
+    return ((size_t) (end-c)>=length && strncmp(c, word, length)==0 &&
+            ((size_t) (end-c)==length || !(isalnum(c[length]) || c[length]=='_')));
+}
+
+/** Checks whether a statement could be continued by the next line, e.g. if (x) or class A */
+static bool cli_batchmaycontinue(const char *start, const char *end) {
+    while (start<end && isspace(*start)) start++;
+    while (end>start && isspace(end[-1])) end--;
+    if (end==start) return false;
+    if (end[-1]==')' || cli_batchkeyword(start, end, "class")) return true;
+    
+    const char *word=end;
+    while (word>start && (isalnum(word[-1]) || word[-1]=='_')) word--;
+    return (cli_batchkeyword(word, end, "else") || cli_batchkeyword(word, end, "try") || cli_batchkeyword(word, end, "do"));
+}
+
+/** @brief Decides whether the statement scanned so far ends at the newline at in->scan
+ *  @details A newline with all brackets closed normally ends a statement, but not if the next line that
+ *  isn't blank begins with {, else or catch, as in if (x)\n{ ... } or }\nelse { ... }. If the next line
+ *  hasn't arrived, a statement that could be continued waits briefly for it; otherwise the statement is
+ *  evaluated straight away so that a streaming producer sees its results. */
+static clibatchboundary cli_batchboundary(clibatchinput *in) {
+    const char *c=in->buffer.data+in->scan+1, *end=in->buffer.data+in->buffer.count;
+    while (c<end && isspace(*c)) c++;
+    
+    if ((c==end || !memchr(c, '\n', end-c)) && !in->eof) {
+        bool wait=cli_batchmaycontinue(in->buffer.data+in->start, in->buffer.data+in->scan);
+        if (cli_batchready(wait ? CLI_BATCHWAIT : 0)) return CLI_BATCHMORE;
+    }
+    
+    if (c<end && (*c=='{' || cli_batchkeyword(c, end, "else") || cli_batchkeyword(c, end, "catch"))) return CLI_BATCHCONTINUES;
+    return CLI_BATCHEND;
+}
+
+/** Finds the next complete statement, i.e. input up to a newline at which all brackets are closed and that isn't continued by the next line
+ *  @param[in] in - batch input
+ *  @param[out] stmt - zero terminated statement; valid until the next call
+ *  @param[out] line - line at which the statement begins
+ *  @returns true if a statement was found, false at the end of the input */
+static bool cli_batchnext(clibatchinput *in, char **stmt, unsigned int *line) {
+    for (;;) {
+        clibatchboundary boundary=CLI_BATCHCONTINUES;
+        for (; in->scan<in->buffer.count; in->scan++) {
+            char c=in->buffer.data[in->scan];
+            in->nb+=cli_bracket(c);
+            if (c=='\n' && in->nb<=0) {
+                boundary=cli_batchboundary(in);
+                if (boundary!=CLI_BATCHCONTINUES) break;
+            }
+        }
+        
+        if (boundary==CLI_BATCHEND || (in->eof && in->start<in->buffer.count)) {
+            unsigned int end=in->scan;
+            if (end<in->buffer.count) in->scan++; // Skip the newline
+            in->buffer.data[end]='\0'; // The buffer always has room for a terminator
+            
+            *stmt=in->buffer.data+in->start;
+            *line=in->line;
+            for (char *c=*stmt; *c!='\0'; c++) if (*c=='\n') in->line++;
+            in->line++;
+            
+            in->start=in->scan;
+            in->nb=0;
+            return true;
+        }
+        
+        if (in->eof) return false;
+        cli_batchread(in);
+    }
+}
+
+/** Checks whether a statement is just whitespace */
+static bool cli_isblank(char *stmt) {
+    for (char *c=stmt; *c!='\0'; c++) if (!isspace(*c)) return false;
+    return true;
+}
+
+/** @brief Evaluates code piped to morpho, one statement at a time, until the end of the input
+ *  @returns exit status: 0 if every statement compiled and ran successfully, 1 otherwise */
+int cli_batch(clioptions opt) {
+    cli_outputreset(opt);
+    
+    program *p = morpho_newprogram();
+    compiler *c = morpho_newcompiler(p);
+    vm *v = morpho_newvm();
+    
+    /* Retain the source evaluated so far, as in an interactive session */
+    clisession session;
+    clisession_init(&session, cli_sessionlimit);
+    cli_globalsession=&session;
+    
+    /* Line editor for output */
+    lineditor edit;
+    linedit_init(&edit);
     
+    morpho_setinputfn(v, cli_inputcallbackfn, NULL);
+    morpho_setprintfn(v, cli_printcallbackfn, &edit);
+    morpho_setwarningfn(v, cli_warningcallbackfn, &edit);
+    morpho_setdebuggerfn(v, cli_debuggercallbackfn, NULL);
+    
+    clibatchinput in;
+    cli_batchinit(&in);
+    
+    error err;
+    error_init(&err);
+    
+    int status=0;
+    char *stmt;
+    unsigned int line;
+    
+    while (cli_batchnext(&in, &stmt, &line)) {
+        if (cli_isblank(stmt)) continue;
+        if (strncmp(stmt, CLI_QUIT, strlen(CLI_QUIT))==0) break;
+        
+        if (morpho_compile(stmt, c, false, &err)) {
+            clisession_add(&session, stmt, CLISESSION_SOURCE);
+            
+            if (opt & CLI_DISASSEMBLE) {
+                int saved=cli_disassemblybegin();
+                morpho_disassemble(v, p, NULL);
+                cli_disassemblyend(saved);
+            }
+            if (opt & CLI_RUN) {
+                if (!morpho_debug(v, p)) {
+                    cli_reporterror(morpho_geterror(v), v);
+                    status=1;
+                }
+            }
+        } else {
+            /* Report the line in the input rather than in the statement */
+            if (err.line!=ERROR_POSNUNIDENTIFIABLE) err.line+=line-1;
+            cli_reporterror(&err, v);
+            status=1;
+        }
+        error_clear(&err);
+    }
+    
+    cli_batchclear(&in);
+    cli_sourcecacheclear();
+    linedit_clear(&edit);
+    cli_globalsession=NULL;
+    clisession_clear(&session);
+    
+    morpho_freevm(v);
     morpho_freecompiler(c);
     morpho_freeprogram(p);
+    
+    cli_outputflush();
+    return status;
+}
+
+/* **********************************************************************
+ * Run statistics
+ * ********************************************************************** */
+
+/** Phases of a run that are timed separately */
+typedef enum {
+    CLI_PHASESETUP,
+    CLI_PHASELOAD,
+    CLI_PHASECOMPILE,
+    CLI_PHASEDISASSEMBLE,
+    CLI_PHASERUN,
+    CLI_PHASECLEANUP,
+    CLI_NPHASES
+} cliphase;
+
+static char *cli_phasenames[CLI_NPHASES] = { "setup", "load", "compile", "disassemble", "run", "cleanup" };
+
+/** Statistics collected from a run */
+typedef struct {
+    double phase[CLI_NPHASES]; /** Wall time spent in each phase in seconds */
+    double last;               /** Time at which the current phase began */
+    size_t sourcebytes;        /** Size of the source */
+    size_t bound;              /** Bytes held by the vm's garbage collector at the end of the run */
+} clistats;
+
+static const char *cli_statsfile = NULL;
+
+/** Sets a file that statistics are written to as JSON; if NULL they are reported on stderr */
+void cli_setstatsfile(const char *file) {
+    cli_statsfile=file;
+}
+
+/** Initializes statistics, starting the clock */
+static void cli_statsinit(clistats *s) {
+    for (int i=0; i<CLI_NPHASES; i++) s->phase[i]=0;
+    s->last=cli_now();
+    s->sourcebytes=0;
+    s->bound=0;
+}
+
+/** Attributes the time since the last phase ended to a phase */
+static void cli_statsphase(clistats *s, cliphase phase) {
+    double now=cli_now();
+    s->phase[phase]+=now-s->last;
+    s->last=now;
+}
+
+/** Adds statistics to a JSON object */
+static void cli_statsjson(varray_char *out, clistats *s, clioptions opt, bool success, double total, double user, double sys, size_t peakrss) {
+    cli_jsonbool(out, "success", success);
+    cli_jsonbool(out, "optimize", (opt & CLI_OPTIMIZE));
+    cli_jsoninteger(out, "source_bytes", (long) s->sourcebytes);
+    cli_jsonopen(out, "phases", '{');
+    for (int i=0; i<CLI_NPHASES; i++) cli_jsonnumber(out, cli_phasenames[i], s->phase[i]);
+    cli_jsonclose(out, '}');
+    cli_jsonnumber(out, "total", total);
+    cli_jsonnumber(out, "cpu_user", user);
+    cli_jsonnumber(out, "cpu_system", sys);
+    cli_jsoninteger(out, "peak_rss_bytes", (long) peakrss);
+    cli_jsoninteger(out, "gc_bound_bytes", (long) s->bound);
+}
+
+/** Reports statistics on stderr, to the statistics file if one has been set, or as a record with -output=jsonl */
+static void cli_statsreport(clistats *s, const char *in, clioptions opt, bool success) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    size_t peakrss=(size_t) usage.ru_maxrss; // Reported in bytes
+#else
+    size_t peakrss=(size_t) usage.ru_maxrss*1024; // Reported in kilobytes
+#endif
+    double user=usage.ru_utime.tv_sec+usage.ru_utime.tv_usec*1e-6;
+    double sys=usage.ru_stime.tv_sec+usage.ru_stime.tv_usec*1e-6;
+    double total=0;
+    for (int i=0; i<CLI_NPHASES; i++) total+=s->phase[i];
+    
+    if (cli_statsfile) {
+        FILE *f=fopen(cli_statsfile, "w");
+        if (!f) {
+            fprintf(stderr, "Could not write statistics to '%s'.\n", cli_statsfile);
+            return;
+        }
+        varray_char out;
+        varray_charinit(&out);
+        cli_jsonopen(&out, NULL, '{');
+        cli_statsjson(&out, s, opt, success, total, user, sys, peakrss);
+        cli_jsonclose(&out, '}');
+        varray_charwrite(&out, '\n');
+        fwrite(out.data, sizeof(char), out.count, f);
+        varray_charclear(&out);
+        fclose(f);
+    } else if (cli_outputisjsonl()) {
+        varray_char *out=cli_outputrecordbegin("stats");
+        cli_jsonstring(out, "file", in);
+        cli_statsjson(out, s, opt, success, total, user, sys, peakrss);
+        cli_outputrecordend();
+    } else {
+        fprintf(stderr, "--- Statistics for '%s' ---\n", in);
+        for (int i=0; i<CLI_NPHASES; i++) {
+            fprintf(stderr, "%-12s %10.3f ms%s\n", cli_phasenames[i], s->phase[i]*1e3,
+                    ((i==CLI_PHASECOMPILE && (opt & CLI_OPTIMIZE)) ? " (including optimization)" : ""));
+        }
+        fprintf(stderr, "%-12s %10.3f ms\n", "total", total*1e3);
+        fprintf(stderr, "%-12s %10.3f ms user, %.3f ms system\n", "cpu", user*1e3, sys*1e3);
+        fprintf(stderr, "%-12s %10zu bytes\n", "source", s->sourcebytes);
+        fprintf(stderr, "%-12s %10zu bytes\n", "peak rss", peakrss);
+        fprintf(stderr, "%-12s %10zu bytes\n", "gc bound", s->bound);
+    }
+}
+
+/* **********************************************************************
+ * Startup trace
+ * ********************************************************************** */
+
+#define CLI_STARTUPMAXSPANS 32
+
+/** A step of initialization */
+typedef struct {
+    const char *name;
+    double start;  /** Time since startup began in seconds */
+    double end;
+} clistartupspan;
+
+static clistartupspan cli_startupspans[CLI_STARTUPMAXSPANS];
+static int cli_nstartupspans = 0;
+static double cli_startuporigin = 0.0;
+static double cli_startuplast = 0.0;
+static bool cli_startupreported = false;
+
+static bool cli_startuptrace = false;
+static const char *cli_startupfile = NULL;
+
+/** @brief Sets whether the startup trace is reported, and a file that it is written to in Chrome's trace event format; if NULL it is reported on stderr */
+void cli_setstartuptrace(bool enable, const char *file) {
+    cli_startuptrace=enable;
+    cli_startupfile=file;
+}
+
+/** @brief Starts timing startup; call first thing in main() */
+void cli_startupbegin(void) {
+    cli_startuporigin=cli_startuplast=cli_now();
+    cli_nstartupspans=0;
+    cli_startupreported=false;
+}
+
+/** @brief Records a step of initialization that ran since the previous step ended
+ *  @param[in] name - name of the step; must be a string constant */
+void cli_startupspan(const char *name) {
+    double now=cli_now();
+    if (cli_nstartupspans<CLI_STARTUPMAXSPANS) {
+        clistartupspan *s=&cli_startupspans[cli_nstartupspans++];
+        s->name=name;
+        s->start=cli_startuplast-cli_startuporigin;
+        s->end=now-cli_startuporigin;
+    }
+    cli_startuplast=now;
+}
+
+/** @brief Reports the startup trace, if enabled, once startup reaches a milestone such as the first prompt
+ *  @param[in] milestone - name of the milestone */
+void cli_startupreport(const char *milestone) {
+    if (!cli_startuptrace || cli_startupreported) return;
+    cli_startupreported=true;
+    double at=cli_now()-cli_startuporigin;
+
+    if (cli_startupfile) {
+        FILE *f=fopen(cli_startupfile, "w");
+        if (!f) {
+            fprintf(stderr, "Could not write startup trace to '%s'.\n", cli_startupfile);
+            return;
+        }
+        fprintf(f, "{\"traceEvents\":[");
+        for (int i=0; i<cli_nstartupspans; i++) {
+            clistartupspan *s=&cli_startupspans[i];
+            fprintf(f, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":1}",
+                    (i ? "," : ""), s->name, s->start*1e6, (s->end-s->start)*1e6);
+        }
+        fprintf(f, "%s\n{\"name\":\"%s\",\"ph\":\"i\",\"ts\":%.3f,\"s\":\"g\",\"pid\":1,\"tid\":1}\n]}\n",
+                (cli_nstartupspans ? "," : ""), milestone, at*1e6);
+        fclose(f);
+    } else {
+        fprintf(stderr, "--- Startup ---\n");
+        for (int i=0; i<cli_nstartupspans; i++) {
+            clistartupspan *s=&cli_startupspans[i];
+            fprintf(stderr, "%-20s %10.3f ms  (at %.3f ms)\n", s->name, (s->end-s->start)*1e3, s->start*1e3);
+        }
+        fprintf(stderr, "%-20s %10.3f ms\n", milestone, at*1e3);
+    }
 }
 
 /* **********************************************************************
  * Run a file
  * ********************************************************************** */
 
-/** Loads and runs a file. */
-void cli_run(const char *in, clioptions opt) {
+/** Loads and runs a file.
+ *  @details Programs are always compiled from source. A compiled program is a graph of heap objects
+ *  (functions, classes, constants, interned symbols and the debug annotations that refer to them), and
+ *  libmorpho provides no way to serialize one and reload it into a fresh runtime. Caching bytecode
+ *  between runs therefore needs support in morpho itself; the cli can't safely do it alone.
+ *  @returns exit status: 0 if the file compiled and ran successfully, 1 otherwise */
+int cli_run(const char *in, clioptions opt) {
+    clistats stats;
+    cli_statsinit(&stats);
+    cli_outputreset(opt);
+    
     program *p = morpho_newprogram();
     compiler *c = morpho_newcompiler(p);
     vm *v = morpho_newvm();
     
     /* Set up line editor for output */
     lineditor edit;
-    lexer l;
+    clilexer l;
+    cli_lexerinit(&l);
     linedit_init(&edit);
-    linedit_syntaxcolor(&edit, cli_lex, &l, cli_tokencolors);
+    if (linedit_checktty()) linedit_resumablesyntaxcolor(&edit, cli_lex, &l, cli_tokencolors); // Colors are only shown on a terminal
 
     morpho_setinputfn(v, cli_inputcallbackfn, &edit);
     morpho_setprintfn(v, cli_printcallbackfn, &edit);
     morpho_setwarningfn(v, cli_warningcallbackfn, &edit);
     morpho_setdebuggerfn(v, cli_debuggercallbackfn, NULL);
     
-    char *src = cli_loadsource(in);
-    if (src) cli_globalsrc = src;
+    cli_statsphase(&stats, CLI_PHASESETUP);
+    cli_startupspan("setup");
+    
+    clisource source;
+    char *src=NULL;
+    if (cli_loadsource(in, &source)) src = cli_globalsrc = source.data;
+    stats.sourcebytes=source.length;
+    cli_statsphase(&stats, CLI_PHASELOAD);
+    cli_startupspan("load");
     
     error err; /* Error structure that received messages from the compiler and VM */
     bool success=false; /* Keep track of whether compilation and execution was successful */
@@ -455,136 +1535,481 @@ void cli_run(const char *in, clioptions opt) {
     if (src) {
         /* Compile code */
         success=morpho_compile(src, c, (opt & CLI_OPTIMIZE), &err);
+        cli_statsphase(&stats, CLI_PHASECOMPILE);
+        cli_startupspan("compile");
         
         /* Run code if successful */
         if (success) {
             if (opt & CLI_DISASSEMBLE) {
+                int saved=cli_disassemblybegin();
                 if (opt & CLI_DISASSEMBLESHOWSRC) {
                     cli_disassemblewithsrc(p, src);
                 } else {
                     morpho_disassemble(v, p, NULL);
                 }
+                cli_disassemblyend(saved);
+                cli_statsphase(&stats, CLI_PHASEDISASSEMBLE);
             }
             if (opt & CLI_RUN) {
+                cli_startupreport("first instruction");
                 if (opt & CLI_DEBUG) {
                     morpho_setdebuggerfn(v, cli_debuggercallbackfn, NULL);
                     success=morpho_debug(v, p);
                 } else if (opt & CLI_PROFILE) {
                     success=morpho_profile(v, p);
+                } else if (opt & CLI_SAMPLE) {
+                    cliprofiler_start(v);
+                    success=morpho_run(v, p);
+                    cliprofiler_stop();
+                    cliprofiler_report(); // Must precede freeing the program, which owns the functions sampled
+                } else if ((opt & CLI_TRACE) && clitrace_start(v, p, in)) {
+                    success=morpho_debug(v, p);
+                    clitrace_stop(success ? NULL : morpho_geterror(v));
                 } else {
                     success=morpho_run(v, p);
                 }
+                cli_outputflush();
+                cli_statsphase(&stats, CLI_PHASERUN);
                 if (!success) cli_reporterror(morpho_geterror(v), v);
             }
         } else {
             cli_reporterror(&err, v);
         }
     } else {
-        printf("Could not open file '%s'.\n", in);
+        if (cli_outputisjsonl()) {
+            varray_char *out=cli_outputrecordbegin("error");
+            cli_jsonstring(out, "id", NULL);
+            cli_jsonstring(out, "message", "Could not open file.");
+            cli_jsonstring(out, "file", in);
+            cli_outputrecordend();
+        } else printf("Could not open file '%s'.\n", in);
     }
     
+    stats.bound=v->bound;
+    cli_statsphase(&stats, CLI_PHASERUN); // Time reporting errors counts towards the run
+    
     linedit_clear(&edit);
+    cli_lexerclear(&l);
     
-    MORPHO_FREE(src);
+    cli_sourcecacheclear();
+    cli_sourceclear(&source);
     morpho_freevm(v);
     morpho_freeprogram(p);
     morpho_freecompiler(c);
+    
+    cli_statsphase(&stats, CLI_PHASECLEANUP);
+    if (opt & CLI_STATS) cli_statsreport(&stats, in, opt, success);
+    
+    if (cli_outputisjsonl()) {
+        varray_char *out=cli_outputrecordbegin("result");
+        cli_jsonstring(out, "file", in);
+        cli_jsonbool(out, "success", success);
+        cli_jsoninteger(out, "status", (success ? 0 : 1));
+        cli_outputrecordend();
+    }
+    cli_outputflush();
+    
+    return (success ? 0 : 1);
 }
 
 /* **********************************************************************
  * Load source code
  * ********************************************************************** */
 
-/** Loads a source file, returning it as a C-string. Call MORPHO_FREE on it when finished. */
-char *cli_loadsource(const char *in) {
+#define CLI_READCHUNK 65536
+
+/** Initializes a source structure */
+void cli_sourceinit(clisource *src) {
+    src->data=NULL;
+    src->length=0;
+    src->map=NULL;
+    src->mapsize=0;
+}
+
+/** Releases a loaded source file */
+void cli_sourceclear(clisource *src) {
+    if (src->map) munmap(src->map, src->mapsize);
+    else if (src->data) MORPHO_FREE(src->data);
+    cli_sourceinit(src);
+}
+
+/** Maps a regular file read only. The pages beyond the end of the file are zero filled, so the source is
+ *  already zero terminated unless the file ends exactly on a page boundary; in that case an extra zero
+ *  page is reserved after the file to act as the terminator. */
+static bool cli_mapsource(int fd, size_t size, clisource *src) {
+    size_t pagesize = (size_t) sysconf(_SC_PAGESIZE);
+    size_t mapsize = size;
+    char *map;
+    
+    if (size%pagesize==0) {
+        mapsize+=pagesize;
+        map=mmap(NULL, mapsize, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (map==MAP_FAILED) return false;
+        if (mmap(map, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0)==MAP_FAILED) {
+            munmap(map, mapsize);
+            return false;
+        }
+    } else {
+        map=mmap(NULL, mapsize, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map==MAP_FAILED) return false;
+    }
+    
+    src->data=map;
+    src->length=size;
+    src->map=map;
+    src->mapsize=mapsize;
+    return true;
+}
+
+/** Reads a file into an allocated buffer; used where the file can't be mapped, e.g. a pipe. Sizes are held
+ *  as size_t throughout, so that, like a mapped file, the source isn't limited to 2GB.
+ *  @param[in] f - file to read
+ *  @param[in] size - expected size, or 0 if unknown
+ *  @param[out] src - the source */
+static bool cli_readsource(FILE *f, size_t size, clisource *src) {
+    char *data=NULL;
+    size_t length=0, capacity=0;
+    
+    size_t chunk=(size>0 ? size : CLI_READCHUNK);
+    for (;;) {
+        if (length+chunk+1>capacity) { // Grow geometrically once the expected size is exceeded
+            size_t newcapacity=length+chunk+1;
+            if (newcapacity<2*capacity) newcapacity=2*capacity;
+            char *new=MORPHO_REALLOC(data, newcapacity);
+            if (!new) {
+                if (data) MORPHO_FREE(data);
+                return false;
+            }
+            data=new;
+            capacity=newcapacity;
+        }
+        size_t n=fread(data+length, sizeof(char), chunk, f);
+        length+=n;
+        if (n<chunk) break; // End of file or error
+        chunk=CLI_READCHUNK;
+    }
+    
+    if (ferror(f)) {
+        MORPHO_FREE(data);
+        return false;
+    }
+    
+    data[length]='\0';
+    src->data=data;
+    src->length=length;
+    return true;
+}
+
+/** Loads a source file as a zero terminated string. Regular files are memory mapped read only; call cli_sourceclear when finished.
+ *  @param[in] in - file to load, relative to the working directory if possible
+ *  @param[out] src - the loaded source
+ *  @returns true on success */
+bool cli_loadsource(const char *in, clisource *src) {
     FILE *f = NULL; /* Input file */
-    int size=0;
+    bool success=false;
     
-    varray_char buffer;
-    varray_charinit(&buffer);
+    cli_sourceinit(src);
     
     /* Open the input file if provided */
     if (in) f=file_openrelative(in,"r"); // Try opening relative to the working directory
-    if (!f) f=fopen(in, "r");
-    if (!f) return NULL;
-    
-    /* Determine the file size */
-    fseek(f, 0L, SEEK_END);
-    size = ((int) ftell(f))+1;
-    rewind(f);
-    
-    if (size) {
-        /* Size the buffer to match */
-        if (!varray_charresize(&buffer, size+1)) {
-            return NULL;
-        }
+    if (!f && in) f=fopen(in, "r");
+    if (!f) return false;
+    
+    struct stat st;
+    if (fstat(fileno(f), &st)==0 && S_ISREG(st.st_mode)) {
+        size_t size = (size_t) st.st_size;
+        success=(size>0 && cli_mapsource(fileno(f), size, src));
+        if (!success) success=cli_readsource(f, size, src);
+    } else success=cli_readsource(f, 0, src);
+    
+    fclose(f);
+    return success;
+}
+
+/* **********************************************************************
+ * Source cache
+ * ********************************************************************** */
+
+DEFINE_VARRAY(clilineoffset, size_t)
+
+DECLARE_VARRAY(clisourcefile, clisourcefile *)
+DEFINE_VARRAY(clisourcefile, clisourcefile *)
+
+/** Source files loaded during this session */
+static varray_clisourcefile cli_sourcecache = { .count = 0, .capacity = 0, .data = NULL };
+
+/** Extends the line index of a source file, e.g. because more source has been appended to it */
+static void cli_sourceindex(clisourcefile *file) {
+    char *c=file->data+file->indexed;
+    for (; *c!='\0'; c++) {
+        if (*c=='\n') varray_clilineoffsetwrite(&file->lines, (size_t) (c-file->data)+1);
+    }
+    file->indexed=(size_t) (c-file->data);
+}
+
+/** Initializes a source file structure with some source text, which may be NULL */
+static void cli_sourcefileinit(clisourcefile *file, char *data) {
+    file->path=NULL;
+    file->data=data;
+    file->indexed=0;
+    file->session=NULL;
+    cli_sourceinit(&file->src);
+    varray_clilineoffsetinit(&file->lines);
+    varray_clilineoffsetwrite(&file->lines, 0); // Line 1 begins at the start
+}
+
+/** Clears a source file structure */
+static void cli_sourcefileclear(clisourcefile *file) {
+    if (file->path) MORPHO_FREE(file->path);
+    cli_sourceclear(&file->src);
+    varray_clilineoffsetclear(&file->lines);
+}
+
+/** Frees a source file */
+static void cli_sourcefilefree(clisourcefile *file) {
+    cli_sourcefileclear(file);
+    MORPHO_FREE(file);
+}
+
+/** Finds a source file in the cache, loading it if necessary
+ *  @param[in] in - module to find, or NULL for the source held in cli_globalsession or cli_globalsrc
+ *  @returns the source file, or NULL if it couldn't be loaded */
+clisourcefile *cli_sourcecachefind(const char *in) {
+    clisourcefile *file=NULL;
+    
+    for (unsigned int i=0; i<cli_sourcecache.count; i++) {
+        clisourcefile *f=cli_sourcecache.data[i];
+        if ((!in && !f->path) || (in && f->path && strcmp(in, f->path)==0)) { file=f; break; }
+    }
+    
+    if (!file) {
+        file=MORPHO_MALLOC(sizeof(clisourcefile));
+        if (!file) return NULL;
+        cli_sourcefileinit(file, NULL);
         
-        /* Read in the file */
-        for (char *c=buffer.data; !feof(f); c=c+strlen(c)) {
-            if (!fgets(c, (int) (buffer.data+buffer.capacity-c), f)) { c[0]='\0'; break; }
+        if (in) {
+            file->path=MORPHO_MALLOC(strlen(in)+1);
+            if (file->path) strcpy(file->path, in);
+            if (!file->path || !cli_loadsource(in, &file->src)) {
+                cli_sourcefilefree(file);
+                return NULL;
+            }
+            file->data=file->src.data;
         }
         
-        fclose(f);
+        varray_clisourcefilewrite(&cli_sourcecache, file);
+    }
+    
+    /* The global source only ever grows, but may move as it does so */
+    if (!file->path) {
+        file->session=cli_globalsession;
+        if (file->session) return file; // The session indexes its own lines
+        if (!cli_globalsrc) return NULL;
+        file->data=cli_globalsrc;
     }
     
-    return buffer.data;
+    cli_sourceindex(file);
+    return file;
+}
+
+/** Locates a line in a cached source file
+ *  @param[in] file - the source file
+ *  @param[in] line - line number, starting from 1
+ *  @param[out] start - start of the line
+ *  @param[out] length - length of the line, excluding the newline
+ *  @returns true if the line exists */
+bool cli_sourceline(clisourcefile *file, int line, char **start, size_t *length) {
+    if (file->session) return clisession_line(file->session, line, start, length);
+    
+    if (line<1 || line>file->lines.count) return false;
+    
+    size_t offset=file->lines.data[line-1];
+    if (offset>=file->indexed) return false; // Nothing follows the final newline
+    
+    size_t end=(line<file->lines.count ? file->lines.data[line]-1 : file->indexed);
+    *start=file->data+offset;
+    *length=end-offset;
+    return true;
+}
+
+/** Empties the source cache at the end of a session */
+void cli_sourcecacheclear(void) {
+    for (unsigned int i=0; i<cli_sourcecache.count; i++) cli_sourcefilefree(cli_sourcecache.data[i]);
+    varray_clisourcefileclear(&cli_sourcecache);
 }
 
 /* **********************************************************************
  * Source listing and disassembly
  * ********************************************************************** */
 
-/** Displays a single line of source */
-static void cli_printline(lineditor *edit, int line, char *prompt, const char *src, int length) {
+/** Displays a single line of source
+ *  @param[in] src - start of the line
+ *  @param[in] length - length of the line, excluding the newline */
+static void cli_printline(lineditor *edit, int line, char *prompt, const char *src, size_t length) {
     printf("%s %4u : ", prompt, line);
     /* Display the src line */
-    char srcline[length];
-    strncpy(srcline, src, length-1);
-    srcline[length-1]='\0';
+    char srcline[length+1];
+    memcpy(srcline, src, length);
+    srcline[length]='\0';
     linedit_displaywithsyntaxcoloring(edit, srcline);
     printf("\n");
 }
 
-/** Disassembles the program showing syntax colored lines of source */
+/** Prints source lines from start to end as part of a disassembly */
+static void cli_disassemblelines(lineditor *edit, clisourcefile *file, int start, int end) {
+    char *line;
+    size_t length;
+    for (int i=start; i<=end && file && cli_sourceline(file, i, &line, &length); i++) {
+        cli_printline(edit, i, ">>>", line, length);
+    }
+}
+
+/** Last line of a source file printed during a disassembly */
+typedef struct {
+    clisourcefile *file;
+    int last;
+} clidisassemblyposn;
+
+DECLARE_VARRAY(clidisassemblyposn, clidisassemblyposn)
+DEFINE_VARRAY(clidisassemblyposn, clidisassemblyposn)
+
+/** Finds the last line printed from a source file, so that returning to a module after an import carries on from where it left off */
+static int *cli_disassemblylast(varray_clidisassemblyposn *posns, clisourcefile *file) {
+    for (int i=0; i<posns->count; i++) if (posns->data[i].file==file) return &posns->data[i].last;
+    clidisassemblyposn posn = { .file = file, .last = 0 };
+    if (!varray_clidisassemblyposnwrite(posns, posn)) return NULL;
+    return &posns->data[posns->count-1].last;
+}
+
+/** Disassembles the program showing syntax colored lines of source.
+ *  The program is walked once: the debug annotations map each run of instructions to the line that
+ *  generated it, so each line is printed followed by its own instructions.
+ *  @param[in] p - program to disassemble
+ *  @param[in] src - source of the program */
 void cli_disassemblewithsrc(program *p, char *src) {
     lineditor edit;
     linedit_init(&edit);
-    lexer l;
-    linedit_syntaxcolor(&edit, cli_lex, &l, cli_tokencolors);
-    
-    int line=1, length=0;
-    for (unsigned int i=0; src[i]!='\0'; i++) {
-        length++;
-        if (src[i]=='\n' || src[i]=='\0') {
-            cli_printline(&edit, line, ">>>", src+i-length+1, length);
-            morpho_disassemble(NULL, p, NULL);
-            line++; length=0;
+    clilexer l;
+    cli_lexerinit(&l);
+    linedit_resumablesyntaxcolor(&edit, cli_lex, &l, cli_tokencolors);
+    
+    clisourcefile mainsrc;
+    cli_sourcefileinit(&mainsrc, src);
+    cli_sourceindex(&mainsrc);
+    
+    varray_clidisassemblyposn posns;
+    varray_clidisassemblyposninit(&posns);
+    
+    clisourcefile *file=&mainsrc; // Source of the current module
+    value *konst=(p->global ? p->global->konst.data : NULL);
+    instructionindx i=0;
+    int mainlast=0, spare=0, *last=&mainlast; // Last line printed in the current module
+    
+    for (unsigned int j=0; j<p->annotations.count; j++) {
+        debugannotation *ann = &p->annotations.data[j];
+        switch (ann->type) {
+            case DEBUG_ELEMENT: {
+                int line=ann->content.element.line;
+                if (line!=*last) {
+                    /* Include lines that generated no code, e.g. comments, if we've moved forward */
+                    cli_disassemblelines(&edit, file, (line>*last ? *last+1 : line), line);
+                    *last=line;
+                }
+                for (int k=0; k<ann->content.element.ninstr && i<p->code.count; k++, i++) {
+                    debugger_disassembleinstruction(NULL, p->code.data[i], i, konst, NULL);
+                    printf("\n");
+                }
+            }
+                break;
+            case DEBUG_FUNCTION: {
+                objectfunction *func=ann->content.function.function;
+                konst=func->konst.data;
+                if (MORPHO_ISSTRING(func->name)) printf("fn %s:\n", MORPHO_GETCSTRING(func->name));
+            }
+                break;
+            case DEBUG_MODULE: {
+                value module=ann->content.module.module;
+                file=(MORPHO_ISSTRING(module) ? cli_sourcecachefind(MORPHO_GETCSTRING(module)) : &mainsrc);
+                last=(file==&mainsrc ? &mainlast : cli_disassemblylast(&posns, file));
+                if (!last) { spare=0; last=&spare; } // Without memory to remember the position, lines may be shown again
+            }
+                break;
+            default:
+                break;
         }
     }
     
+    /* Show any trailing lines of the main program */
+    cli_disassemblelines(&edit, &mainsrc, mainlast+1, INT_MAX);
+    
+    varray_clidisassemblyposnclear(&posns);
+    cli_sourcefileclear(&mainsrc);
     linedit_clear(&edit);
+    cli_lexerclear(&l);
 }
 
-/** Displays a source listing from source lines start to end */
-void cli_list(const char *src, int start, int end) {
-    lineditor edit;
-    
-    if (src) {
-        linedit_init(&edit);
-        lexer l;
-        linedit_syntaxcolor(&edit, cli_lex, &l, cli_tokencolors);
-        
-        int line=1, length=0;
-        for (unsigned int i=0; src[i]!='\0'; i++) {
-            length++;
-            if (src[i]=='\n' || src[i]=='\0') {
-                if (line>=start && line <=end) cli_printline(&edit, line, "", src+i-length+1, length);
-                line++;
-                length=0;
-            }
+/* ----------------------------------------
+ * Disassembly output
+ * ---------------------------------------- */
+
+static const char *cli_disassemblyfile = NULL;
+
+/** Sets a file that disassembly is written to instead of stdout; pass NULL to restore */
+void cli_setdisassemblyfile(const char *file) {
+    cli_disassemblyfile=file;
+}
+
+/** Redirects stdout to the disassembly file, if one is set, or otherwise to stderr while stdout holds JSON records
+ *  @returns a descriptor that restores stdout, or -1 */
+int cli_disassemblybegin(void) {
+    int fd=-1;
+    if (cli_disassemblyfile) {
+        fd=open(cli_disassemblyfile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd<0) {
+            fprintf(stderr, "Could not open file '%s': %s\n", cli_disassemblyfile, strerror(errno));
+            return -1;
         }
-        
-        linedit_clear(&edit);
+    } else if (cli_output.jsonl) {
+        fd=dup(STDERR_FILENO);
     }
+    if (fd<0) return -1;
+    
+    cli_outputflush(); // Buffered output belongs before the redirection
+    fflush(stdout);
+    int saved=dup(STDOUT_FILENO);
+    dup2(fd, STDOUT_FILENO);
+    close(fd);
+    return saved;
+}
+
+/** Restores stdout after disassembling to a file */
+void cli_disassemblyend(int saved) {
+    if (saved<0) return;
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
 }
 
+/** Displays a source listing from source lines start to end
+ *  @param[in] in - module to list, or NULL for the source held in cli_globalsession or cli_globalsrc */
+void cli_list(const char *in, int start, int end) {
+    clisourcefile *file = cli_sourcecachefind(in);
+    if (!file) return;
+    
+    lineditor edit;
+    linedit_init(&edit);
+    clilexer l;
+    cli_lexerinit(&l);
+    linedit_resumablesyntaxcolor(&edit, cli_lex, &l, cli_tokencolors);
+    
+    if (start<1) start=1;
+    
+    char *line;
+    size_t length;
+    for (int i=start; i<=end && cli_sourceline(file, i, &line, &length); i++) {
+        cli_printline(&edit, i, "", line, length);
+    }
+    
+    linedit_clear(&edit);
+    cli_lexerclear(&l);
+}
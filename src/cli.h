@@ -10,11 +10,16 @@
 #include <morpho.h>
 #include <varray.h>
 #include <common.h>
+#include <lex.h>
 
 #include "linedit.h"
 #include "help.h"
 
 #include "debugger.h"
+#include "profiler.h"
+#include "trace.h"
+#include "session.h"
+#include "complete.h"
 
 #define CLI_DEFAULTCOLOR LINEDIT_DEFAULTCOLOR
 #define CLI_ERRORCOLOR  LINEDIT_RED
@@ -26,6 +31,11 @@
 #define CLI_QUIT "quit"
 #define CLI_HELP "help"
 #define CLI_SHORT_HELP "?"
+#define CLI_SEARCH "??"
+
+#define CLI_USERDIR ".morpho6"
+#define CLI_GRAPHEMEFILE "graphemes"
+#define CLI_HISTORYFILE "history"
 
 #define CLI_RUN                 (1<<0)
 #define CLI_DISASSEMBLE         (1<<1)
@@ -33,20 +43,101 @@
 #define CLI_DEBUG               (1<<3)
 #define CLI_OPTIMIZE            (1<<4)
 #define CLI_PROFILE             (1<<5)
+#define CLI_SAMPLE              (1<<6)
+#define CLI_STATS               (1<<7)
+#define CLI_TRACE               (1<<8)
+#define CLI_JSONL               (1<<9)
+
+#define CLI_STATSOPTION "stats"
+#define CLI_STARTUPOPTION "startup-trace"
+#define CLI_OUTPUTOPTION "output"
+#define CLI_OUTPUTJSONL "jsonl"
+#define CLI_OUTPUTTEXT "text"
 
 typedef unsigned int clioptions;
 
 extern char *cli_globalsrc;
+extern clisession *cli_globalsession;
+
+/** Lexer used for syntax coloring */
+typedef struct {
+    lexer l;      /** The morpho lexer */
+    char *next;   /** End of the previous token, or NULL if the lexer is not initialized */
+    char *ground; /** Last point at which the lexer was outside any string interpolation */
+    int depth;    /** Depth of string interpolation at next */
+} clilexer;
+
+extern linedit_colormap cli_tokencolors[];
+
+void cli_lexerinit(clilexer *l);
+void cli_lexerclear(clilexer *l);
+bool cli_lex(char *in, void *ref, linedit_tokenizerstate *state, linedit_token *out);
+bool cli_complete(char *in, void *ref, linedit_stringlist *c);
+
+void cli_outputprint(const char *string);
+void cli_outputflush(void);
+void cli_outputreset(clioptions opt);
+bool cli_outputisjsonl(void);
+varray_char *cli_outputrecordbegin(const char *type);
+void cli_outputrecordend(void);
+
+void cli_jsonopen(varray_char *out, const char *key, char bracket);
+void cli_jsonclose(varray_char *out, char bracket);
+void cli_jsonstring(varray_char *out, const char *key, const char *str);
+void cli_jsoninteger(varray_char *out, const char *key, long n);
+void cli_jsonnumber(varray_char *out, const char *key, double x);
+void cli_jsonbool(varray_char *out, const char *key, bool b);
+void cli_jsonrecord(varray_char *out, const char *type);
+void cli_jsonrecordend(varray_char *out);
+void cli_jsonerror(varray_char *out, const char *type, error *err, vm *v);
 
 void cli_displaywithstyle(lineditor *edit, linedit_color col, linedit_emphasis emph, int n, ...);
 void cli_reporterror(error *err, vm *v);
 
 
-void cli_run(const char *in, clioptions opt);
-void cli(clioptions opt);
+int cli_run(const char *in, clioptions opt);
+int cli(clioptions opt);
+int cli_batch(clioptions opt);
+
+bool cli_userpath(const char *file, char *out, size_t size);
+
+/** A source file loaded into memory */
+typedef struct {
+    char *data;     /** Zero terminated source */
+    size_t length;  /** Length of the source in bytes */
+    void *map;      /** Base of the memory mapping, or NULL if the source is held in an allocated buffer */
+    size_t mapsize; /** Size of the mapping */
+} clisource;
+
+void cli_sourceinit(clisource *src);
+void cli_sourceclear(clisource *src);
+bool cli_loadsource(const char *in, clisource *src);
+DECLARE_VARRAY(clilineoffset, size_t)
+
+/** A source file held in the source cache, with the offset at which each line begins */
+typedef struct {
+    char *path;                  /** Module path, or NULL for the source held in cli_globalsrc or cli_globalsession */
+    clisource src;               /** Source loaded from the module */
+    char *data;                  /** Source text */
+    varray_clilineoffset lines;  /** Offset of the start of each line; line n begins at lines.data[n-1] */
+    size_t indexed;              /** Source up to this offset has been indexed */
+    clisession *session;         /** Session holding the source, which indexes its own lines, or NULL */
+} clisourcefile;
+
+clisourcefile *cli_sourcecachefind(const char *in);
+bool cli_sourceline(clisourcefile *file, int line, char **start, size_t *length);
+void cli_sourcecacheclear(void);
 
-char *cli_loadsource(const char *in);
 void cli_disassemblewithsrc(program *p, char *src);
+void cli_setdisassemblyfile(const char *file);
+void cli_setstatsfile(const char *file);
+void cli_setsessionlimit(size_t limit);
+void cli_setstartuptrace(bool enable, const char *file);
+void cli_startupbegin(void);
+void cli_startupspan(const char *name);
+void cli_startupreport(const char *milestone);
+int cli_disassemblybegin(void);
+void cli_disassemblyend(int saved);
 void cli_list(const char *in, int start, int end);
 
 #endif /* cli_h */
@@ -0,0 +1,260 @@
+/** @file complete.c
+ *  @author T J Atherton
+ *
+ *  @brief Symbol aware autocompletion for the REPL
+*/
+
+#include <ctype.h>
+
+#include <morpho.h>
+#include <lex.h>
+
+#include "complete.h"
+#include "help.h"
+
+DEFINE_VARRAY(clicompletenode, clicompletenode)
+
+/* **********************************************************************
+ * Trie
+ * ********************************************************************** */
+
+/** Finds the child of a node reached by a given byte, optionally creating it
+ *  @returns the child, or CLICOMPLETE_NONODE if it doesn't exist and couldn't be created */
+static uint32_t clicomplete_child(clicompleter *c, uint32_t parent, uint8_t ch, bool create) {
+    uint32_t prev=CLICOMPLETE_NONODE, i=c->nodes.data[parent].child;
+    while (i!=CLICOMPLETE_NONODE && c->nodes.data[i].c<ch) {
+        prev=i;
+        i=c->nodes.data[i].next;
+    }
+    if (i!=CLICOMPLETE_NONODE && c->nodes.data[i].c==ch) return i;
+    if (!create) return CLICOMPLETE_NONODE;
+
+    /* Link a new node in between prev and i so that siblings stay in order */
+    clicompletenode new = { .child = CLICOMPLETE_NONODE, .next = i, .c = ch, .kinds = 0, .below = 0 };
+    uint32_t n=c->nodes.count;
+    varray_clicompletenodewrite(&c->nodes, new);
+    if (c->nodes.count==n) return CLICOMPLETE_NONODE;
+
+    if (prev==CLICOMPLETE_NONODE) c->nodes.data[parent].child=n;
+    else c->nodes.data[prev].next=n;
+    return n;
+}
+
+/** Adds every suggestion beneath a node's children, in order, until the limit is reached
+ *  @param[in] c - the completer
+ *  @param[in] child - first child to visit
+ *  @param[in] kinds - kinds of word to suggest
+ *  @param[in] suffix - characters leading from the node where the prefix ended to child's parent
+ *  @param[out] out - suggestions
+ *  @param[in,out] n - number of suggestions made */
+static void clicomplete_collect(clicompleter *c, uint32_t child, unsigned int kinds, varray_char *suffix, linedit_stringlist *out, int *n) {
+    for (uint32_t i=child; i!=CLICOMPLETE_NONODE && *n<CLICOMPLETE_MAXSUGGESTIONS; i=c->nodes.data[i].next) {
+        clicompletenode *node=&c->nodes.data[i];
+        if (!(node->below & kinds)) continue; // Nothing of interest in this subtree
+
+        varray_charwrite(suffix, (char) node->c);
+        if (node->kinds & kinds) {
+            varray_charwrite(suffix, '\0');
+            linedit_addsuggestion(out, suffix->data);
+            suffix->count--;
+            (*n)++;
+        }
+        clicomplete_collect(c, node->child, kinds, suffix, out, n);
+        suffix->count--;
+    }
+}
+
+/* **********************************************************************
+ * Sources of words
+ * ********************************************************************** */
+
+/** Morpho's keywords, together with the commands understood by the REPL */
+static char *clicomplete_keywords[] = { "as", "and", "break", "class", "continue", "do", "else", "for", "false", "fn", "help", "if", "in", "import", "nil", "or", "print", "return", "true", "var", "while", "quit", "self", "super", "this", "try", "catch", NULL };
+
+/** Checks whether a help topic name could be typed as a symbol */
+static bool clicomplete_issymbol(const char *name, size_t length) {
+    if (!length || isdigit((unsigned char) name[0])) return false;
+    for (size_t i=0; i<length; i++) {
+        if (!isalnum((unsigned char) name[i]) && name[i]!='_') return false;
+    }
+    return true;
+}
+
+/** Adds a help topic; subtopics are generally methods of the class documented by their parent */
+static void clicomplete_helptopic(const char *name, size_t length, bool global, void *ref) {
+    if (clicomplete_issymbol(name, length)) {
+        clicomplete_addword((clicompleter *) ref, name, length, (global ? CLICOMPLETE_GLOBAL : CLICOMPLETE_METHOD));
+    }
+}
+
+/** States of the scan for declarations */
+typedef enum {
+    CLICOMPLETE_SCAN,              // Looking for a declaration
+    CLICOMPLETE_DECLARATION,       // The next symbol is the name of a function, class or import
+    CLICOMPLETE_VARIABLE,          // The next symbol is the name of a variable
+    CLICOMPLETE_INITIALIZER,       // Skipping a variable's initializer; a comma introduces another variable
+    CLICOMPLETE_IMPORT,            // Within an import statement
+    CLICOMPLETE_IMPORTLIST         // Within the list of symbols imported with 'for'
+} clicompletescan;
+
+/* **********************************************************************
+ * Interface
+ * ********************************************************************** */
+
+/** @brief Initializes a completer with no words */
+void clicomplete_init(clicompleter *c) {
+    varray_clicompletenodeinit(&c->nodes);
+    clicompletenode root = { .child = CLICOMPLETE_NONODE, .next = CLICOMPLETE_NONODE, .c = 0, .kinds = 0, .below = 0 };
+    varray_clicompletenodewrite(&c->nodes, root);
+    c->helpadded=false;
+}
+
+/** @brief Frees a completer */
+void clicomplete_clear(clicompleter *c) {
+    varray_clicompletenodeclear(&c->nodes);
+    c->helpadded=false;
+}
+
+/** @brief Adds a word
+ *  @param[in] c - the completer
+ *  @param[in] word - word to add; need not be zero terminated
+ *  @param[in] length - length of the word
+ *  @param[in] kind - kind of word, e.g. CLICOMPLETE_GLOBAL */
+void clicomplete_addword(clicompleter *c, const char *word, size_t length, unsigned int kind) {
+    if (!length || !c->nodes.count) return;
+
+    uint32_t node=0;
+    c->nodes.data[node].below|=kind;
+    for (size_t i=0; i<length; i++) {
+        node=clicomplete_child(c, node, (uint8_t) word[i], true);
+        if (node==CLICOMPLETE_NONODE) return;
+        c->nodes.data[node].below|=kind;
+    }
+    c->nodes.data[node].kinds|=kind;
+}
+
+/** @brief Adds morpho's keywords */
+void clicomplete_addkeywords(clicompleter *c) {
+    for (unsigned int i=0; clicomplete_keywords[i]!=NULL; i++) {
+        clicomplete_addword(c, clicomplete_keywords[i], strlen(clicomplete_keywords[i]), CLICOMPLETE_KEYWORD);
+    }
+}
+
+/** @brief Adds the names of help topics, which cover the builtin functions and classes, and their methods.
+ *  @details The help system must already be initialized. */
+void clicomplete_addhelp(clicompleter *c) {
+    if (c->helpadded) return;
+    help_topicnames(clicomplete_helptopic, c);
+    c->helpadded=true;
+}
+
+/** @brief Adds the globals and methods declared by source that has compiled successfully
+ *  @param[in] c - the completer
+ *  @param[in] source - the source
+ *  @details Finds the functions, classes, variables and imported symbols declared at the top level,
+ *           and the methods defined in the body of each class */
+void clicomplete_addsource(clicompleter *c, char *source) {
+    lexer l;
+    token tok;
+    error err;
+    error_init(&err);
+    lex_init(&l, source, 0);
+
+    clicompletescan state=CLICOMPLETE_SCAN;
+    int depth=0;              // Nesting of brackets of any kind
+    int classbody=-1;         // Depth within the body of the class being declared, or -1
+    bool classpending=false;  // A class has been declared but its body hasn't begun
+    token prev = { .type = TOKEN_NONE, .start = NULL, .length = 0 };
+
+    while (lex(&l, &tok, &err) && tok.type!=TOKEN_EOF) {
+        switch (tok.type) {
+            case TOKEN_LEFTPAREN: case TOKEN_LEFTSQBRACKET: case TOKEN_LEFTCURLYBRACKET:
+                /* A symbol followed by an opening parenthesis at the top level of a class body is a method */
+                if (tok.type==TOKEN_LEFTPAREN && depth==classbody && prev.type==TOKEN_SYMBOL) {
+                    clicomplete_addword(c, prev.start, prev.length, CLICOMPLETE_METHOD);
+                }
+                depth++;
+                if (tok.type==TOKEN_LEFTCURLYBRACKET && classpending) {
+                    classbody=depth;
+                    classpending=false;
+                }
+                break;
+            case TOKEN_RIGHTPAREN: case TOKEN_RIGHTSQBRACKET: case TOKEN_RIGHTCURLYBRACKET:
+                if (depth>0) depth--;
+                if (depth<classbody) classbody=-1;
+                break;
+            default: break;
+        }
+
+        if (depth==0 || state==CLICOMPLETE_INITIALIZER) {
+            /* A declaration ends any statement still being scanned */
+            if (depth==0 && state!=CLICOMPLETE_DECLARATION && state!=CLICOMPLETE_VARIABLE &&
+                (tok.type==TOKEN_VAR || tok.type==TOKEN_FUNCTION || tok.type==TOKEN_CLASS || tok.type==TOKEN_IMPORT)) {
+                state=CLICOMPLETE_SCAN;
+            }
+
+            switch (state) {
+                case CLICOMPLETE_DECLARATION:
+                case CLICOMPLETE_VARIABLE:
+                    if (tok.type==TOKEN_SYMBOL) clicomplete_addword(c, tok.start, tok.length, CLICOMPLETE_GLOBAL);
+                    state=(state==CLICOMPLETE_VARIABLE && tok.type==TOKEN_SYMBOL ? CLICOMPLETE_INITIALIZER : CLICOMPLETE_SCAN);
+                    break;
+                case CLICOMPLETE_INITIALIZER:
+                    if (depth>0) break;
+                    if (tok.type==TOKEN_COMMA) state=CLICOMPLETE_VARIABLE;
+                    else if (tok.type==TOKEN_NEWLINE || tok.type==TOKEN_SEMICOLON) state=CLICOMPLETE_SCAN;
+                    break;
+                case CLICOMPLETE_IMPORT:
+                    if (tok.type==TOKEN_AS) state=CLICOMPLETE_DECLARATION;
+                    else if (tok.type==TOKEN_FOR) state=CLICOMPLETE_IMPORTLIST;
+                    else if (tok.type==TOKEN_NEWLINE || tok.type==TOKEN_SEMICOLON) state=CLICOMPLETE_SCAN;
+                    break;
+                case CLICOMPLETE_IMPORTLIST:
+                    if (tok.type==TOKEN_SYMBOL) clicomplete_addword(c, tok.start, tok.length, CLICOMPLETE_GLOBAL);
+                    else if (tok.type!=TOKEN_COMMA) state=CLICOMPLETE_SCAN;
+                    break;
+                case CLICOMPLETE_SCAN:
+                    break;
+            }
+
+            if (state==CLICOMPLETE_SCAN && depth==0) {
+                switch (tok.type) {
+                    case TOKEN_VAR: state=CLICOMPLETE_VARIABLE; break;
+                    case TOKEN_FUNCTION: state=CLICOMPLETE_DECLARATION; break;
+                    case TOKEN_CLASS: state=CLICOMPLETE_DECLARATION; classpending=true; break;
+                    case TOKEN_IMPORT: state=CLICOMPLETE_IMPORT; break;
+                    default: break;
+                }
+            }
+        }
+
+        prev=tok;
+    }
+
+    lex_clear(&l);
+}
+
+/** @brief Suggests completions of a prefix
+ *  @param[in] c - the completer
+ *  @param[in] prefix - prefix to complete; need not be zero terminated
+ *  @param[in] length - length of the prefix
+ *  @param[in] kinds - kinds of word to suggest
+ *  @param[out] out - the remainder of each word that begins with the prefix, in order
+ *  @returns true if any suggestions were made */
+bool clicomplete_suggest(clicompleter *c, const char *prefix, size_t length, unsigned int kinds, linedit_stringlist *out) {
+    if (!c->nodes.count) return false;
+
+    uint32_t node=0;
+    for (size_t i=0; i<length && node!=CLICOMPLETE_NONODE; i++) {
+        node=clicomplete_child(c, node, (uint8_t) prefix[i], false);
+    }
+    if (node==CLICOMPLETE_NONODE || !(c->nodes.data[node].below & kinds)) return false;
+
+    varray_char suffix;
+    varray_charinit(&suffix);
+    int n=0;
+    clicomplete_collect(c, c->nodes.data[node].child, kinds, &suffix, out, &n);
+    varray_charclear(&suffix);
+
+    return (n>0);
+}
@@ -0,0 +1,58 @@
+/** @file complete.h
+ *  @author T J Atherton
+ *
+ *  @brief Symbol aware autocompletion for the REPL
+*/
+
+#ifndef complete_h
+#define complete_h
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include <varray.h>
+
+#include "linedit.h"
+
+/** Words that may be completed are held in a prefix trie. Each node records the kinds of word that end
+ *  there and the kinds found anywhere beneath it, so that a lookup walks only the characters typed and
+ *  then visits just the subtrees that hold a suggestion. Siblings are kept in order of their character,
+ *  so suggestions are found in a stable order. */
+
+#define CLICOMPLETE_KEYWORD (1<<0) // Morpho keywords
+#define CLICOMPLETE_GLOBAL  (1<<1) // Global functions, classes and variables, and help topics
+#define CLICOMPLETE_METHOD  (1<<2) // Methods, offered after a '.'
+
+#define CLICOMPLETE_MAXSUGGESTIONS 64 // Bounds the work done for each keystroke
+
+#define CLICOMPLETE_NONODE UINT32_MAX
+
+/** A node of the trie */
+typedef struct {
+    uint32_t child;    /** First child, or CLICOMPLETE_NONODE */
+    uint32_t next;     /** Next sibling, or CLICOMPLETE_NONODE */
+    uint8_t c;         /** Byte that leads to this node */
+    uint8_t kinds;     /** Kinds of word that end at this node */
+    uint8_t below;     /** Kinds of word that end at this node or beneath it */
+} clicompletenode;
+
+DECLARE_VARRAY(clicompletenode, clicompletenode)
+
+/** Words available for completion */
+typedef struct {
+    varray_clicompletenode nodes; /** nodes.data[0] is the root */
+    bool helpadded;               /** Whether help topics have been added */
+} clicompleter;
+
+void clicomplete_init(clicompleter *c);
+void clicomplete_clear(clicompleter *c);
+
+void clicomplete_addword(clicompleter *c, const char *word, size_t length, unsigned int kind);
+void clicomplete_addkeywords(clicompleter *c);
+void clicomplete_addhelp(clicompleter *c);
+void clicomplete_addsource(clicompleter *c, char *source);
+
+bool clicomplete_suggest(clicompleter *c, const char *prefix, size_t length, unsigned int kinds, linedit_stringlist *out);
+
+#endif /* complete_h */
@@ -4,7 +4,11 @@
  *  @brief Command line debugger
 */
 
+#include <ctype.h>
+#include <pthread.h>
+
 #include <compile.h>
+#include <object.h>
 #include <vm.h>
 #include <parse.h>
 #include <debug.h>
@@ -22,12 +26,24 @@
  * Debugger front end structure
  * ********************************************************************** */
 
+/** Reasons for entering the debugger */
+typedef enum {
+    CLIDEBUGGER_RESUME,     // No reason: the vm should carry on
+    CLIDEBUGGER_BREAKPOINT,
+    CLIDEBUGGER_SINGLESTEP,
+    CLIDEBUGGER_WATCHPOINT
+} clidebuggerreason;
+
+static char *clidebugger_reasonlabels[] = { "", "Breakpoint", "Single stepping", "Watchpoint" };
+
 typedef struct {
     debugger *debug; /** Debugger */
     lineditor *edit; /** lineeditor for output */
     error *err; /** Error structure to fill out  */
     char *info; /** Report any info to the user after error messages */
     bool stop;
+    clidebuggerreason reason; /** Why the debugger was entered */
+    int watch; /** Watchpoint that changed, if the reason is CLIDEBUGGER_WATCHPOINT */
 } clidebugger;
 
 void clidebugger_init(clidebugger *debug, vm *v, lineditor *edit, error *err) {
@@ -37,6 +53,448 @@ void clidebugger_init(clidebugger *debug, vm *v, lineditor *edit, error *err) {
     debug->err=err;
     debug->info=NULL;
     debug->stop=false;
+    debug->reason=CLIDEBUGGER_BREAKPOINT;
+    debug->watch=-1;
+}
+
+/* **********************************************************************
+ * Conditional breakpoints and watchpoints
+ * ********************************************************************** */
+
+/** The debugger in libmorpho stops the vm at every breakpoint. Conditions, hit counts and watchpoints are
+ *  layered on top of it here: every breakpoint set is also recorded in clidebugger_breakpoints, and when the
+ *  vm stops, clidebugger_checkstop decides whether to enter the interactive front end or to let the vm carry
+ *  on. Conditions are compiled once, when the breakpoint is set, into a short postfix program, so that
+ *  checking one costs a few lookups rather than a parse. Watchpoints need the vm to single step, and their
+ *  values are compared at every instruction. */
+
+/** Operations in a compiled condition */
+typedef enum {
+    CLIDEBUGGER_PUSHVALUE,      // Push constant a
+    CLIDEBUGGER_PUSHSYMBOL,     // Push the value of variable a
+    CLIDEBUGGER_PUSHPROPERTY,   // Push property b of variable a
+    CLIDEBUGGER_OPEQ,
+    CLIDEBUGGER_OPNEQ,
+    CLIDEBUGGER_OPLT,
+    CLIDEBUGGER_OPLTEQ,
+    CLIDEBUGGER_OPGT,
+    CLIDEBUGGER_OPGTEQ,
+    CLIDEBUGGER_OPAND,
+    CLIDEBUGGER_OPOR,
+    CLIDEBUGGER_OPNOT
+} clidebuggerop;
+
+/** An instruction in a compiled condition */
+typedef struct {
+    clidebuggerop op;
+    value a;
+    value b;
+} clidebuggerinstr;
+
+DECLARE_VARRAY(clidebuggerinstr, clidebuggerinstr)
+DEFINE_VARRAY(clidebuggerinstr, clidebuggerinstr)
+
+/** Kinds of breakpoint */
+typedef enum {
+    CLIDEBUGGER_ATINSTRUCTION,
+    CLIDEBUGGER_ATLINE,
+    CLIDEBUGGER_ATFUNCTION
+} clidebuggerlocation;
+
+/** A breakpoint */
+typedef struct {
+    clidebuggerlocation type;
+    instructionindx instr;   /** Instruction, for CLIDEBUGGER_ATINSTRUCTION */
+    value file;              /** File, or nil, for CLIDEBUGGER_ATLINE */
+    int line;                /** Line, for CLIDEBUGGER_ATLINE */
+    value klass;             /** Class, or nil, for CLIDEBUGGER_ATFUNCTION */
+    value fn;                /** Function or method, for CLIDEBUGGER_ATFUNCTION */
+    
+    varray_clidebuggerinstr condition; /** The compiled condition; empty if there is none */
+    char *text;              /** Text of the condition, or NULL */
+    long after;              /** Number of hits to ignore */
+    long hits;               /** Number of times the breakpoint has been reached */
+} clibreakpoint;
+
+DECLARE_VARRAY(clibreakpoint, clibreakpoint)
+DEFINE_VARRAY(clibreakpoint, clibreakpoint)
+
+/** A watchpoint */
+typedef struct {
+    value symbol;            /** Variable watched */
+    value prop;              /** Property of the variable watched, or nil */
+    value last;              /** Value when last checked */
+    bool known;              /** Whether the value could be found when last checked */
+} cliwatchpoint;
+
+DECLARE_VARRAY(cliwatchpoint, cliwatchpoint)
+DEFINE_VARRAY(cliwatchpoint, cliwatchpoint)
+
+static varray_clibreakpoint clidebugger_breakpoints;
+static varray_cliwatchpoint clidebugger_watchpoints;
+
+static bool clidebugger_stepping = false; /* The user asked to single step */
+
+/* Location of the previous instruction seen while single stepping for watchpoints */
+static int clidebugger_lastline = -1;
+static objectfunction *clidebugger_lastfn = NULL;
+static instructionindx clidebugger_lastiindx = 0;
+
+/* ------------------------------------------
+ * Values
+ * ------------------------------------------ */
+
+/** Makes a copy of a string, or returns nil */
+static value clidebugger_copystring(value str) {
+    if (!MORPHO_ISSTRING(str)) return MORPHO_NIL;
+    return object_stringfromcstring(MORPHO_GETCSTRING(str), MORPHO_GETSTRINGLENGTH(str));
+}
+
+/** Checks whether two optional names are the same */
+static bool clidebugger_samename(value a, value b) {
+    if (MORPHO_ISNIL(a) || MORPHO_ISNIL(b)) return (MORPHO_ISNIL(a) && MORPHO_ISNIL(b));
+    return (MORPHO_ISSTRING(a) && MORPHO_ISSTRING(b) && strcmp(MORPHO_GETCSTRING(a), MORPHO_GETCSTRING(b))==0);
+}
+
+/** Converts a value to a double if it's a number */
+static bool clidebugger_number(value v, double *out) {
+    if (MORPHO_ISINTEGER(v)) *out=(double) MORPHO_GETINTEGERVALUE(v);
+    else if (MORPHO_ISFLOAT(v)) *out=MORPHO_GETFLOATVALUE(v);
+    else return false;
+    return true;
+}
+
+/** Truthiness follows morpho: only nil and false are false */
+static bool clidebugger_istrue(value v) {
+    return !(MORPHO_ISNIL(v) || (MORPHO_ISBOOL(v) && !MORPHO_GETBOOLVALUE(v)));
+}
+
+/** Checks whether a value is unchanged, without looking inside objects that might since have been freed */
+static bool clidebugger_unchanged(value a, value b) {
+    double x, y;
+    if (clidebugger_number(a, &x) && clidebugger_number(b, &y)) return (x==y);
+    if (MORPHO_ISBOOL(a) && MORPHO_ISBOOL(b)) return (MORPHO_GETBOOLVALUE(a)==MORPHO_GETBOOLVALUE(b));
+    if (MORPHO_ISNIL(a) || MORPHO_ISNIL(b)) return (MORPHO_ISNIL(a) && MORPHO_ISNIL(b));
+    if (MORPHO_ISOBJECT(a) && MORPHO_ISOBJECT(b)) return (MORPHO_GETOBJECT(a)==MORPHO_GETOBJECT(b));
+    return false;
+}
+
+/** Compares two values; values that can't be ordered fail every comparison but != */
+static bool clidebugger_compare(clidebuggerop op, value a, value b) {
+    int cmp;
+    double x, y;
+    if (clidebugger_number(a, &x) && clidebugger_number(b, &y)) {
+        cmp=(x<y ? -1 : (x>y ? 1 : 0));
+    } else if (MORPHO_ISSTRING(a) && MORPHO_ISSTRING(b)) {
+        cmp=strcmp(MORPHO_GETCSTRING(a), MORPHO_GETCSTRING(b));
+    } else {
+        bool same=clidebugger_unchanged(a, b);
+        return (op==CLIDEBUGGER_OPEQ ? same : (op==CLIDEBUGGER_OPNEQ ? !same : false));
+    }
+    
+    switch (op) {
+        case CLIDEBUGGER_OPEQ: return cmp==0;
+        case CLIDEBUGGER_OPNEQ: return cmp!=0;
+        case CLIDEBUGGER_OPLT: return cmp<0;
+        case CLIDEBUGGER_OPLTEQ: return cmp<=0;
+        case CLIDEBUGGER_OPGT: return cmp>0;
+        case CLIDEBUGGER_OPGTEQ: return cmp>=0;
+        default: return false;
+    }
+}
+
+/** Finds the current value of a variable, or of one of its properties
+ *  @param[in] d - the debugger
+ *  @param[in] symbol - variable to find, in the current frame or the globals
+ *  @param[in] prop - property to find, or nil
+ *  @param[out] out - the value
+ *  @returns true if the value was found */
+static bool clidebugger_lookup(debugger *d, value symbol, value prop, value *out) {
+    callframe *frame;
+    value *val;
+    if (!debugger_findsymbol(d, symbol, &frame, &val)) return false;
+    if (MORPHO_ISNIL(prop)) {
+        *out=*val;
+        return true;
+    }
+    return (MORPHO_ISINSTANCE(*val) && objectinstance_getproperty(MORPHO_GETINSTANCE(*val), prop, out));
+}
+
+/* ------------------------------------------
+ * Conditions
+ * ------------------------------------------ */
+
+/** Frees a compiled condition */
+static void clidebugger_conditionclear(varray_clidebuggerinstr *cond) {
+    for (unsigned int i=0; i<cond->count; i++) {
+        morpho_freeobject(cond->data[i].a);
+        morpho_freeobject(cond->data[i].b);
+    }
+    varray_clidebuggerinstrclear(cond);
+}
+
+/** Evaluates a compiled condition
+ *  @param[in] d - the debugger
+ *  @param[in] cond - condition to evaluate
+ *  @param[out] out - the result
+ *  @returns true if the condition could be evaluated */
+static bool clidebugger_evaluate(debugger *d, varray_clidebuggerinstr *cond, bool *out) {
+    value stack[cond->count+1];
+    int sp=0;
+    
+    for (unsigned int i=0; i<cond->count; i++) {
+        clidebuggerinstr *instr=&cond->data[i];
+        switch (instr->op) {
+            case CLIDEBUGGER_PUSHVALUE:
+                stack[sp++]=instr->a;
+                break;
+            case CLIDEBUGGER_PUSHSYMBOL: case CLIDEBUGGER_PUSHPROPERTY:
+                if (!clidebugger_lookup(d, instr->a, instr->b, &stack[sp])) return false;
+                sp++;
+                break;
+            case CLIDEBUGGER_OPNOT:
+                stack[sp-1]=MORPHO_BOOL(!clidebugger_istrue(stack[sp-1]));
+                break;
+            case CLIDEBUGGER_OPAND:
+                sp--;
+                stack[sp-1]=MORPHO_BOOL(clidebugger_istrue(stack[sp-1]) && clidebugger_istrue(stack[sp]));
+                break;
+            case CLIDEBUGGER_OPOR:
+                sp--;
+                stack[sp-1]=MORPHO_BOOL(clidebugger_istrue(stack[sp-1]) || clidebugger_istrue(stack[sp]));
+                break;
+            default:
+                sp--;
+                stack[sp-1]=MORPHO_BOOL(clidebugger_compare(instr->op, stack[sp-1], stack[sp]));
+        }
+    }
+    
+    if (sp!=1) return false;
+    *out=clidebugger_istrue(stack[0]);
+    return true;
+}
+
+/* ------------------------------------------
+ * Breakpoints
+ * ------------------------------------------ */
+
+/** Initializes a breakpoint */
+static void clidebugger_breakpointinit(clibreakpoint *bp) {
+    bp->type=CLIDEBUGGER_ATINSTRUCTION;
+    bp->instr=0;
+    bp->file=MORPHO_NIL;
+    bp->line=0;
+    bp->klass=MORPHO_NIL;
+    bp->fn=MORPHO_NIL;
+    varray_clidebuggerinstrinit(&bp->condition);
+    bp->text=NULL;
+    bp->after=0;
+    bp->hits=0;
+}
+
+/** Frees a breakpoint's contents */
+static void clidebugger_breakpointclear(clibreakpoint *bp) {
+    morpho_freeobject(bp->file);
+    morpho_freeobject(bp->klass);
+    morpho_freeobject(bp->fn);
+    clidebugger_conditionclear(&bp->condition);
+    if (bp->text) MORPHO_FREE(bp->text);
+    clidebugger_breakpointinit(bp);
+}
+
+/** Checks whether two breakpoints are at the same place */
+static bool clidebugger_samebreakpoint(clibreakpoint *a, clibreakpoint *b) {
+    if (a->type!=b->type) return false;
+    switch (a->type) {
+        case CLIDEBUGGER_ATINSTRUCTION: return a->instr==b->instr;
+        case CLIDEBUGGER_ATLINE: return a->line==b->line && clidebugger_samename(a->file, b->file);
+        case CLIDEBUGGER_ATFUNCTION: return clidebugger_samename(a->klass, b->klass) && clidebugger_samename(a->fn, b->fn);
+    }
+    return false;
+}
+
+/** Records a breakpoint, replacing any at the same place, or removes it; bp is taken over or freed */
+static void clidebugger_recordbreakpoint(clibreakpoint *bp, bool set) {
+    for (unsigned int i=0; i<clidebugger_breakpoints.count; i++) {
+        clibreakpoint *old=&clidebugger_breakpoints.data[i];
+        if (!clidebugger_samebreakpoint(old, bp)) continue;
+        
+        clidebugger_breakpointclear(old);
+        if (set) {
+            *old=*bp;
+        } else {
+            clidebugger_breakpointclear(bp);
+            clidebugger_breakpoints.data[i]=clidebugger_breakpoints.data[--clidebugger_breakpoints.count];
+        }
+        return;
+    }
+    
+    if (set) varray_clibreakpointwrite(&clidebugger_breakpoints, *bp);
+    else clidebugger_breakpointclear(bp);
+}
+
+/** Checks whether a file given in a breakpoint names a module */
+static bool clidebugger_matchfile(value file, value module) {
+    if (MORPHO_ISNIL(file)) return true;
+    if (!MORPHO_ISSTRING(module)) return false;
+    
+    char *f=MORPHO_GETCSTRING(file), *m=MORPHO_GETCSTRING(module);
+    size_t lf=strlen(f), lm=strlen(m);
+    return (lm>=lf && strcmp(m+lm-lf, f)==0 && (lm==lf || m[lm-lf-1]=='/'));
+}
+
+/** Checks whether a breakpoint is at the current instruction
+ *  @param[in] bp - the breakpoint
+ *  @param[in] iindx - current instruction
+ *  @param[in] module, line, fn, klass - where the current instruction is
+ *  @param[in] stepping - whether the vm is single stepping, in which case a breakpoint at a line or
+ *                        function is only reached when the line or function is entered; jumping back
+ *                        within a line, as a loop written on one line does, enters it again */
+static bool clidebugger_atbreakpoint(clibreakpoint *bp, instructionindx iindx, value module, int line, objectfunction *fn, objectclass *klass, bool stepping) {
+    switch (bp->type) {
+        case CLIDEBUGGER_ATINSTRUCTION:
+            return bp->instr==iindx;
+        case CLIDEBUGGER_ATLINE:
+            if (stepping && line==clidebugger_lastline && fn==clidebugger_lastfn && iindx>clidebugger_lastiindx) return false;
+            return bp->line==line && clidebugger_matchfile(bp->file, module);
+        case CLIDEBUGGER_ATFUNCTION:
+            if (!fn || (stepping && fn==clidebugger_lastfn)) return false;
+            if (!clidebugger_samename(bp->fn, fn->name)) return false;
+            return MORPHO_ISNIL(bp->klass) || (klass && clidebugger_samename(bp->klass, klass->name));
+    }
+    return false;
+}
+
+/* ------------------------------------------
+ * Watchpoints
+ * ------------------------------------------ */
+
+/** Sets or removes a watchpoint; symbol and prop are taken over or freed */
+static void clidebugger_recordwatchpoint(debugger *d, value symbol, value prop, bool set) {
+    for (unsigned int i=0; i<clidebugger_watchpoints.count; i++) {
+        cliwatchpoint *w=&clidebugger_watchpoints.data[i];
+        if (clidebugger_samename(w->symbol, symbol) && clidebugger_samename(w->prop, prop)) {
+            morpho_freeobject(w->symbol);
+            morpho_freeobject(w->prop);
+            clidebugger_watchpoints.data[i]=clidebugger_watchpoints.data[--clidebugger_watchpoints.count];
+            break;
+        }
+    }
+    
+    if (set) {
+        cliwatchpoint w = { .symbol = symbol, .prop = prop, .last = MORPHO_NIL };
+        w.known=clidebugger_lookup(d, symbol, prop, &w.last);
+        varray_cliwatchpointwrite(&clidebugger_watchpoints, w);
+    } else {
+        morpho_freeobject(symbol);
+        morpho_freeobject(prop);
+    }
+}
+
+/** Finds the first watchpoint whose value has changed, and updates the value of every watchpoint
+ *  @returns the watchpoint, or -1 if none has changed */
+static int clidebugger_checkwatchpoints(debugger *d) {
+    int changed=-1;
+    for (unsigned int i=0; i<clidebugger_watchpoints.count; i++) {
+        cliwatchpoint *w=&clidebugger_watchpoints.data[i];
+        value val=MORPHO_NIL;
+        bool known=clidebugger_lookup(d, w->symbol, w->prop, &val);
+        if (known && w->known && !clidebugger_unchanged(val, w->last)) { // Going in and out of scope isn't a change
+            if (changed<0) changed=(int) i;
+        }
+        w->last=val;
+        w->known=known;
+    }
+    return changed;
+}
+
+/** Displays the name and value of a watchpoint */
+static void clidebugger_showwatchpoint(clidebugger *debug, int i) {
+    cliwatchpoint *w=&clidebugger_watchpoints.data[i];
+    if (!MORPHO_ISNIL(w->prop)) debugger_showproperty(debug->debug, w->symbol, w->prop);
+    else debugger_showsymbol(debug->debug, w->symbol);
+}
+
+/* ------------------------------------------
+ * Deciding whether to stop
+ * ------------------------------------------ */
+
+/** Decides whether the vm, which has stopped at a breakpoint or is single stepping, should enter the
+ *  interactive debugger
+ *  @param[in] v - the vm
+ *  @param[out] watch - the watchpoint that changed, if any
+ *  @returns the reason to enter the debugger, or CLIDEBUGGER_RESUME to let the vm carry on */
+static clidebuggerreason clidebugger_checkstop(vm *v, int *watch) {
+    debugger *d=vm_getdebugger(v);
+    bool watching=(clidebugger_watchpoints.count>0);
+    bool stepping=(watching || clidebugger_stepping); // Whether the vm is single stepping
+    *watch=(watching && !clidebugger_stepping ? clidebugger_checkwatchpoints(d) : -1);
+    
+    value module=MORPHO_NIL;
+    int line=-1;
+    objectfunction *fn=NULL;
+    objectclass *klass=NULL;
+    debug_infofromindx(v->current, d->iindx, &module, &line, NULL, &fn, &klass);
+    
+    bool known=false, stop=false;
+    for (unsigned int i=0; i<clidebugger_breakpoints.count; i++) {
+        clibreakpoint *bp=&clidebugger_breakpoints.data[i];
+        if (!clidebugger_atbreakpoint(bp, d->iindx, module, line, fn, klass, stepping)) continue;
+        
+        known=true;
+        bp->hits++; // Counted even while the user steps through the breakpoint
+        if (clidebugger_stepping || bp->hits<=bp->after) continue;
+        
+        bool holds=true;
+        if (bp->condition.count && clidebugger_evaluate(d, &bp->condition, &holds) && !holds) continue;
+        stop=true; // Conditions that can't be evaluated stop the vm, so the user can see why
+    }
+    
+    clidebugger_lastline=line;
+    clidebugger_lastfn=fn;
+    clidebugger_lastiindx=d->iindx;
+    
+    if (clidebugger_stepping) return CLIDEBUGGER_SINGLESTEP;
+    if (stop) return CLIDEBUGGER_BREAKPOINT;
+    if (*watch>=0) return CLIDEBUGGER_WATCHPOINT;
+    if (watching || known) return CLIDEBUGGER_RESUME;
+    return CLIDEBUGGER_BREAKPOINT; // A breakpoint set some other way
+}
+
+/** Sets whether the vm single steps once the debugger resumes */
+static void clidebugger_resume(clidebugger *debug, bool step) {
+    clidebugger_stepping=step;
+    debugger_setsinglestep(debug->debug, step || clidebugger_watchpoints.count>0);
+}
+
+/** Displays conditions, hit counts and watchpoints */
+static void clidebugger_showconditions(clidebugger *debug) {
+    vm *v=debugger_currentvm(debug->debug);
+    
+    for (unsigned int i=0; i<clidebugger_breakpoints.count; i++) {
+        clibreakpoint *bp=&clidebugger_breakpoints.data[i];
+        if (!bp->text && !bp->after) continue;
+        
+        switch (bp->type) {
+            case CLIDEBUGGER_ATINSTRUCTION: morpho_printf(v, "Break at instruction %zu", (size_t) bp->instr); break;
+            case CLIDEBUGGER_ATLINE:
+                if (MORPHO_ISSTRING(bp->file)) morpho_printf(v, "Break at \"%s\":%i", MORPHO_GETCSTRING(bp->file), bp->line);
+                else morpho_printf(v, "Break at line %i", bp->line);
+                break;
+            case CLIDEBUGGER_ATFUNCTION:
+                if (MORPHO_ISSTRING(bp->klass)) morpho_printf(v, "Break at %s.%s", MORPHO_GETCSTRING(bp->klass), MORPHO_GETCSTRING(bp->fn));
+                else morpho_printf(v, "Break at %s", MORPHO_GETCSTRING(bp->fn));
+                break;
+        }
+        if (bp->text) morpho_printf(v, " if %s", bp->text);
+        if (bp->after) morpho_printf(v, " after %li", bp->after);
+        morpho_printf(v, " (reached %li times)\n", bp->hits);
+    }
+    
+    for (unsigned int i=0; i<clidebugger_watchpoints.count; i++) {
+        cliwatchpoint *w=&clidebugger_watchpoints.data[i];
+        morpho_printf(v, "Watch %s%s%s\n", MORPHO_GETCSTRING(w->symbol), (MORPHO_ISNIL(w->prop) ? "" : "."), (MORPHO_ISNIL(w->prop) ? "" : MORPHO_GETCSTRING(w->prop)));
+    }
 }
 
 /* **********************************************************************
@@ -48,10 +506,12 @@ void clidebugger_banner(clidebugger *debug) {
     cli_displaywithstyle(debug->edit, DEBUGGER_COLOR, CLI_NOEMPHASIS, 1, "---Morpho debugger---\n");
     cli_displaywithstyle(debug->edit, CLI_DEFAULTCOLOR, CLI_NOEMPHASIS, 1, "Type '?' or 'h' for help.\n");
     
-    morpho_printf(debugger_currentvm(debug->debug), "%s ", (debug->debug->singlestep ? "Single stepping" : "Breakpoint"));
+    morpho_printf(debugger_currentvm(debug->debug), "%s ", clidebugger_reasonlabels[debug->reason]);
     debugger_showlocation(debug->debug, debug->debug->iindx);
     
     morpho_printf(debugger_currentvm(debug->debug), "\n");
+    
+    if (debug->reason==CLIDEBUGGER_WATCHPOINT && debug->watch>=0) clidebugger_showwatchpoint(debug, debug->watch);
 }
 
 /** Display the resume text */
@@ -73,21 +533,15 @@ void clidebugger_list(clidebugger *debug, int *nlines) {
     vm *v = debugger_currentvm(debug->debug);
     
     if (debug_infofromindx(v->current, vm_previnstruction(v), &module, &line, NULL, NULL, NULL)) {
-        char *src=cli_globalsrc;
         char *in = (MORPHO_ISSTRING(module) ? MORPHO_GETCSTRING(module): NULL);
         
-        if (in) src=cli_loadsource(in);
+        int n = 5;
+        if (nlines) n = *nlines;
         
-        if (src) {
-            int n = 5;
-            if (nlines) n = *nlines;
-            
-            int start = line - n, end = line + n;
-            if (start<0) start = 0;
-            
-            cli_list(src, start, end);
-            if (in) MORPHO_FREE(src);
-        }
+        int start = line - n, end = line + n;
+        if (start<0) start = 0;
+        
+        cli_list(in, start, end);
     }
 }
 
@@ -125,10 +579,22 @@ enum {
     DEBUGGER_EQ,
     DEBUGGER_COLON,
     DEBUGGER_QUOTE,
+    DEBUGGER_EQEQ,
+    DEBUGGER_NEQ,
+    DEBUGGER_LT,
+    DEBUGGER_LTEQ,
+    DEBUGGER_GT,
+    DEBUGGER_GTEQ,
+    DEBUGGER_AND,
+    DEBUGGER_OR,
+    DEBUGGER_NOT,
+    DEBUGGER_MINUS,
     
+    DEBUGGER_NUMBER,
     DEBUGGER_INTEGER,
     
     DEBUGGER_ADDRESS,
+    DEBUGGER_AFTER,
     DEBUGGER_BREAK,
     DEBUGGER_CLEAR,
     DEBUGGER_CONTINUE,
@@ -137,6 +603,7 @@ enum {
     DEBUGGER_GLOBALS,
     DEBUGGER_G,
     DEBUGGER_HELP,
+    DEBUGGER_IF,
     DEBUGGER_INFO,
     DEBUGGER_LIST,
     DEBUGGER_PRINT,
@@ -146,6 +613,7 @@ enum {
     DEBUGGER_STACK,
     DEBUGGER_STEP,
     DEBUGGER_TRACE,
+    DEBUGGER_WATCH,
     
     DEBUGGER_SYMBOL,
     DEBUGGER_STRING,
@@ -178,6 +646,17 @@ bool clidebugger_lexstring(lexer *l, token *tok, error *err) {
 
 /** Debugger command tokens chosen to be largely compatible with GDB */
 tokendefn debuggertokens[] = {
+    { "==",             DEBUGGER_EQEQ             , NULL },
+    { "!=",             DEBUGGER_NEQ              , NULL },
+    { "<=",             DEBUGGER_LTEQ             , NULL },
+    { ">=",             DEBUGGER_GTEQ             , NULL },
+    { "&&",             DEBUGGER_AND              , NULL },
+    { "||",             DEBUGGER_OR               , NULL },
+    { "<",              DEBUGGER_LT               , NULL },
+    { ">",              DEBUGGER_GT               , NULL },
+    { "!",              DEBUGGER_NOT              , NULL },
+    { "-",              DEBUGGER_MINUS            , NULL },
+    
     { "*",              DEBUGGER_ASTERISK         , NULL },
     { ".",              DEBUGGER_DOT              , NULL },
     { "=",              DEBUGGER_EQ               , NULL },
@@ -186,6 +665,8 @@ tokendefn debuggertokens[] = {
     
     { "address",        DEBUGGER_ADDRESS          , NULL },
     
+    { "after",          DEBUGGER_AFTER            , NULL },
+    
     { "break",          DEBUGGER_BREAK            , NULL },
     { "b",              DEBUGGER_BREAK            , NULL },
     
@@ -214,6 +695,8 @@ tokendefn debuggertokens[] = {
     { "h",              DEBUGGER_HELP             , NULL },
     { "?",              DEBUGGER_HELP             , NULL },
     
+    { "if",             DEBUGGER_IF               , NULL },
+    
     { "info",           DEBUGGER_INFO             , NULL },
     { "i",              DEBUGGER_INFO             , NULL },
     
@@ -240,6 +723,8 @@ tokendefn debuggertokens[] = {
     { "trace",          DEBUGGER_TRACE            , NULL },
     { "t",              DEBUGGER_TRACE            , NULL },
     
+    { "watch",          DEBUGGER_WATCH            , NULL },
+    
     { "",               TOKEN_NONE                , NULL }
 };
 
@@ -247,7 +732,7 @@ tokendefn debuggertokens[] = {
 void clidebugger_initializelexer(lexer *l, char *src) {
     lex_init(l, src, 0);
     lex_settokendefns(l, debuggertokens);
-    lex_setnumbertype(l, DEBUGGER_INTEGER, TOKEN_NONE, TOKEN_NONE);
+    lex_setnumbertype(l, DEBUGGER_INTEGER, DEBUGGER_NUMBER, TOKEN_NONE);
     lex_setsymboltype(l, DEBUGGER_SYMBOL);
     lex_seteof(l, DEBUGGER_EOF);
 }
@@ -284,12 +769,169 @@ bool clidebugger_parsesymbol(parser *p, clidebugger *debug, value *out) {
     return success;
 }
 
+/* ------------------------------------------
+ * Conditions
+ * ------------------------------------------ */
+
+/** Parses an operand of a condition: a number, string, true, false, nil, or a variable or property */
+static bool clidebugger_parseoperand(parser *p, clidebugger *debug, varray_clidebuggerinstr *out) {
+    clidebuggerinstr instr = { .op = CLIDEBUGGER_PUSHVALUE, .a = MORPHO_NIL, .b = MORPHO_NIL };
+    bool negate=parse_checktokenadvance(p, DEBUGGER_MINUS);
+    long i;
+    
+    if (parse_checktokenadvance(p, DEBUGGER_INTEGER) &&
+        parse_tokentointeger(p, &i)) {
+        instr.a=MORPHO_INTEGER((int) (negate ? -i : i));
+    } else if (parse_checktokenadvance(p, DEBUGGER_NUMBER)) {
+        double x=strtod(p->previous.start, NULL);
+        instr.a=MORPHO_FLOAT(negate ? -x : x);
+    } else if (negate) {
+        parse_error(p, true, DBG_COND);
+        return false;
+    } else if (parse_checktokenadvance(p, DEBUGGER_STRING)) {
+        if (!clidebugger_stringfromtoken(&p->previous, &instr.a)) return false;
+    } else if (clidebugger_parsesymbol(p, debug, &instr.a)) {
+        char *name=MORPHO_GETCSTRING(instr.a);
+        if (strcmp(name, "true")==0 || strcmp(name, "false")==0 || strcmp(name, "nil")==0) {
+            value literal=(name[0]=='t' ? MORPHO_TRUE : (name[0]=='f' ? MORPHO_FALSE : MORPHO_NIL));
+            morpho_freeobject(instr.a);
+            instr.a=literal;
+        } else {
+            instr.op=CLIDEBUGGER_PUSHSYMBOL;
+            if (parse_checktokenadvance(p, DEBUGGER_DOT)) {
+                if (!clidebugger_parsesymbol(p, debug, &instr.b)) {
+                    morpho_freeobject(instr.a);
+                    parse_error(p, true, DBG_COND);
+                    return false;
+                }
+                instr.op=CLIDEBUGGER_PUSHPROPERTY;
+            }
+        }
+    } else {
+        parse_error(p, true, DBG_COND);
+        return false;
+    }
+    
+    varray_clidebuggerinstrwrite(out, instr);
+    return true;
+}
+
+/** Writes an operator to a compiled condition */
+static void clidebugger_writeop(varray_clidebuggerinstr *out, clidebuggerop op) {
+    clidebuggerinstr instr = { .op = op, .a = MORPHO_NIL, .b = MORPHO_NIL };
+    varray_clidebuggerinstrwrite(out, instr);
+}
+
+/** Parses a comparison: operand [ relop operand ] */
+static bool clidebugger_parsecomparison(parser *p, clidebugger *debug, varray_clidebuggerinstr *out) {
+    static const struct { tokentype type; clidebuggerop op; } relops[] = {
+        { DEBUGGER_EQEQ, CLIDEBUGGER_OPEQ }, { DEBUGGER_NEQ, CLIDEBUGGER_OPNEQ },
+        { DEBUGGER_LT, CLIDEBUGGER_OPLT }, { DEBUGGER_LTEQ, CLIDEBUGGER_OPLTEQ },
+        { DEBUGGER_GT, CLIDEBUGGER_OPGT }, { DEBUGGER_GTEQ, CLIDEBUGGER_OPGTEQ }
+    };
+    
+    if (!clidebugger_parseoperand(p, debug, out)) return false;
+    
+    for (unsigned int i=0; i<sizeof(relops)/sizeof(relops[0]); i++) {
+        if (parse_checktokenadvance(p, relops[i].type)) {
+            if (!clidebugger_parseoperand(p, debug, out)) return false;
+            clidebugger_writeop(out, relops[i].op);
+            break;
+        }
+    }
+    return true;
+}
+
+/** Parses a negation: ! negation | comparison */
+static bool clidebugger_parsenegation(parser *p, clidebugger *debug, varray_clidebuggerinstr *out) {
+    if (parse_checktokenadvance(p, DEBUGGER_NOT)) {
+        if (!clidebugger_parsenegation(p, debug, out)) return false;
+        clidebugger_writeop(out, CLIDEBUGGER_OPNOT);
+        return true;
+    }
+    return clidebugger_parsecomparison(p, debug, out);
+}
+
+/** Parses a conjunction: negation { && negation } */
+static bool clidebugger_parseconjunction(parser *p, clidebugger *debug, varray_clidebuggerinstr *out) {
+    if (!clidebugger_parsenegation(p, debug, out)) return false;
+    while (parse_checktokenadvance(p, DEBUGGER_AND)) {
+        if (!clidebugger_parsenegation(p, debug, out)) return false;
+        clidebugger_writeop(out, CLIDEBUGGER_OPAND);
+    }
+    return true;
+}
+
+/** Parses a condition, compiling it to postfix: conjunction { || conjunction } */
+static bool clidebugger_parsecondition(parser *p, clidebugger *debug, varray_clidebuggerinstr *out) {
+    if (!clidebugger_parseconjunction(p, debug, out)) return false;
+    while (parse_checktokenadvance(p, DEBUGGER_OR)) {
+        if (!clidebugger_parseconjunction(p, debug, out)) return false;
+        clidebugger_writeop(out, CLIDEBUGGER_OPOR);
+    }
+    return true;
+}
+
+/** Parses the conditions that may follow a breakpoint: [ if condition ] [ after n ] */
+static bool clidebugger_parsemodifiers(parser *p, clidebugger *debug, clibreakpoint *bp) {
+    for (;;) {
+        if (parse_checktokenadvance(p, DEBUGGER_IF)) {
+            const char *start=p->current.start;
+            clidebugger_conditionclear(&bp->condition);
+            if (!clidebugger_parsecondition(p, debug, &bp->condition)) return false;
+            
+            /* Keep the text of the condition for display */
+            const char *end=(parse_checktoken(p, DEBUGGER_EOF) ? start+strlen(start) : p->current.start);
+            while (end>start && isspace((unsigned char) end[-1])) end--;
+            if (bp->text) MORPHO_FREE(bp->text);
+            bp->text=MORPHO_MALLOC(end-start+1);
+            if (bp->text) {
+                memcpy(bp->text, start, end-start);
+                bp->text[end-start]='\0';
+            }
+        } else if (parse_checktokenadvance(p, DEBUGGER_AFTER)) {
+            if (!parse_checktokenadvance(p, DEBUGGER_INTEGER) ||
+                !parse_tokentointeger(p, &bp->after)) {
+                parse_error(p, true, DBG_AFTER);
+                return false;
+            }
+        } else break;
+    }
+    return true;
+}
+
+/* ------------------------------------------
+ * Breakpoints and watchpoints
+ * ------------------------------------------ */
+
+/** Watchpoint syntax:
+    * symbol [ . symbol ] = break when a variable or property changes */
+bool clidebugger_parsewatchpoint(parser *p, clidebugger *debug, bool set) {
+    value symbol=MORPHO_NIL, prop=MORPHO_NIL;
+    
+    if (!clidebugger_parsesymbol(p, debug, &symbol) ||
+        (parse_checktokenadvance(p, DEBUGGER_DOT) && !clidebugger_parsesymbol(p, debug, &prop))) {
+        morpho_freeobject(symbol);
+        clidebugger_setinfo(debug, DBG_BREAK_INFO);
+        return false;
+    }
+    
+    clidebugger_recordwatchpoint(debug->debug, symbol, prop, set);
+    return true;
+}
+
 /** Breakpoints syntax:
     * integer x         = break at instruction given by x
     * integer x          = break at line x
-    * symbol [ . symbol ] = break at function or method call */
+    * symbol [ . symbol ] = break at function or method call
+    * any of which may be followed by 'if' condition and 'after' n
+    * watch symbol [ . symbol ] = watchpoint */
 bool clidebugger_parsebreakpoint(parser *p, clidebugger *debug, bool set) {
+    if (parse_checktokenadvance(p, DEBUGGER_WATCH)) return clidebugger_parsewatchpoint(p, debug, set);
+    
     value symbol=MORPHO_NIL, method=MORPHO_NIL;
+    clibreakpoint bp;
+    clidebugger_breakpointinit(&bp);
     bool success=false;
     
     long instr=-1, line;
@@ -297,27 +939,57 @@ bool clidebugger_parsebreakpoint(parser *p, clidebugger *debug, bool set) {
          parse_checktokenadvance(p, DEBUGGER_ADDRESS)) &&
         parse_checktokenadvance(p, DEBUGGER_INTEGER) &&
         parse_tokentointeger(p, &instr)) {
-        success=debugger_breakatinstruction(debug->debug, set, (instructionindx) instr);
+        bp.type=CLIDEBUGGER_ATINSTRUCTION;
+        bp.instr=(instructionindx) instr;
+        success=true;
     } else if (parse_checktokenadvance(p, DEBUGGER_STRING) &&
                clidebugger_stringfromtoken(&p->previous, &symbol) &&
                parse_checkrequiredtoken(p, DEBUGGER_COLON, DBG_BRKFILE) &&
                parse_checktokenadvance(p, DEBUGGER_INTEGER) &&
                parse_tokentointeger(p, &line)) {
-        success=debugger_breakatline(debug->debug, set, symbol, (int) line);
+        bp.type=CLIDEBUGGER_ATLINE;
+        bp.file=clidebugger_copystring(symbol);
+        bp.line=(int) line;
+        success=true;
     } else if (parse_checktokenadvance(p, DEBUGGER_INTEGER) &&
                parse_tokentointeger(p, &line)) {
-        success=debugger_breakatline(debug->debug, set, MORPHO_NIL, (int) line);
+        bp.type=CLIDEBUGGER_ATLINE;
+        bp.line=(int) line;
+        success=true;
     } else if (clidebugger_parsesymbol(p, debug, &symbol)) {
+        bp.type=CLIDEBUGGER_ATFUNCTION;
         
         if (parse_checktokenadvance(p, DEBUGGER_DOT)) {
             if (clidebugger_parsesymbol(p, debug, &method)) {
-                success=debugger_breakatfunction(debug->debug, set, symbol, method);
+                bp.klass=clidebugger_copystring(symbol);
+                bp.fn=clidebugger_copystring(method);
+                success=true;
             } else parse_error(p, true, DBG_EXPCTMTHD);
         } else {
-            success=debugger_breakatfunction(debug->debug, set, MORPHO_NIL, symbol);
+            bp.fn=clidebugger_copystring(symbol);
+            success=true;
         }
     } else clidebugger_setinfo(debug, DBG_BREAK_INFO);
     
+    if (success) success=clidebugger_parsemodifiers(p, debug, &bp);
+    
+    if (success) {
+        switch (bp.type) {
+            case CLIDEBUGGER_ATINSTRUCTION:
+                success=debugger_breakatinstruction(debug->debug, set, bp.instr);
+                break;
+            case CLIDEBUGGER_ATLINE:
+                success=debugger_breakatline(debug->debug, set, bp.file, bp.line);
+                break;
+            case CLIDEBUGGER_ATFUNCTION:
+                success=debugger_breakatfunction(debug->debug, set, bp.klass, bp.fn);
+                break;
+        }
+    }
+    
+    if (success) clidebugger_recordbreakpoint(&bp, set);
+    else clidebugger_breakpointclear(&bp);
+    
     morpho_freeobject(symbol);
     morpho_freeobject(method);
     
@@ -332,10 +1004,14 @@ bool clidebugger_clearcommand(parser *p, void *out) {
     return clidebugger_parsebreakpoint(p, (clidebugger *) out, false);
 }
 
+bool clidebugger_watchcommand(parser *p, void *out) {
+    return clidebugger_parsewatchpoint(p, (clidebugger *) out, true);
+}
+
 /** Continue command */
 bool clidebugger_continuecommand(parser *p, void *out) {
     clidebugger *debug = (clidebugger *) out;
-    debugger_setsinglestep(debug->debug, false);
+    clidebugger_resume(debug, false);
     clidebugger_stop(debug);
     return true;
 }
@@ -384,6 +1060,7 @@ bool clidebugger_infocommand(parser *p, void *out) {
         }
     } else if (parse_checktokenadvance(p, DEBUGGER_BREAK)) {
         debugger_showbreakpoints(debug->debug);
+        clidebugger_showconditions(debug);
     } else if (parse_checktokenadvance(p, DEBUGGER_GLOBALS) ||
                parse_checktokenadvance(p, DEBUGGER_G)) {
         if (parse_checktokenadvance(p, DEBUGGER_INTEGER)) {
@@ -441,6 +1118,7 @@ bool clidebugger_printcommand(parser *p, void *out) {
 /** Quit the debugger */
 bool clidebugger_quitcommand(parser *p, void *out) {
     clidebugger *debug = (clidebugger *) out;
+    clidebugger_stepping=false;
     debugger_quit(debug->debug);
     clidebugger_stop(debug);
     return true;
@@ -496,7 +1174,7 @@ bool clidebugger_setcommand(parser *p, void *out) {
 /** Single step */
 bool clidebugger_stepcommand(parser *p, void *out) {
     clidebugger *debug = (clidebugger *) out;
-    debugger_setsinglestep(debug->debug, true);
+    clidebugger_resume(debug, true);
     clidebugger_stop(debug);
     return true;
 }
@@ -537,6 +1215,7 @@ parserule clidebugger_rules[] = {
     PARSERULE_PREFIX(DEBUGGER_SET, clidebugger_setcommand),
     PARSERULE_PREFIX(DEBUGGER_STEP, clidebugger_stepcommand),
     PARSERULE_PREFIX(DEBUGGER_TRACE, clidebugger_tracecommand),
+    PARSERULE_PREFIX(DEBUGGER_WATCH, clidebugger_watchcommand),
     PARSERULE_UNUSED(TOKEN_NONE)
 };
 
@@ -579,6 +1258,13 @@ bool clidebugger_parse(clidebugger *debug, char *in) {
  * ********************************************************************** */
 
 void clidebugger_enter(vm *v) {
+    clidebugger_initialize();
+    
+    /* Breakpoints whose conditions fail, and steps taken only to check watchpoints, resume at once */
+    int watch=-1;
+    clidebuggerreason reason=clidebugger_checkstop(v, &watch);
+    if (reason==CLIDEBUGGER_RESUME) return;
+    
     error err;
     error_init(&err);
     
@@ -588,10 +1274,13 @@ void clidebugger_enter(vm *v) {
     
     clidebugger debug;
     clidebugger_init(&debug, v, &edit, &err);
+    debug.reason=reason;
+    debug.watch=watch;
     clidebugger_banner(&debug);
     
     while (!debug.stop) {
         clidebugger_clearinfo(&debug);
+        cli_outputflush();
         char *input = linedit(&edit);
         if (!input) break;
         
@@ -610,10 +1299,23 @@ void clidebugger_enter(vm *v) {
     error_clear(&err);
 }
 
-void clidebugger_initialize(void) {
+static pthread_once_t clidebugger_initialized = PTHREAD_ONCE_INIT;
+
+/** Defines the debugger's errors and prepares its tables */
+static void clidebugger_initializeonce(void) {
     morpho_defineerror(DBG_PRS, ERROR_PARSE, DBG_PRS_MSG);
     morpho_defineerror(DBG_INFO, ERROR_PARSE, DBG_INFO_MSG);
     morpho_defineerror(DBG_INVLD, ERROR_PARSE, DBG_INVLD_MSG);
     morpho_defineerror(DBG_EXPCTMTHD, ERROR_PARSE, DBG_EXPCTMTHD_MSG);
     morpho_defineerror(DBG_BRKFILE, ERROR_PARSE, DBG_BRKFILE_MSG);
+    morpho_defineerror(DBG_COND, ERROR_PARSE, DBG_COND_MSG);
+    morpho_defineerror(DBG_AFTER, ERROR_PARSE, DBG_AFTER_MSG);
+    
+    varray_clibreakpointinit(&clidebugger_breakpoints);
+    varray_cliwatchpointinit(&clidebugger_watchpoints);
+}
+
+/** @brief Initializes the debugger; this is done when it's first entered, so need only be called early when debugging is expected */
+void clidebugger_initialize(void) {
+    pthread_once(&clidebugger_initialized, clidebugger_initializeonce);
 }
@@ -29,10 +29,16 @@
 #define DBG_BRKFILE                     "DbgBrkFile"
 #define DBG_BRKFILE_MSG                 "Breakpoint specifier should be in form \"file\":line."
 
+#define DBG_COND                        "DbgCond"
+#define DBG_COND_MSG                    "Couldn't parse breakpoint condition."
+
+#define DBG_AFTER                       "DbgAfter"
+#define DBG_AFTER_MSG                   "Expected a number of hits after 'after'."
+
 #define DBG_HELP_INFO      "Available commands:\n" \
     "  [b]reakpoint, [c]ontinue, [d]isassemble, [g]arbage collect,\n" \
     "  [?]/[h]elp, [i]nfo, [l]ist, [p]rint, [q]uit, [s]tep, \n" \
-    "  [t]race, [x]clear\n"
+    "  [t]race, watch, [x]clear\n"
 
 #define DBG_INFO_INFO      "Possible info commands: \n" \
     "  info address n: Displays the address of register n.\n" \
@@ -46,7 +52,10 @@
     "  break * n          : Break at instruction n.\n" \
     "  break n            : Break at line n.\n" \
     "  break \"file\":n     : Break at line n in given file.\n" \
-    "  break <symbol>     : Break at a function or method.\n"
+    "  break <symbol>     : Break at a function or method.\n" \
+    "  break ... if <cond>: Break only when a condition holds, e.g. break 42 if i==9999.\n" \
+    "  break ... after n  : Ignore the first n times the breakpoint is reached.\n" \
+    "  watch <symbol>     : Break when a variable or property (<symbol>.<property>) changes.\n"
 
 #define DBG_SET_INFO     "Possible set commands: \n" \
     "  set register n = X : Sets register n to X.\n" \
@@ -7,6 +7,12 @@
 #include <string.h>
 #include <ctype.h>
 #include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <math.h>
 
 #include <morpho.h>
 #include <common.h>
@@ -27,58 +33,665 @@
  *  [tag]: # (<TAG>)      is used to define additional synonyms for the topic.
  *
  *  The help system also recognizes code blocks etc.
+ *
+ *  Rather than parse the help files on every start, they are compiled into an
+ *  index (see help.h) that is memory mapped and only rebuilt when the help files change.
  */
 
-static dictionary helpdict;
-static objecthelptopic *topics = NULL;
+/** The help index in use */
+typedef struct {
+    char *base; // Start of the index
+    size_t size; // Size in bytes
+    bool mapped; // Whether the index is memory mapped (true) or allocated (false)
+
+    helpfile *files;
+    helptopic *topics;
+    helpkey *keys;
+    char *strings;
+    char *text;
+    helpterm *terms;
+    helpposting *postings;
+
+    uint32_t nfiles;
+    uint32_t ntopics;
+    uint32_t nkeys;
+    size_t nstrings;
+    size_t ntext;
+    uint32_t nterms;
+    uint32_t npostings;
+} helpindex;
+
+static helpindex help;
 
 /* **********************************************************************
- * Help topics
+ * Help index
  * ********************************************************************** */
 
-objecttype objecthelptopictype;
+/** Clears a help index structure */
+static void help_indexinit(helpindex *index) {
+    index->base=NULL;
+    index->size=0;
+    index->mapped=false;
+    index->files=NULL;
+    index->topics=NULL;
+    index->keys=NULL;
+    index->strings=NULL;
+    index->text=NULL;
+    index->terms=NULL;
+    index->postings=NULL;
+    index->nfiles=index->ntopics=index->nkeys=0;
+    index->nstrings=index->ntext=0;
+    index->nterms=index->npostings=0;
+}
 
-/** Help topic object definitions */
-void objecthelptopic_printfn(object *obj, void *v) {
+/** Releases a help index */
+static void help_indexclear(helpindex *index) {
+    if (index->base) {
+        if (index->mapped) munmap(index->base, index->size);
+        else MORPHO_FREE(index->base);
+    }
+    help_indexinit(index);
 }
 
-void objecthelptopic_freefn(object *obj) {
-    objecthelptopic *topic = (objecthelptopic *) obj;
-    
-    if (topic->topic) MORPHO_FREE(topic->topic);
-    if (topic->file) MORPHO_FREE(topic->file);
-        
-    dictionary_freecontents(&topic->subtopics, true, false);
-    dictionary_clear(&topic->subtopics);
+/** Locates a section of the index, checking that it lies within the index */
+static void *help_section(helpindexheader *header, size_t size, helpsection section, size_t recordsize, uint64_t *count) {
+    helpindexsection *s=&header->sections[section];
+    if (s->offset>size || s->count>(size-s->offset)/recordsize) return NULL;
+    if (count) *count=s->count;
+    return ((char *) header)+s->offset;
 }
 
-size_t objecthelptopic_sizefn(object *obj) {
-    return sizeof(objecthelptopic);
+/** Attaches a help index to an image of an index file, validating it in the process
+ *  @param[in] index - index to set up
+ *  @param[in] base - index image
+ *  @param[in] size - size of the image
+ *  @returns true if the image is a valid index */
+static bool help_indexattach(helpindex *index, char *base, size_t size) {
+    helpindexheader *header = (helpindexheader *) base;
+    uint64_t nfiles, ntopics, nkeys, nstrings, ntext, nterms, npostings;
+
+    if (size<sizeof(helpindexheader) ||
+        memcmp(header->magic, HELP_INDEXMAGIC, HELP_INDEXMAGICLENGTH)!=0 ||
+        header->version!=HELP_INDEXVERSION ||
+        header->nsections!=HELP_NSECTIONS) return false;
+
+    index->files=help_section(header, size, HELP_SECTIONFILES, sizeof(helpfile), &nfiles);
+    index->topics=help_section(header, size, HELP_SECTIONTOPICS, sizeof(helptopic), &ntopics);
+    index->keys=help_section(header, size, HELP_SECTIONKEYS, sizeof(helpkey), &nkeys);
+    index->strings=help_section(header, size, HELP_SECTIONSTRINGS, sizeof(char), &nstrings);
+    index->text=help_section(header, size, HELP_SECTIONTEXT, sizeof(char), &ntext);
+    index->terms=help_section(header, size, HELP_SECTIONTERMS, sizeof(helpterm), &nterms);
+    index->postings=help_section(header, size, HELP_SECTIONPOSTINGS, sizeof(helpposting), &npostings);
+
+    if (!index->files || !index->topics || !index->keys || !index->strings || !index->text ||
+        !index->terms || !index->postings) return false;
+
+    /* Strings must be zero terminated so that they can be used directly */
+    if (nstrings==0 || index->strings[nstrings-1]!='\0') return false;
+
+    index->base=base;
+    index->size=size;
+    index->nfiles=(uint32_t) nfiles;
+    index->ntopics=(uint32_t) ntopics;
+    index->nkeys=(uint32_t) nkeys;
+    index->nstrings=(size_t) nstrings;
+    index->ntext=(size_t) ntext;
+    index->nterms=(uint32_t) nterms;
+    index->npostings=(uint32_t) npostings;
+
+    return true;
+}
+
+/** Checks whether references within the index are in bounds */
+static bool help_indexcheckrefs(helpindex *index) {
+    for (uint32_t i=0; i<index->nfiles; i++) {
+        if (index->files[i].path>=index->nstrings) return false;
+    }
+    for (uint32_t i=0; i<index->ntopics; i++) {
+        helptopic *t=&index->topics[i];
+        if (t->name>=index->nstrings || t->title>=index->nstrings ||
+            (t->parent!=HELP_NOPARENT && t->parent>=index->ntopics) ||
+            t->text>index->ntext || t->length>index->ntext-t->text) return false;
+    }
+    for (uint32_t i=0; i<index->nkeys; i++) {
+        helpkey *k=&index->keys[i];
+        if (k->key>=index->nstrings || k->length>index->nstrings-k->key-1 ||
+            k->topic>=index->ntopics || k->dict>index->ntopics) return false;
+    }
+    for (uint32_t i=0; i<index->nterms; i++) {
+        helpterm *t=&index->terms[i];
+        if (t->term>=index->nstrings || t->length>index->nstrings-t->term-1 ||
+            t->postings>index->npostings || t->npostings>index->npostings-t->postings) return false;
+    }
+    for (uint32_t i=0; i<index->npostings; i++) {
+        if (index->postings[i].topic>=index->ntopics) return false;
+    }
+    return true;
 }
 
-objecttypedefn objecthelptopicdefn = {
-    .printfn = objecthelptopic_printfn,
-    .markfn = NULL,
-    .freefn = objecthelptopic_freefn,
-    .sizefn = objecthelptopic_sizefn
-};
+/** Memory maps an index file
+ *  @returns true if a valid index was mapped */
+static bool help_indexmap(helpindex *index, const char *indexfile) {
+    int fd = open(indexfile, O_RDONLY);
+    if (fd<0) return false;
 
-/** Create a new help topic */
-objecthelptopic *help_newtopic(char *topic, char *file, long int location, objecthelptopic *parent) {
-    objecthelptopic *new = (objecthelptopic *) object_new(sizeof(objecthelptopic), OBJECT_HELPTOPIC);
-    
-    if (new) {
-        new->topic=morpho_strdup(topic);
-        new->file=morpho_strdup(file);
-        new->location=location;
-        new->parent=parent;
-        dictionary_init(&new->subtopics);
-        /* Link into the list */
-        new->next=topics;
-        topics=new;
+    bool success=false;
+    struct stat st;
+    if (fstat(fd, &st)==0 && st.st_size>0) {
+        size_t size = (size_t) st.st_size;
+        char *base = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (base!=MAP_FAILED) {
+            success=help_indexattach(index, base, size) && help_indexcheckrefs(index);
+            if (success) index->mapped=true;
+            else {
+                munmap(base, size);
+                help_indexinit(index);
+            }
+        }
+    }
+
+    close(fd);
+    return success;
+}
+
+/** Obtains the list of help files in a canonical order
+ *  @param[out] files - list of file paths as morpho strings
+ *  @returns true on success */
+static bool help_listfiles(varray_value *files) {
+    if (!morpho_listresources(MORPHO_RESOURCE_HELP, files)) return false;
+
+    /* Sort the list so that it can be compared with the index */
+    for (int i=1; i<files->count; i++) {
+        value v=files->data[i];
+        int j=i-1;
+        for (; j>=0 && strcmp(MORPHO_GETCSTRING(files->data[j]), MORPHO_GETCSTRING(v))>0; j--) {
+            files->data[j+1]=files->data[j];
+        }
+        files->data[j+1]=v;
+    }
+    return true;
+}
+
+/** Frees a list of help files */
+static void help_clearfiles(varray_value *files) {
+    for (int i=0; i<files->count; i++) morpho_freeobject(files->data[i]);
+    varray_valueclear(files);
+}
+
+/** Checks whether an index is up to date with the help files it was built from */
+static bool help_indexiscurrent(helpindex *index, varray_value *files) {
+    if (index->nfiles!=(uint32_t) files->count) return false;
+
+    for (uint32_t i=0; i<index->nfiles; i++) {
+        helpfile *f=&index->files[i];
+        char *path=MORPHO_GETCSTRING(files->data[i]);
+        struct stat st;
+
+        if (strcmp(index->strings+f->path, path)!=0 ||
+            stat(path, &st)!=0 ||
+            (int64_t) st.st_mtime!=f->mtime ||
+            (int64_t) st.st_size!=f->size) return false;
     }
-    
-    return new;
+    return true;
+}
+
+/* **********************************************************************
+ * Build the index
+ * ********************************************************************** */
+
+DECLARE_VARRAY(helpfile, helpfile)
+DEFINE_VARRAY(helpfile, helpfile)
+
+DECLARE_VARRAY(helptopic, helptopic)
+DEFINE_VARRAY(helptopic, helptopic)
+
+DECLARE_VARRAY(helpkey, helpkey)
+DEFINE_VARRAY(helpkey, helpkey)
+
+DECLARE_VARRAY(helpterm, helpterm)
+DEFINE_VARRAY(helpterm, helpterm)
+
+DECLARE_VARRAY(helpposting, helpposting)
+DEFINE_VARRAY(helpposting, helpposting)
+
+/** Holds the index while it is being built */
+typedef struct {
+    varray_helpfile files;
+    varray_helptopic topics;
+    varray_helpkey keys;
+    varray_char strings;
+    varray_char text;
+    varray_helpterm terms;
+    varray_helpposting postings;
+} helpbuilder;
+
+static void help_builderinit(helpbuilder *b) {
+    varray_helpfileinit(&b->files);
+    varray_helptopicinit(&b->topics);
+    varray_helpkeyinit(&b->keys);
+    varray_charinit(&b->strings);
+    varray_charinit(&b->text);
+    varray_helpterminit(&b->terms);
+    varray_helppostinginit(&b->postings);
+}
+
+static void help_builderclear(helpbuilder *b) {
+    varray_helpfileclear(&b->files);
+    varray_helptopicclear(&b->topics);
+    varray_helpkeyclear(&b->keys);
+    varray_charclear(&b->strings);
+    varray_charclear(&b->text);
+    varray_helptermclear(&b->terms);
+    varray_helppostingclear(&b->postings);
+}
+
+/** Adds a string to the string table, returning its offset */
+static uint32_t help_addstring(helpbuilder *b, char *string, size_t length) {
+    uint32_t offset = (uint32_t) b->strings.count;
+    varray_charadd(&b->strings, string, (int) length);
+    varray_charwrite(&b->strings, '\0');
+    return offset;
+}
+
+/** Adds a key to a dictionary */
+static void help_addkey(helpbuilder *b, uint32_t dict, char *key, size_t length, uint32_t topic) {
+    helpkey k = { .dict = dict, .length = (uint32_t) length, .topic = topic, .flags = 0 };
+    k.key = help_addstring(b, key, length);
+    varray_helpkeywrite(&b->keys, k);
+}
+
+/** Identifies a topic name as written
+ *  @param[in] line - header line
+ *  @param[out] length - length of the name
+ *  @returns the start of the name */
+static char *help_parsetopicname(char *line, size_t *length) {
+    char *start = line;
+    size_t len = 0;
+    while ((*start=='#' || isspace(*start)) && *start!='\0') start++;
+    while (!iscntrl(start[len])) len++;
+
+    *length=len;
+    return start;
+}
+
+/** Identifies a tag, converting it to lower case.
+ *  @param[in] line - tag line
+ *  @param[out] length - length of the tag
+ *  @returns the start of the tag, or NULL if none was found
+ *  @warning the input line is modified in the process */
+static char *help_parsetag(char *line, size_t *length) {
+    char *start = line;
+    size_t len = 0;
+    /* Skip past everything until the hash */
+    while (*start!='\0' && *start!='#') start++;
+    if (*start=='\0') return NULL;
+    start++; /* Skip # */
+    /* Now skip everything until the tag */
+    while (isspace(*start) && *start!='\0') start++;
+
+    /* Skip opening bracket if present */
+    if (*start=='(') start++;
+
+    while (!iscntrl(start[len]) &&
+           !isspace(start[len]) &&
+           start[len]!=')' // Skip closing bracket
+           ) {
+        start[len]=tolower(start[len]);
+        len++;
+    }
+
+    *length=len;
+    return (len>0 ? start : NULL);
+}
+
+#define HELP_MAXLEVEL 6
+
+/** Determines the level of topic from the markdown header level */
+static int help_parsetopiclevel(char *line) {
+    int level = 0;
+    while (line[level]=='#') level++;
+
+    return (level>=HELP_MAXLEVEL ? HELP_MAXLEVEL-1 : level-1);
+}
+
+/** Finishes the help text of a topic */
+static void help_endtopic(helpbuilder *b, uint32_t topic) {
+    if (topic==HELP_NOPARENT) return;
+    helptopic *t=&b->topics.data[topic];
+    t->length=(uint32_t) (b->text.count-t->text);
+}
+
+/** Adds a help file to the index
+ *  @param[in] b - the index under construction
+ *  @param[in] file - file to load
+ *  @returns true if the file was successfully read */
+static bool help_load(helpbuilder *b, char *file) {
+    uint32_t topic[HELP_MAXLEVEL];
+    for (unsigned int i=0; i<HELP_MAXLEVEL; i++) topic[i]=HELP_NOPARENT;
+    uint32_t current = HELP_NOPARENT; // Topic whose text is being read
+    int level = 0;
+    bool toplevel = false;
+
+#ifdef MORPHO_DEBUG_LOGHELPFILES
+    printf("Loading help file '%s'\n",file);
+#endif
+    FILE *f = fopen(file, "r");
+    if (!f) return false;
+
+    struct stat st;
+    helpfile entry = { .path = help_addstring(b, file, strlen(file)), .pad = 0, .mtime = 0, .size = 0 };
+    if (fstat(fileno(f), &st)==0) {
+        entry.mtime=(int64_t) st.st_mtime;
+        entry.size=(int64_t) st.st_size;
+    }
+    varray_helpfilewrite(&b->files, entry);
+
+    char *line=NULL;
+    size_t capacity=0;
+    ssize_t length;
+
+    while ((length=getline(&line, &capacity, f))>0) {
+        if (line[0]=='#') {
+            /* Headers define available topics */
+            help_endtopic(b, current);
+
+            helptopic t = { .parent = HELP_NOPARENT, .text = (uint32_t) b->text.count, .length = 0, .norm = 0 };
+            varray_charadd(&b->text, line, (int) length); // Keep the header line as written
+
+            size_t namelength;
+            char *name = help_parsetopicname(line, &namelength);
+            level = help_parsetopiclevel(line);
+            if (level>0) t.parent=topic[level-1];
+            t.title = help_addstring(b, name, namelength);
+            for (size_t i=0; i<namelength; i++) name[i]=tolower(name[i]); // Lookups are by the name in lower case
+            t.name = help_addstring(b, name, namelength);
+
+            current = topic[level] = (uint32_t) b->topics.count;
+            varray_helptopicwrite(&b->topics, t);
+
+            /* Insert the topic either into the global dictionary or into the parent's dictionary */
+            uint32_t dict = (t.parent!=HELP_NOPARENT ? t.parent+1 : HELP_GLOBALDICT);
+            help_addkey(b, dict, name, namelength, current);
+#ifdef MORPHO_DEBUG_LOGHELPFILES
+            printf("Parsed topic '%s' level %i\n", name, level);
+#endif
+            continue;
+        }
+
+        if (current!=HELP_NOPARENT) varray_charadd(&b->text, line, (int) length);
+
+        if (strncmp(line, "[tag", 4)==0) {
+            /* Unused links that start with 'tag' define additional search terms */
+            size_t taglength;
+            char *tag = help_parsetag(line, &taglength);
+            if (tag && topic[level]!=HELP_NOPARENT) {
+                /* Insert the topic either into the global dictionary or into the parent's dictionary */
+                uint32_t dict = HELP_GLOBALDICT;
+                if (!toplevel && level>0 && topic[level-1]!=HELP_NOPARENT) dict=topic[level-1]+1;
+                help_addkey(b, dict, tag, taglength, topic[level]);
+#ifdef MORPHO_DEBUG_LOGHELPFILES
+                printf("Parsed tag '%s' level %i\n", tag, level);
+#endif
+            }
+        } else if (strncmp(line, "[toplevel]", 10)==0) {
+            /* Toggles insertion into top level dictionary */
+            toplevel = !toplevel;
+        }
+    }
+    help_endtopic(b, current);
+
+    free(line);
+    fclose(f);
+
+    return true;
+}
+
+/** Compares two keys by dictionary and then key; later definitions sort after earlier ones */
+static char *help_sortstrings;
+
+static int help_keycmp(const void *a, const void *b) {
+    const helpkey *x = (const helpkey *) a, *y = (const helpkey *) b;
+    if (x->dict!=y->dict) return (x->dict<y->dict ? -1 : 1);
+    int cmp = strcmp(help_sortstrings+x->key, help_sortstrings+y->key);
+    if (cmp) return cmp;
+    return (x->key<y->key ? -1 : (x->key>y->key)); // Keys are added in order, so this preserves it
+}
+
+/** Compares two strings given as offsets into the string table */
+static int help_namecmp(const void *a, const void *b) {
+    return strcmp(help_sortstrings+*(const uint32_t *) a, help_sortstrings+*(const uint32_t *) b);
+}
+
+/** Sorts the keys, retaining only the last definition of each, and flags those that are also topic names */
+static void help_sortkeys(helpbuilder *b) {
+    help_sortstrings=b->strings.data;
+    qsort(b->keys.data, b->keys.count, sizeof(helpkey), help_keycmp);
+
+    /* As in a dictionary, later definitions replace earlier ones */
+    unsigned int n=0;
+    for (unsigned int i=0; i<b->keys.count; i++) {
+        if (i+1<b->keys.count && b->keys.data[i].dict==b->keys.data[i+1].dict &&
+            strcmp(b->strings.data+b->keys.data[i].key, b->strings.data+b->keys.data[i+1].key)==0) continue;
+        b->keys.data[n++]=b->keys.data[i];
+    }
+    b->keys.count=n;
+
+    /* Flag keys that coincide with the name of some topic */
+    uint32_t *names = MORPHO_MALLOC(sizeof(uint32_t)*(b->topics.count+1));
+    if (!names) return;
+    for (unsigned int i=0; i<b->topics.count; i++) names[i]=b->topics.data[i].name;
+    qsort(names, b->topics.count, sizeof(uint32_t), help_namecmp);
+
+    for (unsigned int i=0; i<b->keys.count; i++) {
+        if (bsearch(&b->keys.data[i].key, names, b->topics.count, sizeof(uint32_t), help_namecmp)) {
+            b->keys.data[i].flags|=HELP_KEYISTOPICNAME;
+        }
+    }
+    MORPHO_FREE(names);
+}
+
+/* ----------------------------------------
+ * Full text index
+ * ---------------------------------------- */
+
+#define HELP_MINTERMLENGTH 2
+#define HELP_MAXTERMLENGTH 32
+#define HELP_HEADERWEIGHT 3 // Terms in a topic's header count this many times
+
+/** Common words that carry no information */
+static char *help_stopwords[] = { "a", "about", "an", "and", "are", "be", "by", "can", "does", "from", "how", "i",
+    "it", "its", "me", "my", "of", "on", "that", "the", "this", "to", "use", "using", "was", "what", "which", "with", NULL };
+
+/** Finds the next term in a piece of text
+ *  @param[in] text - text to search
+ *  @param[in] end - end of the text
+ *  @param[out] length - length of the term
+ *  @returns the start of the term, or NULL if there are no more */
+static char *help_nextterm(char *text, char *end, size_t *length) {
+    for (char *c=text; c<end; ) {
+        while (c<end && !isalnum((unsigned char) *c) && *c!='_') c++;
+        char *start=c;
+        while (c<end && (isalnum((unsigned char) *c) || *c=='_')) c++;
+        size_t len=c-start;
+        if (len>=HELP_MINTERMLENGTH && len<=HELP_MAXTERMLENGTH) {
+            *length=len;
+            return start;
+        }
+    }
+    return NULL;
+}
+
+/** Checks whether a lower case term is a stop word */
+static bool help_isstopword(char *term, size_t length) {
+    for (int i=0; help_stopwords[i]; i++) {
+        if (strlen(help_stopwords[i])==length && strncmp(help_stopwords[i], term, length)==0) return true;
+    }
+    return false;
+}
+
+/** An occurrence of a term while the index is being built */
+typedef struct {
+    uint32_t start; // Offset into the lower case copy of the text
+    uint32_t length;
+    uint32_t topic;
+    uint32_t weight;
+} helpoccurrence;
+
+DECLARE_VARRAY(helpoccurrence, helpoccurrence)
+DEFINE_VARRAY(helpoccurrence, helpoccurrence)
+
+static char *help_sorttext;
+
+/** Orders occurrences by term and then topic */
+static int help_occurrencecmp(const void *a, const void *b) {
+    const helpoccurrence *x = (const helpoccurrence *) a, *y = (const helpoccurrence *) b;
+    size_t length = (x->length<y->length ? x->length : y->length);
+    int cmp = strncmp(help_sorttext+x->start, help_sorttext+y->start, length);
+    if (cmp) return cmp;
+    if (x->length!=y->length) return (x->length<y->length ? -1 : 1);
+    return (x->topic<y->topic ? -1 : (x->topic>y->topic));
+}
+
+/** Builds the inverted index of the help text */
+static void help_indextext(helpbuilder *b) {
+    varray_helpoccurrence occ;
+    varray_helpoccurrenceinit(&occ);
+
+    /* Work on a lower case copy of the text */
+    char *lower = MORPHO_MALLOC(b->text.count+1);
+    if (!lower) return;
+    for (unsigned int i=0; i<b->text.count; i++) lower[i]=tolower((unsigned char) b->text.data[i]);
+    lower[b->text.count]='\0';
+
+    /* Collect every occurrence of every term */
+    for (uint32_t i=0; i<b->topics.count; i++) {
+        helptopic *t = &b->topics.data[i];
+        char *text = lower+t->text, *end = text+t->length;
+        char *eol = memchr(text, '\n', t->length);
+        size_t length;
+
+        for (char *c=help_nextterm(text, end, &length); c; c=help_nextterm(c+length, end, &length)) {
+            if (help_isstopword(c, length)) continue;
+            helpoccurrence o = { .start = (uint32_t) (c-lower), .length = (uint32_t) length, .topic = i,
+                                 .weight = ((!eol || c<eol) ? HELP_HEADERWEIGHT : 1) };
+            varray_helpoccurrencewrite(&occ, o);
+        }
+    }
+
+    help_sorttext=lower;
+    qsort(occ.data, occ.count, sizeof(helpoccurrence), help_occurrencecmp);
+
+    /* Each run of occurrences of the same term in the same topic becomes a posting */
+    for (unsigned int i=0; i<occ.count; ) {
+        helpoccurrence *first = &occ.data[i];
+        helpterm term = { .length = first->length, .postings = (uint32_t) b->postings.count, .npostings = 0 };
+        term.term = help_addstring(b, lower+first->start, first->length);
+
+        while (i<occ.count && occ.data[i].length==first->length &&
+               strncmp(lower+occ.data[i].start, lower+first->start, first->length)==0) {
+            helpposting p = { .topic = occ.data[i].topic, .count = 0 };
+            for (; i<occ.count && occ.data[i].topic==p.topic && occ.data[i].length==first->length &&
+                   strncmp(lower+occ.data[i].start, lower+first->start, first->length)==0; i++) {
+                p.count+=occ.data[i].weight;
+            }
+            varray_helppostingwrite(&b->postings, p);
+            term.npostings++;
+
+            /* Accumulate the length of each topic's weight vector */
+            float w = 1.0f+logf((float) p.count);
+            b->topics.data[p.topic].norm+=w*w;
+        }
+        varray_helptermwrite(&b->terms, term);
+    }
+
+    for (unsigned int i=0; i<b->topics.count; i++) b->topics.data[i].norm=sqrtf(b->topics.data[i].norm);
+
+    MORPHO_FREE(lower);
+    varray_helpoccurrenceclear(&occ);
+}
+
+/** Rounds an offset up so that the next section is aligned */
+#define HELP_ALIGN(x) (((x)+7) & ~((size_t) 7))
+
+/** Assembles the index image from a builder
+ *  @param[in] b - completed builder
+ *  @param[out] size - size of the image
+ *  @returns the image, or NULL on failure */
+static char *help_assemble(helpbuilder *b, size_t *size) {
+    struct { void *data; size_t count, recordsize; } sections[HELP_NSECTIONS] = {
+        [HELP_SECTIONFILES]   = { b->files.data, b->files.count, sizeof(helpfile) },
+        [HELP_SECTIONTOPICS]  = { b->topics.data, b->topics.count, sizeof(helptopic) },
+        [HELP_SECTIONKEYS]    = { b->keys.data, b->keys.count, sizeof(helpkey) },
+        [HELP_SECTIONSTRINGS] = { b->strings.data, b->strings.count, sizeof(char) },
+        [HELP_SECTIONTEXT]    = { b->text.data, b->text.count, sizeof(char) },
+        [HELP_SECTIONTERMS]   = { b->terms.data, b->terms.count, sizeof(helpterm) },
+        [HELP_SECTIONPOSTINGS]= { b->postings.data, b->postings.count, sizeof(helpposting) },
+    };
+
+    helpindexheader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, HELP_INDEXMAGIC, HELP_INDEXMAGICLENGTH);
+    header.version=HELP_INDEXVERSION;
+    header.nsections=HELP_NSECTIONS;
+
+    size_t offset=HELP_ALIGN(sizeof(helpindexheader));
+    for (int i=0; i<HELP_NSECTIONS; i++) {
+        header.sections[i].offset=offset;
+        header.sections[i].count=sections[i].count;
+        offset=HELP_ALIGN(offset+sections[i].count*sections[i].recordsize);
+    }
+
+    char *image = MORPHO_MALLOC(offset);
+    if (!image) return NULL;
+    memset(image, 0, offset);
+    memcpy(image, &header, sizeof(header));
+    for (int i=0; i<HELP_NSECTIONS; i++) {
+        if (sections[i].count) memcpy(image+header.sections[i].offset, sections[i].data, sections[i].count*sections[i].recordsize);
+    }
+
+    *size=offset;
+    return image;
+}
+
+/** Writes an index image to a file, replacing any previous index in one step */
+static bool help_writeindex(const char *indexfile, char *image, size_t size) {
+    size_t length=strlen(indexfile);
+    char tmp[length+8];
+    snprintf(tmp, length+8, "%s.XXXXXX", indexfile);
+
+    int fd = mkstemp(tmp);
+    if (fd<0) return false;
+
+    bool success=true;
+    for (size_t written=0; success && written<size; ) {
+        ssize_t n = write(fd, image+written, size-written);
+        if (n<0 && errno==EINTR) continue;
+        if (n<=0) success=false;
+        else written+=(size_t) n;
+    }
+
+    if (close(fd)!=0) success=false;
+    if (success) success=(rename(tmp, indexfile)==0);
+    if (!success) unlink(tmp);
+    return success;
+}
+
+/** Builds an index image from a list of help files */
+static char *help_build(varray_value *files, size_t *size) {
+    helpbuilder b;
+    help_builderinit(&b);
+
+    for (int i=0; i<files->count; i++) {
+        if (MORPHO_ISSTRING(files->data[i])) help_load(&b, MORPHO_GETCSTRING(files->data[i]));
+    }
+    varray_charwrite(&b.strings, '\0'); // Ensure the string table is never empty
+
+    help_sortkeys(&b);
+    help_indextext(&b);
+    char *image = help_assemble(&b, size);
+
+    help_builderclear(&b);
+    return image;
 }
 
 /* **********************************************************************
@@ -100,123 +713,298 @@ size_t help_querylength(char *query, char **s) {
     return length;
 }
 
+/** Compares a key with a (dictionary, string) pair */
+static int help_keyfind(uint32_t dict, char *key, size_t length, helpkey *k) {
+    if (dict!=k->dict) return (dict<k->dict ? -1 : 1);
+    int cmp = strncmp(key, help.strings+k->key, length);
+    if (cmp) return cmp;
+    return (length<k->length ? -1 : 0);
+}
+
+/** Finds the range of keys in a dictionary
+ *  @param[in] dict - dictionary to find
+ *  @param[out] first - first key in the dictionary
+ *  @returns the number of keys in the dictionary */
+static uint32_t help_dictrange(uint32_t dict, uint32_t *first) {
+    uint32_t l=0, r=help.nkeys;
+    while (l<r) { // Find the first key with k->dict>=dict
+        uint32_t mid=l+(r-l)/2;
+        if (help.keys[mid].dict<dict) l=mid+1; else r=mid;
+    }
+    *first=l;
+
+    r=l;
+    while (r<help.nkeys && help.keys[r].dict==dict) r++;
+    return r-l;
+}
+
 /** Searches for a given query in the help system. If recurse is true, searches child dictionaries if nothing found here */
-objecthelptopic *help_query(dictionary *dict, char *query, bool recurse) {
-    objecthelptopic *topic = NULL;
+static helptopic *help_query(uint32_t dict, char *query, bool recurse) {
+    helptopic *topic = NULL;
     char *p;
     size_t length = help_querylength(query, &p);
-    
+
     if (length>0) {
         /* Convert query to lower case */
         char q[length+1];
         for (unsigned int i=0; i<length; i++) q[i]=tolower(p[i]);
-        
-        objectstring key = MORPHO_STATICSTRINGWITHLENGTH(q, length);
-        value result;
-        
-        if (dictionary_get(dict, MORPHO_OBJECT(&key), &result)) {
-            if (MORPHO_ISOBJECT(result)) {
-                topic = (objecthelptopic *) MORPHO_GETOBJECT(result);
-            }
-        } else if (recurse) {
-            for (unsigned int i=0; !topic && i<dict->capacity; i++) {
-                if (MORPHO_ISOBJECT(dict->contents[i].key)) {
-                    objecthelptopic *child = (objecthelptopic *) MORPHO_GETOBJECT(dict->contents[i].val);
-                    
-                    topic = help_query(&child->subtopics, query, true);
-                }
+        q[length]='\0';
+
+        /* Binary search for the key */
+        uint32_t l=0, r=help.nkeys;
+        while (l<r) {
+            uint32_t mid=l+(r-l)/2;
+            int cmp=help_keyfind(dict, q, length, &help.keys[mid]);
+            if (cmp==0) { topic=&help.topics[help.keys[mid].topic]; break; }
+            if (cmp<0) r=mid; else l=mid+1;
+        }
+
+        if (!topic && recurse) {
+            uint32_t first, n = help_dictrange(dict, &first);
+            for (uint32_t i=first; !topic && i<first+n; i++) {
+                topic = help_query(help.keys[i].topic+1, query, true);
             }
         }
     }
-    
+
     return topic;
 }
 
 /** Searches for a given query in the help system */
-objecthelptopic *help_search(char *query) {
-    objecthelptopic *topic = NULL;
-    dictionary *dict = &helpdict;
+helptopic *help_search(char *query) {
+    helptopic *topic = NULL;
+    uint32_t dict = HELP_GLOBALDICT;
     char *p;
     size_t length = help_querylength(query, &p);
-    
+
+    if (!help.keys) return NULL;
+
     while (length>0) {
         topic=help_query(dict, p, true);
         length=help_querylength(p+length, &p);
-        if (topic) dict=&topic->subtopics;
+        if (topic) dict=(uint32_t) (topic-help.topics)+1;
     }
-    
+
     return topic;
 }
 
+/* ----------------------------------------
+ * Full text search
+ * ---------------------------------------- */
+
+#define HELP_FUZZYWEIGHT 0.5 // Weight of matches that are only close to the query term
+#define HELP_MAXQUERYTERMS 16
+
+/** Computes the edit distance between two strings, giving up once it's known to exceed max */
+static int help_editdistance(char *a, size_t la, char *b, size_t lb, int max) {
+    int row[HELP_MAXTERMLENGTH+1];
+    if (la>HELP_MAXTERMLENGTH || lb>HELP_MAXTERMLENGTH) return max+1;
+    if ((int) (la>lb ? la-lb : lb-la)>max) return max+1;
+
+    for (size_t j=0; j<=lb; j++) row[j]=(int) j;
+    for (size_t i=1; i<=la; i++) {
+        int diag=row[0], rowmin;
+        row[0]=rowmin=(int) i;
+        for (size_t j=1; j<=lb; j++) {
+            int up=row[j];
+            int d=diag+(a[i-1]!=b[j-1]);
+            if (up+1<d) d=up+1;
+            if (row[j-1]+1<d) d=row[j-1]+1;
+            row[j]=d;
+            diag=up;
+            if (d<rowmin) rowmin=d;
+        }
+        if (rowmin>max) return max+1;
+    }
+    return row[lb];
+}
+
+/** Finds a term in the vocabulary */
+static helpterm *help_findterm(char *term, size_t length) {
+    uint32_t l=0, r=help.nterms;
+    while (l<r) {
+        uint32_t mid=l+(r-l)/2;
+        helpterm *t=&help.terms[mid];
+        size_t n=(length<t->length ? length : t->length);
+        int cmp=strncmp(term, help.strings+t->term, n);
+        if (!cmp) cmp=(length<t->length ? -1 : (length>t->length));
+        if (!cmp) return t;
+        if (cmp<0) r=mid; else l=mid+1;
+    }
+    return NULL;
+}
+
+/** Adds the contribution of a term to the topic scores */
+static void help_scoreterm(helpterm *term, double weight, double *scores) {
+    double idf=log((double) help.ntopics/term->npostings);
+    for (uint32_t i=0; i<term->npostings; i++) {
+        helpposting *p=&help.postings[term->postings+i];
+        helptopic *t=&help.topics[p->topic];
+        if (t->norm>0) scores[p->topic]+=weight*idf*(1.0+log((double) p->count))/t->norm;
+    }
+}
+
+/** Adds the contribution of terms close to a misspelled query term */
+static void help_scorefuzzy(char *term, size_t length, double *scores) {
+    int max=(length<=4 ? 1 : 2), best=max+1;
+
+    /* Find the closest distance first, then score all terms at that distance */
+    for (uint32_t i=0; i<help.nterms; i++) {
+        helpterm *t=&help.terms[i];
+        int d=help_editdistance(term, length, help.strings+t->term, t->length, best);
+        if (d<best) best=d;
+    }
+    if (best>max) return;
+
+    for (uint32_t i=0; i<help.nterms; i++) {
+        helpterm *t=&help.terms[i];
+        if (help_editdistance(term, length, help.strings+t->term, t->length, best)==best) {
+            help_scoreterm(t, HELP_FUZZYWEIGHT, scores);
+        }
+    }
+}
+
+/** Searches the text of all help topics
+ *  @param[in] query - words to look for
+ *  @param[out] results - matching topics, best first
+ *  @param[in] max - maximum number of results
+ *  @returns the number of results */
+int help_searchtext(char *query, helptopic **results, int max) {
+    if (!help.terms || !help.ntopics) return 0;
+
+    double *scores = MORPHO_MALLOC(sizeof(double)*help.ntopics);
+    if (!scores) return 0;
+    for (uint32_t i=0; i<help.ntopics; i++) scores[i]=0;
+
+    /* Lower case copy of the query */
+    size_t qlength=strlen(query);
+    char q[qlength+1];
+    for (size_t i=0; i<=qlength; i++) q[i]=tolower((unsigned char) query[i]);
+
+    size_t length;
+    int nterms=0;
+    for (char *c=help_nextterm(q, q+qlength, &length); c && nterms<HELP_MAXQUERYTERMS; c=help_nextterm(c+length, q+qlength, &length)) {
+        if (help_isstopword(c, length)) continue;
+        nterms++;
+
+        helpterm *term=help_findterm(c, length);
+        if (term) help_scoreterm(term, 1.0, scores);
+        else help_scorefuzzy(c, length, scores);
+    }
+
+    /* Select the best scoring topics */
+    int n=0;
+    double best[max];
+    for (uint32_t i=0; i<help.ntopics; i++) {
+        if (scores[i]<=0) continue;
+        int j=(n<max ? n++ : max);
+        for (; j>0 && best[j-1]<scores[i]; j--) {
+            if (j<max) { best[j]=best[j-1]; results[j]=results[j-1]; }
+        }
+        if (j<max) { best[j]=scores[i]; results[j]=&help.topics[i]; }
+    }
+
+    MORPHO_FREE(scores);
+    return n;
+}
+
+/** Calls a function with the name of every topic, spelled as in the help file
+ *  @param[in] fn - function to call; global is true for topics in the global dictionary and false for subtopics
+ *  @param[in] ref - reference passed to fn */
+void help_topicnames(help_topicnamefn fn, void *ref) {
+    for (uint32_t i=0; i<help.ntopics; i++) {
+        helptopic *topic = &help.topics[i];
+        char *title = help.strings+topic->title;
+        fn(title, strlen(title), topic->parent==HELP_NOPARENT, ref);
+    }
+}
+
 /* **********************************************************************
  * Display help
  * ********************************************************************** */
 
+/** Writes the sequence of topic names that leads to a topic */
+static void help_topicpath(helptopic *topic, varray_char *out) {
+    if (topic->parent!=HELP_NOPARENT) {
+        help_topicpath(&help.topics[topic->parent], out);
+        varray_charwrite(out, ' ');
+    }
+    char *name = help.strings+topic->name;
+    varray_charadd(out, name, (int) strlen(name));
+}
+
+/** Displays the results of a search as the help commands that display each topic */
+void help_displayresults(lineditor *edit, helptopic **results, int n) {
+    varray_char str;
+    varray_charinit(&str);
+
+    linedit_displaywithstyle(edit, HELP_RESULTS, LINEDIT_DEFAULTCOLOR, LINEDIT_UNDERLINE);
+    for (int i=0; i<n; i++) {
+        str.count=0;
+        varray_charadd(&str, "  " HELP_INDEXPAGE " ", (int) strlen("  " HELP_INDEXPAGE " "));
+        help_topicpath(results[i], &str);
+        varray_charadd(&str, "\n\0", 2);
+        linedit_displaywithsyntaxcoloring(edit, str.data);
+    }
+
+    varray_charclear(&str);
+}
+
 /** Display a topic list */
-void help_topiclist(dictionary *dict, lineditor *edit) {
+void help_topiclist(uint32_t dict, lineditor *edit) {
     int width = linedit_getwidth(edit), max = 0;
-    
-    objectlist list = MORPHO_STATICLIST;
-    varray_valueinit(&list.val);
-    
+
     varray_char str;
     varray_charinit(&str);
-    
-    /* We search through the list of topics and find those that are in the dictionary */
-    for (objecthelptopic *topic=topics; topic!=NULL; topic=topic->next) {
-        objectstring key = MORPHO_STATICSTRING(topic->topic);
-        
-        if (dictionary_get(dict, MORPHO_OBJECT(&key), NULL)) {
-            value str = dictionary_intern(dict, MORPHO_OBJECT(&key));
-            varray_valuewrite(&list.val, str);
-        }
-    }
-    
-    list_sort(&list);
-    
-    for (unsigned int i=0; i<list.val.count; i++) {
-        if (MORPHO_ISSTRING(list.val.data[i])) {
-            int len = (int) MORPHO_GETSTRINGLENGTH(list.val.data[i]);
-            if (len>max) max=len;
-        }
+
+    /* Keys are sorted, so the topics in the dictionary are already in order */
+    uint32_t first, n = help_dictrange(dict, &first), count = 0;
+    for (uint32_t i=first; i<first+n; i++) {
+        if (!(help.keys[i].flags & HELP_KEYISTOPICNAME)) continue;
+        if ((int) help.keys[i].length>max) max=(int) help.keys[i].length;
+        count++;
     }
+    if (!max) return;
+
     int ncols = width/(max), k=0;
-    bool single = list.val.count<ncols;
-    
-    for (unsigned int i=0; i<list.val.count; i++) {
-        if (MORPHO_ISSTRING(list.val.data[i])) {
-            objectstring *s = MORPHO_GETSTRING(list.val.data[i]);
-            if (!isalpha(s->string[0])) continue;
-            varray_charadd(&str, s->string, (int) s->length);
+    bool single = count<ncols;
+
+    for (uint32_t i=first, j=0; i<first+n; i++) {
+        helpkey *key = &help.keys[i];
+        if (!(key->flags & HELP_KEYISTOPICNAME)) continue;
+        j++;
+
+        char *s = help.strings+key->key;
+        if (isalpha(s[0])) {
+            varray_charadd(&str, s, (int) key->length);
             if (single) {
                 varray_charadd(&str, "  ", 2);
             } else {
-                for (int k=(int) s->length; k<max+1; k++) varray_charwrite(&str, ' ');
+                for (int k=(int) key->length; k<max+1; k++) varray_charwrite(&str, ' ');
             }
             k++;
         }
-        if (k==ncols-1 || i==list.val.count-1) {
+        if (k==ncols-1 || j==count) {
             varray_charadd(&str, "\n\0", 2);
             linedit_displaywithsyntaxcoloring(edit, str.data);
             str.count=0; k=0;
         }
     }
-    
-    varray_valueclear(&list.val);
+
     varray_charclear(&str);
 }
 
 /** Parse a 'show' command */
-static void help_show(objecthelptopic *topic, lineditor *edit, char *command) {
+static void help_show(helptopic *topic, lineditor *edit, char *command) {
     char *c=command;
     for (; isspace(*c); c++);
     if (*c=='(') c++;
     if (strncmp(c, "topics", 6)==0) {
         linedit_displaywithstyle(edit, HELP_TOPICS, LINEDIT_DEFAULTCOLOR, LINEDIT_UNDERLINE);
-        help_topiclist(&helpdict, edit);
+        help_topiclist(HELP_GLOBALDICT, edit);
     } else if (strncmp(c, "subtopics", 9)==0) {
         linedit_displaywithstyle(edit, HELP_SUBTOPICS, LINEDIT_DEFAULTCOLOR, LINEDIT_UNDERLINE);
-        help_topiclist(&topic->subtopics, edit);
+        help_topiclist((uint32_t) (topic-help.topics)+1, edit);
     }
 }
 
@@ -241,11 +1029,11 @@ static char *help_parseinlinecode(lineditor *edit, char *string) {
     if (*s=='`') s++;
     size_t nchars = help_parsesegment(s, '`');
     if (nchars==0) return string;
-    
+
     char str[nchars+1];
     strncpy(str, string+1, nchars);
     str[nchars]='\0';
-    
+
     linedit_displaywithsyntaxcoloring(edit, str);
     return s + nchars;
 }
@@ -256,17 +1044,17 @@ static char *help_parseemph(lineditor *edit, char *string, char delim, linedit_c
     if (*s==delim) s++;
     size_t nchars = help_parsesegment(s, delim);
     if (nchars==0) return string;
-    
+
     char str[nchars+1];
     strncpy(str, string+1, nchars);
     str[nchars]='\0';
-    
+
     linedit_displaywithstyle(edit, str, col, emph);
     return s + nchars;
 }
 
 /** Displays a single line of help text */
-static bool help_displayline(objecthelptopic *topic, lineditor *edit, char *line, bool allowheader) {
+static bool help_displayline(helptopic *topic, lineditor *edit, char *line, bool allowheader) {
     if (line[0]=='#') {
         if (allowheader) {
             char *s = line;
@@ -290,7 +1078,7 @@ static bool help_displayline(objecthelptopic *topic, lineditor *edit, char *line
     } else {
         char *c = line;
         if (line[0]=='*') { printf("*"); c++; }
-        
+
         /* Display the line, searching for inline markup */
         for (; *c!='\0'; c++) {
             char *next=NULL;
@@ -319,182 +1107,91 @@ static bool help_displayline(objecthelptopic *topic, lineditor *edit, char *line
 }
 
 /** Displays a help topic */
-void help_display(lineditor *edit, objecthelptopic *topic) {
-    FILE *f = (topic ? fopen(topic->file, "r") : NULL);
+void help_display(lineditor *edit, helptopic *topic) {
+    if (!topic) return;
+
     char line[HELP_LINELENGTH];
-    
-    if (f) {
-        /* Jump to the topic */
-        if (fseek(f, topic->location, SEEK_SET)==0) {
-            /* Load and display the help line by line */
-            for(unsigned int i=0; !feof(f); i++) {
-                if (fgets(line, HELP_LINELENGTH, f)) {
-                    if (help_displayline(topic, edit, line, (i==0))) break;
-                }
-            }
-        }
-        
-        fclose(f);
+    char *text = help.text+topic->text, *end = text+topic->length;
+
+    /* Display the help line by line */
+    for (unsigned int i=0; text<end; i++) {
+        char *eol = memchr(text, '\n', end-text);
+        size_t length = (eol ? eol-text+1 : end-text);
+        if (length>=HELP_LINELENGTH) length=HELP_LINELENGTH-1;
+
+        memcpy(line, text, length);
+        line[length]='\0';
+        if (help_displayline(topic, edit, line, (i==0))) break;
+        text+=length;
     }
 }
 
 /* **********************************************************************
- * Process and load help files
+ * Public interface
  * ********************************************************************** */
 
-/** Parses a topic name, returning it as a Morpho string converted to lower case.
- *  @warning the input line is modified in the process */
-value help_parsetopicname(char *line) {
-    char *start = line;
-    size_t length = 0;
-    while ((*start=='#' || isspace(*start)) && *start!='\0') start++;
-    while (!iscntrl(start[length])) {
-        start[length]=tolower(start[length]);
-        length++;
-    }
-    
-    return object_stringfromcstring(start, length);
-}
+/** Builds the help index from the installed help files
+ *  @param[in] indexfile - file to write the index to
+ *  @returns true on success */
+bool help_buildindex(const char *indexfile) {
+    varray_value files;
+    varray_valueinit(&files);
 
-/** Parses a tag, returning it as a Morpho string converted to lower case.
- *  @warning the input line is modified in the process */
-value help_parsetag(char *line) {
-    char *start = line;
-    size_t length = 0;
-    /* Skip past everything until the hash */
-    while (*start!='\0' && *start!='#') start++;
-    if (*start=='\0') return MORPHO_NIL;
-    start++; /* Skip # */
-    /* Now skip everything until the tag */
-    while (isspace(*start) && *start!='\0') start++;
-    
-    /* Skip opening bracket if present */
-    if (*start=='(') start++;
-    
-    while (!iscntrl(start[length]) &&
-           !isspace(start[length]) &&
-           start[length]!=')' // Skip closing bracket
-           ) {
-        start[length]=tolower(start[length]);
-        length++;
+    bool success=false;
+    if (help_listfiles(&files)) {
+        size_t size;
+        char *image = help_build(&files, &size);
+        if (image) {
+            success=help_writeindex(indexfile, image, size);
+            MORPHO_FREE(image);
+        }
     }
-    
-    return object_stringfromcstring(start, length);
+
+    help_clearfiles(&files);
+    return success;
 }
 
-#define HELP_MAXLEVEL 6
+/** Initializes the help system
+ *  @param[in] indexfile - location of the help index; it is rebuilt if missing or out of date. May be NULL.
+ *  @returns true if help is available */
+bool help_initialize(const char *indexfile) {
+    varray_value files;
+    varray_valueinit(&files);
+    help_indexinit(&help);
 
-/** Determines the level of topic from the markdown header level */
-int help_parsetopiclevel(char *line) {
-    int level = 0;
-    while (line[level]=='#') level++;
-    
-    return (level>=HELP_MAXLEVEL ? HELP_MAXLEVEL-1 : level-1);
-}
+    if (!help_listfiles(&files)) {
+        help_clearfiles(&files);
+        return false;
+    }
 
-/** Loads a help file
- *  @param file     file to load
- *  @returns true if any help entries were successfully loaded */
-bool help_load(char *file) {
-    char line[HELP_LINELENGTH];
-    objecthelptopic *topic[HELP_MAXLEVEL];
-    for (unsigned int i=0; i<HELP_MAXLEVEL; i++) topic[i]=NULL;
-    int level = 0;
-    bool toplevel = false;
-    
-#ifdef MORPHO_DEBUG_LOGHELPFILES
-    printf("Loading help file '%s'\n",file);
-#endif
-    FILE *f = fopen(file, "r");
-    
-    if (f) {
-        while (!feof(f)) {
-            long int cloc = ftell(f); /* Store the current position */
-            
-            if (fgets(line, HELP_LINELENGTH, f)) {
-                if (line[0]=='#') {
-                    /* Headers define available topics */
-                    value key = help_parsetopicname(line);
-                    level = help_parsetopiclevel(line);
-                    if (MORPHO_ISOBJECT(key)) {
-                        topic[level]=help_newtopic(MORPHO_GETCSTRING(key), file, cloc,
-                                                   (level>0 ? topic[level-1] : NULL) );
-                        if (topic[level]) {
-                            /* Insert the topic... */
-                            dictionary *dict = &helpdict; /* ... either into the global dictionary */
-                            if (level>0) dict=&topic[level-1]->subtopics; /* or into the parent's dictionary */
-                            
-                            dictionary_insert(dict, key, MORPHO_OBJECT(topic[level]));
-#ifdef MORPHO_DEBUG_LOGHELPFILES
-                            printf("Parsed topic '%s' level %i\n", MORPHO_GETCSTRING(key), level);
-#endif
-                        }
-                    }
-                } else if (strncmp(line, "[tag", 4)==0) {
-                    /* Unused links that start with 'tag' define additional search terms */
-                    value key = help_parsetag(line);
-                    if (MORPHO_ISOBJECT(key)) {
-                        /* Insert the topic... */
-                        dictionary *dict = &helpdict; /* ... either into the global dictionary */
-                        if (!toplevel && level>0) dict=&topic[level-1]->subtopics; /* or into the parent's dictionary */
-                        dictionary_insert(dict, key, MORPHO_OBJECT(topic[level]));
-#ifdef MORPHO_DEBUG_LOGHELPFILES
-                        printf("Parsed tag '%s' level %i\n", MORPHO_GETCSTRING(key), level);
-#endif
-                    }
-                } else if (strncmp(line, "[toplevel]", 10)==0) {
-                    /* Toggles insertion into top level dictionary */
-                    toplevel = !toplevel;
-                }
-            }
-        }
-        fclose(f);
+    /* Use an existing index if it matches the help files */
+    bool success=(indexfile && help_indexmap(&help, indexfile));
+    if (success && !help_indexiscurrent(&help, &files)) {
+        help_indexclear(&help);
+        success=false;
     }
-    
-    return false;
-}
 
-/** Searches for help files
- *  @returns true if any help files were successfully processed. */
-bool help_findfiles(void) {
-    bool success=false;
-    varray_value files;
-    varray_valueinit(&files);
-    
-    if (morpho_listresources(MORPHO_RESOURCE_HELP, &files)) {
-        for (int i=0; i<files.count; i++) {
-            if (MORPHO_ISSTRING(files.data[i]) &&
-                help_load(MORPHO_GETCSTRING(files.data[i]))) success=true;
+    if (!success) {
+        size_t size;
+        char *image = help_build(&files, &size);
+
+        if (image) {
+            /* Save the index for next time, and map it if possible */
+            if (indexfile && help_writeindex(indexfile, image, size) && help_indexmap(&help, indexfile)) {
+                MORPHO_FREE(image);
+                success=true;
+            } else if (help_indexattach(&help, image, size)) {
+                success=true;
+            } else MORPHO_FREE(image);
         }
     }
-    
-    for (int i=0; i<files.count; i++) morpho_freeobject(files.data[i]);
-    varray_valueclear(&files);
-    
-    return success;
-}
 
-/* **********************************************************************
- * Public interface
- * ********************************************************************** */
+    help_clearfiles(&files);
 
-/** Initializes the help system
- *  @returns true if help is available */
-bool help_initialize(void) {
-    objecthelptopictype=object_addtype(&objecthelptopicdefn);
-    
-    dictionary_init(&helpdict);
-    
-    return help_findfiles();
+    return success && help.ntopics>0;
 }
 
 /** Finalizes the help system */
 void help_finalize(void) {
-    while (topics) {
-        objecthelptopic *c = topics;
-        topics = c->next;
-        object_free((object *) c);
-    }
-    dictionary_freecontents(&helpdict, true, false);
-    dictionary_clear(&helpdict);
+    help_indexclear(&help);
 }
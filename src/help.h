@@ -8,34 +8,135 @@
 #define help_h
 
 #include <stdio.h>
+#include <stdint.h>
 
 #include <morpho.h>
 #include <object.h>
 
 #include "linedit.h"
 
-extern objecttype objecthelptopictype;
-#define OBJECT_HELPTOPIC objecthelptopictype
+/* **********************************************************************
+ * Help index
+ * ********************************************************************** */
 
-typedef struct sobjecthelptopic {
-    object obj;
-    char *topic; // Topic name
-    char *file; // File
-    long int location; // Location in file
-    struct sobjecthelptopic *parent; // Parent topic
-    struct sobjecthelptopic *next; // Next topic (global linked list)
-    dictionary subtopics; // Subtopics
-} objecthelptopic;
+/** The help files are compiled into an index that is memory mapped at startup. The index holds
+ *  a table of sections, each of which is an array of fixed size records (or raw bytes):
+ *
+ *  files    - the help files the index was built from, with their modification times and sizes
+ *  topics   - one record per topic, in the order they appear in the files
+ *  keys     - names and tags by which topics may be found, sorted by (dictionary, key)
+ *  strings  - zero terminated strings referred to by the other sections
+ *  text     - the help text of every topic, concatenated
+ *  terms    - vocabulary of the help text for full text search, sorted
+ *  postings - for each term, the topics in which it occurs and how often */
+
+#define HELP_INDEXMAGIC "MORPHOHI"
+#define HELP_INDEXMAGICLENGTH 8
+#define HELP_INDEXVERSION 3
+
+#define HELP_INDEXFILE "help.idx"
+
+/** Sections of the help index */
+typedef enum {
+    HELP_SECTIONFILES,
+    HELP_SECTIONTOPICS,
+    HELP_SECTIONKEYS,
+    HELP_SECTIONSTRINGS,
+    HELP_SECTIONTEXT,
+    HELP_SECTIONTERMS,
+    HELP_SECTIONPOSTINGS,
+    HELP_NSECTIONS
+} helpsection;
+
+/** Location of a section in the index */
+typedef struct {
+    uint64_t offset; // Offset from the start of the index in bytes
+    uint64_t count; // Number of records
+} helpindexsection;
+
+/** Header at the start of the index */
+typedef struct {
+    char magic[HELP_INDEXMAGICLENGTH];
+    uint32_t version;
+    uint32_t nsections;
+    helpindexsection sections[HELP_NSECTIONS];
+} helpindexheader;
+
+/** A help file that contributed to the index */
+typedef struct {
+    uint32_t path; // Path to the file (offset into strings)
+    uint32_t pad;
+    int64_t mtime; // Modification time
+    int64_t size; // Size in bytes
+} helpfile;
+
+#define HELP_NOPARENT UINT32_MAX
+
+/** A help topic */
+typedef struct {
+    uint32_t name; // Topic name in lower case (offset into strings)
+    uint32_t title; // Topic name as written in the help file (offset into strings)
+    uint32_t parent; // Parent topic, or HELP_NOPARENT
+    uint32_t text; // Offset of the help text
+    uint32_t length; // Length of the help text in bytes
+    float norm; // Length of the topic's term weight vector, used to normalize search scores
+} helptopic;
+
+/** The global dictionary; topic i holds its subtopics in dictionary i+1 */
+#define HELP_GLOBALDICT 0
+
+#define HELP_KEYISTOPICNAME (1<<0)
+
+/** A search key */
+typedef struct {
+    uint32_t dict; // Dictionary containing the key
+    uint32_t key; // Key in lower case (offset into strings)
+    uint32_t length; // Length of the key
+    uint32_t topic; // Topic found by the key
+    uint32_t flags; // HELP_KEYISTOPICNAME if the key coincides with the name of a topic
+} helpkey;
+
+/** A term in the full text index */
+typedef struct {
+    uint32_t term; // The term in lower case (offset into strings)
+    uint32_t length; // Length of the term
+    uint32_t postings; // First posting
+    uint32_t npostings; // Number of postings, i.e. the number of topics containing the term
+} helpterm;
+
+/** Occurrence of a term in a topic */
+typedef struct {
+    uint32_t topic; // Topic containing the term
+    uint32_t count; // Number of occurrences
+} helpposting;
+
+/* **********************************************************************
+ * Interface
+ * ********************************************************************** */
 
 #define HELP_INDEXPAGE "help"
 #define HELP_TOPICS "Topics:\n"
 #define HELP_SUBTOPICS "Subtopics:\n"
 
 size_t help_querylength(char *query, char **s);
-objecthelptopic *help_search(char *query);
-void help_display(lineditor *edit, objecthelptopic *topic);
+helptopic *help_search(char *query);
+void help_display(lineditor *edit, helptopic *topic);
+
+#define HELP_MAXRESULTS 10
+#define HELP_NORESULTS "No matches found for '%s'\n"
+#define HELP_RESULTS "Matches:\n"
+
+int help_searchtext(char *query, helptopic **results, int max);
+
+/** Function called with the name of a topic as written in the help file, which need not be zero terminated */
+typedef void (*help_topicnamefn) (const char *name, size_t length, bool global, void *ref);
+
+void help_topicnames(help_topicnamefn fn, void *ref);
+void help_displayresults(lineditor *edit, helptopic **results, int n);
+
+bool help_buildindex(const char *indexfile);
 
-bool help_initialize(void);
-void help_finalize(void); 
+bool help_initialize(const char *indexfile);
+void help_finalize(void);
 
 #endif /* help_h */
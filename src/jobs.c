@@ -0,0 +1,388 @@
+/** @file jobs.c
+ *  @author T J Atherton
+ *
+ *  @brief Runs many scripts concurrently across a pool of worker processes
+*/
+
+#include <stdio.h>
+#include <time.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <file.h>
+
+#include "jobs.h"
+
+#define CLIJOBS_BUFFERSIZE 1024
+
+/** @brief Each job is compiled and run in a child process with its own program, compiler and vm, just as
+ *  cli_run does. Jobs run in separate processes rather than threads because nothing establishes that
+ *  libmorpho's compiler, vm, garbage collector and global tables may be used from several threads at once.
+ *  The parent never runs morpho code itself, so no runtime threads exist when it forks. Output from a
+ *  job is captured through the print and warning callbacks, sent to the parent through a pipe, and written
+ *  out in one piece once the job completes, so the output of different jobs never interleaves. */
+
+/* **********************************************************************
+ * Jobs
+ * ********************************************************************** */
+
+/** A script to run */
+typedef struct {
+    char *file;         /** Script to run */
+    varray_char output; /** Output captured while running */
+    int status;         /** Exit status */
+    double time;        /** Wall time taken in seconds */
+    bool jsonl;         /** Whether output is captured as JSON records */
+} clijob;
+
+DECLARE_VARRAY(clijob, clijob)
+DEFINE_VARRAY(clijob, clijob)
+
+/** Jobs to be run */
+typedef struct {
+    varray_clijob jobs;
+    clioptions opt;
+} clijobqueue;
+
+/** A job running in a child process */
+typedef struct {
+    int job;       /** Index of the job */
+    pid_t pid;     /** The child */
+    int fd;        /** Read end of the pipe carrying the job's output */
+    double start;  /** When the job started */
+} clijobprocess;
+
+/** Returns the time on a monotonic clock in seconds */
+static double clijobs_now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec+t.tv_nsec*1e-9;
+}
+
+/** Adds a job to the queue */
+static bool clijobs_add(clijobqueue *q, const char *file, size_t length) {
+    clijob job = { .status = 1, .time = 0, .jsonl = false };
+    job.file=MORPHO_MALLOC(length+1);
+    if (!job.file) return false;
+    memcpy(job.file, file, length);
+    job.file[length]='\0';
+    varray_charinit(&job.output);
+    varray_clijobwrite(&q->jobs, job);
+    return true;
+}
+
+/** Adds every script listed in a manifest, one per line, ignoring blank lines and lines beginning with # */
+static bool clijobs_addmanifest(clijobqueue *q, const char *manifest) {
+    clisource src;
+    if (!cli_loadsource(manifest, &src)) {
+        fprintf(stderr, "Could not open manifest '%s'.\n", manifest);
+        return false;
+    }
+    
+    for (char *line=src.data; *line!='\0'; ) {
+        char *end=strchr(line, '\n');
+        if (!end) end=line+strlen(line);
+        
+        /* Trim surrounding whitespace */
+        char *start=line, *stop=end;
+        while (start<stop && isspace(*start)) start++;
+        while (stop>start && isspace(*(stop-1))) stop--;
+        
+        if (stop>start && *start!='#') clijobs_add(q, start, stop-start);
+        line=(*end=='\0' ? end : end+1);
+    }
+    
+    cli_sourceclear(&src);
+    return true;
+}
+
+/* **********************************************************************
+ * Running a job
+ * ********************************************************************** */
+
+/** Print callback that captures a job's output */
+static void clijobs_printfn(vm *v, void *ref, char *string) {
+    clijob *job = (clijob *) ref;
+    if (job->jsonl) {
+        cli_jsonrecord(&job->output, "print");
+        cli_jsonstring(&job->output, "text", string);
+        cli_jsonrecordend(&job->output);
+    } else varray_charadd(&job->output, string, (int) strlen(string));
+}
+
+/** Records an error or warning in a job's output, in the same format as cli_reporterror */
+static void clijobs_error(clijob *job, char *label, error *err, vm *v) {
+    if (job->jsonl) {
+        cli_jsonerror(&job->output, (strcmp(label, "Warning")==0 ? "warning" : "error"), err, v);
+        return;
+    }
+    
+    char buffer[CLIJOBS_BUFFERSIZE+MORPHO_ERRORSTRINGSIZE];
+    int n;
+    
+    if (!ERROR_ISRUNTIMEERROR(*err) && err->line!=ERROR_POSNUNIDENTIFIABLE && err->posn!=ERROR_POSNUNIDENTIFIABLE) {
+        n=snprintf(buffer, sizeof(buffer), "%s '%s' [line %u char %u%s%s%s] : %s\n", label, err->id, err->line, err->posn+1,
+                   (err->file ? " in module '" : ""), (err->file ? err->file : ""), (err->file ? "'" : ""), err->msg);
+    } else {
+        n=snprintf(buffer, sizeof(buffer), "%s '%s': %s\n", label, err->id, err->msg);
+    }
+    
+    if (n>0) varray_charadd(&job->output, buffer, (n<(int) sizeof(buffer) ? n : (int) sizeof(buffer)-1));
+}
+
+/** Warning callback that captures warnings from a job */
+static void clijobs_warningfn(vm *v, void *ref, error *err) {
+    clijobs_error((clijob *) ref, "Warning", err, NULL);
+}
+
+/** Records a job's result, if output is captured as JSON records */
+static void clijobs_result(clijob *job) {
+    if (!job->jsonl) return;
+    cli_jsonrecord(&job->output, "result");
+    cli_jsonstring(&job->output, "file", job->file);
+    cli_jsonbool(&job->output, "success", (job->status==0));
+    cli_jsoninteger(&job->output, "status", job->status);
+    cli_jsonnumber(&job->output, "time", job->time);
+    cli_jsonrecordend(&job->output);
+}
+
+/** Records a message about a job that the job couldn't report itself */
+static void clijobs_message(clijob *job, const char *msg) {
+    if (job->jsonl) {
+        cli_jsonrecord(&job->output, "error");
+        cli_jsonstring(&job->output, "id", NULL);
+        cli_jsonstring(&job->output, "message", msg);
+        cli_jsonstring(&job->output, "file", job->file);
+        cli_jsonrecordend(&job->output);
+    } else {
+        varray_charadd(&job->output, (char *) msg, (int) strlen(msg));
+        varray_charwrite(&job->output, '\n');
+    }
+}
+
+/** Compiles and runs a single job */
+static void clijobs_runjob(clijob *job, clioptions opt) {
+    double start=clijobs_now();
+    job->jsonl=(opt & CLI_JSONL);
+    
+    program *p = morpho_newprogram();
+    compiler *c = morpho_newcompiler(p);
+    vm *v = morpho_newvm();
+    
+    morpho_setprintfn(v, clijobs_printfn, job);
+    morpho_setwarningfn(v, clijobs_warningfn, job);
+    
+    error err;
+    error_init(&err);
+    
+    /* Resolve imports and resources relative to the script, as cli_run does; each job has its own process */
+    file_setworkingdirectory(job->file);
+    
+    clisource src;
+    if (cli_loadsource(job->file, &src)) {
+        if (morpho_compile(src.data, c, (opt & CLI_OPTIMIZE), &err)) {
+            if (morpho_run(v, p)) job->status=0;
+            else clijobs_error(job, "Error", morpho_geterror(v), v);
+        } else clijobs_error(job, "Error", &err, NULL);
+    } else if (job->jsonl) {
+        cli_jsonrecord(&job->output, "error");
+        cli_jsonstring(&job->output, "id", NULL);
+        cli_jsonstring(&job->output, "message", "Could not open file.");
+        cli_jsonstring(&job->output, "file", job->file);
+        cli_jsonrecordend(&job->output);
+    } else {
+        char msg[CLIJOBS_BUFFERSIZE];
+        int n=snprintf(msg, sizeof(msg), "Could not open file '%s'.\n", job->file);
+        if (n>0) varray_charadd(&job->output, msg, (n<(int) sizeof(msg) ? n : (int) sizeof(msg)-1));
+    }
+    
+    cli_sourceclear(&src);
+    morpho_freevm(v);
+    morpho_freecompiler(c);
+    morpho_freeprogram(p);
+    
+    job->time=clijobs_now()-start;
+    clijobs_result(job);
+}
+
+/* **********************************************************************
+ * Worker processes
+ * ********************************************************************** */
+
+/** Writes a buffer in full */
+static bool clijobs_write(int fd, const char *data, size_t length) {
+    while (length>0) {
+        ssize_t n=write(fd, data, length);
+        if (n<0 && errno==EINTR) continue;
+        if (n<=0) return false;
+        data+=n; length-=(size_t) n;
+    }
+    return true;
+}
+
+/** Starts a job in a child process, which sends its output back through a pipe and exits with its status */
+static bool clijobs_start(clijobqueue *q, int i, clijobprocess *proc) {
+    int fds[2];
+    if (pipe(fds)!=0) return false;
+    
+    fflush(stdout);
+    fflush(stderr);
+    
+    pid_t pid=fork();
+    if (pid<0) {
+        close(fds[0]);
+        close(fds[1]);
+        return false;
+    }
+    
+    if (pid==0) {
+        close(fds[0]);
+        clijob *job=&q->jobs.data[i];
+        clijobs_runjob(job, q->opt);
+        bool sent=clijobs_write(fds[1], job->output.data, job->output.count);
+        _exit(sent ? job->status : 1); // The parent's exit handlers don't belong to the job
+    }
+    
+    close(fds[1]);
+    proc->job=i;
+    proc->pid=pid;
+    proc->fd=fds[0];
+    proc->start=clijobs_now();
+    q->jobs.data[i].jsonl=(q->opt & CLI_JSONL);
+    return true;
+}
+
+/** Reads output that a job has sent
+ *  @returns false once the job has closed its end of the pipe */
+static bool clijobs_read(clijobqueue *q, clijobprocess *proc) {
+    char buffer[CLIJOBS_BUFFERSIZE];
+    ssize_t n;
+    do n=read(proc->fd, buffer, sizeof(buffer));
+    while (n<0 && errno==EINTR);
+    
+    if (n<=0) return false;
+    varray_charadd(&q->jobs.data[proc->job].output, buffer, (int) n);
+    return true;
+}
+
+/** Collects a job's status once it has finished and writes its output in one piece */
+static void clijobs_finish(clijobqueue *q, clijobprocess *proc) {
+    clijob *job=&q->jobs.data[proc->job];
+    close(proc->fd);
+    
+    int wstatus=0;
+    while (waitpid(proc->pid, &wstatus, 0)<0 && errno==EINTR);
+    job->time=clijobs_now()-proc->start;
+    
+    if (WIFEXITED(wstatus)) job->status=WEXITSTATUS(wstatus);
+    else { // The job couldn't record its own result
+        char msg[CLIJOBS_BUFFERSIZE];
+        snprintf(msg, sizeof(msg), "Job '%s' ended by signal %i.", job->file, (WIFSIGNALED(wstatus) ? WTERMSIG(wstatus) : 0));
+        job->status=(WIFSIGNALED(wstatus) ? 128+WTERMSIG(wstatus) : 1);
+        clijobs_message(job, msg);
+        clijobs_result(job);
+    }
+    
+    fwrite(job->output.data, sizeof(char), job->output.count, stdout);
+    fflush(stdout);
+}
+
+/** Runs every job, keeping up to nworkers child processes busy */
+static void clijobs_runall(clijobqueue *q, int nworkers) {
+    clijobprocess procs[nworkers];
+    struct pollfd fds[nworkers];
+    int nactive=0, next=0;
+    
+    while (next<q->jobs.count || nactive>0) {
+        while (nactive<nworkers && next<q->jobs.count) {
+            if (clijobs_start(q, next, &procs[nactive])) nactive++;
+            else {
+                clijob *job=&q->jobs.data[next];
+                char msg[CLIJOBS_BUFFERSIZE];
+                snprintf(msg, sizeof(msg), "Could not start a process for '%s': %s", job->file, strerror(errno));
+                job->jsonl=(q->opt & CLI_JSONL);
+                clijobs_message(job, msg);
+                clijobs_result(job);
+                fwrite(job->output.data, sizeof(char), job->output.count, stdout);
+            }
+            next++;
+        }
+        if (nactive==0) continue;
+        
+        for (int i=0; i<nactive; i++) {
+            fds[i].fd=procs[i].fd;
+            fds[i].events=POLLIN;
+            fds[i].revents=0;
+        }
+        if (poll(fds, nactive, -1)<0) continue; // Interrupted by a signal
+        
+        /* Go backwards so that a finished job may be replaced by the last one */
+        for (int i=nactive-1; i>=0; i--) {
+            if (fds[i].revents && !clijobs_read(q, &procs[i])) {
+                clijobs_finish(q, &procs[i]);
+                procs[i]=procs[--nactive];
+            }
+        }
+    }
+    fflush(stdout);
+}
+
+/* **********************************************************************
+ * Interface
+ * ********************************************************************** */
+
+/** Writes the per job summary to stderr */
+static void clijobs_summary(clijobqueue *q, double time) {
+    int nfailed=0;
+    
+    fprintf(stderr, "%-40s %-8s %10s\n", "Job", "Status", "Time (s)");
+    for (unsigned int i=0; i<q->jobs.count; i++) {
+        clijob *job=&q->jobs.data[i];
+        if (job->status) nfailed++;
+        fprintf(stderr, "%-40s %-8s %10.3f\n", job->file, (job->status ? "failed" : "ok"), job->time);
+    }
+    fprintf(stderr, "%u jobs, %i failed, %.3f s wall time\n", q->jobs.count, nfailed, time);
+}
+
+/** @brief Runs a batch of scripts concurrently
+ *  @param[in] nfiles - number of arguments
+ *  @param[in] files - scripts to run; an argument of the form @file names a manifest of scripts
+ *  @param[in] opt - options
+ *  @param[in] nworkers - number of jobs to run at once, or 0 to choose automatically
+ *  @param[in] nthreads - number of threads each vm may use, as set by -w
+ *  @returns exit status: 0 if every job succeeded, 1 otherwise */
+int clijobs_run(int nfiles, const char *files[], clioptions opt, int nworkers, int nthreads) {
+    clijobqueue q;
+    varray_clijobinit(&q.jobs);
+    q.opt=opt;
+    
+    bool success=true;
+    for (int i=0; i<nfiles; i++) {
+        if (files[i][0]==CLIJOBS_MANIFESTPREFIX) success&=clijobs_addmanifest(&q, files[i]+1);
+        else success&=clijobs_add(&q, files[i], strlen(files[i]));
+    }
+    
+    /* By default share the cores among the workers, allowing for the threads each vm uses */
+    if (nworkers<=0) {
+        long ncores=sysconf(_SC_NPROCESSORS_ONLN);
+        nworkers=(int) (ncores>0 ? ncores : 1)/(nthreads>0 ? nthreads : 1);
+    }
+    if (nworkers<1) nworkers=1;
+    if (nworkers>q.jobs.count) nworkers=q.jobs.count;
+    
+    double start=clijobs_now();
+    
+    if (q.jobs.count>0) clijobs_runall(&q, nworkers);
+    
+    if (!(opt & CLI_JSONL)) clijobs_summary(&q, clijobs_now()-start); // Each job's record includes its result
+    
+    for (unsigned int i=0; i<q.jobs.count; i++) {
+        if (q.jobs.data[i].status) success=false;
+        MORPHO_FREE(q.jobs.data[i].file);
+        varray_charclear(&q.jobs.data[i].output);
+    }
+    varray_clijobclear(&q.jobs);
+    
+    return (success ? 0 : 1);
+}
@@ -0,0 +1,17 @@
+/** @file jobs.h
+ *  @author T J Atherton
+ *
+ *  @brief Runs many scripts concurrently across a pool of worker processes
+*/
+
+#ifndef jobs_h
+#define jobs_h
+
+#include "cli.h"
+
+#define CLIJOBS_BATCH "batch"
+#define CLIJOBS_MANIFESTPREFIX '@' // An argument @file names a manifest listing one script per line
+
+int clijobs_run(int nfiles, const char *files[], clioptions opt, int nworkers, int nthreads);
+
+#endif /* jobs_h */
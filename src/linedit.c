@@ -64,6 +64,10 @@ linedit_terminaltype linedit_checksupport(void) {
  * Switch to/from raw mode
  * ---------------------------------------- */
 
+/** Control sequences to switch bracketed paste mode on and off */
+#define LINEDIT_ENABLEPASTE  "\033[?2004h"
+#define LINEDIT_DISABLEPASTE "\033[?2004l"
+
 /** Holds the original terminal state */
 struct termios terminit;
 
@@ -100,44 +104,22 @@ void linedit_enablerawmode(void) {
     termraw.c_cc[VMIN] = 1; termraw.c_cc[VTIME] = 0; /* 1 byte, no timer */
     
     tcsetattr(STDIN_FILENO, TCSAFLUSH, &termraw);
+    
+    /* Ask the terminal to bracket pasted text so that it can be inserted in one go */
+    write(STDOUT_FILENO, LINEDIT_ENABLEPASTE, strlen(LINEDIT_ENABLEPASTE));
 }
 
 /** @brief Restore terminal state to normal */
 void linedit_disablerawmode(void) {
+    write(STDOUT_FILENO, LINEDIT_DISABLEPASTE, strlen(LINEDIT_DISABLEPASTE));
     tcsetattr(STDIN_FILENO, TCSAFLUSH, &terminit);
     printf("\r"); /** Print a carriage return to ensure we're back on the left hand side */
 }
 
 /* ----------------------------------------
- * Get cursor position and width
+ * Get terminal width
  * ---------------------------------------- */
 
-#define LINEDIT_CURSORPOSN_BUFFERSIZE 128
-/** @brief Gets the cursor position */
-bool linedit_getcursorposition(int *x, int *y) {
-    char answer[LINEDIT_CURSORPOSN_BUFFERSIZE];
-    int i=0, row=0, col=0;
-
-    /* Report cursor location */
-    if (write(STDOUT_FILENO, "\x1b[6n", 4) != 4) return false;
-
-    /* Read the response: ESC [ rows ; cols R */
-    while (i < sizeof(answer)-1) {
-        if (read(STDIN_FILENO,answer+i,1) != 1) break;
-        if (answer[i] == 'R') break; // Response is 'R' terminated
-        i++;
-    }
-    answer[i] = '\0'; // Terminal response is not null-terminated by default
-
-    /* Parse response */
-    if (answer[0] != 27 || answer[1] != '[') return false;
-    if (sscanf(answer+2,"%d;%d",&row,&col) != 2) return false;
-    
-    if (y) *y = row; // Return result
-    if (x) *x = col;
-    return true;
-}
-
 /** @brief Gets the terminal width */
 void linedit_getterminalwidth(lineditor *edit) {
     struct winsize ws;
@@ -168,91 +150,255 @@ bool linedit_keypressavailable(void) {
 }
 
 /* ----------------------------------------
- * Output
+ * Input buffer
  * ---------------------------------------- */
 
-/** @brief Writes a string to the terminal */
-bool linedit_write(char *string) {
-    size_t length=strlen(string);
-    if (write(STDOUT_FILENO, string, length)==-1) {
-        fprintf(stderr, "Error writing to terminal.\n");
-        return false;
+/** @brief Initializes an input buffer */
+void linedit_inputinit(linedit_inputbuffer *in) {
+    in->length=0;
+    in->posn=0;
+}
+
+/** @brief Checks whether the input buffer holds undecoded bytes */
+bool linedit_inputbuffered(linedit_inputbuffer *in) {
+    return (in->posn<in->length);
+}
+
+/** @brief Refills the input buffer with whatever the terminal has available, blocking until at least one byte arrives */
+bool linedit_inputfill(linedit_inputbuffer *in) {
+    ssize_t n;
+    do {
+        n=read(STDIN_FILENO, in->data, LINEDIT_INPUTBUFFERSIZE);
+    } while (n<0 && errno==EINTR);
+    if (n<=0) return false;
+    
+    in->length=(size_t) n;
+    in->posn=0;
+    return true;
+}
+
+/** @brief Returns a byte to the input buffer, e.g. a keypress that arrived while waiting for something else */
+void linedit_inputpush(linedit_inputbuffer *in, char c) {
+    if (in->length>=LINEDIT_INPUTBUFFERSIZE && in->posn>0) { // Compact the buffer
+        memmove(in->data, in->data+in->posn, in->length-in->posn);
+        in->length-=in->posn;
+        in->posn=0;
     }
+    if (in->length<LINEDIT_INPUTBUFFERSIZE) in->data[in->length++]=c;
+}
+
+/** @brief Reads a single byte of input from the terminal */
+bool linedit_readbyte(lineditor *edit, char *c) {
+    linedit_inputbuffer *in=&edit->input;
+    if (!linedit_inputbuffered(in) && !linedit_inputfill(in)) return false;
+    *c=in->data[in->posn++];
     return true;
 }
 
-/** @brief Writes a character to the terminal */
-bool linedit_writechar(char c) {
-    if (write(STDOUT_FILENO, &c, 1)==-1) {
-        fprintf(stderr, "Error writing to terminal.\n");
-        return false;
+/** @brief Detect if further input is available from the buffer or the terminal; non-blocking */
+bool linedit_inputavailable(lineditor *edit) {
+    return linedit_inputbuffered(&edit->input) || linedit_keypressavailable();
+}
+
+/* ----------------------------------------
+ * Output buffer
+ * ---------------------------------------- */
+
+void linedit_stringinit(linedit_string *string);
+void linedit_stringclear(linedit_string *string);
+void linedit_stringappend(linedit_string *string, char *c, size_t nbytes);
+bool linedit_stringresize(linedit_string *string, size_t size);
+
+/** Size of each segment of the output buffer */
+#define LINEDIT_OUTPUTSEGMENTSIZE 16384
+
+/** Maximum number of segments to send with a single call to writev */
+#ifdef IOV_MAX
+#define LINEDIT_MAXIOV IOV_MAX
+#else
+#define LINEDIT_MAXIOV 16
+#endif
+
+/** Initializes an output buffer */
+void linedit_outputinit(linedit_outputbuffer *out) {
+    out->nsegments=0;
+    out->capacity=0;
+    out->segments=NULL;
+}
+
+/** Frees an output buffer */
+void linedit_outputclear(linedit_outputbuffer *out) {
+    for (int i=0; i<out->capacity; i++) linedit_stringclear(&out->segments[i]);
+    free(out->segments);
+    linedit_outputinit(out);
+}
+
+/** Adds a new segment to an output buffer
+ *  @returns the new segment, or NULL on allocation failure */
+linedit_string *linedit_outputaddsegment(linedit_outputbuffer *out) {
+    if (out->nsegments>=out->capacity) {
+        int newcapacity=(out->capacity ? 2*out->capacity : 1);
+        linedit_string *new=realloc(out->segments, newcapacity*sizeof(linedit_string));
+        if (!new) return NULL;
+        for (int i=out->capacity; i<newcapacity; i++) linedit_stringinit(&new[i]);
+        out->segments=new;
+        out->capacity=newcapacity;
+    }
+    
+    linedit_string *seg=&out->segments[out->nsegments];
+    if (!seg->string && !linedit_stringresize(seg, LINEDIT_OUTPUTSEGMENTSIZE)) return NULL;
+    
+    out->nsegments++;
+    return seg;
+}
+
+/** Appends bytes to an output buffer, spilling into new segments as necessary */
+bool linedit_outputwrite(linedit_outputbuffer *out, char *string, size_t length) {
+    while (length>0) {
+        linedit_string *seg=(out->nsegments ? &out->segments[out->nsegments-1] : NULL);
+        if (!seg || seg->length+1>=seg->capacity) seg=linedit_outputaddsegment(out);
+        if (!seg) return false;
+        
+        size_t n=seg->capacity-seg->length-1; // Bytes that fit in this segment
+        if (n>length) n=length;
+        linedit_stringappend(seg, string, n);
+        string+=n; length-=n;
     }
     return true;
 }
 
+/** Counts the number of bytes pending in an output buffer */
+size_t linedit_outputlength(linedit_outputbuffer *out) {
+    size_t length=0;
+    for (int i=0; i<out->nsegments; i++) length+=out->segments[i].length;
+    return length;
+}
+
+/** @brief Sends any pending output to the terminal
+ *  @details A frame held in a single segment is sent with one write; larger frames are
+ *           gathered with writev. Segments are retained for reuse by the next frame. */
+bool linedit_flush(lineditor *edit) {
+    linedit_outputbuffer *out=&edit->output;
+    bool success=true;
+    
+    for (int i=0; i<out->nsegments && success; ) {
+        struct iovec iov[LINEDIT_MAXIOV];
+        int n=0;
+        for (; n<LINEDIT_MAXIOV && i+n<out->nsegments; n++) {
+            iov[n].iov_base=out->segments[i+n].string;
+            iov[n].iov_len=out->segments[i+n].length;
+        }
+        
+        /* Send the segments, taking care of partial and interrupted writes */
+        for (int k=0; k<n && success; ) {
+            ssize_t nbytes=(n-k==1 ? write(STDOUT_FILENO, iov[k].iov_base, iov[k].iov_len) : writev(STDOUT_FILENO, iov+k, n-k));
+            if (nbytes<0 && errno==EINTR) continue; // Interrupted by a signal before anything was sent
+            if (nbytes<0) {
+                fprintf(stderr, "Error writing to terminal.\n");
+                success=false;
+                break;
+            }
+            while (k<n && (size_t) nbytes>=iov[k].iov_len) { nbytes-=iov[k].iov_len; iov[k].iov_len=0; k++; }
+            if (k<n) {
+                iov[k].iov_base=((char *) iov[k].iov_base)+nbytes;
+                iov[k].iov_len-=nbytes;
+            }
+        }
+        i+=n;
+    }
+    
+    /* Reset the segments */
+    for (int i=0; i<out->nsegments; i++) {
+        out->segments[i].length=0;
+        out->segments[i].string[0]='\0';
+    }
+    out->nsegments=0;
+    
+    return success;
+}
+
+/* ----------------------------------------
+ * Output
+ * ---------------------------------------- */
+
+/** @brief Writes a string to the output buffer */
+bool linedit_writebytes(lineditor *edit, char *string, size_t length) {
+    return linedit_outputwrite(&edit->output, string, length);
+}
+
+/** @brief Writes a string to the output buffer */
+bool linedit_write(lineditor *edit, char *string) {
+    return linedit_writebytes(edit, string, strlen(string));
+}
+
+/** @brief Writes a character to the output buffer */
+bool linedit_writechar(lineditor *edit, char c) {
+    return linedit_writebytes(edit, &c, 1);
+}
+
 /** @brief Erases the current line */
-bool linedit_eraseline(void) {
-    return linedit_write("\033[2K");
+bool linedit_eraseline(lineditor *edit) {
+    return linedit_write(edit, "\033[2K");
 }
 
 /** @brief Erases the rest of the current line */
-bool linedit_erasetoendofline(void) {
-    return linedit_write("\033[0K");
+bool linedit_erasetoendofline(lineditor *edit) {
+    return linedit_write(edit, "\033[0K");
 }
 
 /** @brief Moves the cursor to the start of the line */
-bool linedit_home(void) {
-    return linedit_write("\r");
+bool linedit_home(lineditor *edit) {
+    return linedit_write(edit, "\r");
 }
 
 /** @brief Sets default text */
-bool linedit_defaulttext(void) {
-    return linedit_write("\033[0m");
+bool linedit_defaulttext(lineditor *edit) {
+    return linedit_write(edit, "\033[0m");
 }
 
 /** @brief Line feed */
-bool linedit_linefeed(void) {
-    return linedit_write("\n");
+bool linedit_linefeed(lineditor *edit) {
+    return linedit_write(edit, "\n");
 }
 
 /** @brief Moves the cursor to the specified position */
-bool linedit_movetocolumn(int posn) {
+bool linedit_movetocolumn(lineditor *edit, int posn) {
     char code[LINEDIT_CODESTRINGSIZE];
     if (posn>0) {
         snprintf(code, LINEDIT_CODESTRINGSIZE, "\r\033[%iC", posn);
-        return linedit_write(code);
+        return linedit_write(edit, code);
     }
     return true;
 }
 
 /** @brief Moves the cursor up by n lines */
-bool linedit_moveup(int n) {
+bool linedit_moveup(lineditor *edit, int n) {
     char code[LINEDIT_CODESTRINGSIZE];
     if (n>0) {
         snprintf(code, LINEDIT_CODESTRINGSIZE, "\033[%iA", n);
-        return linedit_write(code);
+        return linedit_write(edit, code);
     }
     return true;
 }
 
 /** @brief Moves the cursor down by n lines */
- bool linedit_movedown(int n) {
+bool linedit_movedown(lineditor *edit, int n) {
     char code[LINEDIT_CODESTRINGSIZE];
     if (n>0) {
         snprintf(code, LINEDIT_CODESTRINGSIZE, "\033[%iB", n);
-        return linedit_write(code);
+        return linedit_write(edit, code);
     }
-     return true;
+    return true;
 }
 
 /** @brief Hides the cursor */
-bool linedit_hidecursor(void) {
-    return linedit_write("\033[?25l");
+bool linedit_hidecursor(lineditor *edit) {
+    return linedit_write(edit, "\033[?25l");
 }
 
 /** @brief Shows the cursor */
-bool linedit_showcursor(void) {
-    return linedit_write("\033[?25h");
+bool linedit_showcursor(lineditor *edit) {
+    return linedit_write(edit, "\033[?25h");
 }
 
 /* **********************************************************************
@@ -332,6 +478,7 @@ void linedit_graphemeclear(linedit_graphemedictionary *dict) {
     for (int i=0; i<dict->capacity; i++) {
         if (dict->contents[i].grapheme) free(dict->contents[i].grapheme);
     }
+    free(dict->contents);
     linedit_graphemeinit(dict);
 }
 
@@ -363,12 +510,17 @@ bool linedit_graphemeresize(linedit_graphemedictionary *dict, int size) {
     dict->contents=new;
     dict->count=0;
     
+    bool success=true;
     if (old) { // Copy old contents across
         for (unsigned int i=0; i<osize; i++) {
-            if (old[i].grapheme) if (!linedit_graphemeinsert(dict, old[i].grapheme, strlen(old[i].grapheme), old[i].width)) return false;
+            if (old[i].grapheme) {
+                if (success) success=linedit_graphemeinsert(dict, old[i].grapheme, strlen(old[i].grapheme), old[i].width);
+                free(old[i].grapheme);
+            }
         }
+        free(old);
     }
-    return true;
+    return success;
 }
 
 bool linedit_graphemefind(linedit_graphemedictionary *dict, char *grapheme, size_t length, int *posn) {
@@ -384,7 +536,8 @@ bool linedit_graphemefind(linedit_graphemedictionary *dict, char *grapheme, size
             return false;
         }
         
-        if (strncmp(grapheme, dict->contents[i].grapheme, length)==0) { // Found
+        if (strncmp(grapheme, dict->contents[i].grapheme, length)==0 &&
+            dict->contents[i].grapheme[length]=='\0') { // Found
             if (posn) *posn = i;
             return true;
         }
@@ -435,7 +588,7 @@ void linedit_graphemeshow(linedit_graphemedictionary *dict) {
 }
 
 /* ----------------------------------------
- * Grapheme display width
+ * Grapheme length
  * ---------------------------------------- */
 
 /** @brief Identifies the length of the next grapheme */
@@ -445,67 +598,704 @@ size_t linedit_graphemelength(lineditor *edit, char *str, char *end) {
     return (size_t) linedit_utf8numberofbytes(str); // Fallback on displaying unicode chars one by one
 }
 
+/* ----------------------------------------
+ * Width tables
+ * ---------------------------------------- */
+
+/** A range of unicode code points */
+typedef struct {
+    uint32_t first;
+    uint32_t last;
+} linedit_coderange;
+
+/** Code points with East Asian Width W or F, which includes those with emoji presentation.
+ *  Generated from the Unicode 14.0 character database, merging across unassigned code points. */
+static const linedit_coderange linedit_widecodepoints[] = {
+    { 0x1100, 0x115F }, { 0x231A, 0x231B }, { 0x2329, 0x232A }, { 0x23E9, 0x23EC },
+    { 0x23F0, 0x23F0 }, { 0x23F3, 0x23F3 }, { 0x25FD, 0x25FE }, { 0x2614, 0x2615 },
+    { 0x2648, 0x2653 }, { 0x267F, 0x267F }, { 0x2693, 0x2693 }, { 0x26A1, 0x26A1 },
+    { 0x26AA, 0x26AB }, { 0x26BD, 0x26BE }, { 0x26C4, 0x26C5 }, { 0x26CE, 0x26CE },
+    { 0x26D4, 0x26D4 }, { 0x26EA, 0x26EA }, { 0x26F2, 0x26F3 }, { 0x26F5, 0x26F5 },
+    { 0x26FA, 0x26FA }, { 0x26FD, 0x26FD }, { 0x2705, 0x2705 }, { 0x270A, 0x270B },
+    { 0x2728, 0x2728 }, { 0x274C, 0x274C }, { 0x274E, 0x274E }, { 0x2753, 0x2755 },
+    { 0x2757, 0x2757 }, { 0x2795, 0x2797 }, { 0x27B0, 0x27B0 }, { 0x27BF, 0x27BF },
+    { 0x2B1B, 0x2B1C }, { 0x2B50, 0x2B50 }, { 0x2B55, 0x2B55 }, { 0x2E80, 0x303E },
+    { 0x3041, 0x3247 }, { 0x3250, 0x4DBF }, { 0x4E00, 0xA4C6 }, { 0xA960, 0xA97C },
+    { 0xAC00, 0xD7A3 }, { 0xF900, 0xFAD9 }, { 0xFE10, 0xFE19 }, { 0xFE30, 0xFE6B },
+    { 0xFF01, 0xFF60 }, { 0xFFE0, 0xFFE6 }, { 0x16FE0, 0x18D08 }, { 0x1AFF0, 0x1B2FB },
+    { 0x1F004, 0x1F004 }, { 0x1F0CF, 0x1F0CF }, { 0x1F18E, 0x1F18E }, { 0x1F191, 0x1F19A },
+    { 0x1F200, 0x1F320 }, { 0x1F32D, 0x1F335 }, { 0x1F337, 0x1F37C }, { 0x1F37E, 0x1F393 },
+    { 0x1F3A0, 0x1F3CA }, { 0x1F3CF, 0x1F3D3 }, { 0x1F3E0, 0x1F3F0 }, { 0x1F3F4, 0x1F3F4 },
+    { 0x1F3F8, 0x1F43E }, { 0x1F440, 0x1F440 }, { 0x1F442, 0x1F4FC }, { 0x1F4FF, 0x1F53D },
+    { 0x1F54B, 0x1F54E }, { 0x1F550, 0x1F567 }, { 0x1F57A, 0x1F57A }, { 0x1F595, 0x1F596 },
+    { 0x1F5A4, 0x1F5A4 }, { 0x1F5FB, 0x1F64F }, { 0x1F680, 0x1F6C5 }, { 0x1F6CC, 0x1F6CC },
+    { 0x1F6D0, 0x1F6D2 }, { 0x1F6D5, 0x1F6DF }, { 0x1F6EB, 0x1F6EC }, { 0x1F6F4, 0x1F6FC },
+    { 0x1F7E0, 0x1F7F0 }, { 0x1F90C, 0x1F93A }, { 0x1F93C, 0x1F945 }, { 0x1F947, 0x1F9FF },
+    { 0x1FA70, 0x1FAF6 }, { 0x20000, 0x3134A },
+};
+
+/** Nonspacing and enclosing marks, and zero width format characters, that combine with a preceding code point */
+static const linedit_coderange linedit_zerowidthcodepoints[] = {
+    { 0x0300, 0x036F }, { 0x0483, 0x0489 }, { 0x0591, 0x05BD }, { 0x05BF, 0x05BF },
+    { 0x05C1, 0x05C2 }, { 0x05C4, 0x05C5 }, { 0x05C7, 0x05C7 }, { 0x0610, 0x061A },
+    { 0x064B, 0x065F }, { 0x0670, 0x0670 }, { 0x06D6, 0x06DC }, { 0x06DF, 0x06E4 },
+    { 0x06E7, 0x06E8 }, { 0x06EA, 0x06ED }, { 0x0711, 0x0711 }, { 0x0730, 0x074A },
+    { 0x07A6, 0x07B0 }, { 0x07EB, 0x07F3 }, { 0x07FD, 0x07FD }, { 0x0816, 0x0819 },
+    { 0x081B, 0x0823 }, { 0x0825, 0x0827 }, { 0x0829, 0x082D }, { 0x0859, 0x085B },
+    { 0x0898, 0x089F }, { 0x08CA, 0x08E1 }, { 0x08E3, 0x0902 }, { 0x093A, 0x093A },
+    { 0x093C, 0x093C }, { 0x0941, 0x0948 }, { 0x094D, 0x094D }, { 0x0951, 0x0957 },
+    { 0x0962, 0x0963 }, { 0x0981, 0x0981 }, { 0x09BC, 0x09BC }, { 0x09C1, 0x09C4 },
+    { 0x09CD, 0x09CD }, { 0x09E2, 0x09E3 }, { 0x09FE, 0x0A02 }, { 0x0A3C, 0x0A3C },
+    { 0x0A41, 0x0A51 }, { 0x0A70, 0x0A71 }, { 0x0A75, 0x0A75 }, { 0x0A81, 0x0A82 },
+    { 0x0ABC, 0x0ABC }, { 0x0AC1, 0x0AC8 }, { 0x0ACD, 0x0ACD }, { 0x0AE2, 0x0AE3 },
+    { 0x0AFA, 0x0B01 }, { 0x0B3C, 0x0B3C }, { 0x0B3F, 0x0B3F }, { 0x0B41, 0x0B44 },
+    { 0x0B4D, 0x0B56 }, { 0x0B62, 0x0B63 }, { 0x0B82, 0x0B82 }, { 0x0BC0, 0x0BC0 },
+    { 0x0BCD, 0x0BCD }, { 0x0C00, 0x0C00 }, { 0x0C04, 0x0C04 }, { 0x0C3C, 0x0C3C },
+    { 0x0C3E, 0x0C40 }, { 0x0C46, 0x0C56 }, { 0x0C62, 0x0C63 }, { 0x0C81, 0x0C81 },
+    { 0x0CBC, 0x0CBC }, { 0x0CBF, 0x0CBF }, { 0x0CC6, 0x0CC6 }, { 0x0CCC, 0x0CCD },
+    { 0x0CE2, 0x0CE3 }, { 0x0D00, 0x0D01 }, { 0x0D3B, 0x0D3C }, { 0x0D41, 0x0D44 },
+    { 0x0D4D, 0x0D4D }, { 0x0D62, 0x0D63 }, { 0x0D81, 0x0D81 }, { 0x0DCA, 0x0DCA },
+    { 0x0DD2, 0x0DD6 }, { 0x0E31, 0x0E31 }, { 0x0E34, 0x0E3A }, { 0x0E47, 0x0E4E },
+    { 0x0EB1, 0x0EB1 }, { 0x0EB4, 0x0EBC }, { 0x0EC8, 0x0ECD }, { 0x0F18, 0x0F19 },
+    { 0x0F35, 0x0F35 }, { 0x0F37, 0x0F37 }, { 0x0F39, 0x0F39 }, { 0x0F71, 0x0F7E },
+    { 0x0F80, 0x0F84 }, { 0x0F86, 0x0F87 }, { 0x0F8D, 0x0FBC }, { 0x0FC6, 0x0FC6 },
+    { 0x102D, 0x1030 }, { 0x1032, 0x1037 }, { 0x1039, 0x103A }, { 0x103D, 0x103E },
+    { 0x1058, 0x1059 }, { 0x105E, 0x1060 }, { 0x1071, 0x1074 }, { 0x1082, 0x1082 },
+    { 0x1085, 0x1086 }, { 0x108D, 0x108D }, { 0x109D, 0x109D }, { 0x135D, 0x135F },
+    { 0x1712, 0x1714 }, { 0x1732, 0x1733 }, { 0x1752, 0x1753 }, { 0x1772, 0x1773 },
+    { 0x17B4, 0x17B5 }, { 0x17B7, 0x17BD }, { 0x17C6, 0x17C6 }, { 0x17C9, 0x17D3 },
+    { 0x17DD, 0x17DD }, { 0x180B, 0x180D }, { 0x180F, 0x180F }, { 0x1885, 0x1886 },
+    { 0x18A9, 0x18A9 }, { 0x1920, 0x1922 }, { 0x1927, 0x1928 }, { 0x1932, 0x1932 },
+    { 0x1939, 0x193B }, { 0x1A17, 0x1A18 }, { 0x1A1B, 0x1A1B }, { 0x1A56, 0x1A56 },
+    { 0x1A58, 0x1A60 }, { 0x1A62, 0x1A62 }, { 0x1A65, 0x1A6C }, { 0x1A73, 0x1A7F },
+    { 0x1AB0, 0x1B03 }, { 0x1B34, 0x1B34 }, { 0x1B36, 0x1B3A }, { 0x1B3C, 0x1B3C },
+    { 0x1B42, 0x1B42 }, { 0x1B6B, 0x1B73 }, { 0x1B80, 0x1B81 }, { 0x1BA2, 0x1BA5 },
+    { 0x1BA8, 0x1BA9 }, { 0x1BAB, 0x1BAD }, { 0x1BE6, 0x1BE6 }, { 0x1BE8, 0x1BE9 },
+    { 0x1BED, 0x1BED }, { 0x1BEF, 0x1BF1 }, { 0x1C2C, 0x1C33 }, { 0x1C36, 0x1C37 },
+    { 0x1CD0, 0x1CD2 }, { 0x1CD4, 0x1CE0 }, { 0x1CE2, 0x1CE8 }, { 0x1CED, 0x1CED },
+    { 0x1CF4, 0x1CF4 }, { 0x1CF8, 0x1CF9 }, { 0x1DC0, 0x1DFF }, { 0x200B, 0x200D },
+    { 0x2060, 0x2060 }, { 0x20D0, 0x20F0 }, { 0x2CEF, 0x2CF1 }, { 0x2D7F, 0x2D7F },
+    { 0x2DE0, 0x2DFF }, { 0x302A, 0x302D }, { 0x3099, 0x309A }, { 0xA66F, 0xA672 },
+    { 0xA674, 0xA67D }, { 0xA69E, 0xA69F }, { 0xA6F0, 0xA6F1 }, { 0xA802, 0xA802 },
+    { 0xA806, 0xA806 }, { 0xA80B, 0xA80B }, { 0xA825, 0xA826 }, { 0xA82C, 0xA82C },
+    { 0xA8C4, 0xA8C5 }, { 0xA8E0, 0xA8F1 }, { 0xA8FF, 0xA8FF }, { 0xA926, 0xA92D },
+    { 0xA947, 0xA951 }, { 0xA980, 0xA982 }, { 0xA9B3, 0xA9B3 }, { 0xA9B6, 0xA9B9 },
+    { 0xA9BC, 0xA9BD }, { 0xA9E5, 0xA9E5 }, { 0xAA29, 0xAA2E }, { 0xAA31, 0xAA32 },
+    { 0xAA35, 0xAA36 }, { 0xAA43, 0xAA43 }, { 0xAA4C, 0xAA4C }, { 0xAA7C, 0xAA7C },
+    { 0xAAB0, 0xAAB0 }, { 0xAAB2, 0xAAB4 }, { 0xAAB7, 0xAAB8 }, { 0xAABE, 0xAABF },
+    { 0xAAC1, 0xAAC1 }, { 0xAAEC, 0xAAED }, { 0xAAF6, 0xAAF6 }, { 0xABE5, 0xABE5 },
+    { 0xABE8, 0xABE8 }, { 0xABED, 0xABED }, { 0xFB1E, 0xFB1E }, { 0xFE00, 0xFE0F },
+    { 0xFE20, 0xFE2F }, { 0xFEFF, 0xFEFF }, { 0x101FD, 0x101FD }, { 0x102E0, 0x102E0 },
+    { 0x10376, 0x1037A }, { 0x10A01, 0x10A0F }, { 0x10A38, 0x10A3F }, { 0x10AE5, 0x10AE6 },
+    { 0x10D24, 0x10D27 }, { 0x10EAB, 0x10EAC }, { 0x10F46, 0x10F50 }, { 0x10F82, 0x10F85 },
+    { 0x11001, 0x11001 }, { 0x11038, 0x11046 }, { 0x11070, 0x11070 }, { 0x11073, 0x11074 },
+    { 0x1107F, 0x11081 }, { 0x110B3, 0x110B6 }, { 0x110B9, 0x110BA }, { 0x110C2, 0x110C2 },
+    { 0x11100, 0x11102 }, { 0x11127, 0x1112B }, { 0x1112D, 0x11134 }, { 0x11173, 0x11173 },
+    { 0x11180, 0x11181 }, { 0x111B6, 0x111BE }, { 0x111C9, 0x111CC }, { 0x111CF, 0x111CF },
+    { 0x1122F, 0x11231 }, { 0x11234, 0x11234 }, { 0x11236, 0x11237 }, { 0x1123E, 0x1123E },
+    { 0x112DF, 0x112DF }, { 0x112E3, 0x112EA }, { 0x11300, 0x11301 }, { 0x1133B, 0x1133C },
+    { 0x11340, 0x11340 }, { 0x11366, 0x11374 }, { 0x11438, 0x1143F }, { 0x11442, 0x11444 },
+    { 0x11446, 0x11446 }, { 0x1145E, 0x1145E }, { 0x114B3, 0x114B8 }, { 0x114BA, 0x114BA },
+    { 0x114BF, 0x114C0 }, { 0x114C2, 0x114C3 }, { 0x115B2, 0x115B5 }, { 0x115BC, 0x115BD },
+    { 0x115BF, 0x115C0 }, { 0x115DC, 0x115DD }, { 0x11633, 0x1163A }, { 0x1163D, 0x1163D },
+    { 0x1163F, 0x11640 }, { 0x116AB, 0x116AB }, { 0x116AD, 0x116AD }, { 0x116B0, 0x116B5 },
+    { 0x116B7, 0x116B7 }, { 0x1171D, 0x1171F }, { 0x11722, 0x11725 }, { 0x11727, 0x1172B },
+    { 0x1182F, 0x11837 }, { 0x11839, 0x1183A }, { 0x1193B, 0x1193C }, { 0x1193E, 0x1193E },
+    { 0x11943, 0x11943 }, { 0x119D4, 0x119DB }, { 0x119E0, 0x119E0 }, { 0x11A01, 0x11A0A },
+    { 0x11A33, 0x11A38 }, { 0x11A3B, 0x11A3E }, { 0x11A47, 0x11A47 }, { 0x11A51, 0x11A56 },
+    { 0x11A59, 0x11A5B }, { 0x11A8A, 0x11A96 }, { 0x11A98, 0x11A99 }, { 0x11C30, 0x11C3D },
+    { 0x11C3F, 0x11C3F }, { 0x11C92, 0x11CA7 }, { 0x11CAA, 0x11CB0 }, { 0x11CB2, 0x11CB3 },
+    { 0x11CB5, 0x11CB6 }, { 0x11D31, 0x11D45 }, { 0x11D47, 0x11D47 }, { 0x11D90, 0x11D91 },
+    { 0x11D95, 0x11D95 }, { 0x11D97, 0x11D97 }, { 0x11EF3, 0x11EF4 }, { 0x16AF0, 0x16AF4 },
+    { 0x16B30, 0x16B36 }, { 0x16F4F, 0x16F4F }, { 0x16F8F, 0x16F92 }, { 0x16FE4, 0x16FE4 },
+    { 0x1BC9D, 0x1BC9E }, { 0x1CF00, 0x1CF46 }, { 0x1D167, 0x1D169 }, { 0x1D17B, 0x1D182 },
+    { 0x1D185, 0x1D18B }, { 0x1D1AA, 0x1D1AD }, { 0x1D242, 0x1D244 }, { 0x1DA00, 0x1DA36 },
+    { 0x1DA3B, 0x1DA6C }, { 0x1DA75, 0x1DA75 }, { 0x1DA84, 0x1DA84 }, { 0x1DA9B, 0x1DAAF },
+    { 0x1E000, 0x1E02A }, { 0x1E130, 0x1E136 }, { 0x1E2AE, 0x1E2AE }, { 0x1E2EC, 0x1E2EF },
+    { 0x1E8D0, 0x1E8D6 }, { 0x1E944, 0x1E94A }, { 0xE0100, 0xE01EF },
+};
+
+#define LINEDIT_NRANGES(x) (sizeof(x)/sizeof(linedit_coderange))
+
+#define LINEDIT_ZWJ                 0x200D
+#define LINEDIT_TEXTPRESENTATION    0xFE0E
+#define LINEDIT_EMOJIPRESENTATION   0xFE0F
+#define LINEDIT_REGIONALFIRST       0x1F1E6
+#define LINEDIT_REGIONALLAST        0x1F1FF
+
+/** @brief Checks whether a code point lies in a sorted table of ranges */
+bool linedit_inrange(const linedit_coderange *table, int n, uint32_t cp) {
+    int l=0, r=n-1;
+    if (cp<table[0].first || cp>table[n-1].last) return false;
+    
+    while (l<=r) {
+        int mid=(l+r)/2;
+        if (cp<table[mid].first) r=mid-1;
+        else if (cp>table[mid].last) l=mid+1;
+        else return true;
+    }
+    return false;
+}
+
+/** @brief Estimates the display width of a grapheme from the unicode width tables
+ *  @returns true if the width could be determined, false if the terminal must be consulted */
+bool linedit_graphemeestimatewidth(char *grapheme, size_t length, int *width) {
+    uint32_t base=(uint32_t) linedit_utf8toint(grapheme);
+    if (linedit_inrange(linedit_zerowidthcodepoints, LINEDIT_NRANGES(linedit_zerowidthcodepoints), base)) return false;
+    
+    int w=(linedit_inrange(linedit_widecodepoints, LINEDIT_NRANGES(linedit_widecodepoints), base) ? 2 : 1);
+    bool regional=(base>=LINEDIT_REGIONALFIRST && base<=LINEDIT_REGIONALLAST);
+    
+    int nbytes=linedit_utf8numberofbytes(grapheme);
+    for (char *c=grapheme+nbytes; nbytes && c<grapheme+length; c+=nbytes) {
+        nbytes=linedit_utf8numberofbytes(c);
+        uint32_t cp=(uint32_t) linedit_utf8toint(c);
+        
+        if (cp==LINEDIT_EMOJIPRESENTATION) w=2;
+        else if (cp==LINEDIT_ZWJ) return false; // Terminals differ in how they show joined sequences
+        else if (regional && cp>=LINEDIT_REGIONALFIRST && cp<=LINEDIT_REGIONALLAST) w=2; // Flags
+        else if (cp==LINEDIT_TEXTPRESENTATION ||
+                 linedit_inrange(linedit_zerowidthcodepoints, LINEDIT_NRANGES(linedit_zerowidthcodepoints), cp)) continue;
+        else if (!linedit_inrange(linedit_widecodepoints, LINEDIT_NRANGES(linedit_widecodepoints), cp)) return false; // e.g. Emoji modifiers are wide
+    }
+    
+    if (!nbytes) return false; // Corrupted
+    *width=w;
+    return true;
+}
+
+/* ----------------------------------------
+ * Process-wide width cache
+ * ---------------------------------------- */
+
+/** Widths measured from the terminal, shared by all line editors */
+linedit_graphemedictionary linedit_graphemewidths = { .count=0, .capacity=0, .contents=NULL };
+
+/** Set when a width has been measured since the cache was loaded */
+bool linedit_graphemewidthsmodified=false;
+
+/** Frees the widths shared by all line editors */
+void linedit_freegraphemewidths(void) {
+    linedit_graphemeclear(&linedit_graphemewidths);
+    linedit_graphemewidthsmodified=false;
+}
+
+#define LINEDIT_GRAPHEMEFILEHEADER "linedit grapheme widths"
+#define LINEDIT_GRAPHEMELINESIZE 256
+
+/** @brief Loads previously measured grapheme widths from a file
+ *  @param[in] path - file to load from
+ *  @returns true on success
+ *  @details Widths are only used if they were measured with the same TERM */
+bool linedit_loadgraphemewidths(const char *path) {
+    FILE *f=fopen(path, "r");
+    if (!f) return false;
+    
+    char line[LINEDIT_GRAPHEMELINESIZE], header[LINEDIT_GRAPHEMELINESIZE];
+    char *term=getenv("TERM");
+    snprintf(header, LINEDIT_GRAPHEMELINESIZE, "%s %s\n", LINEDIT_GRAPHEMEFILEHEADER, (term ? term : ""));
+    
+    bool success=(fgets(line, LINEDIT_GRAPHEMELINESIZE, f) && strcmp(line, header)==0);
+    
+    /* Each line contains a width followed by a tab and the grapheme */
+    while (success && fgets(line, LINEDIT_GRAPHEMELINESIZE, f)) {
+        char *sep=strchr(line, '\t');
+        size_t length;
+        if (!sep || !isdigit(line[0])) continue;
+        length=strlen(sep+1);
+        if (length>0 && sep[length]=='\n') length--;
+        if (length>0) success=linedit_graphemeinsert(&linedit_graphemewidths, sep+1, length, atoi(line));
+    }
+    
+    fclose(f);
+    return success;
+}
+
+/** @brief Saves measured grapheme widths to a file, if any new ones have been measured
+ *  @param[in] path - file to write
+ *  @returns true on success */
+bool linedit_savegraphemewidths(const char *path) {
+    if (!linedit_graphemewidthsmodified) return true;
+    
+    FILE *f=fopen(path, "w");
+    if (!f) return false;
+    
+    char *term=getenv("TERM");
+    fprintf(f, "%s %s\n", LINEDIT_GRAPHEMEFILEHEADER, (term ? term : ""));
+    
+    linedit_graphemedictionary *dict=&linedit_graphemewidths;
+    for (int i=0; i<dict->capacity; i++) {
+        if (dict->contents[i].grapheme) fprintf(f, "%i\t%s\n", dict->contents[i].width, dict->contents[i].grapheme);
+    }
+    
+    bool success=(fclose(f)==0);
+    if (success) linedit_graphemewidthsmodified=false;
+    return success;
+}
+
+/* ----------------------------------------
+ * Grapheme display width
+ * ---------------------------------------- */
+
 /** @brief Returns the display with of a grapheme sequence if known */
 bool linedit_graphemedisplaywidth(lineditor *edit, char *grapheme, size_t length, int *width) {
     if (length==1) {
         if (iscntrl(*grapheme)) return 0;
-        return 1;
+        *width=1;
+        return true;
     }
     
-    return linedit_graphemelookup(&edit->graphemedict, grapheme, length, width);
+    /* Measurements take precedence as they reflect what the terminal actually does */
+    if (linedit_graphemelookup(&linedit_graphemewidths, grapheme, length, width)) return true;
+    
+    return linedit_graphemeestimatewidth(grapheme, length, width);
+}
+
+/* ----------------------------------------
+ * Measure grapheme widths
+ * ---------------------------------------- */
+
+linedit_string *linedit_newstring(char *string);
+int linedit_stringlistcount(linedit_stringlist *list);
+void linedit_stringlistclear(linedit_stringlist *list);
+
+/** Maximum time to wait for the terminal to answer a batch of cursor position requests */
+#define LINEDIT_PROBETIMEOUT 250 // ms
+
+/** Cursor position request and the start of its reply */
+#define LINEDIT_CURSORREQUEST "\033[6n"
+#define LINEDIT_CURSORREPORTSIZE 32
+
+/** Cleared if the terminal fails to answer cursor position requests, so that we stop asking */
+bool linedit_terminalreports=true;
+
+/** @brief Checks whether a partial terminal reply could still become a cursor position report ESC [ row ; col R */
+bool linedit_ispartialreport(char *seq, int n) {
+    if (n>=1 && seq[0]!='\033') return false;
+    if (n>=2 && seq[1]!='[') return false;
+    bool semicolon=false;
+    for (int i=2; i<n; i++) {
+        if (seq[i]==';' && !semicolon && i>2) semicolon=true;
+        else if (!isdigit(seq[i])) return false;
+    }
+    return true;
 }
 
-/** @brief Renders a grapheme sequence, measuring its display width */
-bool linedit_graphememeasurewidth(lineditor *edit, char *grapheme, size_t length, int *width) {
-    int x0=0, x1=0, w=0;
-    linedit_getcursorposition(&x0, NULL);
-    write(STDOUT_FILENO, grapheme, length);
-    linedit_getcursorposition(&x1, NULL);
-    w=(x1>x0 ? x1-x0 : 1);
-    *width = w;
-    return linedit_graphemeinsert(&edit->graphemedict, grapheme, length, w);
+/** @brief Reads replies to cursor position requests
+ *  @param[in] edit - the line editor
+ *  @param[in] n - number of replies expected
+ *  @param[out] cols - columns reported
+ *  @returns the number of replies read before the timeout
+ *  @details Any other input that arrives meanwhile is kept in the input buffer */
+int linedit_readcursorreports(lineditor *edit, int n, int *cols) {
+    char seq[LINEDIT_CURSORREPORTSIZE];
+    int nseq=0, nreports=0;
+    
+    struct timespec now, deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec+=LINEDIT_PROBETIMEOUT/1000;
+    deadline.tv_nsec+=(LINEDIT_PROBETIMEOUT%1000)*1000000L;
+    if (deadline.tv_nsec>=1000000000L) { deadline.tv_sec++; deadline.tv_nsec-=1000000000L; }
+    
+    while (nreports<n) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long remaining=(deadline.tv_sec-now.tv_sec)*1000000L+(deadline.tv_nsec-now.tv_nsec)/1000L;
+        if (remaining<=0) break;
+        
+        fd_set readfds;
+        FD_ZERO(&readfds);
+        FD_SET(STDIN_FILENO, &readfds);
+        struct timeval timeout={ .tv_sec=remaining/1000000L, .tv_usec=remaining%1000000L };
+        
+        int ret=select(STDIN_FILENO+1, &readfds, NULL, NULL, &timeout);
+        if (ret<0 && errno==EINTR) continue;
+        if (ret<=0) break;
+        
+        char data[LINEDIT_INPUTBUFFERSIZE];
+        ssize_t nread=read(STDIN_FILENO, data, LINEDIT_INPUTBUFFERSIZE);
+        if (nread<=0) break;
+        
+        for (ssize_t i=0; i<nread; i++) {
+            char c=data[i];
+            if (nseq==0 && c!='\033') { linedit_inputpush(&edit->input, c); continue; }
+            
+            if (c=='R' && nseq>2 && linedit_ispartialreport(seq, nseq)) { // Complete report
+                seq[nseq]='\0';
+                char *sep=strchr(seq, ';');
+                if (sep && nreports<n) cols[nreports++]=atoi(sep+1);
+                nseq=0;
+                continue;
+            }
+            
+            if (nseq<LINEDIT_CURSORREPORTSIZE-1) seq[nseq++]=c;
+            if (!linedit_ispartialreport(seq, nseq)) { // Not a report after all, so treat as input
+                for (int k=0; k<nseq; k++) linedit_inputpush(&edit->input, seq[k]);
+                nseq=0;
+            }
+        }
+    }
+    
+    for (int k=0; k<nseq; k++) linedit_inputpush(&edit->input, seq[k]);
+    return nreports;
+}
+
+/** @brief Queues a grapheme to be measured once the frame is laid out */
+void linedit_queuemeasurement(lineditor *edit, char *grapheme, size_t length) {
+    for (linedit_string *s=edit->unmeasured.first; s; s=s->next) {
+        if (s->length==length && strncmp(s->string, grapheme, length)==0) return;
+    }
+    
+    linedit_string *new=linedit_newstring("");
+    if (!new) return;
+    linedit_stringappend(new, grapheme, length);
+    new->next=edit->unmeasured.first;
+    edit->unmeasured.first=new;
+}
+
+/** @brief Measures the display width of all queued graphemes at once
+ *  @details Each grapheme is shown at the start of the current row and followed by a cursor position request;
+ *           the whole batch is sent with a single write and the replies read together */
+void linedit_measuregraphemes(lineditor *edit) {
+    int n=linedit_stringlistcount(&edit->unmeasured);
+    if (!n) return;
+    
+    int *cols=malloc(sizeof(int)*n);
+    if (cols) {
+        for (linedit_string *s=edit->unmeasured.first; s; s=s->next) {
+            linedit_home(edit);
+            linedit_writebytes(edit, s->string, s->length);
+            linedit_write(edit, LINEDIT_CURSORREQUEST);
+        }
+        linedit_flush(edit);
+        
+        int nreports=linedit_readcursorreports(edit, n, cols);
+        if (nreports<n) linedit_terminalreports=false; // Don't stall again on a terminal that won't answer
+        
+        int i=0;
+        for (linedit_string *s=edit->unmeasured.first; s && i<nreports; s=s->next, i++) {
+            int w=(cols[i]>1 ? cols[i]-1 : 1);
+            linedit_graphemeinsert(&linedit_graphemewidths, s->string, s->length, w);
+            linedit_graphemewidthsmodified=true;
+        }
+        free(cols);
+    }
+    
+    linedit_stringlistclear(&edit->unmeasured);
+    
+    /* The probes disturbed the current row, so the screen must be redrawn in full */
+    linedit_home(edit);
+    edit->col=0;
+    edit->screenvalid=false;
 }
 
 /* **********************************************************************
  * Rendering
  * ********************************************************************** */
 
-/** @brief Renders a string, showing only characters in columns l...r */
-void linedit_renderstring(lineditor *edit, char *string, size_t length, int l, int r) {
-    int i=0;
+/* ----------------------------------------
+ * Screen model
+ * ---------------------------------------- */
+
+#define LINEDIT_ATTRCOLORMASK   0x0f
+#define LINEDIT_ATTRBOLD        (1<<4)
+#define LINEDIT_ATTRUNDERLINE   (1<<5)
+#define LINEDIT_ATTRREVERSE     (1<<6)
+#define LINEDIT_DEFAULTATTR     ((linedit_attributes) LINEDIT_DEFAULTCOLOR)
+#define LINEDIT_UNKNOWNATTR     ((linedit_attributes) -1)
+
+#define LINEDIT_MINIMUMROWSIZE  8
+
+/** Initializes a screen */
+void linedit_screeninit(linedit_screen *screen) {
+    screen->nrows=0;
+    screen->capacity=0;
+    screen->rows=NULL;
+    screen->cursorrow=0;
+    screen->cursorcol=0;
+}
+
+/** Frees a screen */
+void linedit_screenclear(linedit_screen *screen) {
+    for (int i=0; i<screen->capacity; i++) {
+        linedit_stringclear(&screen->rows[i].text);
+        free(screen->rows[i].cells);
+    }
+    free(screen->rows);
+    linedit_screeninit(screen);
+}
+
+/** Empties a screen, retaining allocated memory for reuse */
+void linedit_screenreset(linedit_screen *screen) {
+    screen->nrows=0;
+    screen->cursorrow=0;
+    screen->cursorcol=0;
+}
+
+/** Adds a new empty row to a screen */
+linedit_screenrow *linedit_screenaddrow(linedit_screen *screen) {
+    if (screen->nrows>=screen->capacity) {
+        int newcapacity=(screen->capacity ? 2*screen->capacity : LINEDIT_MINIMUMROWSIZE);
+        linedit_screenrow *new=realloc(screen->rows, newcapacity*sizeof(linedit_screenrow));
+        if (!new) return NULL;
+        for (int i=screen->capacity; i<newcapacity; i++) {
+            linedit_stringinit(&new[i].text);
+            new[i].ncells=0;
+            new[i].capacity=0;
+            new[i].cells=NULL;
+            new[i].width=0;
+        }
+        screen->rows=new;
+        screen->capacity=newcapacity;
+    }
+    
+    linedit_screenrow *row=&screen->rows[screen->nrows];
+    row->text.length=0;
+    row->ncells=0;
+    row->width=0;
+    screen->nrows++;
+    return row;
+}
+
+/** Adds a cell to a row */
+bool linedit_screenaddcell(linedit_screenrow *row, char *grapheme, size_t length, int width, linedit_attributes attr) {
+    if (row->ncells>=row->capacity) {
+        int newcapacity=(row->capacity ? 2*row->capacity : LINEDIT_MINIMUMROWSIZE);
+        linedit_cell *new=realloc(row->cells, newcapacity*sizeof(linedit_cell));
+        if (!new) return false;
+        row->cells=new;
+        row->capacity=newcapacity;
+    }
+    
+    linedit_cell *cell=&row->cells[row->ncells];
+    cell->offset=row->text.length;
+    cell->length=length;
+    cell->width=width;
+    cell->attr=attr;
+    linedit_stringappend(&row->text, grapheme, length);
+    row->ncells++;
+    row->width+=width;
+    return true;
+}
+
+/** Compares two cells */
+bool linedit_cellcmp(linedit_screenrow *a, int i, linedit_screenrow *b, int j) {
+    linedit_cell *ca=&a->cells[i], *cb=&b->cells[j];
+    return (ca->width==cb->width && ca->attr==cb->attr && ca->length==cb->length &&
+            memcmp(a->text.string+ca->offset, b->text.string+cb->offset, ca->length)==0);
+}
+
+/** Updates display attributes from the parameters of an SGR control sequence */
+linedit_attributes linedit_parsesgr(char *seq, char *end, linedit_attributes attr) {
+    int param=0;
+    for (char *c=seq; c<=end; c++) {
+        if (isdigit(*c)) {
+            param=10*param+(*c-'0');
+            continue;
+        }
+        switch (param) {
+            case 0: attr=LINEDIT_DEFAULTATTR; break;
+            case 1: attr|=LINEDIT_ATTRBOLD; break;
+            case 4: attr|=LINEDIT_ATTRUNDERLINE; break;
+            case 7: attr|=LINEDIT_ATTRREVERSE; break;
+            case 22: attr&=~LINEDIT_ATTRBOLD; break;
+            case 24: attr&=~LINEDIT_ATTRUNDERLINE; break;
+            case 27: attr&=~LINEDIT_ATTRREVERSE; break;
+            case 39: attr=(attr & ~LINEDIT_ATTRCOLORMASK) | LINEDIT_DEFAULTCOLOR; break;
+            default:
+                if (param>=30 && param<38) attr=(attr & ~LINEDIT_ATTRCOLORMASK) | (param-30);
+                break;
+        }
+        param=0;
+    }
+    return attr;
+}
+
+/** Writes a control sequence to switch the terminal to given display attributes */
+void linedit_setattributes(lineditor *edit, linedit_attributes attr) {
+    if (edit->attr==attr) return;
+    
+    char code[LINEDIT_CODESTRINGSIZE];
+    int n=snprintf(code, LINEDIT_CODESTRINGSIZE, "\033[0");
+    linedit_color col=(attr & LINEDIT_ATTRCOLORMASK);
+    if (col!=LINEDIT_DEFAULTCOLOR) n+=snprintf(code+n, LINEDIT_CODESTRINGSIZE-n, ";%i", 30+col);
+    if (attr & LINEDIT_ATTRBOLD) n+=snprintf(code+n, LINEDIT_CODESTRINGSIZE-n, ";1");
+    if (attr & LINEDIT_ATTRUNDERLINE) n+=snprintf(code+n, LINEDIT_CODESTRINGSIZE-n, ";4");
+    if (attr & LINEDIT_ATTRREVERSE) n+=snprintf(code+n, LINEDIT_CODESTRINGSIZE-n, ";7");
+    snprintf(code+n, LINEDIT_CODESTRINGSIZE-n, "m");
+    
+    linedit_write(edit, code);
+    edit->attr=attr;
+}
+
+/** Moves the terminal cursor to a given row and column of the screen, scrolling new rows into view as needed */
+void linedit_movecursor(lineditor *edit, int row, int col) {
+    if (row<edit->row) {
+        linedit_moveup(edit, edit->row-row);
+    } else if (row>edit->row) {
+        int existing=(row<edit->height ? row : edit->height-1);
+        linedit_movedown(edit, existing-edit->row);
+        for (int i=existing; i<row; i++) linedit_linefeed(edit); // Line feeds scroll if necessary
+        if (row>=edit->height) edit->height=row+1;
+    }
+    edit->row=row;
+    
+    if (col!=edit->col) {
+        if (col>0) linedit_movetocolumn(edit, col); // Includes a carriage return
+        else linedit_home(edit);
+        edit->col=col;
+    }
+}
+
+/** @brief Records the cursor position in the next frame */
+void linedit_setframecursor(linedit_screen *frame) {
+    frame->cursorrow=frame->nrows-1;
+    frame->cursorcol=frame->rows[frame->nrows-1].width;
+}
+
+/** @brief Lays out a string as cells appended to the next frame
+ *  @param[in] edit   the line editor
+ *  @param[in] string string to render, containing text and SGR control sequences
+ *  @param[in] length length of string in bytes
+ *  @param[in] attr   display attributes in effect; updated on exit
+ *  @param[in] nchars if non-NULL, counts characters so the cursor can be placed at edit->posn
+ *  @returns true on success */
+bool linedit_renderstring(lineditor *edit, char *string, size_t length, linedit_attributes *attr, int *nchars) {
+    linedit_screen *frame=&edit->frame;
+    linedit_screenrow *row=&frame->rows[frame->nrows-1];
     size_t len=0;
     
-    for (char *s=string; *s!='\0'; s+=len) {
+    for (char *s=string; s<string+length && *s!='\0'; s+=len) {
         len = linedit_graphemelength(edit, s, string+length);
         if (!len) break;
         
-        if (*s=='\r') { // Reset on a carriage return
-            if (write(STDOUT_FILENO, "\r" , 1)==-1) return;
-            i=0;
-        } else if (*s=='\n') { // Clear to end of line and return
-            if (!linedit_write("\x1b[K\n\r")) return;
-            if (write(STDOUT_FILENO, edit->cprompt.string, edit->cprompt.length)==-1) return;
-            i=0;
-        } else if (*s=='\t') {
-            if (!linedit_write(" ")) return;
-            i+=1;
+        if (*s=='\033') { // A terminal control sequence; only display attributes are retained
+            char *ctl=s; // First identify its length
+            while (!isalpha(*ctl) && *ctl!='\0') ctl++;
+            if (*ctl=='m' && s[1]=='[') *attr=linedit_parsesgr(s+2, ctl, *attr);
+            len=(*ctl=='\0' ? (size_t) (ctl-s) : (size_t) (ctl-s+1));
+            continue;
+        }
+        
+        bool atcursor=(nchars && *nchars==edit->posn);
+        if (nchars) {
+            size_t count=1;
+            linedit_utf8count(s, len, &count);
+            *nchars+=(int) count;
+        }
+        
+        if (*s=='\n') { // Start a new row showing the continuation prompt
+            if (atcursor) linedit_setframecursor(frame);
+            if (!linedit_screenaddrow(frame)) return false;
+            linedit_attributes pattr=LINEDIT_DEFAULTATTR;
+            if (!linedit_renderstring(edit, edit->cprompt.string, edit->cprompt.length, &pattr, NULL)) return false;
+            row=&frame->rows[frame->nrows-1];
+            continue;
+        }
+        
+        char *g=s;
+        size_t glen=len;
+        int width=1;
+        if (*s=='\t') { // Tabs are shown as a space
+            g=" "; glen=1;
         } else if (iscntrl(*s)) {
-            if (*s=='\033') { // A terminal control character
-                char *ctl=s; // First identify its length
-                while (!isalpha(*ctl) && *ctl!='\0') ctl++;
-                if (write(STDOUT_FILENO, s, ctl-s+1)==-1) return; // print it
-                s=ctl;
-            }
-        } else { // Otherwise show printable characters that lie within the window
-            int width=1;
-            if (!linedit_graphemedisplaywidth(edit, s, len, &width)) {
-                linedit_graphememeasurewidth(edit, s, len, &width);
-            } else if (i>=l && i<r) {
-                if (write(STDOUT_FILENO, s, len)==-1) return;
+            continue;
+        } else if (!linedit_graphemedisplaywidth(edit, s, len, &width)) {
+            width=1; // Provisional; the frame is laid out again once the width is measured
+            if (linedit_terminalreports) linedit_queuemeasurement(edit, s, len);
+        }
+        
+        if (row->width+width>edit->ncols && row->ncells>0) { // Rows that are too long wrap over
+            if (!linedit_screenaddrow(frame)) return false;
+            row=&frame->rows[frame->nrows-1];
+        }
+        
+        if (atcursor) linedit_setframecursor(frame);
+        if (!linedit_screenaddcell(row, g, glen, width, *attr)) return false;
+    }
+    
+    return true;
+}
+
+/** @brief Changes the number of rows of terminal in use, erasing garbage if necessary */
+void linedit_changeheight(lineditor *edit, int oldheight, int newheight) {
+    for (int i=newheight; i<oldheight; i++) { // Erase rows that are no longer used
+        linedit_movecursor(edit, i, edit->col);
+        linedit_eraseline(edit);
+    }
+}
+
+/** @brief Displays the next frame, sending only the differences from what is on the screen */
+void linedit_present(lineditor *edit) {
+    linedit_screen *old=&edit->screen, *new=&edit->frame;
+    bool hidden=false;
+    
+    for (int i=0; i<new->nrows; i++) {
+        linedit_screenrow *nrow=&new->rows[i];
+        linedit_screenrow *orow=(edit->screenvalid && i<old->nrows ? &old->rows[i] : NULL);
+        
+        /* Find the first cell that differs */
+        int k=0, col=0;
+        if (orow) {
+            while (k<nrow->ncells && k<orow->ncells && linedit_cellcmp(nrow, k, orow, k)) {
+                col+=nrow->cells[k].width;
+                k++;
             }
-            i+=1;
+            if (k==nrow->ncells && k==orow->ncells) continue; // Row is unchanged
         }
+        
+        if (!hidden) { linedit_hidecursor(edit); hidden=true; }
+        linedit_movecursor(edit, i, col);
+        
+        /* Write the changed cells */
+        for (int j=k; j<nrow->ncells; j++) {
+            linedit_cell *cell=&nrow->cells[j];
+            linedit_setattributes(edit, cell->attr);
+            linedit_writebytes(edit, nrow->text.string+cell->offset, cell->length);
+            edit->col+=cell->width;
+        }
+        
+        /* Erase anything left over from the previous frame */
+        if ((!orow || orow->width>nrow->width) && nrow->width<edit->ncols) {
+            linedit_setattributes(edit, LINEDIT_DEFAULTATTR);
+            linedit_erasetoendofline(edit);
+        }
+        
+        if (edit->col>=edit->ncols) { // Avoid relying on the terminal's behavior at the right margin
+            linedit_home(edit);
+            edit->col=0;
+        }
+    }
+    
+    linedit_setattributes(edit, LINEDIT_DEFAULTATTR);
+    
+    int oldheight=(edit->screenvalid ? old->nrows : edit->height);
+    if (new->nrows<oldheight) {
+        if (!hidden) { linedit_hidecursor(edit); hidden=true; }
+        linedit_changeheight(edit, oldheight, new->nrows);
     }
+    
+    linedit_movecursor(edit, new->cursorrow, new->cursorcol);
+    if (hidden) linedit_showcursor(edit);
+    
+    linedit_flush(edit); // Send the whole frame at once
+    
+    /* The frame now reflects the screen */
+    linedit_screen swap=edit->screen;
+    edit->screen=edit->frame;
+    edit->frame=swap;
+    linedit_screenreset(&edit->frame);
+    edit->screenvalid=true;
+}
+
+/** @brief Prepares to draw frames starting from the current line of the terminal */
+void linedit_startscreen(lineditor *edit) {
+    linedit_screenreset(&edit->screen);
+    linedit_screenreset(&edit->frame);
+    edit->screenvalid=false;
+    edit->height=1;
+    edit->row=0;
+    edit->col=-1; // Column is unknown
+    edit->attr=LINEDIT_UNKNOWNATTR;
 }
 
 /* **********************************************************************
@@ -514,18 +1304,298 @@ void linedit_renderstring(lineditor *edit, char *string, size_t length, int l, i
 
 #define linedit_MINIMUMSTRINGSIZE  8
 
+/* ----------------------------------------
+ * Position index
+ * ---------------------------------------- */
+
+#define LINEDIT_INDEXSTRIDE 64
+
+/** Returns a checkpoint at the start of a string */
+static linedit_checkpoint linedit_checkpointstart(void) {
+    linedit_checkpoint start = { .posn = 0, .offset = 0, .line = 0, .col = 0 };
+    return start;
+}
+
+/** Discards the contents of an index */
+static void linedit_indexreset(linedit_stringindex *index) {
+    index->count=0;
+    index->end=linedit_checkpointstart();
+    index->nrows=0;
+}
+
+/** Enables or disables the position index of a string */
+void linedit_stringsetindexed(linedit_string *string, bool indexed) {
+    if (indexed && !string->index) {
+        string->index=malloc(sizeof(linedit_stringindex));
+        if (!string->index) return;
+        string->index->checkpoints=NULL;
+        string->index->capacity=0;
+        string->index->rows=NULL;
+        string->index->rowcapacity=0;
+        string->index->ncols=0;
+        string->index->nwidths=0;
+        linedit_indexreset(string->index);
+    } else if (!indexed && string->index) {
+        free(string->index->checkpoints);
+        free(string->index->rows);
+        free(string->index);
+        string->index=NULL;
+    }
+}
+
+/** Adds a checkpoint to an index */
+static bool linedit_indexadd(linedit_stringindex *index, linedit_checkpoint *c) {
+    if (index->count>=index->capacity) {
+        int capacity=(index->capacity ? 2*index->capacity : LINEDIT_INDEXSTRIDE);
+        linedit_checkpoint *new=realloc(index->checkpoints, capacity*sizeof(linedit_checkpoint));
+        if (!new) return false;
+        index->checkpoints=new;
+        index->capacity=capacity;
+    }
+    index->checkpoints[index->count++]=*c;
+    return true;
+}
+
+/** Advances a position by one character */
+static bool linedit_indexstep(linedit_string *string, linedit_checkpoint *c) {
+    char *s=string->string+c->offset;
+    int n=linedit_utf8numberofbytes(s);
+    if (!n) return false; // The string is corrupted 
+    
+    if (*s=='\n') {
+        c->line++; c->col=0;
+    } else c->col++;
+    c->offset+=n;
+    c->posn++;
+    return true;
+}
+
+/** Indexes the string until reaching character posn and passing the end of line */
+static void linedit_indexextend(linedit_string *string, size_t posn, int line) {
+    linedit_stringindex *index=string->index;
+    while (index->end.offset<string->length && (index->end.posn<posn || index->end.line<=line)) {
+        if (index->end.col%LINEDIT_INDEXSTRIDE==0 && !linedit_indexadd(index, &index->end)) return;
+        if (!linedit_indexstep(string, &index->end)) return;
+    }
+}
+
+/** Finds the last checkpoint at or before character posn, or -1 if there is none */
+static int linedit_indexfind(linedit_stringindex *index, size_t posn) {
+    int l=0, r=index->count-1, found=-1;
+    while (l<=r) {
+        int mid=(l+r)/2;
+        if (index->checkpoints[mid].posn<=posn) { found=mid; l=mid+1; } else r=mid-1;
+    }
+    return found;
+}
+
+/** Finds the last checkpoint at or before a line and column, or -1 if there is none; use col=-1 for the end of the line */
+static int linedit_indexfindcoordinates(linedit_stringindex *index, int line, int col) {
+    int l=0, r=index->count-1, found=-1;
+    while (l<=r) {
+        int mid=(l+r)/2;
+        linedit_checkpoint *c=&index->checkpoints[mid];
+        if (c->line<line || (c->line==line && (col<0 || c->col<=col))) { found=mid; l=mid+1; } else r=mid-1;
+    }
+    return found;
+}
+
+/** Locates character posn in an indexed string
+ *  @param[in] string - the string
+ *  @param[in] posn - character position
+ *  @param[out] out - the position, or the end of the string if posn lies beyond it
+ *  @returns true if the position exists */
+static bool linedit_indexlocate(linedit_string *string, size_t posn, linedit_checkpoint *out) {
+    linedit_stringindex *index=string->index;
+    if (posn>=index->end.posn) linedit_indexextend(string, posn, -1);
+    
+    linedit_checkpoint c=index->end;
+    if (posn<index->end.posn) {
+        int i=linedit_indexfind(index, posn);
+        c=(i>=0 ? index->checkpoints[i] : linedit_checkpointstart());
+    }
+    
+    while (c.posn<posn && c.offset<string->length && linedit_indexstep(string, &c));
+    
+    *out=c;
+    return (c.posn==posn);
+}
+
+/** Discards display rows from a line onwards */
+static void linedit_indexinvalidaterows(linedit_stringindex *index, int line) {
+    if (index->nrows>line+1) index->nrows=line+1; // The row on which the line begins is unchanged
+}
+
+/** Discards the index after an edit at a position, to be rebuilt when next needed */
+static void linedit_indextruncate(linedit_stringindex *index, linedit_checkpoint *at) {
+    linedit_indexinvalidaterows(index, at->line);
+    if (index->end.posn<=at->posn) return; // The edit lies beyond what has been indexed
+    
+    int i=linedit_indexfind(index, at->posn);
+    if (i>=0) { // Resume from the checkpoint, which is added again as indexing continues
+        index->end=index->checkpoints[i];
+        index->count=i;
+    } else linedit_indexreset(index);
+}
+
+/** Moves checkpoints after an edit at a position that neither added nor removed lines
+ *  @param[in] index - the index
+ *  @param[in] at - position of the edit
+ *  @param[in] nchars - change in length in characters
+ *  @param[in] nbytes - change in length in bytes */
+static void linedit_indexshift(linedit_stringindex *index, linedit_checkpoint *at, long nchars, long nbytes) {
+    linedit_indexinvalidaterows(index, at->line);
+    
+    int i=linedit_indexfind(index, at->posn)+1;
+    if (nchars<0) { // Remove checkpoints in the deleted text
+        int j=i;
+        while (j<index->count && index->checkpoints[j].posn<=at->posn-nchars) j++;
+        memmove(index->checkpoints+i, index->checkpoints+j, (index->count-j)*sizeof(linedit_checkpoint));
+        index->count-=j-i;
+    }
+    
+    for (; i<index->count; i++) {
+        linedit_checkpoint *c=&index->checkpoints[i];
+        c->posn+=nchars;
+        c->offset+=nbytes;
+        if (c->line==at->line) c->col+=(int) nchars;
+    }
+    
+    index->end.posn+=nchars;
+    index->end.offset+=nbytes;
+    if (index->end.line==at->line) index->end.col+=(int) nchars;
+}
+
+/** Updates the index of a string after characters were inserted
+ *  @param[in] string - the string, after insertion
+ *  @param[in] at - insertion point
+ *  @param[in] c - text inserted
+ *  @param[in] n - number of bytes inserted */
+static void linedit_indexinsert(linedit_string *string, linedit_checkpoint *at, char *c, size_t n) {
+    linedit_stringindex *index=string->index;
+    size_t nchars;
+    
+    if (index->end.posn<=at->posn) { // The edit lies beyond what has been indexed
+        linedit_indexinvalidaterows(index, at->line);
+    } else if (n<=LINEDIT_INDEXSTRIDE && !memchr(c, '\n', n) && linedit_utf8count(c, n, &nchars)) {
+        linedit_indexshift(index, at, (long) nchars, (long) n);
+    } else linedit_indextruncate(index, at);
+}
+
+/** Updates the index of a string before characters are deleted
+ *  @param[in] string - the string, before deletion
+ *  @param[in] at - start of the deleted text
+ *  @param[in] nchars - number of characters to delete
+ *  @param[in] nbytes - number of bytes to delete */
+static void linedit_indexdelete(linedit_string *string, linedit_checkpoint *at, size_t nchars, size_t nbytes) {
+    linedit_stringindex *index=string->index;
+    
+    if (index->end.posn<=at->posn) {
+        linedit_indexinvalidaterows(index, at->line);
+    } else if (index->end.posn>at->posn+nchars && !memchr(string->string+at->offset, '\n', nbytes)) {
+        linedit_indexshift(index, at, -(long) nchars, -(long) nbytes);
+    } else linedit_indextruncate(index, at);
+}
+
+/** Finds display coordinates relative to a position by scanning graphemes, as linedit_stringdisplaycoordinates does
+ *  @param[in] from - position to start from, which must be the start of a line
+ *  @param[in] posn - position to stop at, or -1 to stop after the end of the line */
+static void linedit_indexdisplayscan(lineditor *edit, linedit_string *string, linedit_checkpoint *from, long posn, int *xout, int *yout) {
+    int x=0, y=0;
+    size_t n=from->posn, count;
+    for (size_t i=from->offset; i<string->length; n+=count) {
+        if (posn>=0 && n>=(size_t) posn) break;
+        
+        char *c=string->string+i;
+        size_t len = linedit_graphemelength(edit, c, string->string+string->length);
+        if (!linedit_utf8count(c, len, &count)) break;
+        
+        if (*c=='\n') {
+            x=0; y++;
+            if (posn<0) break;
+        } else {
+            int w=1;
+            linedit_graphemedisplaywidth(edit, c, len, &w);
+            if (x+w>edit->ncols) { // Lines that are too long wrap over
+                x=w; y++;
+            } else x+=w;
+        }
+        
+        i+=len;
+        if (!len) break;
+    }
+    *xout=x;
+    *yout=y;
+}
+
+/** Finds the checkpoint at the start of a line, or NULL if it hasn't been indexed */
+static linedit_checkpoint *linedit_indexlinestart(linedit_stringindex *index, int line) {
+    int i=linedit_indexfindcoordinates(index, line, 0);
+    if (i<0 || index->checkpoints[i].line!=line) return NULL;
+    return &index->checkpoints[i];
+}
+
+/** Finds the display rows on which lines up to a given line begin, reusing rows found previously */
+static bool linedit_indexrows(lineditor *edit, linedit_string *string, int line) {
+    linedit_stringindex *index=string->index;
+    
+    if (index->ncols!=edit->ncols || index->nwidths!=linedit_graphemewidths.count) {
+        index->nrows=0; // Lines wrap differently
+        index->ncols=edit->ncols;
+        index->nwidths=linedit_graphemewidths.count;
+    }
+    
+    if (index->rowcapacity<line+1) {
+        int capacity=(line+1)*2;
+        int *new=realloc(index->rows, capacity*sizeof(int));
+        if (!new) return false;
+        index->rows=new;
+        index->rowcapacity=capacity;
+    }
+    
+    if (!index->nrows) index->rows[index->nrows++]=0;
+    
+    while (index->nrows<=line) {
+        int prev=index->nrows-1, x, height;
+        linedit_checkpoint *start=linedit_indexlinestart(index, prev);
+        if (!start) return false;
+        linedit_indexdisplayscan(edit, string, start, -1, &x, &height);
+        index->rows[index->nrows]=index->rows[prev]+height;
+        index->nrows++;
+    }
+    return true;
+}
+
+/* ----------------------------------------
+ * String operations
+ * ---------------------------------------- */
+
+
 /** Initializes a string, clearing all fields */
 void linedit_stringinit(linedit_string *string) {
     string->capacity=0;
     string->length=0;
     string->next=NULL;
     string->string=NULL;
+    string->index=NULL;
 }
 
-/** Clears a string, deallocating memory if necessary */
+/** Clears a string, deallocating memory if necessary; an indexed string remains indexed */
 void linedit_stringclear(linedit_string *string) {
+    linedit_stringindex *index=string->index;
     if (string->string) free(string->string);
     linedit_stringinit(string);
+    if (index) {
+        linedit_indexreset(index);
+        string->index=index;
+    }
+}
+
+/** Empties a string without deallocating memory */
+void linedit_stringempty(linedit_string *string) {
+    string->length=0;
+    if (string->string) string->string[0]='\0';
+    if (string->index) linedit_indexreset(string->index);
 }
 
 /** @brief Finds the index of character i in a utf8 encoded string.
@@ -534,6 +1604,13 @@ void linedit_stringclear(linedit_string *string) {
  * @param[in] offset - Offset into the string - set to 0 to count from the start of the string
  * @param[out] out - offset in bytes from offset to character i */
 bool linedit_stringutf8index(linedit_string *string, size_t i, size_t offset, size_t *out) {
+    if (string->index && offset==0) {
+        linedit_checkpoint c;
+        if (!linedit_indexlocate(string, i, &c)) return false;
+        *out=c.offset;
+        return true;
+    }
+    
     int advance=0;
     size_t nchars=0;
     
@@ -574,11 +1651,24 @@ void linedit_stringappend(linedit_string *string, char *c, size_t nbytes) {
         if (!linedit_stringresize(string, string->length+nbytes+1)) return;
     }
     
-    strncpy(string->string+string->length, c, nbytes);
+    memcpy(string->string+string->length, c, nbytes); // Pasted text may contain zero bytes
     string->length+=nbytes;
     string->string[string->length]='\0'; /* Keep the string zero-terminated */
 }
 
+/** @brief Finds a sequence of bytes within a block of text that may itself contain zero bytes
+ *  @returns a pointer to the first occurrence, or NULL if there is none */
+char *linedit_findbytes(char *block, size_t length, const char *bytes, size_t nbytes) {
+    if (nbytes==0) return block;
+    for (size_t i=0; i+nbytes<=length; i++) {
+        char *c=memchr(block+i, bytes[0], length-nbytes+1-i);
+        if (!c) break;
+        if (memcmp(c, bytes, nbytes)==0) return c;
+        i=c-block;
+    }
+    return NULL;
+}
+
 /** @brief   Inserts characters at a given position
  *  @param[in] string - string to amend
  *  @param[in] posn - insertion position as a character index
@@ -588,7 +1678,11 @@ void linedit_stringappend(linedit_string *string, char *c, size_t nbytes) {
  *           the new characters are instead appended. */
 void linedit_stringinsert(linedit_string *string, size_t posn, char *c, size_t n) {
     size_t offset;
-    if (!linedit_stringutf8index(string, posn, 0, &offset)) return;
+    linedit_checkpoint at;
+    if (string->index) {
+        if (!linedit_indexlocate(string, posn, &at)) return;
+        offset=at.offset;
+    } else if (!linedit_stringutf8index(string, posn, 0, &offset)) return;
     
     if (offset<string->length) {
         if (string->capacity<=string->length+n) {
@@ -599,6 +1693,7 @@ void linedit_stringinsert(linedit_string *string, size_t posn, char *c, size_t n
         /* Copy in the text to insert */
         memmove(string->string+offset, c, n);
         string->length+=n;
+        if (string->index) linedit_indexinsert(string, &at, string->string+offset, n);
     } else {
         linedit_stringappend(string, c, n);
     }
@@ -614,10 +1709,15 @@ void linedit_stringdelete(linedit_string *string, size_t posn, size_t n) {
     
     if (string->length<n) return;
     
-    if (!linedit_stringutf8index(string, posn, 0, &offset)) return;
+    linedit_checkpoint at;
+    if (string->index) {
+        if (!linedit_indexlocate(string, posn, &at)) return;
+        offset=at.offset;
+    } else if (!linedit_stringutf8index(string, posn, 0, &offset)) return;
     if (!linedit_stringutf8index(string, n, offset, &nbytes)) return;
     
     if (offset<string->length) {
+        if (string->index) linedit_indexdelete(string, &at, n, nbytes);
         if (offset+nbytes<string->length) {
             memmove(string->string+offset, string->string+offset+nbytes, string->length-offset-nbytes+1);
         } else {
@@ -641,6 +1741,12 @@ void linedit_stringaddcstring(linedit_string *string, char *s) {
 
 /** Finds the length of a string in unicode characters */
 int linedit_stringlength(linedit_string *string) {
+    if (string->index) {
+        linedit_checkpoint end;
+        linedit_indexlocate(string, SIZE_MAX, &end);
+        return (int) end.posn;
+    }
+    
     size_t count=0;
     linedit_utf8count(string->string, string->length, &count);
     return (int) count;
@@ -661,6 +1767,20 @@ int linedit_stringdisplaywidth(lineditor *edit, linedit_string *string) {
 
 /** Finds the display coordinates for a given position in a string */
 void linedit_stringdisplaycoordinates(lineditor *edit, linedit_string *string, int posn, int *xout, int *yout) {
+    if (string->index) {
+        linedit_checkpoint at;
+        linedit_indexlocate(string, (posn<0 ? SIZE_MAX : (size_t) posn), &at);
+        
+        linedit_checkpoint *start=(at.col==0 ? &at : linedit_indexlinestart(string->index, at.line));
+        if (start && linedit_indexrows(edit, string, at.line)) {
+            int x, y;
+            linedit_indexdisplayscan(edit, string, start, (long) at.posn, &x, &y);
+            if (xout) *xout = x;
+            if (yout) *yout = string->index->rows[at.line]+y;
+            return;
+        }
+    }
+    
     int x=0, y=0, n=0;
     size_t count;
     for (int i=0; i<string->length; n+=count) {
@@ -693,6 +1813,14 @@ void linedit_stringdisplaycoordinates(lineditor *edit, linedit_string *string, i
  * @param[out] xout - x coordinates corresponding to posn n
  * @param[out] yout - y */
 void linedit_stringcoordinates(linedit_string *string, int posn, int *xout, int *yout) {
+    if (string->index) {
+        linedit_checkpoint at;
+        linedit_indexlocate(string, (posn<0 ? SIZE_MAX : (size_t) posn), &at);
+        if (xout) *xout = at.col;
+        if (yout) *yout = at.line;
+        return;
+    }
+    
     int x=0, y=0, n=0;
     for (int i=0; i<string->length; n++) {
         if (n==posn) break;
@@ -714,8 +1842,19 @@ void linedit_stringcoordinates(linedit_string *string, int posn, int *xout, int
  * @param[in] y - line number
  * @param[out] posn - position corresponding to   */
 void linedit_stringfindposition(linedit_string *string, int x, int y, int *posn) {
-    int xx=0, yy=0, n=0;
-    for (int i=0; i<string->length; n++) {
+    int xx=0, yy=0, n=0, i=0;
+    
+    /* Begin from the nearest checkpoint */
+    if (string->index) {
+        linedit_indexextend(string, 0, y);
+        int k=linedit_indexfindcoordinates(string->index, y, x);
+        if (k>=0) {
+            linedit_checkpoint *c=&string->index->checkpoints[k];
+            xx=c->col; yy=c->line; n=(int) c->posn; i=(int) c->offset;
+        }
+    }
+    
+    for (; i<string->length; n++) {
         if (xx==x && yy==y) break;
         
         char *c = string->string+i;
@@ -837,41 +1976,444 @@ int linedit_stringlistcount(linedit_stringlist *list) {
 }
 
 /* **********************************************************************
- * History list
+ * History
  * ********************************************************************** */
 
-/** Adds an entry to the history list */
-void linedit_historyadd(lineditor *edit, char *string) {
-    linedit_stringlistadd(&edit->history, string);
+#define LINEDIT_HISTORYHEADER "linedit history\n"
+#define LINEDIT_HISTORYMAXSIZE (4*1024*1024) // The history file is compacted once it grows beyond this
+#define LINEDIT_HISTORYKEEPSIZE (LINEDIT_HISTORYMAXSIZE/2) // ...keeping this much of the most recent history
+#define LINEDIT_HISTORYCOPYSIZE 4096
+
+/* ----------------------------------------
+ * History store
+ * ---------------------------------------- */
+
+/** Initializes the history store */
+void linedit_historyinit(linedit_historystore *h) {
+    h->entries=NULL;
+    h->count=h->capacity=0;
+    h->posn=0;
+    linedit_stringinit(&h->pending);
+    h->path=NULL;
+    h->filesize=0;
+    h->loaded=false;
+    h->map=NULL;
+    h->mapsize=0;
+    linedit_stringinit(&h->last);
+    h->buckets=NULL;
+    h->nindexed=0;
+    linedit_stringinit(&h->query);
+}
+
+/** Frees the substring index */
+void linedit_searchindexclear(linedit_historystore *h) {
+    if (h->buckets) {
+        for (int i=0; i<LINEDIT_SEARCHBUCKETS; i++) free(h->buckets[i].entries);
+        free(h->buckets);
+    }
+    h->buckets=NULL;
+    h->nindexed=0;
+}
+
+/** Frees the history store */
+void linedit_historystoreclear(linedit_historystore *h) {
+    for (int i=0; i<h->count; i++) if (h->entries[i].owned) free(h->entries[i].text);
+    free(h->entries);
+    if (h->map) munmap(h->map, h->mapsize);
+    free(h->path);
+    linedit_stringclear(&h->pending);
+    linedit_stringclear(&h->last);
+    linedit_stringclear(&h->query);
+    linedit_searchindexclear(h);
+    linedit_historyinit(h);
+}
+
+/** Ensures the store has room for n more entries */
+bool linedit_historyreserve(linedit_historystore *h, int n) {
+    if (h->count+n<=h->capacity) return true;
+    int capacity=(h->capacity ? h->capacity : 16);
+    while (capacity<h->count+n) capacity*=2;
+    linedit_historyentry *new=realloc(h->entries, capacity*sizeof(linedit_historyentry));
+    if (!new) return false;
+    h->entries=new;
+    h->capacity=capacity;
+    return true;
 }
 
-/** Frees the history list */
-void linedit_historyclear(lineditor *edit) {
-    linedit_stringlistclear(&edit->history);
+/** Checks whether two entries are the same */
+bool linedit_historyequal(linedit_historyentry *a, linedit_historyentry *b) {
+    return (a->hash==b->hash && a->length==b->length && memcmp(a->text, b->text, a->length)==0);
+}
+
+/** Adds an entry to the store, unless it repeats the most recent one */
+void linedit_historystoreadd(linedit_historystore *h, char *string) {
+    linedit_historyentry entry = { .text = string, .length = strlen(string), .owned = true };
+    entry.hash=linedit_hashstring(string, entry.length);
+    if (h->count>0 && linedit_historyequal(&h->entries[h->count-1], &entry)) return;
+    
+    if (!linedit_historyreserve(h, 1)) return;
+    entry.text=malloc(entry.length+1);
+    if (!entry.text) return;
+    memcpy(entry.text, string, entry.length+1);
+    h->entries[h->count++]=entry;
+}
+
+/* ----------------------------------------
+ * History file
+ * ---------------------------------------- */
+
+/** Set of entries used to remove duplicates */
+typedef struct {
+    linedit_historyentry **slots;
+    size_t size;
+} linedit_historyset;
+
+/** Inserts an entry into the set, returning false if it was already present */
+bool linedit_historysetinsert(linedit_historyset *set, linedit_historyentry *entry) {
+    for (size_t i=entry->hash&(set->size-1); ; i=(i+1)&(set->size-1)) {
+        if (!set->slots[i]) { set->slots[i]=entry; return true; }
+        if (linedit_historyequal(set->slots[i], entry)) return false;
+    }
 }
 
-/** Makes a particular history entry current */
-unsigned int linedit_historyselect(lineditor *edit, unsigned int n) {
-    unsigned int m=n;
-    linedit_string *s=linedit_stringlistselect(&edit->history, n, &m);
+/** Rewrites the history file with the most recent entries, which follow the entries from this session */
+void linedit_historycompact(linedit_historystore *h, linedit_historyentry *entries, int n) {
+    size_t keep=0;
+    int first=n;
+    while (first>0 && keep+entries[first-1].length+1<=LINEDIT_HISTORYKEEPSIZE) keep+=entries[--first].length+1;
+    
+    size_t length=strlen(h->path);
+    char tmp[length+5];
+    snprintf(tmp, length+5, "%s.tmp", h->path);
     
-    if (s) {
-        edit->current.length=0;
-        linedit_stringaddcstring(&edit->current, s->string);
+    FILE *f=fopen(tmp, "w");
+    if (!f) return;
+    bool success=(fputs(LINEDIT_HISTORYHEADER, f)>=0);
+    for (int i=first; success && i<n; i++) success=(fwrite(entries[i].text, 1, entries[i].length+1, f)==entries[i].length+1);
+    
+    /* Carry over anything appended since the file was opened, including this session's entries */
+    FILE *old=fopen(h->path, "r");
+    if (old && fseek(old, (long) h->filesize, SEEK_SET)==0) {
+        char buffer[LINEDIT_HISTORYCOPYSIZE];
+        size_t k;
+        while (success && (k=fread(buffer, 1, LINEDIT_HISTORYCOPYSIZE, old))>0) success=(fwrite(buffer, 1, k, f)==k);
     }
+    if (old) fclose(old);
+    success=(fclose(f)==0) && success;
     
-    return m;
+    if (success && rename(tmp, h->path)==0) return;
+    unlink(tmp);
 }
 
-/** Advances the history list */
-void linedit_historyadvance(lineditor *edit, unsigned int n) {
-    edit->history.posn+=n;
-    edit->history.posn=linedit_historyselect(edit, edit->history.posn);
+/** Reads the entries written by earlier sessions, which precede those entered so far in this session.
+ *  Entries refer directly to the mapping of the file, and only the most recent occurrence of each is kept. */
+void linedit_historyload(linedit_historystore *h) {
+    if (h->loaded) return;
+    h->loaded=true;
+    size_t headerlength=strlen(LINEDIT_HISTORYHEADER);
+    if (!h->path || h->filesize<=headerlength) return;
+    
+    int fd=open(h->path, O_RDONLY);
+    if (fd<0) return;
+    
+    /* The file may have been compacted by another session in the meantime */
+    struct stat st;
+    if (fstat(fd, &st)!=0 || (size_t) st.st_size<h->filesize) h->filesize=0;
+    void *map=(h->filesize>headerlength ? mmap(NULL, h->filesize, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED);
+    close(fd);
+    if (map==MAP_FAILED) return;
+    
+    char *start=map, *end=start+h->filesize;
+    if (memcmp(start, LINEDIT_HISTORYHEADER, headerlength)!=0) { munmap(map, h->filesize); return; }
+    h->map=map;
+    h->mapsize=h->filesize;
+    
+    /* Each entry is terminated by a zero byte; an incomplete entry at the end is ignored */
+    int n=0;
+    for (char *c=start+headerlength; c<end && (c=memchr(c, '\0', end-c)); c++) n++;
+    
+    linedit_historyentry *entries=malloc((n ? n : 1)*sizeof(linedit_historyentry));
+    linedit_historyset set = { .size = 1 };
+    while (set.size<2*(size_t) (n+h->count)+1) set.size*=2;
+    set.slots=calloc(set.size, sizeof(linedit_historyentry *));
+    
+    if (entries && set.slots && linedit_historyreserve(h, n)) {
+        int k=0;
+        for (char *c=start+headerlength, *z; c<end && (z=memchr(c, '\0', end-c)); c=z+1) {
+            linedit_historyentry *e=&entries[k++];
+            e->text=c;
+            e->length=(size_t) (z-c);
+            e->hash=linedit_hashstring(c, e->length);
+            e->owned=false;
+        }
+        
+        /* Keep the most recent occurrence of each entry, including those from this session */
+        for (int i=0; i<h->count; i++) linedit_historysetinsert(&set, &h->entries[i]);
+        int nkept=0;
+        for (int i=n-1; i>=0; i--) {
+            if (linedit_historysetinsert(&set, &entries[i])) entries[n-1-nkept++]=entries[i];
+        }
+        
+        /* Place them before the entries from this session */
+        memmove(h->entries+nkept, h->entries, h->count*sizeof(linedit_historyentry));
+        memcpy(h->entries, entries+n-nkept, nkept*sizeof(linedit_historyentry));
+        h->count+=nkept;
+        
+        if (h->filesize>LINEDIT_HISTORYMAXSIZE) linedit_historycompact(h, entries+n-nkept, nkept);
+    }
+    
+    free(set.slots);
+    free(entries);
+    linedit_searchindexclear(h); // Entries have moved
+}
+
+/** Appends a line to the history file */
+void linedit_historyappend(linedit_historystore *h, char *string) {
+    if (!h->path || (h->last.string && strcmp(h->last.string, string)==0)) return;
+    
+    int fd=open(h->path, O_WRONLY | O_APPEND | O_CREAT, 0600);
+    if (fd<0) return;
+    
+    /* Hold a lock from checking for the header until the entry is written, so that two sessions creating
+       the file at once don't both write the header, nor one write an entry ahead of the other's header */
+    bool locked=(flock(fd, LOCK_EX)==0);
+    
+    struct stat st;
+    bool success=true;
+    if (fstat(fd, &st)==0 && st.st_size==0) {
+        success=(write(fd, LINEDIT_HISTORYHEADER, strlen(LINEDIT_HISTORYHEADER))>=0);
+    }
+    
+    /* Each entry is written in one piece, so that entries from concurrent sessions don't interleave */
+    if (success && write(fd, string, strlen(string)+1)>0) {
+        linedit_stringempty(&h->last);
+        linedit_stringaddcstring(&h->last, string);
+    }
+    if (locked) flock(fd, LOCK_UN);
+    close(fd);
+}
+
+/* ----------------------------------------
+ * Substring index
+ * ---------------------------------------- */
+
+/** Finds the bucket for the trigram beginning at c */
+int linedit_searchbucketfor(char *c) {
+    unsigned int h=((unsigned char) c[0]*31u+(unsigned char) c[1])*31u+(unsigned char) c[2];
+    return (int) (h & (LINEDIT_SEARCHBUCKETS-1));
+}
+
+/** Adds the trigrams of entries not yet indexed to the index */
+bool linedit_searchindexupdate(linedit_historystore *h) {
+    if (!h->buckets) {
+        h->buckets=calloc(LINEDIT_SEARCHBUCKETS, sizeof(linedit_searchbucket));
+        if (!h->buckets) return false;
+    }
+    
+    for (; h->nindexed<h->count; h->nindexed++) {
+        linedit_historyentry *e=&h->entries[h->nindexed];
+        for (size_t i=0; i+2<e->length; i++) {
+            linedit_searchbucket *b=&h->buckets[linedit_searchbucketfor(e->text+i)];
+            if (b->count>0 && b->entries[b->count-1]==h->nindexed) continue; // Already listed
+            if (b->count>=b->capacity) {
+                int capacity=(b->capacity ? 2*b->capacity : 8);
+                int *new=realloc(b->entries, capacity*sizeof(int));
+                if (!new) return false;
+                b->entries=new;
+                b->capacity=capacity;
+            }
+            b->entries[b->count++]=h->nindexed;
+        }
+    }
+    return true;
+}
+
+/** Finds the most recent entry in the store before entry before that contains a string, or -1 */
+int linedit_searchstore(linedit_historystore *h, char *query, int before) {
+    size_t length=strlen(query);
+    if (before>h->count) before=h->count;
+    
+    /* Short queries, or a failure to build the index, fall back to checking every entry */
+    if (length<3 || !linedit_searchindexupdate(h)) {
+        for (int i=before-1; i>=0; i--) if (linedit_findbytes(h->entries[i].text, h->entries[i].length, query, length)) return i;
+        return -1;
+    }
+    
+    /* Only entries listed under every trigram of the query can match; check those under the rarest */
+    linedit_searchbucket *b=NULL;
+    for (size_t i=0; i+2<length; i++) {
+        linedit_searchbucket *bb=&h->buckets[linedit_searchbucketfor(query+i)];
+        if (!b || bb->count<b->count) b=bb;
+    }
+    
+    int l=0, r=b->count; // Find the first listed entry at or after before
+    while (l<r) {
+        int mid=(l+r)/2;
+        if (b->entries[mid]<before) l=mid+1; else r=mid;
+    }
+    
+    for (int i=l-1; i>=0; i--) {
+        linedit_historyentry *e=&h->entries[b->entries[i]];
+        if (linedit_findbytes(e->text, e->length, query, length)) return b->entries[i];
+    }
+    return -1;
+}
+
+/* ----------------------------------------
+ * History as seen by the editor
+ * ---------------------------------------- */
+
+/** Returns the number of entries supplied by the history callback */
+int linedit_historyexternalcount(lineditor *edit) {
+    char *text; size_t length;
+    return (edit->historyfn ? (edit->historyfn) (edit->href, UINT_MAX, &text, &length) : 0);
 }
 
-/** Returns the number of entries in the history list */
+/** Returns the number of entries in the history, loading the history file if necessary */
 int linedit_historycount(lineditor *edit) {
-    return linedit_stringlistcount(&edit->history);
+    linedit_historyload(&edit->history);
+    return linedit_historyexternalcount(edit)+edit->history.count;
+}
+
+/** Gets an entry from the history
+ *  @param[in] n - entry to get, counting back from the most recent starting at 1; entries from the
+ *                 history callback, which belong to the current session, come first */
+bool linedit_historyget(lineditor *edit, int n, char **text, size_t *length) {
+    int nexternal=linedit_historyexternalcount(edit);
+    if (n<1) return false;
+    if (n<=nexternal) {
+        (edit->historyfn) (edit->href, (unsigned int) n-1, text, length);
+        return true;
+    }
+    
+    linedit_historystore *h=&edit->history;
+    int i=h->count-1-(n-1-nexternal);
+    if (i<0) return false;
+    *text=h->entries[i].text;
+    *length=h->entries[i].length;
+    return true;
+}
+
+/** Records a line that the user has entered */
+void linedit_historyadd(lineditor *edit, char *string) {
+    if (!edit->historyfn) linedit_historystoreadd(&edit->history, string);
+    linedit_historyappend(&edit->history, string);
+}
+
+/** Frees the history */
+void linedit_historyclear(lineditor *edit) {
+    linedit_historystoreclear(&edit->history);
+}
+
+/** Makes a particular history entry current; entry 0 is the line that was being edited
+ *  @returns the entry actually selected */
+int linedit_historyselect(lineditor *edit, int n) {
+    int count=linedit_historycount(edit);
+    if (n>count) n=count; // Stop at the oldest entry
+    if (n<0) n=0;
+    
+    char *text=NULL;
+    size_t length=0;
+    linedit_stringempty(&edit->current);
+    if (n>0 && linedit_historyget(edit, n, &text, &length)) {
+        linedit_stringappend(&edit->current, text, length);
+    } else if (edit->history.pending.string) {
+        linedit_stringappend(&edit->current, edit->history.pending.string, edit->history.pending.length);
+    }
+    
+    return n;
+}
+
+/** Advances the history list */
+void linedit_historyadvance(lineditor *edit, int n) {
+    edit->history.posn=linedit_historyselect(edit, edit->history.posn+n);
+}
+
+/** Saves the line being edited on entering history or search */
+void linedit_historysavepending(lineditor *edit) {
+    linedit_stringempty(&edit->history.pending);
+    if (edit->current.string) linedit_stringappend(&edit->history.pending, edit->current.string, edit->current.length);
+    edit->history.posn=0;
+}
+
+/** @brief Keeps history in a file, so that it persists between sessions
+ *  @param[in] edit - line editor to configure
+ *  @param[in] path - history file; it is only read when history is first needed
+ *  @returns true on success */
+bool linedit_historyfile(lineditor *edit, const char *path) {
+    linedit_historystore *h=&edit->history;
+    free(h->path);
+    h->path=malloc(strlen(path)+1);
+    if (!h->path) return false;
+    strcpy(h->path, path);
+    
+    /* Only what earlier sessions wrote is read back; this session's entries are already held */
+    struct stat st;
+    h->filesize=(stat(path, &st)==0 ? (size_t) st.st_size : 0);
+    h->loaded=false;
+    return true;
+}
+
+/* ----------------------------------------
+ * Incremental search
+ * ---------------------------------------- */
+
+#define LINEDIT_SEARCHPROMPT "(search)'"
+#define LINEDIT_SEARCHPROMPTEND "': "
+
+/** Finds the most recent entry after entry from that contains the query
+ *  @returns the entry found, counting back from the most recent starting at 1, or -1 */
+int linedit_historysearch(lineditor *edit, int from) {
+    char *query=edit->history.query.string;
+    if (!query) query="";
+    size_t querylength=strlen(query);
+    if (from<1) from=1;
+    
+    /* Entries from the history callback are few, belonging to this session, so check each in turn */
+    int nexternal=linedit_historyexternalcount(edit);
+    for (int n=from; n<=nexternal; n++) {
+        char *text;
+        size_t length;
+        (edit->historyfn) (edit->href, (unsigned int) n-1, &text, &length);
+        
+        if (text && linedit_findbytes(text, length, query, querylength)) return n;
+    }
+    
+    linedit_historystore *h=&edit->history;
+    linedit_historyload(h);
+    int before=h->count-(from-1-nexternal); // Entries are numbered back from the most recent
+    int i=linedit_searchstore(h, query, before);
+    return (i<0 ? -1 : nexternal+h->count-i);
+}
+
+/** Shows a search match, or the line that was being edited if there is none, with the cursor at the match */
+void linedit_searchshow(lineditor *edit, int n) {
+    edit->history.posn=linedit_historyselect(edit, n);
+    
+    char *match=(edit->history.query.string ? strstr(edit->current.string ? edit->current.string : "", edit->history.query.string) : NULL);
+    size_t count=0;
+    if (match) linedit_utf8count(edit->current.string, (size_t) (match-edit->current.string), &count);
+    edit->posn=(match ? (int) count : linedit_stringlength(&edit->current));
+}
+
+/** Searches again after the query changed, or for an older match */
+void linedit_searchupdate(lineditor *edit, int from) {
+    int n=linedit_historysearch(edit, from);
+    if (n>0) linedit_searchshow(edit, n);
+    else if (!edit->history.query.length) linedit_searchshow(edit, 0);
+}
+
+/** Begins an incremental search of the history */
+void linedit_searchbegin(lineditor *edit) {
+    linedit_historysavepending(edit);
+    linedit_stringempty(&edit->history.query);
+}
+
+/** Builds the prompt shown during a search */
+void linedit_searchprompt(lineditor *edit, linedit_string *out) {
+    linedit_stringaddcstring(out, LINEDIT_SEARCHPROMPT);
+    if (edit->history.query.string) linedit_stringaddcstring(out, edit->history.query.string);
+    linedit_stringaddcstring(out, LINEDIT_SEARCHPROMPTEND);
 }
 
 /* **********************************************************************
@@ -1021,16 +2563,21 @@ linedit_color linedit_colorfromtokentype(lineditor *edit, linedit_tokentype type
     return LINEDIT_DEFAULTCOLOR;
 }
 
+/** Calls whichever tokenizer has been provided */
+bool linedit_tokenize(lineditor *edit, char *in, linedit_tokenizerstate *state, linedit_token *tok) {
+    if (edit->color->rtokenizer) return (edit->color->rtokenizer) (in, edit->color->tokref, state, tok);
+    return (edit->color->tokenizer) (in, edit->color->tokref, tok);
+}
+
 /** Print a string with syntax coloring */
 void linedit_syntaxcolorstring(lineditor *edit, linedit_string *in, linedit_string *out) {
-    linedit_tokenizefn tokenizer=edit->color->tokenizer;
+    linedit_tokenizerstate state=0;
     linedit_color col=LINEDIT_DEFAULTCOLOR;
     linedit_token tok;
     unsigned int iter=0;
-    int line=0;
     
     for (char *c=in->string; c!=NULL && *c!='\0';) {
-        bool success = (tokenizer) (c, edit->color->tokref, &tok);
+        bool success = linedit_tokenize(edit, c, &state, &tok);
         /* Get the next token */
         if (success && tok.length>0 && tok.start>=c) {
             size_t padding=tok.start-c;
@@ -1065,6 +2612,184 @@ void linedit_syntaxcolorstring(lineditor *edit, linedit_string *in, linedit_stri
     }
 }
 
+/* ----------------------------------------
+ * Cached token stream
+ * ---------------------------------------- */
+
+#define LINEDIT_MINIMUMLISTSIZE 8
+
+/** Initializes a syntax cache */
+void linedit_syntaxcacheinit(linedit_syntaxcache *cache) {
+    linedit_stringinit(&cache->text);
+    cache->nlines=0;
+    cache->capacity=0;
+    cache->lines=NULL;
+}
+
+/** Frees a cached line */
+void linedit_syntaxlineclear(linedit_syntaxline *line) {
+    free(line->spans);
+    line->spans=NULL;
+    line->nspans=0;
+    line->capacity=0;
+}
+
+/** Frees the contents of a syntax cache */
+void linedit_syntaxcacheclear(linedit_syntaxcache *cache) {
+    for (int i=0; i<cache->nlines; i++) linedit_syntaxlineclear(&cache->lines[i]);
+    free(cache->lines);
+    linedit_stringclear(&cache->text);
+    linedit_syntaxcacheinit(cache);
+}
+
+/** Adds a line to a list of lines, returning a pointer to it */
+linedit_syntaxline *linedit_syntaxaddline(linedit_syntaxline **lines, int *nlines, int *capacity, size_t start, linedit_tokenizerstate state) {
+    if (*nlines>=*capacity) {
+        int newcapacity=(*capacity ? 2*(*capacity) : LINEDIT_MINIMUMLISTSIZE);
+        linedit_syntaxline *new=realloc(*lines, newcapacity*sizeof(linedit_syntaxline));
+        if (!new) return NULL;
+        *lines=new; *capacity=newcapacity;
+    }
+    linedit_syntaxline *line=&(*lines)[*nlines];
+    line->start=start;
+    line->length=0;
+    line->state=state;
+    line->nspans=0;
+    line->capacity=0;
+    line->spans=NULL;
+    (*nlines)++;
+    return line;
+}
+
+/** Adds a span to a line */
+bool linedit_syntaxaddspan(linedit_syntaxline *line, size_t offset, size_t length, linedit_color col) {
+    if (line->nspans>=line->capacity) {
+        int newcapacity=(line->capacity ? 2*line->capacity : LINEDIT_MINIMUMLISTSIZE);
+        linedit_tokenspan *new=realloc(line->spans, newcapacity*sizeof(linedit_tokenspan));
+        if (!new) return false;
+        line->spans=new; line->capacity=newcapacity;
+    }
+    linedit_tokenspan *span=&line->spans[line->nspans];
+    span->offset=offset-line->start;
+    span->length=length;
+    span->col=col;
+    line->nspans++;
+    line->length=offset+length-line->start;
+    return true;
+}
+
+/** Finds the cached line that contains a given byte offset */
+int linedit_syntaxfindline(linedit_syntaxline *lines, int nlines, size_t offset) {
+    int l=0, r=nlines-1;
+    while (l<r) { // Binary search for the last line that starts at or before offset
+        int m=(l+r+1)/2;
+        if (lines[m].start<=offset) l=m; else r=m-1;
+    }
+    return l;
+}
+
+/** @brief Brings the token stream up to date with a string
+ *  @details Lines before the first modification are retained. Tokenizing then resumes from
+ *           the first modified line and continues only until it reaches a line boundary past
+ *           the last modification where the tokenizer state matches the state previously
+ *           recorded there; the remaining lines are reused from the cache. */
+void linedit_syntaxcacheupdate(lineditor *edit, linedit_string *in) {
+    linedit_syntaxcache *cache=&edit->syntaxcache;
+    char *new=(in->string ? in->string : "");
+    size_t newlen=in->length, oldlen=cache->text.length;
+    char *old=(cache->text.string ? cache->text.string : "");
+    
+    if (cache->nlines>0 && newlen==oldlen && memcmp(old, new, newlen)==0) return;
+    
+    /* Find the common prefix and suffix of the old and new text */
+    size_t minlen=(newlen<oldlen ? newlen : oldlen), prefix=0, suffix=0;
+    while (prefix<minlen && old[prefix]==new[prefix]) prefix++;
+    while (suffix<minlen-prefix && old[oldlen-suffix-1]==new[newlen-suffix-1]) suffix++;
+    long delta=(long) newlen-(long) oldlen;
+    
+    /* Identify the first line that may have changed */
+    int first=0;
+    if (cache->nlines>0) {
+        first=linedit_syntaxfindline(cache->lines, cache->nlines, prefix);
+        if (first>0 && cache->lines[first].start==prefix) first--;
+    }
+    
+    /* Detach lines from the first modified line onwards */
+    linedit_syntaxline *oldlines=cache->lines+first;
+    int noldlines=cache->nlines-first, reuse=-1;
+    size_t posn=(noldlines>0 ? oldlines[0].start : 0);
+    linedit_tokenizerstate state=(noldlines>0 ? oldlines[0].state : 0);
+    
+    linedit_syntaxline *lines=NULL;
+    int nlines=0, capacity=0;
+    linedit_syntaxline *line=linedit_syntaxaddline(&lines, &nlines, &capacity, posn, state);
+    
+    for (unsigned int iter=0; line && posn<newlen; iter++) {
+        linedit_token tok;
+        char *c=new+posn;
+        bool success = linedit_tokenize(edit, c, &state, &tok);
+        
+        if (!success || tok.length==0 || tok.start<c || iter>newlen) {
+            /* Unrecognized text; display the remainder without coloring */
+            linedit_syntaxaddspan(line, posn, newlen-posn, LINEDIT_DEFAULTCOLOR);
+            posn=newlen;
+            break;
+        }
+        
+        if (tok.start>c) linedit_syntaxaddspan(line, posn, tok.start-c, LINEDIT_DEFAULTCOLOR);
+        linedit_syntaxaddspan(line, tok.start-new, tok.length, linedit_colorfromtokentype(edit, tok.type));
+        posn=tok.start+tok.length-new;
+        
+        if (posn<newlen && new[posn-1]=='\n') { // We've reached a line boundary
+            if (posn>=newlen-suffix) { // ... and the rest of the text is unchanged
+                size_t oposn=(size_t) ((long) posn-delta);
+                int j=linedit_syntaxfindline(oldlines, noldlines, oposn);
+                if (noldlines>0 && oldlines[j].start==oposn && oldlines[j].state==state) {
+                    reuse=j; break;
+                }
+            }
+            line=linedit_syntaxaddline(&lines, &nlines, &capacity, posn, state);
+        }
+    }
+    
+    /* Assemble the new list of lines */
+    for (int i=0; i<noldlines; i++) {
+        if (reuse>=0 && i>=reuse) {
+            linedit_syntaxline *l=linedit_syntaxaddline(&lines, &nlines, &capacity, 0, 0);
+            if (!l) { linedit_syntaxlineclear(&oldlines[i]); continue; }
+            *l=oldlines[i];
+            l->start=(size_t) ((long) l->start+delta);
+        } else linedit_syntaxlineclear(&oldlines[i]);
+    }
+    
+    /* Retain unmodified lines from the old cache */
+    cache->nlines=first;
+    for (int i=0; i<nlines; i++) {
+        linedit_syntaxline *l=linedit_syntaxaddline(&cache->lines, &cache->nlines, &cache->capacity, 0, 0);
+        if (l) *l=lines[i]; else linedit_syntaxlineclear(&lines[i]);
+    }
+    free(lines);
+    
+    /* Keep a copy of the text */
+    cache->text.length=0;
+    linedit_stringappend(&cache->text, new, newlen);
+}
+
+/** Print a string with syntax coloring, using and updating the cached token stream */
+void linedit_syntaxcolorcached(lineditor *edit, linedit_string *in, linedit_string *out) {
+    linedit_syntaxcacheupdate(edit, in);
+    
+    linedit_syntaxcache *cache=&edit->syntaxcache;
+    for (int i=0; i<cache->nlines; i++) {
+        linedit_syntaxline *line=&cache->lines[i];
+        for (int j=0; j<line->nspans; j++) {
+            linedit_tokenspan *span=&line->spans[j];
+            size_t offset=line->start+span->offset;
+            linedit_addcstringwithselection(edit, in->string+offset, offset, span->length, &span->col, out);
+        }
+    }
+}
+
 /** Print a string without syntax coloring */
 void linedit_plainstring(lineditor *edit, linedit_string *in, linedit_string *out) {
     linedit_addcstringwithselection(edit, in->string, 0, in->length, NULL, out);
@@ -1082,6 +2807,7 @@ typedef enum {
     HOME, END,               // Home and End
     SHIFT_LEFT, SHIFT_RIGHT, // Shift+arrow key
     CTRL,
+    PASTE,                   // Start of a bracketed paste
 } keytype;
 
 /** A single keypress event obtained and processed by the terminal */
@@ -1104,6 +2830,10 @@ enum keycodes {
 /** Enable this macro to get reports on unhandled keypresses */
 //#define LINEDIT_DEBUGKEYPRESS
 
+/** Bracketed paste markers; the start marker follows the escape character */
+#define LINEDIT_PASTESTART "[200~"
+#define LINEDIT_PASTEEND   "\033[201~"
+
 /** Initializes a keypress structure */
 void linedit_keypressinit(keypress *out) {
     out->type=UNKNOWN;
@@ -1115,24 +2845,25 @@ void linedit_keypressinit(keypress *out) {
 bool linedit_readkey(lineditor *edit, keypress *out) {
     out->type=UNKNOWN;
     
-    if (read(STDIN_FILENO, out->c, 1) == 1) {
+    if (linedit_readbyte(edit, out->c)) {
         if (iscntrl(LINEDIT_KEYPRESSGETCHAR(out))) {
             switch (LINEDIT_KEYPRESSGETCHAR(out)) {
                 case ESC_CODE:
                 {   /* Escape sequences */
-                    char seq[LINEDIT_CODESTRINGSIZE];
-                    ssize_t ret=0;
+                    char seq[LINEDIT_CODESTRINGSIZE] = "";
                     
-                    /* Read in the escape sequence */
-                    for (unsigned int i=0; i<LINEDIT_CODESTRINGSIZE; i++) {
-                        ret=read(STDIN_FILENO, &seq[i], 1);
-                        if (ret<0 || isalpha(seq[i])) break;
+                    /* Read in the escape sequence, which is terminated by a letter or '~' */
+                    for (unsigned int i=0; i<LINEDIT_CODESTRINGSIZE-1; i++) {
+                        if (!linedit_readbyte(edit, &seq[i])) break;
+                        if (isalpha(seq[i]) || (i>0 && seq[i]=='~')) break;
                     }
                     
                     /** Decode the escape sequence */
                     if (seq[0]=='[') {
                         if (isdigit(seq[1])) { /* Extended seqence */
-                            if (strncmp(seq, "[1;2C", 5)==0) {
+                            if (strncmp(seq, LINEDIT_PASTESTART, strlen(LINEDIT_PASTESTART))==0) {
+                                out->type=PASTE;
+                            } else if (strncmp(seq, "[1;2C", 5)==0) {
                                 out->type=SHIFT_RIGHT;
                             } else if (strncmp(seq, "[1;2D", 5)==0) {
                                 out->type=SHIFT_LEFT;
@@ -1182,10 +2913,8 @@ bool linedit_readkey(lineditor *edit, keypress *out) {
         } else {
             out->nbytes=linedit_utf8numberofbytes(out->c);
             /* Read in the unicode sequence */
-            ssize_t ret=0;
             for (int i=1; i<out->nbytes; i++) {
-                ret=read(STDIN_FILENO, &out->c[i], 1);
-                if (ret<0) break;
+                if (!linedit_readbyte(edit, &out->c[i])) break;
             }
             out->type=CHARACTER;
 #ifdef LINEDIT_DEBUGKEYPRESS
@@ -1211,12 +2940,7 @@ lineditormode linedit_getmode(lineditor *edit) {
 
 /** @brief Sets the current mode, setting/clearing any state dependent data  */
 void linedit_setmode(lineditor *edit, lineditormode mode) {
-    if (mode!=LINEDIT_HISTORYMODE) {
-        if (edit->mode==LINEDIT_HISTORYMODE) {
-            linedit_stringlistremove(&edit->history, edit->history.first);
-        }
-        edit->history.posn=0;
-    }
+    if (mode!=LINEDIT_HISTORYMODE && mode!=LINEDIT_SEARCHMODE) edit->history.posn=0;
     if (mode==LINEDIT_SELECTIONMODE) {
         if (edit->sposn<0) edit->sposn=edit->posn;
     } else {
@@ -1256,9 +2980,37 @@ bool linedit_atnewline(lineditor *edit) {
  * Redraw
  * ---------------------------------------- */
 
+/** Lays out the prompt and the rendered buffer as the next frame */
+bool linedit_layout(lineditor *edit, linedit_string *output) {
+    linedit_attributes attr=LINEDIT_DEFAULTATTR;
+    int nchars=0;
+    linedit_screenreset(&edit->frame);
+    edit->frame.cursorrow=-1;
+    
+    /* A search shows what is being searched for in place of the prompt */
+    linedit_string *prompt=&edit->prompt, search;
+    linedit_stringinit(&search);
+    if (edit->mode==LINEDIT_SEARCHMODE) {
+        linedit_searchprompt(edit, &search);
+        prompt=&search;
+    }
+    
+    bool success=(linedit_screenaddrow(&edit->frame) &&
+                  linedit_renderstring(edit, prompt->string, prompt->length, &attr, NULL) &&
+                  linedit_renderstring(edit, output->string, output->length, &attr, &nchars));
+    linedit_stringclear(&search);
+    if (!success) return false;
+    
+    if (edit->frame.cursorrow<0) { // Cursor lies at the end of the buffer
+        linedit_setframecursor(&edit->frame);
+        // Keep the cursor on screen if the last row is full
+        if (edit->frame.cursorcol>=edit->ncols && linedit_screenaddrow(&edit->frame)) linedit_setframecursor(&edit->frame);
+    }
+    return true;
+}
+
 /** Refreshes the display */
 void linedit_redraw(lineditor *edit) {
-    int sugglength=0;
     linedit_string output; /* Holds the output string */
     linedit_stringinit(&output);
     
@@ -1266,7 +3018,7 @@ void linedit_redraw(lineditor *edit) {
     linedit_stringdefaulttext(&output);
     
     if (edit->color) {
-        linedit_syntaxcolorstring(edit, &edit->current, &output);
+        linedit_syntaxcolorcached(edit, &edit->current, &output);
     } else {
         linedit_plainstring(edit, &edit->current, &output);
     }
@@ -1276,65 +3028,29 @@ void linedit_redraw(lineditor *edit) {
         char *suggestion = linedit_currentsuggestion(edit);
         linedit_stringsetemphasis(&output, LINEDIT_BOLD);
         linedit_stringaddcstring(&output, suggestion);
-        sugglength=(int) strlen(suggestion);
     }
     
     // Reset default text
     linedit_stringdefaulttext(&output);
     
-    // Retrieve the display coordinates of the current editing position
-    int xpos, ypos, nlines;
-    linedit_stringdisplaycoordinates(edit, &edit->current, edit->posn, &xpos, &ypos);
-    linedit_stringdisplaycoordinates(edit, &edit->current, -1, NULL, &nlines);
-    
-    int promptwidth=linedit_stringdisplaywidth(edit, &edit->prompt);
-    int stringwidth=linedit_stringlength(&edit->current);
-    
-    int start=0, end=promptwidth+stringwidth+sugglength;
+    // Lay out the prompt and output string as the next frame
+    bool success=linedit_layout(edit, &output);
     
-    linedit_hidecursor();
-    linedit_moveup(ypos); // Move to the starting line
-    linedit_home();
-    linedit_defaulttext();
-    linedit_write(edit->prompt.string);
-    
-    // Now render the output string
-    linedit_renderstring(edit, output.string, output.length, start, end);
-    
-    linedit_erasetoendofline();
-    
-    linedit_moveup(nlines-ypos);  // Move to the cursor position
-    linedit_movetocolumn(promptwidth+xpos-start);
+    // If any graphemes had unknown widths, measure them all together and lay out again
+    if (success && edit->unmeasured.first) {
+        linedit_measuregraphemes(edit);
+        success=linedit_layout(edit, &output);
+        linedit_stringlistclear(&edit->unmeasured); // Any that remain have a provisional width
+    }
     
-    linedit_showcursor();
+    // Now send only what has changed to the terminal
+    if (success) linedit_present(edit);
 
     linedit_stringclear(&output);
 }
 
-/** @brief Changes the height of the current line editing session, erasing garbage if necessary */
-void linedit_changeheight(lineditor *edit, int oldheight, int newheight, int oldvpos, int newvpos) {
-    if (oldheight==newheight) {
-        if (oldvpos<newvpos) linedit_movedown(newvpos-oldvpos);
-        else linedit_moveup(oldvpos-newvpos);
-    } else if (newheight>oldheight) {
-        for (int i=0; i<newheight-oldheight; i++) linedit_linefeed();
-    } else {
-        for (int i=0; i<oldheight-oldvpos; i++) { // Erase to end
-            linedit_eraseline();
-            linedit_linefeed();
-        }
-        for (int i=0; i<oldheight-newvpos; i++) { 
-            linedit_eraseline();
-            linedit_moveup(1);
-        }
-    }
-}
-
 /** @brief Moves to the end of the buffer */
 void linedit_movetoend(lineditor *edit) {
-    int vpos, nlines=linedit_stringcountlines(&edit->current);
-    linedit_stringcoordinates(&edit->current, edit->posn, NULL, &vpos);
-    for (int i=vpos; i<nlines; i++) linedit_linefeed();
     linedit_setposition(edit, -1);
 }
 
@@ -1387,6 +3103,114 @@ void linedit_processchangeline(lineditor *edit, int delta) {
     linedit_stringfindposition(&edit->current, x, y, &edit->posn);
 }
 
+/** @brief Reads the remainder of a bracketed paste
+ *  @param[in] edit - the line editor
+ *  @param[out] out - filled out with the pasted text, with carriage returns converted to newlines
+ *  @details The text is taken from the terminal in whole chunks rather than decoded as keypresses */
+void linedit_readpaste(lineditor *edit, linedit_string *out) {
+    linedit_inputbuffer *in=&edit->input;
+    size_t markerlength=strlen(LINEDIT_PASTEEND);
+    
+    for (;;) {
+        if (!linedit_inputbuffered(in) && !linedit_inputfill(in)) break;
+        
+        /* Take everything available; the end marker may straddle two chunks */
+        size_t start=(out->length>markerlength ? out->length-markerlength : 0);
+        size_t navailable=in->length-in->posn;
+        linedit_stringappend(out, in->data+in->posn, navailable);
+        in->posn=in->length;
+        
+        char *end=(out->string ? linedit_findbytes(out->string+start, out->length-start, LINEDIT_PASTEEND, markerlength) : NULL);
+        if (end) {
+            size_t length=end-out->string;
+            size_t overshoot=out->length-length-markerlength;
+            in->posn-=overshoot; // Bytes after the marker are ordinary input
+            out->length=length;
+            out->string[length]='\0';
+            break;
+        }
+    }
+    
+    if (!out->string) return;
+    
+    /* Terminals send returns for newlines; zero bytes can't be held in the buffer and are dropped */
+    size_t j=0;
+    for (size_t i=0; i<out->length; i++) {
+        char c=out->string[i];
+        if (c=='\0') continue;
+        if (c=='\r') {
+            if (i+1<out->length && out->string[i+1]=='\n') continue;
+            c='\n';
+        }
+        out->string[j++]=c;
+    }
+    out->length=j;
+    out->string[j]='\0';
+}
+
+/** @brief Inserts a bracketed paste into the current buffer
+ *  @returns false if the pasted text completed the input, true otherwise */
+bool linedit_processpaste(lineditor *edit) {
+    linedit_string paste;
+    linedit_stringinit(&paste);
+    linedit_readpaste(edit, &paste);
+    
+    /* A trailing newline acts like the return key */
+    bool enter=(paste.length>0 && paste.string[paste.length-1]=='\n');
+    if (enter) paste.string[--paste.length]='\0';
+    
+    linedit_setmode(edit, LINEDIT_DEFAULTMODE);
+    if (paste.length>0) {
+        linedit_stringinsert(&edit->current, edit->posn, paste.string, paste.length);
+        linedit_advanceposition(edit, linedit_stringlength(&paste));
+    }
+    linedit_stringclear(&paste);
+    
+    if (enter) { // Check whether the input is complete just once for the whole block
+        if (!linedit_shouldmultiline(edit)) return false;
+        linedit_stringinsert(&edit->current, edit->posn, "\n", 1);
+        linedit_advanceposition(edit, +1);
+    }
+    return true;
+}
+
+/** @brief Processes a keypress during an incremental search of the history
+ *  @returns true if the search consumed the key; otherwise the search ends, keeping the match, and the key is processed as usual */
+bool linedit_processsearchkey(lineditor *edit, keypress *key) {
+    linedit_historystore *h=&edit->history;
+    
+    switch (key->type) {
+        case CHARACTER: // The current match may still match
+            linedit_stringappend(&h->query, key->c, key->nbytes);
+            linedit_searchupdate(edit, h->posn);
+            return true;
+        case DELETE:
+            if (h->query.length>0) { // Remove the last character of the query
+                size_t n=h->query.length-1;
+                while (n>0 && ((unsigned char) h->query.string[n] & 0xC0)==0x80) n--;
+                h->query.length=n;
+                h->query.string[n]='\0';
+            }
+            linedit_searchupdate(edit, 1);
+            return true;
+        case CTRL:
+            if (LINEDIT_KEYPRESSGETCHAR(key)=='R') { // Find an older match
+                linedit_searchupdate(edit, h->posn+1);
+                return true;
+            } else if (LINEDIT_KEYPRESSGETCHAR(key)=='G') { // Abandon the search
+                linedit_searchshow(edit, 0);
+                linedit_setmode(edit, LINEDIT_DEFAULTMODE);
+                return true;
+            }
+            break;
+        default:
+            break;
+    }
+    
+    linedit_setmode(edit, LINEDIT_DEFAULTMODE);
+    return false;
+}
+
 /** @brief Obtain and process a single keypress */
 bool linedit_processkeypress(lineditor *edit) {
     keypress key;
@@ -1396,6 +3220,11 @@ bool linedit_processkeypress(lineditor *edit) {
     
     do {
         if (linedit_readkey(edit, &key)) {
+            if (linedit_getmode(edit)==LINEDIT_SEARCHMODE && linedit_processsearchkey(edit, &key)) {
+                regeneratesuggestions=false;
+                continue;
+            }
+            
             switch (key.type) {
                 case CHARACTER:
                     linedit_setmode(edit, LINEDIT_DEFAULTMODE);
@@ -1433,8 +3262,8 @@ bool linedit_processkeypress(lineditor *edit) {
                 case UP:
                 {
                     if (linedit_getmode(edit)!=LINEDIT_HISTORYMODE) {
+                        linedit_historysavepending(edit);
                         linedit_setmode(edit, LINEDIT_HISTORYMODE);
-                        linedit_historyadd(edit, (edit->current.string ? edit->current.string : ""));
                     }
                     
                     linedit_historyadvance(edit, 1);
@@ -1450,6 +3279,9 @@ bool linedit_processkeypress(lineditor *edit) {
                         regeneratesuggestions=false;
                     }
                     break;
+                case PASTE:
+                    if (!linedit_processpaste(edit)) return false;
+                    break;
                 case RETURN:
                     if (linedit_shouldmultiline(edit)) {
                         linedit_stringaddcstring(&edit->current, "\n");
@@ -1525,6 +3357,12 @@ bool linedit_processkeypress(lineditor *edit) {
                         case 'P': /* Previous line */
                             linedit_processchangeline(edit, -1);
                             break;
+                        case 'R': /* Search the history */
+                            linedit_searchbegin(edit);
+                            linedit_setmode(edit, LINEDIT_SEARCHMODE);
+                            linedit_stringlistclear(&edit->suggestions);
+                            regeneratesuggestions=false;
+                            break;
                         case 'V': /* Paste */
                             linedit_setmode(edit, LINEDIT_DEFAULTMODE);
                             if (edit->clipboard.length>0) {
@@ -1539,7 +3377,7 @@ bool linedit_processkeypress(lineditor *edit) {
                     break;
             }
         }
-    } while (linedit_keypressavailable());
+    } while (linedit_inputavailable(edit));
     
     if (regeneratesuggestions) linedit_generatesuggestions(edit);
     
@@ -1550,17 +3388,21 @@ bool linedit_processkeypress(lineditor *edit) {
  * Main loops for different terminal types
  * ---------------------------------------- */
 
+#define LINEDIT_NOTERMINALBUFFER 4096
+
 /** If we're not attached to a terminal, e.g. a pipe, simply read the
     file in. */
 void linedit_noterminal(lineditor *edit) {
-    int c;
+    char buffer[LINEDIT_NOTERMINALBUFFER];
     linedit_stringclear(&edit->current);
-    do {
-        c = fgetc(stdin);
-        if (c==EOF || c=='\n') return;
-        char a = (char) c;
-        linedit_stringappend(&edit->current, &a, 1);
-    } while (true);
+    
+    /* Read a line in chunks; stdio's buffer is shared with any other readers of stdin */
+    while (fgets(buffer, LINEDIT_NOTERMINALBUFFER, stdin)) {
+        size_t length=strlen(buffer);
+        bool eol=(length>0 && buffer[length-1]=='\n');
+        linedit_stringappend(&edit->current, buffer, length-(eol ? 1 : 0));
+        if (eol) return;
+    }
 }
 
 /** If the terminal is unsupported, default to fgets with a fixed buffer */
@@ -1584,18 +3426,11 @@ void linedit_supported(lineditor *edit) {
     linedit_setmode(edit, LINEDIT_DEFAULTMODE);
     linedit_getterminalwidth(edit);
     linedit_setposition(edit, 0);
+    linedit_startscreen(edit); // The session begins on the current line of the terminal
     linedit_redraw(edit);
-    
-    int vpos=0, nlines=0; // Keep track of the current vertical position and line number
 
     while (linedit_processkeypress(edit)) {
-        int newvpos;
-        linedit_stringcoordinates(&edit->current, edit->posn, NULL, &newvpos);
-        int newnlines=linedit_stringcountlines(&edit->current);
-        linedit_changeheight(edit, nlines, newnlines, vpos, newvpos);
-            
         linedit_redraw(edit);
-        vpos=newvpos; nlines=newnlines;
     }
 
     /* Ensure we're always on the last line of the input when redrawing before exit */
@@ -1612,7 +3447,8 @@ void linedit_supported(lineditor *edit) {
         linedit_historyadd(edit, edit->current.string);
     }
     
-    linedit_linefeed(); // Move to next line
+    linedit_linefeed(edit); // Move to next line
+    linedit_flush(edit);
 }
 
 /* **********************************************************************
@@ -1624,10 +3460,12 @@ void linedit_init(lineditor *edit) {
     if (!edit) return;
     edit->color=NULL;
     edit->ncols=0;
-    linedit_stringlistinit(&edit->history);
+    linedit_historyinit(&edit->history);
     linedit_stringlistinit(&edit->suggestions);
+    linedit_stringlistinit(&edit->unmeasured);
     edit->mode=LINEDIT_DEFAULTMODE;
     linedit_stringinit(&edit->current);
+    linedit_stringsetindexed(&edit->current, true); // The buffer being edited keeps a position index
     linedit_stringinit(&edit->prompt);
     linedit_stringinit(&edit->cprompt);
     linedit_stringinit(&edit->clipboard);
@@ -1636,8 +3474,15 @@ void linedit_init(lineditor *edit) {
     edit->cref=NULL;
     edit->multiline=NULL;
     edit->mlref=NULL;
+    edit->historyfn=NULL;
+    edit->href=NULL;
     edit->graphemefn=NULL;
-    linedit_graphemeinit(&edit->graphemedict);
+    linedit_inputinit(&edit->input);
+    linedit_outputinit(&edit->output);
+    linedit_syntaxcacheinit(&edit->syntaxcache);
+    linedit_screeninit(&edit->screen);
+    linedit_screeninit(&edit->frame);
+    linedit_startscreen(edit);
 }
 
 /** Finalize a line editor */
@@ -1649,11 +3494,16 @@ void linedit_clear(lineditor *edit) {
     }
     linedit_historyclear(edit);
     linedit_stringlistclear(&edit->suggestions);
+    linedit_stringlistclear(&edit->unmeasured);
     linedit_stringclear(&edit->current);
+    linedit_stringsetindexed(&edit->current, false);
     linedit_stringclear(&edit->prompt);
     linedit_stringclear(&edit->cprompt);
     linedit_stringclear(&edit->clipboard);
-    linedit_graphemeclear(&edit->graphemedict);
+    linedit_outputclear(&edit->output);
+    linedit_syntaxcacheclear(&edit->syntaxcache);
+    linedit_screenclear(&edit->screen);
+    linedit_screenclear(&edit->frame);
 }
 
 /** Public interface to the line editor.
@@ -1673,15 +3523,12 @@ char *linedit(lineditor *edit) {
     return linedit_cstring(&edit->current);
 }
 
-/** @brief Configures syntax coloring
- *  @param[in] edit             Line editor to configure
- *  @param[in] tokenizer  Callback function that will identify the next token from a string
- *  @param[in] ref               Reference that will be passed to the tokenizer callback function.
- *  @param[in] map             Map from token types to colors */
-void linedit_syntaxcolor(lineditor *edit, linedit_tokenizefn tokenizer, void *ref, linedit_colormap *map) {
+/** Sets up syntax coloring data with a given tokenizer */
+void linedit_setsyntaxcolordata(lineditor *edit, linedit_tokenizefn tokenizer, linedit_resumabletokenizefn rtokenizer, void *ref, linedit_colormap *map) {
     if (!edit) return;
     if (!map) return;
     if (edit->color) free(edit->color);
+    linedit_syntaxcacheclear(&edit->syntaxcache); // Cached colors are no longer valid
     int ncols;
     
     for (ncols=0; map[ncols].type!=LINEDIT_ENDCOLORMAP; ncols++);
@@ -1691,6 +3538,7 @@ void linedit_syntaxcolor(lineditor *edit, linedit_tokenizefn tokenizer, void *re
     if (!edit->color) return;
     
     edit->color->tokenizer=tokenizer;
+    edit->color->rtokenizer=rtokenizer;
     edit->color->tokref=ref;
     edit->color->ncols=ncols;
     edit->color->lexwarning=false;
@@ -1701,6 +3549,24 @@ void linedit_syntaxcolor(lineditor *edit, linedit_tokenizefn tokenizer, void *re
     qsort(edit->color->col, ncols, sizeof(linedit_colormap), linedit_colormapcmp);
 }
 
+/** @brief Configures syntax coloring
+ *  @param[in] edit             Line editor to configure
+ *  @param[in] tokenizer  Callback function that will identify the next token from a string
+ *  @param[in] ref               Reference that will be passed to the tokenizer callback function.
+ *  @param[in] map             Map from token types to colors */
+void linedit_syntaxcolor(lineditor *edit, linedit_tokenizefn tokenizer, void *ref, linedit_colormap *map) {
+    linedit_setsyntaxcolordata(edit, tokenizer, NULL, ref, map);
+}
+
+/** @brief Configures syntax coloring with a tokenizer that can resume from a saved state
+ *  @param[in] edit             Line editor to configure
+ *  @param[in] tokenizer  Callback function that will identify the next token from a string
+ *  @param[in] ref               Reference that will be passed to the tokenizer callback function.
+ *  @param[in] map             Map from token types to colors */
+void linedit_resumablesyntaxcolor(lineditor *edit, linedit_resumabletokenizefn tokenizer, void *ref, linedit_colormap *map) {
+    linedit_setsyntaxcolordata(edit, NULL, tokenizer, ref, map);
+}
+
 /** @brief Configures autocomplete
  *  @param[in] edit               Line editor to configure
  *  @param[in] completer    Callback function that will identify autocomplete suggestions
@@ -1727,6 +3593,15 @@ void linedit_multiline(lineditor *edit, linedit_multilinefn multiline, void *ref
     }
 }
 
+/** @brief Configures an external history
+ *  @param[in] edit              Line editor to configure
+ *  @param[in] history     Callback function that supplies history entries, or NULL to use linedit's own history
+ *  @param[in] ref                 Reference that will be passed to the history callback function. */
+void linedit_history(lineditor *edit, linedit_historyfn history, void *ref) {
+    edit->historyfn=history;
+    edit->href=ref;
+}
+
 /** @brief Adds a completion suggestion
  *  @param completion   completion data structure
  *  @param string       string to add */
@@ -1771,6 +3646,30 @@ void linedit_displaywithstyle(lineditor *edit, char *string, linedit_color col,
     }
 }
 
+/** @brief Gets the control sequences that surround a string displayed with a given style, so that callers
+ *  displaying many strings need check the terminal only once */
+bool linedit_stylesequences(linedit_color col, linedit_emphasis emph, char *start, char *end, size_t size) {
+    if (size) *start=*end='\0';
+    if (linedit_checksupport()!=LINEDIT_SUPPORTED) return false;
+    
+    linedit_string s, e;
+    linedit_stringinit(&s);
+    linedit_stringinit(&e);
+    linedit_stringsetcolor(&s, col);
+    linedit_stringsetemphasis(&s, emph);
+    linedit_stringdefaulttext(&e);
+    
+    bool success=(s.string && e.string && strlen(s.string)<size && strlen(e.string)<size);
+    if (success) {
+        strcpy(start, s.string);
+        strcpy(end, e.string);
+    }
+    
+    linedit_stringclear(&s);
+    linedit_stringclear(&e);
+    return success;
+}
+
 /** @brief Displays a string with syntax coloring
  *  @param edit         Line editor in use
  *  @param string       String to display
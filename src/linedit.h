@@ -13,10 +13,19 @@
 #include <ctype.h>
 #include <string.h>
 #include <stdint.h>
+#include <errno.h>
 
 #include <termios.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <sys/select.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <time.h>
+#include <limits.h>
 
 /* **********************************************************************
  * Types
@@ -28,12 +37,38 @@
 
 typedef struct linedit_string_s linedit_string;
 
+/** A position in a string */
+typedef struct {
+    size_t posn;   /** Position in unicode characters */
+    size_t offset; /** Offset in bytes */
+    int line;      /** Line number */
+    int col;       /** Position within the line in unicode characters */
+} linedit_checkpoint;
+
+/** Index of positions in a string that is being edited, so that positions can be
+ *  located without rescanning the string from the start. Every line begins with a checkpoint,
+ *  and long lines hold further checkpoints every LINEDIT_INDEXSTRIDE characters. Edits update
+ *  checkpoints after the edit in place, or discard them to be rebuilt when next needed. */
+typedef struct {
+    linedit_checkpoint *checkpoints; /** Checkpoints in order of position */
+    int count;
+    int capacity;
+    linedit_checkpoint end;  /** The string has been indexed up to this position */
+    
+    int *rows;               /** Display row on which each line begins */
+    int nrows;               /** Number of lines for which rows are known */
+    int rowcapacity;
+    int ncols;               /** Terminal width with which rows were found */
+    int nwidths;             /** Number of measured grapheme widths when rows were found */
+} linedit_stringindex;
+
 /** lineditor strings */
 struct linedit_string_s {
     size_t capacity;  /** Capacity of the string in bytes */
     size_t length; /** Length in bytes */
     char *string; /** String data */
     linedit_string *next; /** Enable strings to be chained together */
+    linedit_stringindex *index; /** Position index, or NULL if the string isn't indexed */
 } ;
 
 /** A list of strings */
@@ -72,6 +107,21 @@ typedef struct {
  *           false otherwise. */
 typedef bool (*linedit_tokenizefn) (char *in, void *ref, linedit_token *tok);
 
+/** State saved by a resumable tokenizer */
+typedef long linedit_tokenizerstate;
+
+/** @brief Resumable tokenizer callback function
+ *  @param   in    - a string
+ *  @param   ref   - pointer to a reference structure provided to linedit by the user
+ *  @param   state - the tokenizer state in effect at the start of in; the function should
+ *                   update this to reflect the state after the token it identifies
+ *  @param   tok   - pointer to a token structure that the caller should fill out.
+ *  @details As for linedit_tokenizefn, but linedit saves the state at the start of each
+ *           line and may later resume tokenizing from any line, passing the saved state
+ *           back, rather than restarting from the beginning of the string. Lines whose
+ *           text and starting state are unchanged are not tokenized again. */
+typedef bool (*linedit_resumabletokenizefn) (char *in, void *ref, linedit_tokenizerstate *state, linedit_token *tok);
+
 /* -----------------------
  * Color
  * ----------------------- */
@@ -106,12 +156,39 @@ typedef struct {
 /** Structure to hold all information related to syntax coloring */
 typedef struct {
     linedit_tokenizefn tokenizer; /** A tokenizer function */
+    linedit_resumabletokenizefn rtokenizer; /** A resumable tokenizer function, used in preference to the above */
     void *tokref;                 /** Reference passed to tokenizer callback function */
     bool lexwarning;
     unsigned int ncols;           /** Number of colors provided */
     linedit_colormap col[];       /** Flexible array member mapping token types to colors */
 } linedit_syntaxcolordata;
 
+/** A run of characters within a line that share a color */
+typedef struct {
+    size_t offset;              /** Offset from the start of the line in bytes */
+    size_t length;              /** Length in bytes */
+    linedit_color col;          /** Color to display */
+} linedit_tokenspan;
+
+/** Cached tokenization of a line. A line begins wherever the tokenizer resumes after a newline,
+ *  so a token that spans several lines of text (e.g. a long comment) belongs to a single line. */
+typedef struct {
+    size_t start;                  /** Offset of the start of the line in bytes */
+    size_t length;                 /** Length of the line in bytes */
+    linedit_tokenizerstate state;  /** Tokenizer state at the start of the line */
+    int nspans;                    /** Number of spans */
+    int capacity;                  /** Capacity of the span list */
+    linedit_tokenspan *spans;      /** Spans that make up the line */
+} linedit_syntaxline;
+
+/** Token stream retained between redraws so that only modified lines are tokenized again */
+typedef struct {
+    linedit_string text;           /** Copy of the text that was tokenized */
+    int nlines;                    /** Number of lines */
+    int capacity;                  /** Capacity of the line list */
+    linedit_syntaxline *lines;     /** Lines */
+} linedit_syntaxcache;
+
 /* -----------------------
  * Completion
  * ----------------------- */
@@ -147,6 +224,22 @@ typedef bool (*linedit_completefn) (char *in, void *ref, linedit_stringlist *com
 */
 typedef bool (*linedit_multilinefn) (char *in, void *ref);
 
+/* -----------------------
+ * History callback
+ * ----------------------- */
+
+/** @brief History callback function
+ *  @param[in]  ref        - pointer to a reference structure provided by the user
+ *  @param[in]  n          - entry requested, where 0 is the most recent
+ *  @param[out] entry      - set to the text of the entry if n is less than the number of entries; need not be zero terminated
+ *  @param[out] length     - set to the length of the entry in bytes
+ *  @details Supplies entries for the current session held by the user in place of linedit's own.
+ *           linedit then doesn't keep lines in memory itself, though it still appends them to the
+ *           history file if one is set; the user should record each line it returns.
+ *           The function should return the number of entries available.
+*/
+typedef int (*linedit_historyfn) (void *ref, unsigned int n, char **entry, size_t *length);
+
 /* -----------------------
  * Unicode grapheme support
  * ----------------------- */
@@ -172,6 +265,107 @@ typedef struct {
 */
 typedef size_t (*linedit_graphemefn) (const char *in, const char *end);
 
+/* -----------------------
+ * Input buffer
+ * ----------------------- */
+
+#define LINEDIT_INPUTBUFFERSIZE 4096
+
+/** Bytes read from the terminal but not yet decoded into keypresses */
+typedef struct {
+    char data[LINEDIT_INPUTBUFFERSIZE]; /** Raw input */
+    size_t length;          /** Number of bytes held */
+    size_t posn;            /** Next byte to decode */
+} linedit_inputbuffer;
+
+/* -----------------------
+ * Output buffer
+ * ----------------------- */
+
+/** Output destined for the terminal is accumulated in fixed size segments so that a whole
+ *  frame can be sent with a single write (or writev if the frame spans several segments) */
+typedef struct {
+    int nsegments;            /** Number of segments in use */
+    int capacity;             /** Number of segments allocated */
+    linedit_string *segments; /** The segments */
+} linedit_outputbuffer;
+
+/* -----------------------
+ * Screen model
+ * ----------------------- */
+
+/** Display attributes of a cell: a linedit_color in the low bits together with emphasis flags */
+typedef unsigned int linedit_attributes;
+
+/** A single grapheme displayed on the screen */
+typedef struct {
+    size_t offset;              /** Offset of the grapheme in the row's text */
+    size_t length;              /** Length of the grapheme in bytes */
+    int width;                  /** Display width in columns */
+    linedit_attributes attr;    /** Display attributes */
+} linedit_cell;
+
+/** A row of the screen */
+typedef struct {
+    linedit_string text;        /** Grapheme data */
+    int ncells;                 /** Number of cells */
+    int capacity;               /** Capacity of the cell list */
+    linedit_cell *cells;        /** Cells */
+    int width;                  /** Total display width of the row */
+} linedit_screenrow;
+
+/** The rows occupied by the line editor, starting from the row containing the prompt */
+typedef struct {
+    int nrows;                  /** Number of rows */
+    int capacity;               /** Capacity of the row list */
+    linedit_screenrow *rows;    /** Rows */
+    int cursorrow;              /** Cursor position */
+    int cursorcol;
+} linedit_screen;
+
+/* -----------------------
+ * History
+ * ----------------------- */
+
+/** An entry in the history */
+typedef struct {
+    char *text;     /** Zero terminated text */
+    size_t length;  /** Length in bytes */
+    uint32_t hash;
+    bool owned;     /** Whether text was allocated, rather than lying in the history file's mapping */
+} linedit_historyentry;
+
+/** Entries in the substring index that contain a given trigram */
+typedef struct {
+    int *entries;   /** Entries in ascending order */
+    int count;
+    int capacity;
+} linedit_searchbucket;
+
+#define LINEDIT_SEARCHBUCKETS 4096
+
+/** History, held as an array with the oldest entry first. Entries from earlier sessions are read
+ *  from the history file, which is mapped into memory when first needed; each line entered is
+ *  appended to the file at once. */
+typedef struct {
+    linedit_historyentry *entries;
+    int count;
+    int capacity;
+    int posn;                /** Entry selected, counting back from the most recent; 0 is the line being edited */
+    linedit_string pending;  /** The line being edited when history was entered */
+    
+    char *path;              /** History file, or NULL */
+    size_t filesize;         /** Size of the history file written by earlier sessions */
+    bool loaded;             /** Whether entries from the history file have been read */
+    void *map;               /** Mapping of the history file */
+    size_t mapsize;
+    linedit_string last;     /** Last line appended to the file */
+    
+    linedit_searchbucket *buckets; /** Substring index: entries containing each trigram */
+    int nindexed;            /** Entries indexed so far */
+    linedit_string query;    /** Text being searched for */
+} linedit_historystore;
+
 /* -----------------------
  * lineditor structure
  * ----------------------- */
@@ -182,7 +376,8 @@ typedef size_t (*linedit_graphemefn) (const char *in, const char *end);
 typedef enum {
     LINEDIT_DEFAULTMODE,
     LINEDIT_SELECTIONMODE,
-    LINEDIT_HISTORYMODE
+    LINEDIT_HISTORYMODE,
+    LINEDIT_SEARCHMODE
 } lineditormode;
 
 /** Holds all state information needed for a line editor */
@@ -197,10 +392,12 @@ typedef struct {
     linedit_string current;  /** Current string that's being edited */
     linedit_string clipboard;/** Copy/paste clipboard */
     
-    linedit_stringlist history; /** History list */
+    linedit_historystore history; /** History */
     linedit_stringlist suggestions; /** Autocompletion suggestions */
+    linedit_stringlist unmeasured;  /** Graphemes in the frame whose display widths are unknown */
     
     linedit_syntaxcolordata *color; /** Structure to handle syntax coloring */
+    linedit_syntaxcache syntaxcache; /** Cached token stream for the current string */
     
     linedit_completefn completer; /** Autocompletion callback function*/
     void *cref;                   /** Reference for autocompletion callback function */
@@ -208,8 +405,21 @@ typedef struct {
     linedit_multilinefn multiline; /** Multiline callback */
     void *mlref;                   /** Reference for multiline callback function */
     
+    linedit_historyfn historyfn;   /** History callback */
+    void *href;                    /** Reference for history callback function */
+    
     linedit_graphemefn graphemefn; /** Grapheme splitting */
-    linedit_graphemedictionary graphemedict; /** Grapheme dictionary */
+
+    linedit_inputbuffer input;   /** Pending input from the terminal */
+    linedit_outputbuffer output; /** Pending output to the terminal */
+    
+    linedit_screen screen;   /** What is currently displayed on the terminal */
+    linedit_screen frame;    /** The next frame to display */
+    bool screenvalid;        /** Whether the contents of screen are known to match the terminal */
+    int height;              /** Number of terminal rows in use, starting from the prompt */
+    int row;                 /** Position of the terminal cursor relative to the prompt */
+    int col;
+    linedit_attributes attr; /** Current display attributes of the terminal */
 } lineditor;
 
 /* **********************************************************************
@@ -228,6 +438,13 @@ char *linedit(lineditor *edit);
  *  @param[in] map               Map from token types to colors */
 void linedit_syntaxcolor(lineditor *edit, linedit_tokenizefn tokenizer, void *ref, linedit_colormap *cols);
 
+/** @brief Configures syntax coloring with a tokenizer that can resume from a saved state
+ *  @param[in] edit             Line editor to configure
+ *  @param[in] tokenizer  Callback function that will identify the next token from a string
+ *  @param[in] ref               Reference that will be passed to the tokenizer callback function.
+ *  @param[in] map               Map from token types to colors */
+void linedit_resumablesyntaxcolor(lineditor *edit, linedit_resumabletokenizefn tokenizer, void *ref, linedit_colormap *cols);
+
 /** @brief Configures autocomplete
  *  @param[in] edit               Line editor to configure
  *  @param[in] completer    Callback function that will identify autocomplete suggestions
@@ -241,6 +458,18 @@ void linedit_autocomplete(lineditor *edit, linedit_completefn completer, void *r
  *  @param[in] cprompt        Continuation prompt, or NULL to just reuse the regular prompt */
 void linedit_multiline(lineditor *edit, linedit_multilinefn multiline, void *ref, char *cprompt);
 
+/** @brief Configures an external history
+ *  @param[in] edit              Line editor to configure
+ *  @param[in] history     Callback function that supplies history entries, or NULL to use linedit's own history
+ *  @param[in] ref                 Reference that will be passed to the history callback function. */
+void linedit_history(lineditor *edit, linedit_historyfn history, void *ref);
+
+/** @brief Keeps history in a file, so that it persists between sessions
+ *  @param[in] edit              Line editor to configure
+ *  @param[in] path              History file; it is only read when history is first needed
+ *  @returns true on success */
+bool linedit_historyfile(lineditor *edit, const char *path);
+
 /** @brief Adds a completion suggestion
  *  @param[in] completion   Completion data structure
  *  @param[in] string            String to add */
@@ -251,6 +480,19 @@ void linedit_addsuggestion(linedit_stringlist *completion, char *string);
  *  @param[in] prompt       Prompt string to use */
 void linedit_setprompt(lineditor *edit, char *prompt);
 
+/** @brief Loads previously measured grapheme widths, which are shared by all line editors
+ *  @param[in] path             File to load from
+ *  @returns true on success; widths measured with a different TERM are ignored */
+bool linedit_loadgraphemewidths(const char *path);
+
+/** @brief Saves measured grapheme widths so that the terminal need not be probed again
+ *  @param[in] path             File to write
+ *  @returns true on success */
+bool linedit_savegraphemewidths(const char *path);
+
+/** @brief Frees the grapheme widths shared by all line editors; call once no line editor is in use */
+void linedit_freegraphemewidths(void);
+
 /** @brief Sets the grapheme splitter to use
  *  @param[in] edit           Line editor to configure
  *  @param[in] graphemefn       Grapheme splitter to use */
@@ -263,6 +505,16 @@ void linedit_setgraphemesplitter(lineditor *edit, linedit_graphemefn graphemefn)
  *  @param[in] emph           Emphasis */
 void linedit_displaywithstyle(lineditor *edit, char *string, linedit_color col, linedit_emphasis emph);
 
+/** @brief Gets the control sequences that surround a string displayed with a given color and emphasis
+ *  @param[in] col             Color
+ *  @param[in] emph           Emphasis
+ *  @param[out] start         Sequence that sets the style
+ *  @param[out] end           Sequence that restores default text
+ *  @param[in] size           Size of each buffer; LINEDIT_STYLESIZE is sufficient
+ *  @returns true if the terminal supports styled text; otherwise the sequences are empty */
+#define LINEDIT_STYLESIZE 48
+bool linedit_stylesequences(linedit_color col, linedit_emphasis emph, char *start, char *end, size_t size);
+
 /** @brief Displays a string with syntax coloring
  *  @param[in] edit           Line editor to use
  *  @param[in] string      String to display */
@@ -6,17 +6,35 @@
 
 #include <stdio.h>
 #include <stdarg.h>
+#include <limits.h>
 
 #include "cli.h"
 #include "debugger.h"
+#include "server.h"
+#include "jobs.h"
+#include "threads.h"
 
-int main(int argc, const char * argv[]) {
+/** Processes command line arguments and runs morpho accordingly; jobs submitted to a server are run the same way
+ *  @param[in] argc - number of arguments
+ *  @param[in] argv - arguments; argv[0] is the program name
+ *  @returns exit status */
+static int main_execute(int argc, const char * argv[]) {
     clioptions opt = CLI_RUN;
     const char *file = NULL;
+    bool batch = false; /* Run many scripts concurrently */
+    int nworkers = 0, nthreads = 0;
+    clithreadsoption workers;
     int i=0;
     
-    morpho_initialize();
-    clidebugger_initialize();
+    clithreads_optioninit(&workers);
+    
+    cli_setdisassemblyfile(NULL);
+    cliprofiler_setoutput(NULL);
+    clitrace_setoutput(NULL);
+    clitrace_setregisters(false);
+    cli_setstatsfile(NULL);
+    cli_setsessionlimit(0);
+    cli_setstartuptrace(false, NULL);
     
     /* Process command line arguments */
     for (i=1; i<argc; i++) {
@@ -35,6 +53,38 @@ int main(int argc, const char * argv[]) {
                             /* Show lines of source alongside disassembly */
                             opt |= CLI_DISASSEMBLESHOWSRC;
                         }
+                        /* Write the disassembly to a file given as -D=file or -DL=file */
+                        char *eq=strchr(option, '=');
+                        if (eq && eq[1]!='\0') cli_setdisassemblyfile(eq+1);
+                    }
+                    break;
+                case 'b': /* Batch of scripts */
+                    if (strncmp(option+1, CLIJOBS_BATCH, strlen(CLIJOBS_BATCH))==0) batch=true;
+                    break;
+                case 'h': /* Rebuild the help index */
+                    if (strncmp(option+1, "helpindex", strlen("helpindex"))==0) {
+                        char path[PATH_MAX];
+                        bool success=(cli_userpath(HELP_INDEXFILE, path, PATH_MAX) && help_buildindex(path));
+                        if (!success) fprintf(stderr, "Couldn't build help index.\n");
+                        return (success ? 0 : 1);
+                    }
+                    break;
+                case 'j': /* Number of concurrent jobs in a batch */
+                    {
+                        const char *c=option+2;
+                        while (!isdigit(*c) && *c!='\0') c++;
+                        if (isdigit(*c)) nworkers=atoi(c);
+                    }
+                    break;
+                case 'o': /* Output format, as -output=jsonl or -output=text */
+                    if (strncmp(option+1, CLI_OUTPUTOPTION, strlen(CLI_OUTPUTOPTION))==0) {
+                        const char *eq=strchr(option, '=');
+                        if (eq && strcmp(eq+1, CLI_OUTPUTJSONL)==0) opt |= CLI_JSONL;
+                        else if (eq && strcmp(eq+1, CLI_OUTPUTTEXT)==0) opt &= ~CLI_JSONL;
+                        else {
+                            fprintf(stderr, "Unknown output format; use -output=%s or -output=%s.\n", CLI_OUTPUTJSONL, CLI_OUTPUTTEXT);
+                            return 1;
+                        }
                     }
                     break;
                 case 'O': /* Optimize */
@@ -47,16 +97,55 @@ int main(int argc, const char * argv[]) {
                     }
 #endif
                     break;
-                case 'w': /* Workers */
-                    {
-                        const char *c=option+2;
-                        int nw=0;
+                case 's':
+                    if (strncmp(option+1, CLI_STARTUPOPTION, strlen(CLI_STARTUPOPTION))==0) {
+                        /* Report the time taken by each step of startup on stderr, or to a file given as -startup-trace=file */
+                        const char *eq=strchr(option, '=');
+                        cli_setstartuptrace(true, (eq && eq[1]!='\0') ? eq+1 : NULL);
+                    } else if (strncmp(option+1, CLI_STATSOPTION, strlen(CLI_STATSOPTION))==0) {
+                        /* Report statistics on stderr, or as JSON to a file given as -stats=file */
+                        const char *eq=strchr(option, '=');
+                        if (eq && eq[1]!='\0') cli_setstatsfile(eq+1);
+                        opt |= CLI_STATS;
+                    } else if (strncmp(option+1, CLISESSION_LIMITOPTION, strlen(CLISESSION_LIMITOPTION))==0) {
+                        /* Keep at most N MB of an interactive session's input in memory, as -sessionlimit=N */
+                        const char *c=option+1+strlen(CLISESSION_LIMITOPTION);
+                        while (!isdigit(*c) && *c!='\0') c++;
+                        if (isdigit(*c)) cli_setsessionlimit((size_t) atoi(c)*1024*1024);
+                    } else if (strncmp(option+1, CLIPROFILER_INTERVAL, strlen(CLIPROFILER_INTERVAL))==0) {
+                        /* Sampling interval in microseconds, as -sampleinterval=N */
+                        const char *c=option+1+strlen(CLIPROFILER_INTERVAL);
                         while (!isdigit(*c) && *c!='\0') c++;
-                        if (isdigit(*c)) nw=atoi(c);
-                        if (nw<0) nw=0;
-                        morpho_setthreadnumber(nw);
+                        if (isdigit(*c)) cliprofiler_setinterval(atoi(c));
+                    } else if (strncmp(option+1, CLIPROFILER_SAMPLE, strlen(CLIPROFILER_SAMPLE))==0) {
+                        /* Sampling profile written to a file given as -sample=file */
+                        const char *eq=strchr(option, '=');
+                        cliprofiler_setoutput((eq && eq[1]!='\0') ? eq+1 : CLIPROFILER_DEFAULTOUTPUT);
+                        opt |= CLI_SAMPLE;
+                    }
+                    break;
+                case 't':
+                    if (strncmp(option+1, CLITRACE_SUMMARYOPTION, strlen(CLITRACE_SUMMARYOPTION))==0) {
+                        /* Summarize a trace written earlier, given as -tracesummary=file */
+                        const char *eq=strchr(option, '=');
+                        return (clitrace_summary((eq && eq[1]!='\0') ? eq+1 : CLITRACE_DEFAULTOUTPUT) ? 0 : 1);
+                    } else if (strncmp(option+1, CLITRACE_REGISTERSOPTION, strlen(CLITRACE_REGISTERSOPTION))==0) {
+                        /* Include register snapshots in the trace */
+                        clitrace_setregisters(true);
+                        if (!(opt & CLI_TRACE)) clitrace_setoutput(CLITRACE_DEFAULTOUTPUT);
+                        opt |= CLI_TRACE;
+                    } else if (strncmp(option+1, CLITRACE_OPTION, strlen(CLITRACE_OPTION))==0) {
+                        /* Execution trace written to a file given as -trace=file */
+                        const char *eq=strchr(option, '=');
+                        clitrace_setoutput((eq && eq[1]!='\0') ? eq+1 : CLITRACE_DEFAULTOUTPUT);
+                        opt |= CLI_TRACE;
                     }
-
+                    break;
+                case 'w': /* Workers, as -w4, -w auto or -w bench, optionally followed by ,compact or ,scatter */
+                    /* The setting may also be given as the next argument */
+                    if (option[2]=='\0' && i+1<argc && clithreads_isspec(argv[i+1])) clithreads_parse(argv[++i], &workers);
+                    else clithreads_parse(option+2, &workers);
+                    workers.set=true;
                     break;
             }
         } else {
@@ -65,11 +154,50 @@ int main(int argc, const char * argv[]) {
         }
     }
     
-    if (i<argc) morpho_setargs(argc-i-1, argv+i+1); // Pass unprocessed args to the morpho runtime.
+    cli_startupspan("arguments");
+    
+    /* Size the runtime's worker pool and place its threads */
+    nthreads=clithreads_configure(&workers);
+    
+    /* The debugger's errors are only needed when debugging */
+    if (opt & CLI_DEBUG) {
+        clidebugger_initialize();
+        cli_startupspan("debugger");
+    }
+    
+    /* In a batch, every remaining argument is a script to run */
+    if (batch && file) return clijobs_run(argc-i, argv+i, opt, nworkers, nthreads);
+    
+    /* Pass unprocessed args to the morpho runtime; always set them so that a server's jobs don't see each other's */
+    if (i<argc) morpho_setargs(argc-i-1, argv+i+1);
+    else morpho_setargs(0, argv+argc);
 
-    if (file) cli_run(file, opt);
-    else cli(opt);
+    if (file && workers.bench) return clithreads_bench(file, opt, &workers);
+    if (file) return cli_run(file, opt);
+    return cli(opt);
+}
+
+int main(int argc, const char * argv[]) {
+    cli_startupbegin();
+    
+    /* Hand the job to a resident server if there is one, without initializing morpho at all */
+    if (argc>1 && strcmp(argv[1], CLISERVER_CONNECT)==0) {
+        int status;
+        if (cliserver_submit(NULL, argc-1, argv+1, &status)) return status;
+        
+        /* Otherwise run the job here; argv[1] stands in for the program name */
+        argc--; argv++;
+    }
+    
+    morpho_initialize();
+    cli_startupspan("morpho_initialize");
+    
+    int status;
+    if (argc>1 && strcmp(argv[1], CLISERVER_SERVE)==0) {
+        status=cliserver_serve(argc>2 ? argv[2] : NULL, main_execute);
+    } else status=main_execute(argc, argv);
 
+    linedit_freegraphemewidths();
     morpho_finalize();
-    return 0;
+    return status;
 }
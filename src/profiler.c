@@ -0,0 +1,253 @@
+/** @file profiler.c
+ *  @author T J Atherton
+ *
+ *  @brief Sampling profiler that records the morpho call stack
+*/
+
+#include <stdio.h>
+#include <signal.h>
+#include <sys/time.h>
+
+#include <vm.h>
+
+#include "profiler.h"
+#include "cli.h"
+
+/** @brief The profiler sets an interval timer that delivers SIGPROF while the program runs. On each
+ *  signal, the handler copies the function pointers from the vm's call frames into a preallocated pool;
+ *  it doesn't allocate or follow any pointers, so it is safe however the vm was interrupted.
+ *  Once the run is over, identical stacks are counted and written out either in collapsed stack format,
+ *  as used by flamegraph.pl and speedscope, or as JSON. Functions are only looked up after the run,
+ *  while the program, which owns them, is still alive. */
+
+/* **********************************************************************
+ * Sample storage
+ * ********************************************************************** */
+
+/** A recorded sample */
+typedef struct {
+    unsigned int start; // First frame in the pool, outermost first
+    unsigned int depth; // Number of frames
+    unsigned int skipped; // Outermost frames left out of a stack deeper than CLIPROFILER_MAXDEPTH
+} cliprofilersample;
+
+#define CLIPROFILER_MAXSAMPLES (CLIPROFILER_POOLSIZE/8)
+
+typedef struct {
+    vm *v; // vm being sampled
+    objectfunction **frames;
+    cliprofilersample *samples;
+    volatile sig_atomic_t nframes;
+    volatile sig_atomic_t nsamples;
+    volatile sig_atomic_t ndropped;
+} cliprofiler;
+
+static cliprofiler profiler = { .v = NULL, .frames = NULL, .samples = NULL };
+
+static const char *cliprofiler_output = NULL;
+static int cliprofiler_interval = CLIPROFILER_DEFAULTINTERVAL;
+
+static struct sigaction cliprofiler_oldaction;
+
+/** Sets the file that the profile is written to; profiling is enabled only if a file is given */
+void cliprofiler_setoutput(const char *file) {
+    cliprofiler_output=file;
+}
+
+/** Sets the sampling interval in microseconds */
+void cliprofiler_setinterval(int interval) {
+    cliprofiler_interval=(interval>0 ? interval : CLIPROFILER_DEFAULTINTERVAL);
+}
+
+/** Frees sample storage */
+static void cliprofiler_clear(void) {
+    if (profiler.frames) MORPHO_FREE(profiler.frames);
+    if (profiler.samples) MORPHO_FREE(profiler.samples);
+    profiler.frames=NULL;
+    profiler.samples=NULL;
+    profiler.v=NULL;
+    profiler.nframes=profiler.nsamples=profiler.ndropped=0;
+}
+
+/* **********************************************************************
+ * Sampling
+ * ********************************************************************** */
+
+/** Records the vm's current call stack */
+static void cliprofiler_handler(int sig) {
+    vm *v=profiler.v;
+    if (!v || !v->fp) return;
+    
+    unsigned int depth=(unsigned int) (v->fp-v->frame)+1, skipped=0;
+    if (depth>CLIPROFILER_MAXDEPTH) { // Keep the innermost frames, which include the function running
+        skipped=depth-CLIPROFILER_MAXDEPTH;
+        depth=CLIPROFILER_MAXDEPTH;
+    }
+    
+    if (profiler.nsamples>=CLIPROFILER_MAXSAMPLES || profiler.nframes+depth>CLIPROFILER_POOLSIZE) {
+        profiler.ndropped++;
+        return;
+    }
+    
+    cliprofilersample *s=&profiler.samples[profiler.nsamples];
+    s->start=(unsigned int) profiler.nframes;
+    s->depth=depth;
+    s->skipped=skipped;
+    for (unsigned int i=0; i<depth; i++) profiler.frames[s->start+i]=v->frame[skipped+i].function;
+    
+    profiler.nframes+=depth;
+    profiler.nsamples++;
+}
+
+/** @brief Starts sampling a vm, if a profile output file has been set
+ *  @returns true if sampling began */
+bool cliprofiler_start(vm *v) {
+    if (!cliprofiler_output) return false;
+    
+    cliprofiler_clear();
+    profiler.frames=MORPHO_MALLOC(sizeof(objectfunction *)*CLIPROFILER_POOLSIZE);
+    profiler.samples=MORPHO_MALLOC(sizeof(cliprofilersample)*CLIPROFILER_MAXSAMPLES);
+    if (!profiler.frames || !profiler.samples) {
+        cliprofiler_clear();
+        return false;
+    }
+    profiler.v=v;
+    
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler=cliprofiler_handler;
+    sa.sa_flags=SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGPROF, &sa, &cliprofiler_oldaction)!=0) {
+        cliprofiler_clear();
+        return false;
+    }
+    
+    struct itimerval timer;
+    timer.it_interval.tv_sec=cliprofiler_interval/1000000;
+    timer.it_interval.tv_usec=cliprofiler_interval%1000000;
+    timer.it_value=timer.it_interval;
+    setitimer(ITIMER_PROF, &timer, NULL);
+    
+    return true;
+}
+
+/** @brief Stops sampling; the samples are kept until reported */
+void cliprofiler_stop(void) {
+    struct itimerval timer;
+    memset(&timer, 0, sizeof(timer));
+    setitimer(ITIMER_PROF, &timer, NULL);
+    sigaction(SIGPROF, &cliprofiler_oldaction, NULL);
+    profiler.v=NULL;
+}
+
+/* **********************************************************************
+ * Reporting
+ * ********************************************************************** */
+
+/** Orders samples so that identical stacks are adjacent */
+static int cliprofiler_samplecmp(const void *a, const void *b) {
+    const cliprofilersample *x=a, *y=b;
+    if ((x->skipped>0)!=(y->skipped>0)) return (x->skipped>0 ? 1 : -1);
+    unsigned int n=(x->depth<y->depth ? x->depth : y->depth);
+    for (unsigned int i=0; i<n; i++) {
+        objectfunction *f=profiler.frames[x->start+i], *g=profiler.frames[y->start+i];
+        if (f!=g) return ((uintptr_t) f<(uintptr_t) g ? -1 : 1);
+    }
+    return (x->depth<y->depth ? -1 : (x->depth>y->depth));
+}
+
+/** Checks whether two samples have the same stack */
+static bool cliprofiler_samestack(cliprofilersample *x, cliprofilersample *y) {
+    return cliprofiler_samplecmp(x, y)==0;
+}
+
+/** Name of the function in a frame */
+static char *cliprofiler_name(objectfunction *func, unsigned int depth) {
+    if (depth==0) return CLIPROFILER_GLOBAL;
+    if (func && MORPHO_ISSTRING(func->name)) return MORPHO_GETCSTRING(func->name);
+    return CLIPROFILER_ANONYMOUS;
+}
+
+/** Writes a string as a JSON string literal */
+static void cliprofiler_jsonstring(FILE *f, char *str) {
+    fputc('"', f);
+    for (char *c=str; *c!='\0'; c++) {
+        if (*c=='"' || *c=='\\') fprintf(f, "\\%c", *c);
+        else if ((unsigned char) *c<0x20) fprintf(f, "\\u%04x", (unsigned char) *c);
+        else fputc(*c, f);
+    }
+    fputc('"', f);
+}
+
+/** Name of the kth recorded frame of a sample */
+static char *cliprofiler_framename(cliprofilersample *s, unsigned int k) {
+    return cliprofiler_name(profiler.frames[s->start+k], s->skipped+k);
+}
+
+/** Writes stacks in collapsed format, one line per distinct stack: outer;inner count */
+static void cliprofiler_writecollapsed(FILE *f) {
+    for (int i=0; i<profiler.nsamples; ) {
+        cliprofilersample *s=&profiler.samples[i];
+        int count=0;
+        for (; i<profiler.nsamples && cliprofiler_samestack(s, &profiler.samples[i]); i++) count++;
+        
+        if (s->skipped) fprintf(f, "%s;", CLIPROFILER_TRUNCATED);
+        for (unsigned int k=0; k<s->depth; k++) {
+            fprintf(f, "%s%s", (k ? ";" : ""), cliprofiler_framename(s, k));
+        }
+        fprintf(f, " %i\n", count);
+    }
+}
+
+/** Writes stacks as JSON */
+static void cliprofiler_writejson(FILE *f) {
+    fprintf(f, "{\"interval_us\":%i,\"samples\":%i,\"dropped\":%i,\"stacks\":[",
+            cliprofiler_interval, (int) profiler.nsamples, (int) profiler.ndropped);
+    
+    bool first=true;
+    for (int i=0; i<profiler.nsamples; ) {
+        cliprofilersample *s=&profiler.samples[i];
+        int count=0;
+        for (; i<profiler.nsamples && cliprofiler_samestack(s, &profiler.samples[i]); i++) count++;
+        
+        fprintf(f, "%s\n{\"stack\":[", (first ? "" : ","));
+        if (s->skipped) {
+            cliprofiler_jsonstring(f, CLIPROFILER_TRUNCATED);
+            fputc(',', f);
+        }
+        for (unsigned int k=0; k<s->depth; k++) {
+            if (k) fputc(',', f);
+            cliprofiler_jsonstring(f, cliprofiler_framename(s, k));
+        }
+        fprintf(f, "],\"count\":%i}", count);
+        first=false;
+    }
+    fprintf(f, "\n]}\n");
+}
+
+/** @brief Writes the profile to the output file and releases the samples; call before the program is freed
+ *  @returns true on success */
+bool cliprofiler_report(void) {
+    if (!cliprofiler_output || !profiler.samples) return false;
+    
+    FILE *f=fopen(cliprofiler_output, "w");
+    if (!f) {
+        fprintf(stderr, "Could not write profile to '%s'.\n", cliprofiler_output);
+        cliprofiler_clear();
+        return false;
+    }
+    
+    qsort(profiler.samples, profiler.nsamples, sizeof(cliprofilersample), cliprofiler_samplecmp);
+    
+    size_t length=strlen(cliprofiler_output), extlength=strlen(CLIPROFILER_JSONEXTENSION);
+    if (length>=extlength && strcmp(cliprofiler_output+length-extlength, CLIPROFILER_JSONEXTENSION)==0) {
+        cliprofiler_writejson(f);
+    } else cliprofiler_writecollapsed(f);
+    
+    if (profiler.ndropped) fprintf(stderr, "Profiler: %i samples dropped because the sample buffer was full.\n", (int) profiler.ndropped);
+    
+    fclose(f);
+    cliprofiler_clear();
+    return true;
+}
@@ -0,0 +1,33 @@
+/** @file profiler.h
+ *  @author T J Atherton
+ *
+ *  @brief Sampling profiler that records the morpho call stack
+*/
+
+#ifndef profiler_h
+#define profiler_h
+
+#include <morpho.h>
+
+#define CLIPROFILER_SAMPLE "sample"
+#define CLIPROFILER_INTERVAL "sampleinterval"
+
+#define CLIPROFILER_DEFAULTINTERVAL 1000 // Sampling interval in microseconds
+#define CLIPROFILER_MAXDEPTH 128         // Deeper stacks are truncated to their innermost frames
+#define CLIPROFILER_POOLSIZE (1<<20)     // Total number of frames that can be recorded
+
+#define CLIPROFILER_DEFAULTOUTPUT "morpho.folded"
+#define CLIPROFILER_JSONEXTENSION ".json"
+
+#define CLIPROFILER_GLOBAL "(global)"
+#define CLIPROFILER_ANONYMOUS "(anonymous)"
+#define CLIPROFILER_TRUNCATED "[truncated]" // Stands in for the outer frames of a truncated stack
+
+void cliprofiler_setoutput(const char *file);
+void cliprofiler_setinterval(int interval);
+
+bool cliprofiler_start(vm *v);
+void cliprofiler_stop(void);
+bool cliprofiler_report(void);
+
+#endif /* profiler_h */
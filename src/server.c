@@ -0,0 +1,427 @@
+/** @file server.c
+ *  @author T J Atherton
+ *
+ *  @brief Resident server that runs jobs submitted by morpho6 clients
+*/
+
+#include <stdio.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "server.h"
+#include "cli.h"
+
+/** @brief A server keeps one initialized morpho runtime resident and listens on a Unix socket.
+ *  @details Clients pass their stdin, stdout and stderr to the server along with the job, so output
+ *  from the job goes straight to the client's own streams through the usual print, warning and error
+ *  callbacks. Jobs are run one at a time, each in a child process forked from the server: the child
+ *  starts from the initialized runtime without paying for initialization again, and whatever global state
+ *  the job leaves behind (the source cache, the arguments set with morpho_setargs, buffered output and
+ *  the runtime's own tables) is discarded with the child rather than seen by the next job. Ctrl-C in the
+ *  client is forwarded to the child as SIGINT. */
+
+#define CLISERVER_NFDS 3 // stdin, stdout and stderr
+
+/* **********************************************************************
+ * Socket utility functions
+ * ********************************************************************** */
+
+/** Fills out the address of the server socket
+ *  @param[in] socketpath - path of the socket, or NULL to use $MORPHO6_SERVER or else the user's morpho directory
+ *  @param[out] addr - the address
+ *  @returns true on success */
+static bool cliserver_address(const char *socketpath, struct sockaddr_un *addr) {
+    char path[PATH_MAX];
+    if (!socketpath) socketpath=getenv(CLISERVER_SOCKETENV);
+    if (!socketpath) {
+        if (!cli_userpath(CLISERVER_SOCKET, path, PATH_MAX)) return false;
+        socketpath=path;
+    }
+    if (strlen(socketpath)>=sizeof(addr->sun_path)) return false;
+    
+    memset(addr, 0, sizeof(struct sockaddr_un));
+    addr->sun_family=AF_UNIX;
+    strcpy(addr->sun_path, socketpath);
+    return true;
+}
+
+/** Connects to a socket, returning the descriptor or -1 on failure */
+static int cliserver_connect(struct sockaddr_un *addr) {
+    int fd=socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd<0) return -1;
+    if (connect(fd, (struct sockaddr *) addr, sizeof(struct sockaddr_un))<0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/** Writes a buffer in full */
+static bool cliserver_write(int fd, const void *data, size_t length) {
+    const char *c=data;
+    while (length>0) {
+        ssize_t n=write(fd, c, length);
+        if (n<0 && errno==EINTR) continue;
+        if (n<=0) return false;
+        c+=n; length-=(size_t) n;
+    }
+    return true;
+}
+
+/** Reads a buffer in full */
+static bool cliserver_read(int fd, void *data, size_t length) {
+    char *c=data;
+    while (length>0) {
+        ssize_t n=read(fd, c, length);
+        if (n<0 && errno==EINTR) continue;
+        if (n<=0) return false;
+        c+=n; length-=(size_t) n;
+    }
+    return true;
+}
+
+/** Sends a message header together with our standard streams */
+static bool cliserver_sendheader(int fd, cliservermessage *msg) {
+    int fds[CLISERVER_NFDS] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+    char control[CMSG_SPACE(sizeof(fds))];
+    memset(control, 0, sizeof(control));
+    
+    struct iovec iov = { .iov_base = msg, .iov_len = sizeof(cliservermessage) };
+    struct msghdr hdr = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control) };
+    
+    struct cmsghdr *cmsg=CMSG_FIRSTHDR(&hdr);
+    cmsg->cmsg_level=SOL_SOCKET;
+    cmsg->cmsg_type=SCM_RIGHTS;
+    cmsg->cmsg_len=CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    
+    ssize_t n;
+    do n=sendmsg(fd, &hdr, 0); while (n<0 && errno==EINTR);
+    return (n==sizeof(cliservermessage));
+}
+
+/** Receives a message header together with the client's standard streams */
+static bool cliserver_receiveheader(int fd, cliservermessage *msg, int fds[CLISERVER_NFDS]) {
+    char control[CMSG_SPACE(sizeof(int)*CLISERVER_NFDS)];
+    struct iovec iov = { .iov_base = msg, .iov_len = sizeof(cliservermessage) };
+    struct msghdr hdr = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control) };
+    
+    ssize_t n;
+    do n=recvmsg(fd, &hdr, 0); while (n<0 && errno==EINTR);
+    if (n<=0) return false;
+    
+    bool success=false;
+    for (struct cmsghdr *cmsg=CMSG_FIRSTHDR(&hdr); cmsg; cmsg=CMSG_NXTHDR(&hdr, cmsg)) {
+        if (cmsg->cmsg_level!=SOL_SOCKET || cmsg->cmsg_type!=SCM_RIGHTS) continue;
+        
+        size_t nfds=(cmsg->cmsg_len-CMSG_LEN(0))/sizeof(int);
+        int received[nfds];
+        memcpy(received, CMSG_DATA(cmsg), sizeof(received));
+        
+        if (!success && nfds==CLISERVER_NFDS) {
+            memcpy(fds, received, sizeof(received));
+            success=true;
+        } else for (size_t i=0; i<nfds; i++) close(received[i]);
+    }
+    
+    if (success && (n!=sizeof(cliservermessage) || (hdr.msg_flags & MSG_CTRUNC))) {
+        for (int i=0; i<CLISERVER_NFDS; i++) close(fds[i]);
+        success=false;
+    }
+    return success;
+}
+
+/* **********************************************************************
+ * Client
+ * ********************************************************************** */
+
+static volatile sig_atomic_t cliserver_connection = -1; /* Connection to the server while a job runs */
+
+/** Forwards Ctrl-C to the server while waiting for a job */
+static void cliserver_forwardinterrupt(int sig) {
+    char c=CLISERVER_INTERRUPT;
+    if (cliserver_connection>=0) {
+        ssize_t n=write(cliserver_connection, &c, 1); // Only async signal safe calls may be made here
+        (void) n;
+    }
+}
+
+/** @brief Submits a job to a running server and waits for it to complete
+ *  @param[in] socketpath - path of the server's socket, or NULL for the default
+ *  @param[in] argc - number of arguments
+ *  @param[in] argv - arguments; argv[0] takes the place of the program name
+ *  @param[out] status - exit status of the job
+ *  @returns true if the job was submitted; false if no server could be reached */
+bool cliserver_submit(const char *socketpath, int argc, const char *argv[], int *status) {
+    struct sockaddr_un addr;
+    char cwd[PATH_MAX];
+    if (!cliserver_address(socketpath, &addr) || !getcwd(cwd, PATH_MAX)) return false;
+    
+    /* Working directory and arguments as consecutive zero terminated strings */
+    size_t length=strlen(cwd)+1;
+    for (int i=0; i<argc; i++) length+=strlen(argv[i])+1;
+    if (length>CLISERVER_MAXMESSAGE) return false;
+    
+    char *strings=MORPHO_MALLOC(length);
+    if (!strings) return false;
+    char *c=strings;
+    strcpy(c, cwd); c+=strlen(cwd)+1;
+    for (int i=0; i<argc; i++) {
+        strcpy(c, argv[i]); c+=strlen(argv[i])+1;
+    }
+    
+    int fd=cliserver_connect(&addr);
+    bool success=false;
+    if (fd>=0) {
+        cliservermessage msg = { .length = (uint32_t) length, .argc = (uint32_t) argc };
+        success=(cliserver_sendheader(fd, &msg) && cliserver_write(fd, strings, length));
+        
+        if (success) {
+            /* The job is now the server's; pass on Ctrl-C until it is done */
+            struct sigaction sa, old;
+            memset(&sa, 0, sizeof(sa));
+            sa.sa_handler=cliserver_forwardinterrupt;
+            sigemptyset(&sa.sa_mask);
+            cliserver_connection=fd;
+            sigaction(SIGINT, &sa, &old);
+            
+            /* If the server can't report back, the job failed */
+            int32_t result;
+            if (cliserver_read(fd, &result, sizeof(result))) *status=(int) result;
+            else {
+                fprintf(stderr, "Lost connection to the morpho server.\n");
+                *status=1;
+            }
+            
+            sigaction(SIGINT, &old, NULL);
+            cliserver_connection=-1;
+        }
+        close(fd);
+    }
+    
+    MORPHO_FREE(strings);
+    return success;
+}
+
+/* **********************************************************************
+ * Server
+ * ********************************************************************** */
+
+static volatile sig_atomic_t cliserver_stop = 0;
+
+static int cliserver_childpipe[2] = { -1, -1 }; /* Written to when a job's process exits, so that the server can wait on it with poll */
+
+/** Asks the server to stop once the current job is complete */
+static void cliserver_signalhandler(int sig) {
+    cliserver_stop=1;
+}
+
+/** Wakes the server when a job's process exits */
+static void cliserver_childhandler(int sig) {
+    int saved=errno;
+    char c=0;
+    ssize_t n=write(cliserver_childpipe[1], &c, 1);
+    (void) n;
+    errno=saved;
+}
+
+/** Runs a job with the client's standard streams and working directory in place of the server's */
+static int cliserver_runjob(cliserver_jobfn job, int fds[CLISERVER_NFDS], char *cwd, int argc, const char *argv[]) {
+    int saved[CLISERVER_NFDS];
+    int here=open(".", O_RDONLY);
+    int status=1;
+    
+    fflush(stdout);
+    fflush(stderr);
+    for (int i=0; i<CLISERVER_NFDS; i++) {
+        saved[i]=dup(i);
+        dup2(fds[i], i);
+    }
+    clearerr(stdin);
+    
+    if (chdir(cwd)==0) {
+        status=job(argc, argv);
+    } else fprintf(stderr, "Could not change to directory '%s'.\n", cwd);
+    
+    fflush(stdout);
+    fflush(stderr);
+    for (int i=0; i<CLISERVER_NFDS; i++) {
+        dup2(saved[i], i);
+        close(saved[i]);
+    }
+    clearerr(stdin);
+    
+    if (here>=0) {
+        if (fchdir(here)!=0) fprintf(stderr, "Could not restore the server's working directory.\n");
+        close(here);
+    }
+    return status;
+}
+
+/** @brief Runs a job in a child process, forwarding interrupts from the client until it exits
+ *  @param[in] client - connection to the client
+ *  @param[in] listener - the server's listening socket, which the child doesn't need
+ *  @returns the job's exit status; a job ended by a signal reports 128 plus the signal, as a shell does */
+static int cliserver_forkjob(int client, int listener, cliserver_jobfn job, int fds[CLISERVER_NFDS], char *cwd, int argc, const char *argv[]) {
+    fflush(stdout);
+    fflush(stderr);
+    
+    pid_t pid=fork();
+    if (pid<0) {
+        fprintf(stderr, "Could not start a job: %s\n", strerror(errno));
+        return 1;
+    }
+    
+    if (pid==0) { // The child runs the job with the signal handling of an ordinary morpho process
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+        signal(SIGPIPE, SIG_DFL);
+        signal(SIGCHLD, SIG_DFL);
+        close(listener);
+        close(client);
+        close(cliserver_childpipe[0]);
+        close(cliserver_childpipe[1]);
+        
+        int status=cliserver_runjob(job, fds, cwd, argc, argv);
+        cli_outputflush();
+        fflush(NULL);
+        _exit(status); // The server's own exit handlers don't belong to the job
+    }
+    
+    struct pollfd pfd[2] = { { .fd=client, .events=POLLIN }, { .fd=cliserver_childpipe[0], .events=POLLIN } };
+    int wstatus=0;
+    for (;;) {
+        pid_t r=waitpid(pid, &wstatus, WNOHANG);
+        if (r==pid || (r<0 && errno!=EINTR)) break;
+        
+        if (poll(pfd, 2, -1)<0) continue; // Interrupted, e.g. by SIGCHLD
+        
+        if (pfd[0].revents) { // The client interrupted the job or went away
+            char c;
+            ssize_t n=read(client, &c, 1);
+            if (n>0 && c==CLISERVER_INTERRUPT) kill(pid, SIGINT);
+            else if (n==0 || (n<0 && errno!=EINTR)) {
+                kill(pid, SIGTERM); // No one is left to see the job's output
+                pfd[0].fd=-1;
+            }
+        }
+        
+        if (pfd[1].revents) { // Drain the notifications; waitpid then tells whether this job is done
+            char buffer[64];
+            while (read(cliserver_childpipe[0], buffer, sizeof(buffer))>0);
+        }
+    }
+    
+    if (WIFSIGNALED(wstatus)) return 128+WTERMSIG(wstatus);
+    return (WIFEXITED(wstatus) ? WEXITSTATUS(wstatus) : 1);
+}
+
+/** Handles a connection from a client */
+static void cliserver_handle(int client, int listener, cliserver_jobfn job) {
+    cliservermessage msg;
+    int fds[CLISERVER_NFDS];
+    int32_t status=1;
+    
+    if (!cliserver_receiveheader(client, &msg, fds)) return;
+    
+    char *strings=NULL;
+    if (msg.length>0 && msg.length<=CLISERVER_MAXMESSAGE && msg.argc<msg.length &&
+        (strings=MORPHO_MALLOC(msg.length)) &&
+        cliserver_read(client, strings, msg.length) && strings[msg.length-1]=='\0') {
+        char *end=strings+msg.length;
+        char *cwd=strings;
+        char *c=cwd+strlen(cwd)+1;
+        
+        const char *argv[msg.argc+1];
+        unsigned int argc;
+        for (argc=0; argc<msg.argc && c<end; argc++) {
+            argv[argc]=c;
+            c+=strlen(c)+1;
+        }
+        argv[argc]=NULL;
+        
+        if (argc==msg.argc) status=(int32_t) cliserver_forkjob(client, listener, job, fds, cwd, (int) argc, argv);
+    }
+    
+    if (strings) MORPHO_FREE(strings);
+    for (int i=0; i<CLISERVER_NFDS; i++) close(fds[i]);
+    
+    cliserver_write(client, &status, sizeof(status));
+}
+
+/** @brief Runs a server that executes jobs submitted by clients until interrupted
+ *  @param[in] socketpath - path of the socket to listen on, or NULL for the default
+ *  @param[in] job - function that runs each job
+ *  @returns exit status */
+int cliserver_serve(const char *socketpath, cliserver_jobfn job) {
+    struct sockaddr_un addr;
+    if (!cliserver_address(socketpath, &addr)) {
+        fprintf(stderr, "Invalid server socket path.\n");
+        return 1;
+    }
+    
+    /* Remove a socket left behind by a server that didn't exit cleanly, but don't displace a live one */
+    int existing=cliserver_connect(&addr);
+    if (existing>=0) {
+        close(existing);
+        fprintf(stderr, "A morpho server is already listening at '%s'.\n", addr.sun_path);
+        return 1;
+    }
+    unlink(addr.sun_path);
+    
+    int fd=socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd<0 || bind(fd, (struct sockaddr *) &addr, sizeof(addr))<0 || listen(fd, SOMAXCONN)<0) {
+        fprintf(stderr, "Could not listen at '%s': %s\n", addr.sun_path, strerror(errno));
+        if (fd>=0) close(fd);
+        return 1;
+    }
+    
+    /* Interrupt accept, rather than restarting it, so that the server can shut down cleanly */
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler=cliserver_signalhandler;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN); // Clients may go away while their job is running
+    
+    /* Learn when a job's process exits without polling for it */
+    if (pipe(cliserver_childpipe)!=0) {
+        fprintf(stderr, "Could not create a pipe: %s\n", strerror(errno));
+        close(fd);
+        unlink(addr.sun_path);
+        return 1;
+    }
+    for (int i=0; i<2; i++) {
+        fcntl(cliserver_childpipe[i], F_SETFL, O_NONBLOCK);
+        fcntl(cliserver_childpipe[i], F_SETFD, FD_CLOEXEC);
+    }
+    sa.sa_handler=cliserver_childhandler;
+    sa.sa_flags=SA_RESTART | SA_NOCLDSTOP;
+    sigaction(SIGCHLD, &sa, NULL);
+    
+    fprintf(stderr, "morpho server listening at '%s'.\n", addr.sun_path);
+    
+    while (!cliserver_stop) {
+        int client=accept(fd, NULL, NULL);
+        if (client<0) {
+            if (errno==EINTR || errno==ECONNABORTED) continue;
+            fprintf(stderr, "Server error: %s\n", strerror(errno));
+            break;
+        }
+        cliserver_handle(client, fd, job);
+        close(client);
+    }
+    
+    close(fd);
+    for (int i=0; i<2; i++) close(cliserver_childpipe[i]);
+    unlink(addr.sun_path);
+    return 0;
+}
@@ -0,0 +1,38 @@
+/** @file server.h
+ *  @author T J Atherton
+ *
+ *  @brief Resident server that runs jobs submitted by morpho6 clients
+*/
+
+#ifndef server_h
+#define server_h
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define CLISERVER_SOCKET "server.sock"
+#define CLISERVER_SOCKETENV "MORPHO6_SERVER" // Overrides the location of the socket
+
+#define CLISERVER_SERVE "-server"
+#define CLISERVER_CONNECT "-connect"
+
+#define CLISERVER_MAXMESSAGE (1<<20)
+
+#define CLISERVER_INTERRUPT 'i' // Sent by a client while its job runs to forward Ctrl-C
+
+/** A message submitting a job begins with this header; the client's stdin, stdout and stderr
+ *  accompany it as ancillary data, followed by the client's working directory and argv as a sequence of
+ *  zero terminated strings. While the job runs, the client may send CLISERVER_INTERRUPT to interrupt it.
+ *  The server replies with the job's exit status as an int32_t. */
+typedef struct {
+    uint32_t length; // Length of the strings that follow
+    uint32_t argc;
+} cliservermessage;
+
+/** Function that runs a job given its arguments, returning the exit status */
+typedef int (*cliserver_jobfn) (int argc, const char *argv[]);
+
+int cliserver_serve(const char *socketpath, cliserver_jobfn job);
+bool cliserver_submit(const char *socketpath, int argc, const char *argv[], int *status);
+
+#endif /* server_h */
@@ -0,0 +1,212 @@
+/** @file session.c
+ *  @author T J Atherton
+ *
+ *  @brief Stores the input of an interactive session
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <morpho.h>
+
+#include "session.h"
+
+DEFINE_VARRAY(clisessionchunk, clisessionchunk)
+DEFINE_VARRAY(clisessionentry, clisessionentry)
+DEFINE_VARRAY(clisessionline, clisessionline)
+DEFINE_VARRAY(clisessionindex, uint32_t)
+
+#define CLISESSION_SPILLTEMPLATE "/tmp/morpho6-sessionXXXXXX"
+
+/* **********************************************************************
+ * Spilling input to disk
+ * ********************************************************************** */
+
+/** Opens the spill file, which is unlinked at once so that it disappears with the process */
+static bool clisession_openspill(clisession *s) {
+    if (s->spillfd>=0) return true;
+
+    char path[]=CLISESSION_SPILLTEMPLATE;
+    s->spillfd=mkstemp(path);
+    if (s->spillfd<0) return false;
+    unlink(path);
+    s->spillsize=0;
+    return true;
+}
+
+/** Writes a chunk to the spill file and replaces it with a read only mapping of what was written */
+static bool clisession_spill(clisession *s, clisessionchunk *chunk) {
+    if (!clisession_openspill(s)) return false;
+
+    size_t page=(size_t) sysconf(_SC_PAGESIZE);
+    size_t offset=(s->spillsize+page-1)/page*page; // Mappings must begin on a page boundary
+
+    for (size_t n=0; n<chunk->length; ) {
+        ssize_t k=pwrite(s->spillfd, chunk->data+n, chunk->length-n, (off_t) (offset+n));
+        if (k<=0) return false;
+        n+=(size_t) k;
+    }
+
+    void *map=mmap(NULL, chunk->length, PROT_READ, MAP_PRIVATE, s->spillfd, (off_t) offset);
+    if (map==MAP_FAILED) return false;
+
+    s->spillsize=offset+chunk->length;
+    s->resident-=chunk->capacity;
+
+    MORPHO_FREE(chunk->data);
+    chunk->data=map;
+    chunk->map=map;
+    chunk->mapsize=chunk->length;
+    chunk->capacity=chunk->length;
+    return true;
+}
+
+/** Spills the oldest chunks until the input held in memory is within the limit; the chunk being
+ *  filled is always kept in memory */
+static void clisession_enforcelimit(clisession *s) {
+    if (!s->limit) return;
+
+    for (unsigned int i=0; i+1<s->chunks.count && s->resident>s->limit; i++) {
+        clisessionchunk *chunk=&s->chunks.data[i];
+        if (!chunk->map && !clisession_spill(s, chunk)) return;
+    }
+}
+
+/* **********************************************************************
+ * Interface
+ * ********************************************************************** */
+
+/** @brief Initializes a session
+ *  @param[in] s - session to initialize
+ *  @param[in] limit - bytes of input to keep in memory, or 0 for no limit */
+void clisession_init(clisession *s, size_t limit) {
+    varray_clisessionchunkinit(&s->chunks);
+    varray_clisessionentryinit(&s->entries);
+    varray_clisessionlineinit(&s->lines);
+    varray_clisessionindexinit(&s->history);
+    s->limit=limit;
+    s->resident=0;
+    s->spillfd=-1;
+    s->spillsize=0;
+}
+
+/** @brief Frees the contents of a session */
+void clisession_clear(clisession *s) {
+    for (unsigned int i=0; i<s->chunks.count; i++) {
+        clisessionchunk *chunk=&s->chunks.data[i];
+        if (chunk->map) munmap(chunk->map, chunk->mapsize);
+        else MORPHO_FREE(chunk->data);
+    }
+    if (s->spillfd>=0) close(s->spillfd);
+
+    varray_clisessionchunkclear(&s->chunks);
+    varray_clisessionentryclear(&s->entries);
+    varray_clisessionlineclear(&s->lines);
+    varray_clisessionindexclear(&s->history);
+    clisession_init(s, s->limit);
+}
+
+/** @brief Adds an entry to the session
+ *  @param[in] s - the session
+ *  @param[in] text - text that was entered
+ *  @param[in] flags - CLISESSION_SOURCE if the text compiled, and so forms part of the session's source, and
+ *                      CLISESSION_HISTORY if it should appear in the history
+ *  @returns true on success */
+bool clisession_add(clisession *s, const char *text, unsigned int flags) {
+    size_t length=strlen(text);
+    if (length>=UINT32_MAX) return false; // Lines are located by 32 bit offsets
+
+    clisessionchunk *chunk=(s->chunks.count ? &s->chunks.data[s->chunks.count-1] : NULL);
+
+    /* Begin a new chunk if the entry doesn't fit; entries larger than a chunk get a chunk of their own */
+    if (!chunk || chunk->map || chunk->capacity-chunk->length<length+1) {
+        clisessionchunk new = { .data = NULL, .length = 0, .map = NULL, .mapsize = 0 };
+        new.capacity=(length+1>CLISESSION_CHUNKSIZE ? length+1 : CLISESSION_CHUNKSIZE);
+        new.data=MORPHO_MALLOC(new.capacity);
+        if (!new.data) return false;
+        unsigned int nchunks=s->chunks.count;
+        varray_clisessionchunkwrite(&s->chunks, new);
+        if (s->chunks.count==nchunks) {
+            MORPHO_FREE(new.data);
+            return false;
+        }
+        s->resident+=new.capacity;
+        chunk=&s->chunks.data[s->chunks.count-1];
+    }
+
+    clisessionentry entry = { .chunk = s->chunks.count-1, .flags = flags,
+                              .offset = chunk->length, .length = length };
+    varray_clisessionentrywrite(&s->entries, entry);
+
+    memcpy(chunk->data+chunk->length, text, length);
+    chunk->data[chunk->length+length]='\n';
+    chunk->length+=length+1;
+
+    if (flags & CLISESSION_HISTORY) varray_clisessionindexwrite(&s->history, s->entries.count-1);
+    
+    /* Index the lines of source */
+    if (flags & CLISESSION_SOURCE) {
+        clisessionline line = { .chunk = entry.chunk, .offset = (uint32_t) entry.offset };
+        varray_clisessionlinewrite(&s->lines, line);
+        for (size_t i=0; i<length; i++) {
+            if (text[i]!='\n') continue;
+            line.offset=(uint32_t) (entry.offset+i+1);
+            varray_clisessionlinewrite(&s->lines, line);
+        }
+    }
+
+    clisession_enforcelimit(s);
+    return true;
+}
+
+/** @brief Returns the number of entries in the session */
+int clisession_count(clisession *s) {
+    return (int) s->entries.count;
+}
+
+/** @brief Gets an entry from the session
+ *  @param[in] s - the session
+ *  @param[in] n - entry to get, starting from 0 for the first one entered
+ *  @param[out] text - text of the entry; not zero terminated, and valid until the session is next added to
+ *  @param[out] length - length of the entry
+ *  @returns true if the entry exists */
+bool clisession_entry(clisession *s, int n, char **text, size_t *length) {
+    if (n<0 || n>=s->entries.count) return false;
+    clisessionentry *entry=&s->entries.data[n];
+    *text=s->chunks.data[entry->chunk].data+entry->offset;
+    *length=entry->length;
+    return true;
+}
+
+/** @brief Locates a line of the session's source
+ *  @param[in] s - the session
+ *  @param[in] line - line number, starting from 1
+ *  @param[out] start - start of the line; valid until the session is next added to
+ *  @param[out] length - length of the line, excluding the newline
+ *  @returns true if the line exists */
+bool clisession_line(clisession *s, int line, char **start, size_t *length) {
+    if (line<1 || line>s->lines.count) return false;
+    clisessionline *l=&s->lines.data[line-1];
+    clisessionchunk *chunk=&s->chunks.data[l->chunk];
+
+    *start=chunk->data+l->offset;
+    char *end=memchr(*start, '\n', chunk->length-l->offset); // Every entry is followed by a newline
+    *length=(size_t) (end-*start);
+    return true;
+}
+
+/** @brief History callback for linedit that supplies entries from a session, most recent first
+ *  @param[in] ref - the session
+ *  @param[in] n - entry to supply
+ *  @param[out] text - text of the entry
+ *  @param[out] length - length of the entry
+ *  @returns the number of entries available */
+int clisession_history(void *ref, unsigned int n, char **text, size_t *length) {
+    clisession *s = (clisession *) ref;
+    int count=(int) s->history.count;
+    if (n<count) clisession_entry(s, (int) s->history.data[count-1-(int) n], text, length);
+    return count;
+}
@@ -0,0 +1,78 @@
+/** @file session.h
+ *  @author T J Atherton
+ *
+ *  @brief Stores the input of an interactive session
+*/
+
+#ifndef session_h
+#define session_h
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include <varray.h>
+
+/** Every line entered in a session is held once, in a sequence of chunks, and serves both as the history
+ *  and, for input that compiled, as the session's source. Entries never straddle chunks, so each entry
+ *  and each line of source is contiguous in memory. If the session has a limit, chunks beyond the limit
+ *  are written to a temporary file and mapped back in, so the operating system may page them out. */
+
+#define CLISESSION_CHUNKSIZE (64*1024)
+
+#define CLISESSION_LIMITOPTION "sessionlimit" // -sessionlimit=N keeps at most N MB of input in memory
+
+/** A chunk of input */
+typedef struct {
+    char *data;        /** Text of the chunk */
+    size_t length;     /** Bytes in use */
+    size_t capacity;   /** Bytes available */
+    void *map;         /** Mapping of the chunk in the spill file, or NULL if the chunk is in memory */
+    size_t mapsize;    /** Size of the mapping */
+} clisessionchunk;
+
+#define CLISESSION_SOURCE  (1<<0) // The entry compiled and is part of the session's source
+#define CLISESSION_HISTORY (1<<1) // The entry appears in the history
+
+/** An entry in the session; its text is followed by a newline in the chunk */
+typedef struct {
+    uint32_t chunk;    /** Chunk containing the entry */
+    uint32_t flags;
+    size_t offset;     /** Offset of the entry in the chunk */
+    size_t length;     /** Length of the entry, excluding the newline */
+} clisessionentry;
+
+/** Start of a line of the session's source */
+typedef struct {
+    uint32_t chunk;
+    uint32_t offset;
+} clisessionline;
+
+DECLARE_VARRAY(clisessionchunk, clisessionchunk)
+DECLARE_VARRAY(clisessionentry, clisessionentry)
+DECLARE_VARRAY(clisessionline, clisessionline)
+DECLARE_VARRAY(clisessionindex, uint32_t)
+
+/** The input of a session */
+typedef struct {
+    varray_clisessionchunk chunks;
+    varray_clisessionentry entries;
+    varray_clisessionline lines;  /** Line n of the source begins at lines.data[n-1] */
+    varray_clisessionindex history; /** Entries that appear in the history, oldest first */
+    size_t limit;                 /** Bytes of input to keep in memory, or 0 for no limit */
+    size_t resident;              /** Bytes of input currently held in memory */
+    int spillfd;                  /** Spill file, or -1 if none has been needed */
+    size_t spillsize;             /** Size of the spill file */
+} clisession;
+
+void clisession_init(clisession *s, size_t limit);
+void clisession_clear(clisession *s);
+
+bool clisession_add(clisession *s, const char *text, unsigned int flags);
+
+int clisession_count(clisession *s);
+bool clisession_entry(clisession *s, int n, char **text, size_t *length);
+bool clisession_line(clisession *s, int line, char **start, size_t *length);
+int clisession_history(void *ref, unsigned int n, char **text, size_t *length);
+
+#endif /* session_h */
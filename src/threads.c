@@ -0,0 +1,475 @@
+/** @file threads.c
+ *  @author T J Atherton
+ *
+ *  @brief Chooses the number of worker threads for the runtime and where they run
+*/
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // For sched_getaffinity and cpu_set_t
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <time.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/wait.h>
+
+#ifdef __linux__
+#include <sched.h>
+#include <sys/syscall.h>
+#endif
+
+#include "threads.h"
+
+/** @brief The runtime's worker pool is created and managed by libmorpho, which only lets us set its size.
+ *  Placement is therefore controlled through CPU affinity: once the pool has been sized, every thread of
+ *  the process is restricted to the CPUs chosen by the policy, and each thread other than the one
+ *  running morpho is pinned to one of them. Threads the runtime creates later inherit the restriction.
+ *  The topology is read from sysfs and the cgroup hierarchy, which are only available on Linux; elsewhere
+ *  every CPU is taken to be a core of a single node and threads aren't pinned. */
+
+/* **********************************************************************
+ * Parsing -w
+ * ********************************************************************** */
+
+/** @brief Initializes settings as though -w was not given */
+void clithreads_optioninit(clithreadsoption *opt) {
+    opt->set=false;
+    opt->nthreads=0;
+    opt->automatic=false;
+    opt->bench=false;
+    opt->policy=CLITHREADS_NOPIN;
+}
+
+/** Checks whether a token of a -w setting is a given word */
+static bool clithreads_isword(const char *token, size_t length, const char *word) {
+    return (length==strlen(word) && strncmp(token, word, length)==0);
+}
+
+/** Checks whether a token of a -w setting is a number */
+static bool clithreads_isnumber(const char *token, size_t length) {
+    for (size_t i=0; i<length; i++) if (!isdigit((unsigned char) token[i])) return false;
+    return (length>0);
+}
+
+/** @brief Checks whether an argument that follows -w is its setting, rather than a script
+ *  @details Every comma separated token must be a number or one of the words, so that a script named
+ *           e.g. compact_test.m or 2dplot.m isn't mistaken for a setting */
+bool clithreads_isspec(const char *arg) {
+    for (const char *c=arg; ; ) {
+        const char *end=c;
+        while (*end!='\0' && *end!=',') end++;
+        size_t length=(size_t) (end-c);
+
+        if (!clithreads_isnumber(c, length) &&
+            !clithreads_isword(c, length, CLITHREADS_AUTO) &&
+            !clithreads_isword(c, length, CLITHREADS_BENCH) &&
+            !clithreads_isword(c, length, CLITHREADS_COMPACT) &&
+            !clithreads_isword(c, length, CLITHREADS_SCATTER)) return false;
+
+        if (*end=='\0') return true;
+        c=end+1;
+    }
+}
+
+/** @brief Parses a -w setting: a number of threads, auto or bench, optionally followed by ,compact or ,scatter
+ *  @param[in] spec - the setting
+ *  @param[out] opt - settings, updated with anything recognized
+ *  @returns true if anything was recognized */
+bool clithreads_parse(const char *spec, clithreadsoption *opt) {
+    bool recognized=false;
+
+    for (const char *c=spec; *c!='\0'; ) {
+        while (*c=='=') c++;
+        const char *end=c;
+        while (*end!='\0' && *end!=',') end++;
+        size_t length=(size_t) (end-c);
+
+        if (clithreads_isword(c, length, CLITHREADS_AUTO)) opt->automatic=recognized=true;
+        else if (clithreads_isword(c, length, CLITHREADS_BENCH)) opt->bench=recognized=true;
+        else if (clithreads_isword(c, length, CLITHREADS_COMPACT)) { opt->policy=CLITHREADS_PINCOMPACT; recognized=true; }
+        else if (clithreads_isword(c, length, CLITHREADS_SCATTER)) { opt->policy=CLITHREADS_PINSCATTER; recognized=true; }
+        else {
+            const char *d=c;
+            while (d<end && !isdigit((unsigned char) *d)) d++;
+            if (d<end) {
+                int n=atoi(d);
+                opt->nthreads=(n>0 ? n : 0);
+                opt->automatic=false;
+                recognized=true;
+            }
+        }
+
+        c=(*end==',' ? end+1 : end);
+    }
+
+    return recognized;
+}
+
+/* **********************************************************************
+ * Topology
+ * ********************************************************************** */
+
+/** Reads an integer from a file, such as one in sysfs */
+static bool clithreads_readint(const char *path, long long *out) {
+    FILE *f=fopen(path, "r");
+    if (!f) return false;
+    bool success=(fscanf(f, "%lld", out)==1);
+    fclose(f);
+    return success;
+}
+
+/** Finds the index of a value in a list, adding it if it's not present */
+static int clithreads_index(long long *list, int *n, int max, long long value) {
+    for (int i=0; i<*n; i++) if (list[i]==value) return i;
+    if (*n>=max) return max-1;
+    list[*n]=value;
+    return (*n)++;
+}
+
+#ifdef __linux__
+/** Reads a cgroup v2 cpu.max file, returning the CPUs allowed or 0 if unlimited */
+static double clithreads_cpumax(const char *path) {
+    FILE *f=fopen(path, "r");
+    if (!f) return 0;
+    char quota[32];
+    long long period=0;
+    double cpus=0;
+    if (fscanf(f, "%31s %lld", quota, &period)==2 && isdigit((unsigned char) quota[0]) && period>0) {
+        cpus=(double) atoll(quota)/(double) period;
+    }
+    fclose(f);
+    return cpus;
+}
+#endif
+
+/** Finds the CPUs allowed by a cgroup quota on the process, or 0 if there is none */
+static double clithreads_quota(void) {
+    double quota=0;
+#ifdef __linux__
+    /* cgroup v2 applies the tightest limit of the process's group and its ancestors */
+    char group[PATH_MAX]="";
+    FILE *f=fopen("/proc/self/cgroup", "r");
+    if (f) {
+        char line[PATH_MAX];
+        while (fgets(line, sizeof(line), f)) {
+            if (strncmp(line, "0::", 3)!=0) continue;
+            snprintf(group, sizeof(group), "%s", line+3);
+            group[strcspn(group, "\n")]='\0';
+        }
+        fclose(f);
+    }
+
+    for (;;) {
+        char path[PATH_MAX+32];
+        snprintf(path, sizeof(path), "/sys/fs/cgroup%s/cpu.max", (strcmp(group, "/")==0 ? "" : group));
+        double cpus=clithreads_cpumax(path);
+        if (cpus>0 && (quota==0 || cpus<quota)) quota=cpus;
+
+        char *slash=strrchr(group, '/');
+        if (!slash || group[0]=='\0' || strcmp(group, "/")==0) break;
+        if (slash==group) strcpy(group, "/");
+        else *slash='\0';
+    }
+
+    /* cgroup v1 */
+    const char *dirs[] = { "/sys/fs/cgroup/cpu", "/sys/fs/cgroup/cpu,cpuacct", NULL };
+    for (int i=0; quota==0 && dirs[i]; i++) {
+        char path[PATH_MAX];
+        long long q=0, period=0;
+        snprintf(path, sizeof(path), "%s/cpu.cfs_quota_us", dirs[i]);
+        if (!clithreads_readint(path, &q) || q<=0) continue;
+        snprintf(path, sizeof(path), "%s/cpu.cfs_period_us", dirs[i]);
+        if (clithreads_readint(path, &period) && period>0) quota=(double) q/(double) period;
+    }
+#endif
+    return quota;
+}
+
+/** Finds the NUMA node that a CPU belongs to, or 0 if it isn't known */
+static long long clithreads_cpunode(int cpu) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%i", cpu);
+    DIR *dir=opendir(path);
+    if (!dir) return 0;
+
+    long long node=0;
+    struct dirent *entry;
+    while ((entry=readdir(dir))) {
+        if (strncmp(entry->d_name, "node", 4)==0 && isdigit((unsigned char) entry->d_name[4])) {
+            node=atoll(entry->d_name+4);
+            break;
+        }
+    }
+    closedir(dir);
+    return node;
+}
+
+/** Identifies the physical core of a CPU by the first of the CPUs that share it; unlike core_id, which is
+ *  only unique within a die, this distinguishes the cores of every die and package */
+static long long clithreads_cpucore(int cpu) {
+    const char *files[] = { "core_cpus_list", "thread_siblings_list", NULL }; // The latter on older kernels
+    for (int i=0; files[i]; i++) {
+        char path[PATH_MAX];
+        long long first;
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%i/topology/%s", cpu, files[i]);
+        if (clithreads_readint(path, &first)) return first; // Lists are in ascending order
+    }
+    return cpu;
+}
+
+/** @brief Detects the CPUs, physical cores and NUMA nodes available to the process, and any cgroup quota */
+void clithreads_detect(clithreadstopology *t) {
+    t->ncpus=0;
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set)==0) {
+        for (int cpu=0; cpu<CPU_SETSIZE && t->ncpus<CLITHREADS_MAXCPUS; cpu++) {
+            if (CPU_ISSET(cpu, &set)) t->cpu[t->ncpus++]=cpu;
+        }
+    }
+#endif
+    if (t->ncpus==0) {
+        long n=sysconf(_SC_NPROCESSORS_ONLN);
+        if (n<1) n=1;
+        if (n>CLITHREADS_MAXCPUS) n=CLITHREADS_MAXCPUS;
+        for (int i=0; i<n; i++) t->cpu[i]=i;
+        t->ncpus=(int) n;
+    }
+
+    /* Number cores and nodes densely in the order they're first seen */
+    long long cores[CLITHREADS_MAXCPUS], nodes[CLITHREADS_MAXNODES];
+    t->ncores=t->nnodes=0;
+    for (int i=0; i<t->ncpus; i++) {
+        t->core[i]=clithreads_index(cores, &t->ncores, CLITHREADS_MAXCPUS, clithreads_cpucore(t->cpu[i]));
+        t->node[i]=clithreads_index(nodes, &t->nnodes, CLITHREADS_MAXNODES, clithreads_cpunode(t->cpu[i]));
+    }
+
+    t->quota=clithreads_quota();
+}
+
+/** @brief Recommends a number of threads: one per physical core, within any cgroup quota */
+int clithreads_recommended(clithreadstopology *t) {
+    int n=t->ncores;
+    if (t->quota>0 && t->quota<n) n=(int) t->quota; // Rounded down
+    return (n>0 ? n : 1);
+}
+
+/* **********************************************************************
+ * Pinning
+ * ********************************************************************** */
+
+/** Position of a CPU in the order threads are placed */
+typedef struct {
+    int cpu;   // Index of the CPU in the topology
+    int node;  // Its node
+    int rank;  // Number of CPUs that precede it on the same core, so that hyperthreads are used last
+    int posn;  // Number of CPUs of the same rank that precede it on the same node
+} clithreadsslot;
+
+static clithreadspolicy clithreads_sortpolicy;
+
+/** Orders CPUs so that those used first come first */
+static int clithreads_slotcmp(const void *a, const void *b) {
+    const clithreadsslot *x=a, *y=b;
+    int kx[3], ky[3];
+    if (clithreads_sortpolicy==CLITHREADS_PINSCATTER) {
+        kx[0]=x->rank; kx[1]=x->posn; kx[2]=x->node;
+        ky[0]=y->rank; ky[1]=y->posn; ky[2]=y->node;
+    } else {
+        kx[0]=x->node; kx[1]=x->rank; kx[2]=x->posn;
+        ky[0]=y->node; ky[1]=y->rank; ky[2]=y->posn;
+    }
+    for (int i=0; i<3; i++) if (kx[i]!=ky[i]) return (kx[i]<ky[i] ? -1 : 1);
+    return 0;
+}
+
+/** @brief Restricts the process to the CPUs a policy chooses for a number of threads, and pins its threads to them
+ *  @param[in] t - the topology
+ *  @param[in] nthreads - number of threads
+ *  @param[in] policy - placement policy
+ *  @returns true if the threads were pinned */
+bool clithreads_pin(clithreadstopology *t, int nthreads, clithreadspolicy policy) {
+    if (policy==CLITHREADS_NOPIN || t->ncpus<1) return false;
+#ifdef __linux__
+    clithreadsslot *slots=MORPHO_MALLOC(sizeof(clithreadsslot)*t->ncpus);
+    if (!slots) return false;
+
+    for (int i=0; i<t->ncpus; i++) {
+        slots[i].cpu=i;
+        slots[i].node=t->node[i];
+        slots[i].rank=slots[i].posn=0;
+        for (int j=0; j<i; j++) if (t->core[j]==t->core[i]) slots[i].rank++;
+        for (int j=0; j<i; j++) if (t->node[j]==t->node[i] && slots[j].rank==slots[i].rank) slots[i].posn++;
+    }
+    clithreads_sortpolicy=policy;
+    qsort(slots, t->ncpus, sizeof(clithreadsslot), clithreads_slotcmp);
+
+    int n=(nthreads<1 ? 1 : (nthreads>t->ncpus ? t->ncpus : nthreads));
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int i=0; i<n; i++) CPU_SET(t->cpu[slots[i].cpu], &set);
+
+    /* Restrict every thread of the process, then give each thread but this one a CPU of its own */
+    bool success=false;
+    pid_t self=(pid_t) syscall(SYS_gettid);
+    DIR *dir=opendir("/proc/self/task");
+    if (dir) {
+        struct dirent *entry;
+        int k=0;
+        while ((entry=readdir(dir))) {
+            if (!isdigit((unsigned char) entry->d_name[0])) continue;
+            pid_t tid=(pid_t) atoi(entry->d_name);
+            if (tid==self) {
+                success=(sched_setaffinity(tid, sizeof(set), &set)==0);
+            } else {
+                cpu_set_t one;
+                CPU_ZERO(&one);
+                CPU_SET(t->cpu[slots[k % n].cpu], &one);
+                sched_setaffinity(tid, sizeof(one), &one);
+                k++;
+            }
+        }
+        closedir(dir);
+    }
+
+    MORPHO_FREE(slots);
+    return success;
+#else
+    fprintf(stderr, "Threads can't be pinned on this platform.\n");
+    return false;
+#endif
+}
+
+/* **********************************************************************
+ * Interface
+ * ********************************************************************** */
+
+/** @brief Applies the settings given with -w to the runtime
+ *  @returns the number of threads used */
+int clithreads_configure(clithreadsoption *opt) {
+    if (!opt->set) return 0;
+
+    int n=opt->nthreads;
+    clithreadstopology *t=NULL;
+    if (opt->automatic || opt->policy!=CLITHREADS_NOPIN) {
+        t=MORPHO_MALLOC(sizeof(clithreadstopology));
+        if (t) clithreads_detect(t);
+    }
+    if (opt->automatic && t) n=clithreads_recommended(t);
+
+    morpho_setthreadnumber(n);
+    if (t && opt->policy!=CLITHREADS_NOPIN) clithreads_pin(t, n, opt->policy);
+
+    if (t) MORPHO_FREE(t);
+    return n;
+}
+
+/** Returns the time on a monotonic clock in seconds */
+static double clithreads_now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec+t.tv_nsec*1e-9;
+}
+
+#define CLITHREADS_MAXCANDIDATES 32
+
+/** Runs a script in a child process with a given number of threads, with its output discarded
+ *  @details The runtime's worker pool is created when it is first needed, and can't be resized once it
+ *           exists, so each run is made in a fresh child where the thread count can still be set
+ *  @returns exit status of the run, or -1 if the child couldn't be started */
+static int clithreads_benchrun(const char *file, clioptions opt, clithreadstopology *t, int n, clithreadspolicy policy, int null) {
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid=fork();
+    if (pid<0) return -1;
+
+    if (pid==0) {
+        morpho_setthreadnumber(n);
+        if (policy!=CLITHREADS_NOPIN) clithreads_pin(t, n, policy);
+        if (null>=0) dup2(null, STDOUT_FILENO);
+
+        int result=cli_run(file, opt & ~CLI_STATS);
+        cli_outputflush();
+        fflush(stdout);
+        _exit(result);
+    }
+
+    int status;
+    while (waitpid(pid, &status, 0)<0) if (errno!=EINTR) return -1;
+    if (WIFSIGNALED(status)) return 128+WTERMSIG(status);
+    return WEXITSTATUS(status);
+}
+
+/** @brief Runs a script with a range of thread counts, with its output discarded, and reports the fastest on stderr
+ *  @param[in] file - the script
+ *  @param[in] opt - options to run it with
+ *  @param[in] threads - settings given with -w, whose placement policy is used
+ *  @returns exit status */
+int clithreads_bench(const char *file, clioptions opt, clithreadsoption *threads) {
+    clithreadstopology *t=MORPHO_MALLOC(sizeof(clithreadstopology));
+    if (!t) return 1;
+    clithreads_detect(t);
+
+    fprintf(stderr, "%i CPUs, %i cores, %i NUMA node%s", t->ncpus, t->ncores, t->nnodes, (t->nnodes==1 ? "" : "s"));
+    if (t->quota>0) fprintf(stderr, ", cgroup quota of %.2f CPUs", t->quota);
+    fprintf(stderr, "\n");
+
+    /* Try powers of two up to the CPUs available, together with the recommended count */
+    int max=t->ncpus, recommended=clithreads_recommended(t);
+    if (t->quota>0 && t->quota<max) max=(int) t->quota+((int) t->quota<t->quota ? 1 : 0); // Rounded up
+    int candidates[CLITHREADS_MAXCANDIDATES], ncandidates=0;
+    for (int n=1; n<max && ncandidates<CLITHREADS_MAXCANDIDATES-2; n*=2) candidates[ncandidates++]=n;
+    candidates[ncandidates++]=max;
+    if (recommended<max) {
+        int i=ncandidates;
+        while (i>0 && candidates[i-1]>recommended) i--;
+        if (i==0 || candidates[i-1]!=recommended) {
+            memmove(candidates+i+1, candidates+i, sizeof(int)*(ncandidates-i));
+            candidates[i]=recommended;
+            ncandidates++;
+        }
+    }
+
+    int null=open("/dev/null", O_WRONLY);
+    int status=0, best=0;
+    double base=0, fastest=0;
+
+    fprintf(stderr, "%8s %12s %8s\n", "Threads", "Time (s)", "Speedup");
+    for (int i=0; i<ncandidates; i++) {
+        int n=candidates[i];
+
+        double start=clithreads_now();
+        int result=clithreads_benchrun(file, opt, t, n, threads->policy, null);
+        double time=clithreads_now()-start;
+
+        if (result<0) {
+            fprintf(stderr, "Could not start a process to run '%s': %s\n", file, strerror(errno));
+            status=1;
+            break;
+        } else if (result!=0) {
+            fprintf(stderr, "'%s' failed when run with %i thread%s.\n", file, n, (n==1 ? "" : "s"));
+            status=result;
+            break;
+        }
+
+        if (i==0) base=time;
+        if (best==0 || time<fastest) {
+            best=n;
+            fastest=time;
+        }
+        fprintf(stderr, "%8i %12.3f %7.2fx\n", n, time, (time>0 ? base/time : 1.0));
+    }
+
+    if (null>=0) close(null);
+    if (best) fprintf(stderr, "Fastest for '%s': -w%i\n", file, best);
+
+    MORPHO_FREE(t);
+    return status;
+}
@@ -0,0 +1,60 @@
+/** @file threads.h
+ *  @author T J Atherton
+ *
+ *  @brief Chooses the number of worker threads for the runtime and where they run
+*/
+
+#ifndef threads_h
+#define threads_h
+
+#include <stdbool.h>
+
+#include "cli.h"
+
+#define CLITHREADS_AUTO "auto"
+#define CLITHREADS_BENCH "bench"
+#define CLITHREADS_COMPACT "compact"
+#define CLITHREADS_SCATTER "scatter"
+
+#define CLITHREADS_MAXCPUS 1024 // CPUs considered when detecting the topology
+#define CLITHREADS_MAXNODES 64  // NUMA nodes distinguished
+
+/** How worker threads are placed on the machine */
+typedef enum {
+    CLITHREADS_NOPIN,      // Leave placement to the operating system
+    CLITHREADS_PINCOMPACT, // Fill the cores of one NUMA node before using the next
+    CLITHREADS_PINSCATTER  // Spread threads evenly across NUMA nodes
+} clithreadspolicy;
+
+/** Settings given with -w, e.g. -w4, -w auto or -w auto,compact */
+typedef struct {
+    bool set;                 /** Whether -w was given */
+    int nthreads;             /** Number of threads requested */
+    bool automatic;           /** Choose the number of threads from the machine */
+    bool bench;               /** Time the script with several thread counts */
+    clithreadspolicy policy;  /** How threads are placed */
+} clithreadsoption;
+
+/** The part of the machine available to this process */
+typedef struct {
+    int ncpus;               /** Logical CPUs the process may run on */
+    int ncores;              /** Physical cores among them */
+    int nnodes;              /** NUMA nodes among them */
+    double quota;            /** CPUs allowed by a cgroup quota, or 0 if there is none */
+    int cpu[CLITHREADS_MAXCPUS];     /** The CPUs */
+    int core[CLITHREADS_MAXCPUS];    /** Physical core of each CPU, numbered from 0 */
+    int node[CLITHREADS_MAXCPUS];    /** NUMA node of each CPU, numbered from 0 */
+} clithreadstopology;
+
+void clithreads_optioninit(clithreadsoption *opt);
+bool clithreads_isspec(const char *arg);
+bool clithreads_parse(const char *spec, clithreadsoption *opt);
+
+void clithreads_detect(clithreadstopology *t);
+int clithreads_recommended(clithreadstopology *t);
+bool clithreads_pin(clithreadstopology *t, int nthreads, clithreadspolicy policy);
+
+int clithreads_configure(clithreadsoption *opt);
+int clithreads_bench(const char *file, clioptions opt, clithreadsoption *threads);
+
+#endif /* threads_h */
@@ -0,0 +1,537 @@
+/** @file trace.c
+ *  @author T J Atherton
+ *
+ *  @brief Records an execution trace without stopping the program
+*/
+
+#include <stdio.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <vm.h>
+
+#include "trace.h"
+#include "cli.h"
+
+/** @brief Tracing runs the program under the debugger with single stepping turned on, but with a
+ *  debugger callback that records an event and returns rather than prompting the user. Each source
+ *  location is looked up in a table built from the program's annotations before the run, so that the
+ *  cost of an instruction is a comparison or two; function entry and exit are detected from changes to
+ *  the vm's frame pointer. Events are written into a fixed size ring buffer that keeps the most recent,
+ *  and the buffer is written to the log when the run ends, or from a signal handler if it crashes. */
+
+/* **********************************************************************
+ * Trace storage
+ * ********************************************************************** */
+
+#define CLITRACE_NONAME UINT32_MAX
+#define CLITRACE_NAMESIZE 256
+
+/** Maps a function to its name */
+typedef struct {
+    objectfunction *func;
+    uint32_t name;
+} clitracefunction;
+
+typedef struct {
+    vm *v;                        // vm being traced
+    program *p;                   // program being run
+    int fd;                       // Log file, or -1
+
+    clitraceevent *events;        // Ring buffer of CLITRACE_CAPACITY events
+    volatile uint64_t total;      // Events recorded
+
+    varray_char names;            // Zero terminated names referred to by events
+    uint32_t nnames;
+
+    uint32_t *lines;              // Source line of each instruction
+    uint32_t *modules;            // Module containing each instruction
+    instructionindx ninstr;
+
+    clitracefunction *functions;  // Open addressing table of the functions seen
+    unsigned int nfunctions;
+    unsigned int functionsize;
+
+    objectfunction *func;         // Function currently executing
+    unsigned int depth;           // Depth of its frame
+    uint32_t name;                // Its name
+    uint32_t line;                // Current line and module
+    uint32_t module;
+} clitrace;
+
+static clitrace trace = { .v = NULL, .fd = -1, .events = NULL };
+
+static const char *clitrace_output = NULL;
+static bool clitrace_registers = false;
+
+static int clitrace_signals[] = { SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT };
+#define CLITRACE_NSIGNALS (sizeof(clitrace_signals)/sizeof(int))
+static struct sigaction clitrace_oldactions[CLITRACE_NSIGNALS];
+
+/** Sets the file that the trace is written to; tracing is enabled only if a file is given */
+void clitrace_setoutput(const char *file) {
+    clitrace_output=file;
+}
+
+/** Sets whether registers are recorded each time a new line is reached */
+void clitrace_setregisters(bool registers) {
+    clitrace_registers=registers;
+}
+
+/** Frees trace storage */
+static void clitrace_clear(void) {
+    if (trace.fd>=0) close(trace.fd);
+    if (trace.events) MORPHO_FREE(trace.events);
+    if (trace.lines) MORPHO_FREE(trace.lines);
+    if (trace.modules) MORPHO_FREE(trace.modules);
+    if (trace.functions) MORPHO_FREE(trace.functions);
+    varray_charclear(&trace.names);
+
+    trace.v=NULL;
+    trace.p=NULL;
+    trace.fd=-1;
+    trace.events=NULL;
+    trace.lines=trace.modules=NULL;
+    trace.functions=NULL;
+    trace.total=0;
+    trace.nnames=0;
+    trace.ninstr=0;
+    trace.nfunctions=trace.functionsize=0;
+}
+
+/** Finds a name, adding it if it hasn't been seen
+ *  @returns the name's index, or CLITRACE_NONAME if it couldn't be added */
+static uint32_t clitrace_intern(const char *name) {
+    uint32_t n=0;
+    for (unsigned int i=0; i<trace.names.count; i+=strlen(trace.names.data+i)+1, n++) {
+        if (strcmp(trace.names.data+i, name)==0) return n;
+    }
+
+    unsigned int count=trace.names.count;
+    if (!varray_charadd(&trace.names, (char *) name, (int) strlen(name)+1)) {
+        trace.names.count=count;
+        return CLITRACE_NONAME;
+    }
+    return trace.nnames++;
+}
+
+/** Builds the table of the line and module of each instruction from the program's annotations */
+static bool clitrace_buildlines(program *p, const char *in) {
+    trace.ninstr=p->code.count;
+    trace.lines=MORPHO_MALLOC(sizeof(uint32_t)*(trace.ninstr+1));
+    trace.modules=MORPHO_MALLOC(sizeof(uint32_t)*(trace.ninstr+1));
+    if (!trace.lines || !trace.modules) return false;
+
+    uint32_t main=clitrace_intern(in), module=main, line=0;
+    instructionindx i=0;
+
+    for (unsigned int j=0; j<p->annotations.count; j++) {
+        debugannotation *ann = &p->annotations.data[j];
+        switch (ann->type) {
+            case DEBUG_ELEMENT:
+                line=(uint32_t) ann->content.element.line;
+                for (int k=0; k<ann->content.element.ninstr && i<trace.ninstr; k++, i++) {
+                    trace.lines[i]=line;
+                    trace.modules[i]=module;
+                }
+                break;
+            case DEBUG_MODULE: {
+                value mod=ann->content.module.module;
+                module=(MORPHO_ISSTRING(mod) ? clitrace_intern(MORPHO_GETCSTRING(mod)) : main);
+            }
+                break;
+            default:
+                break;
+        }
+    }
+
+    /* Instructions without annotations are attributed to the last line */
+    for (; i<trace.ninstr; i++) {
+        trace.lines[i]=line;
+        trace.modules[i]=module;
+    }
+    return true;
+}
+
+/* **********************************************************************
+ * Recording
+ * ********************************************************************** */
+
+/** Adds an event to the ring buffer, overwriting the oldest if it's full */
+static inline clitraceevent *clitrace_record(uint8_t type, uint32_t id) {
+    clitraceevent *e=&trace.events[trace.total & (CLITRACE_CAPACITY-1)];
+    e->type=type;
+    e->tag=0;
+    e->depth=(uint16_t) trace.depth;
+    e->id=id;
+    e->data.at.module=trace.module;
+    e->data.at.line=trace.line;
+    trace.total++;
+    return e;
+}
+
+/** Constructs the name of a function, including the class of a method */
+static uint32_t clitrace_namefunction(objectfunction *func, instructionindx iindx, unsigned int depth) {
+    if (depth==0) return clitrace_intern(CLITRACE_GLOBAL);
+    if (!func || !MORPHO_ISSTRING(func->name)) return clitrace_intern(CLITRACE_ANONYMOUS);
+
+    char *name=MORPHO_GETCSTRING(func->name);
+    value module=MORPHO_NIL;
+    int line=0;
+    objectfunction *fn=NULL;
+    objectclass *klass=NULL;
+    if (debug_infofromindx(trace.p, iindx, &module, &line, NULL, &fn, &klass) &&
+        klass && MORPHO_ISSTRING(klass->name)) {
+        char buffer[CLITRACE_NAMESIZE];
+        snprintf(buffer, CLITRACE_NAMESIZE, "%s.%s", MORPHO_GETCSTRING(klass->name), name);
+        return clitrace_intern(buffer);
+    }
+    return clitrace_intern(name);
+}
+
+/** Finds the name of a function, naming it the first time it's seen */
+static uint32_t clitrace_function(objectfunction *func, instructionindx iindx, unsigned int depth) {
+    if (trace.nfunctions*2>=trace.functionsize) {
+        /* Grow the table, keeping it at most half full */
+        unsigned int size=(trace.functionsize ? 2*trace.functionsize : 64);
+        clitracefunction *new=MORPHO_MALLOC(sizeof(clitracefunction)*size);
+        if (!new) return clitrace_namefunction(func, iindx, depth);
+        for (unsigned int i=0; i<size; i++) new[i].func=NULL;
+        for (unsigned int i=0; i<trace.functionsize; i++) {
+            clitracefunction *f=&trace.functions[i];
+            if (!f->func) continue;
+            unsigned int j=((uintptr_t) f->func >> 4) & (size-1);
+            while (new[j].func) j=(j+1) & (size-1);
+            new[j]=*f;
+        }
+        if (trace.functions) MORPHO_FREE(trace.functions);
+        trace.functions=new;
+        trace.functionsize=size;
+    }
+
+    unsigned int j=((uintptr_t) func >> 4) & (trace.functionsize-1);
+    for (; trace.functions[j].func; j=(j+1) & (trace.functionsize-1)) {
+        if (trace.functions[j].func==func) return trace.functions[j].name;
+    }
+
+    trace.functions[j].func=func;
+    trace.functions[j].name=clitrace_namefunction(func, iindx, depth);
+    trace.nfunctions++;
+    return trace.functions[j].name;
+}
+
+/** Records the contents of the current frame's registers */
+static void clitrace_snapshot(vm *v) {
+    objectfunction *func=v->fp->function;
+    if (!func) return;
+    int n=(func->nregs<CLITRACE_MAXREGISTERS ? func->nregs : CLITRACE_MAXREGISTERS);
+    value *reg=v->stack.data+v->fp->roffset;
+
+    for (int i=0; i<n; i++) {
+        clitraceevent *e=clitrace_record(CLITRACE_REGISTER, (uint32_t) i);
+        value val=reg[i];
+        if (MORPHO_ISINTEGER(val)) {
+            e->tag=CLITRACE_INTEGER;
+            e->data.number=(double) MORPHO_GETINTEGERVALUE(val);
+        } else if (MORPHO_ISFLOAT(val)) {
+            e->tag=CLITRACE_FLOAT;
+            e->data.number=MORPHO_GETFLOATVALUE(val);
+        } else if (MORPHO_ISBOOL(val)) {
+            e->tag=CLITRACE_BOOL;
+            e->data.number=(MORPHO_GETBOOLVALUE(val) ? 1.0 : 0.0);
+        } else {
+            e->tag=(MORPHO_ISOBJECT(val) ? CLITRACE_OBJECT : CLITRACE_NIL);
+            e->data.number=0.0;
+        }
+    }
+}
+
+/** Debugger callback called on every instruction while tracing */
+static void clitrace_debuggerfn(vm *v, void *ref) {
+    debugger *d=vm_getdebugger(v);
+    instructionindx iindx=d->iindx;
+    unsigned int depth=(unsigned int) (v->fp-v->frame);
+    objectfunction *func=v->fp->function;
+
+    if (func!=trace.func || depth!=trace.depth) {
+        bool returned=(depth<trace.depth);
+        if (depth==trace.depth && depth>0) {
+            /* A return followed at once by another call from the caller, e.g. f(g()) */
+            objectfunction *caller=(v->fp-1)->function;
+            clitrace_record(CLITRACE_RETURN, clitrace_function(caller, iindx, depth-1));
+        }
+        trace.func=func;
+        trace.depth=depth;
+        trace.name=clitrace_function(func, iindx, depth);
+        clitrace_record((returned ? CLITRACE_RETURN : CLITRACE_CALL), trace.name);
+        trace.line=CLITRACE_NONAME; // Record the line reached in the new function
+    }
+
+    if (iindx<trace.ninstr &&
+        (trace.lines[iindx]!=trace.line || trace.modules[iindx]!=trace.module)) {
+        trace.line=trace.lines[iindx];
+        trace.module=trace.modules[iindx];
+        clitrace_record(CLITRACE_LINE, trace.name);
+        if (clitrace_registers) clitrace_snapshot(v);
+    }
+}
+
+/* **********************************************************************
+ * Writing the log
+ * ********************************************************************** */
+
+/** Writes a buffer in full; safe to call from a signal handler */
+static bool clitrace_write(int fd, const void *data, size_t size) {
+    const char *c=data;
+    while (size>0) {
+        ssize_t n=write(fd, c, size);
+        if (n<=0) return false;
+        c+=n;
+        size-=(size_t) n;
+    }
+    return true;
+}
+
+/** Writes the ring buffer to the log; safe to call from a signal handler
+ *  @param[in] sig - signal that ended the run, or 0 */
+static bool clitrace_flush(int sig) {
+    if (trace.fd<0 || !trace.events) return false;
+
+    uint64_t total=trace.total;
+    uint64_t n=(total<CLITRACE_CAPACITY ? total : CLITRACE_CAPACITY);
+    uint64_t first=(total-n) & (CLITRACE_CAPACITY-1);
+    uint64_t tail=(first+n>CLITRACE_CAPACITY ? CLITRACE_CAPACITY-first : n);
+
+    clitraceheader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CLITRACE_MAGIC, sizeof(header.magic));
+    header.version=CLITRACE_VERSION;
+    header.eventsize=sizeof(clitraceevent);
+    header.total=total;
+    header.nevents=n;
+    header.namesize=trace.names.count;
+    header.signal=(uint32_t) sig;
+    header.registers=clitrace_registers;
+
+    return (lseek(trace.fd, 0, SEEK_SET)==0 &&
+            clitrace_write(trace.fd, &header, sizeof(header)) &&
+            clitrace_write(trace.fd, trace.events+first, sizeof(clitraceevent)*tail) &&
+            clitrace_write(trace.fd, trace.events, sizeof(clitraceevent)*(n-tail)) &&
+            clitrace_write(trace.fd, trace.names.data, trace.names.count));
+}
+
+/** Writes the trace if the program crashes, then lets the signal take its usual course */
+static void clitrace_crashhandler(int sig) {
+    clitrace_flush(sig);
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+/** @brief Prepares to trace a run of a program, if a trace output file has been set; run the program with morpho_debug
+ *  @param[in] v - the vm that will run the program
+ *  @param[in] p - the program, which must already be compiled
+ *  @param[in] in - name of the program's source file
+ *  @returns true if tracing began */
+bool clitrace_start(vm *v, program *p, const char *in) {
+    if (!clitrace_output) return false;
+
+    clitrace_clear();
+    varray_charinit(&trace.names);
+    trace.events=MORPHO_MALLOC(sizeof(clitraceevent)*CLITRACE_CAPACITY);
+    if (!trace.events || !clitrace_buildlines(p, in)) {
+        clitrace_clear();
+        return false;
+    }
+
+    trace.fd=open(clitrace_output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (trace.fd<0) {
+        fprintf(stderr, "Could not write trace to '%s'.\n", clitrace_output);
+        clitrace_clear();
+        return false;
+    }
+
+    trace.v=v;
+    trace.p=p;
+    trace.func=NULL;
+    trace.depth=0;
+    trace.line=trace.module=CLITRACE_NONAME;
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler=clitrace_crashhandler;
+    sigemptyset(&sa.sa_mask);
+    for (unsigned int i=0; i<CLITRACE_NSIGNALS; i++) sigaction(clitrace_signals[i], &sa, &clitrace_oldactions[i]);
+
+    morpho_setdebuggerfn(v, clitrace_debuggerfn, NULL);
+    debugger_setsinglestep(vm_getdebugger(v), true);
+    return true;
+}
+
+/** @brief Stops tracing and writes the log; call before the program is freed
+ *  @param[in] err - the error that ended the run, or NULL if it succeeded */
+void clitrace_stop(error *err) {
+    if (!trace.events) return;
+
+    for (unsigned int i=0; i<CLITRACE_NSIGNALS; i++) sigaction(clitrace_signals[i], &clitrace_oldactions[i], NULL);
+
+    if (err && err->cat!=ERROR_NONE && err->id) clitrace_record(CLITRACE_ERROR, clitrace_intern(err->id));
+
+    if (!clitrace_flush(0)) fprintf(stderr, "Could not write trace to '%s'.\n", clitrace_output);
+    clitrace_clear();
+}
+
+/* **********************************************************************
+ * Summary
+ * ********************************************************************** */
+
+/** Totals for a function */
+typedef struct {
+    uint32_t name;
+    uint64_t calls;
+    uint64_t lines;
+} clitracetotal;
+
+/** Orders functions by the number of lines executed, most first */
+static int clitrace_totalcmp(const void *a, const void *b) {
+    const clitracetotal *x=a, *y=b;
+    if (x->lines!=y->lines) return (x->lines<y->lines ? 1 : -1);
+    return (x->calls<y->calls ? 1 : (x->calls>y->calls ? -1 : 0));
+}
+
+/** Displays an event, indented by its depth */
+static void clitrace_showevent(clitraceevent *e, char **names, uint32_t nnames) {
+    const char *name=(e->id<nnames ? names[e->id] : "?");
+    const char *module=(e->data.at.module<nnames ? names[e->data.at.module] : "?");
+    printf("%*s", 2*(e->depth<16 ? e->depth : 16), "");
+
+    switch (e->type) {
+        case CLITRACE_CALL: printf("-> %s\n", name); break;
+        case CLITRACE_RETURN: printf("<- %s\n", name); break;
+        case CLITRACE_LINE: printf("%s at %s:%u\n", name, module, e->data.at.line); break;
+        case CLITRACE_ERROR: printf("Error '%s'\n", name); break;
+        case CLITRACE_REGISTER:
+            switch (e->tag) {
+                case CLITRACE_INTEGER: printf("   r%u = %lli\n", e->id, (long long) e->data.number); break;
+                case CLITRACE_FLOAT: printf("   r%u = %g\n", e->id, e->data.number); break;
+                case CLITRACE_BOOL: printf("   r%u = %s\n", e->id, (e->data.number!=0.0 ? "true" : "false")); break;
+                case CLITRACE_OBJECT: printf("   r%u = <object>\n", e->id); break;
+                default: printf("   r%u = nil\n", e->id); break;
+            }
+            break;
+        default: break;
+    }
+}
+
+/** A trace log read back into memory */
+typedef struct {
+    clitraceheader header;
+    clitraceevent *events;
+    char *namedata;     // Zero terminated names
+    char **names;       // Start of each name
+    uint32_t nnames;
+} clitracelog;
+
+/** Frees a log read into memory */
+static void clitrace_logclear(clitracelog *log) {
+    if (log->events) MORPHO_FREE(log->events);
+    if (log->namedata) MORPHO_FREE(log->namedata);
+    if (log->names) MORPHO_FREE(log->names);
+    log->events=NULL;
+    log->namedata=NULL;
+    log->names=NULL;
+    log->nnames=0;
+}
+
+/** Reads a trace log, checking that it was written by this version */
+static bool clitrace_read(const char *file, clitracelog *log) {
+    log->events=NULL;
+    log->namedata=NULL;
+    log->names=NULL;
+    log->nnames=0;
+
+    FILE *f=fopen(file, "rb");
+    if (!f) {
+        fprintf(stderr, "Could not open trace '%s'.\n", file);
+        return false;
+    }
+
+    clitraceheader *header=&log->header;
+    bool success=(fread(header, sizeof(clitraceheader), 1, f)==1 &&
+                  memcmp(header->magic, CLITRACE_MAGIC, sizeof(header->magic))==0 &&
+                  header->version==CLITRACE_VERSION && header->eventsize==sizeof(clitraceevent) &&
+                  header->nevents<=CLITRACE_CAPACITY);
+    if (!success) fprintf(stderr, "'%s' is not a trace written by this version of morpho.\n", file);
+
+    if (success) {
+        log->events=MORPHO_MALLOC(sizeof(clitraceevent)*(header->nevents+1));
+        log->namedata=MORPHO_MALLOC(header->namesize+1);
+        success=(log->events && log->namedata &&
+                 fread(log->events, sizeof(clitraceevent), header->nevents, f)==header->nevents &&
+                 fread(log->namedata, 1, header->namesize, f)==header->namesize);
+        if (!success) fprintf(stderr, "Could not read trace '%s'.\n", file);
+    }
+    fclose(f);
+
+    if (success) {
+        /* Find where each name begins */
+        log->namedata[header->namesize]='\0';
+        for (uint64_t i=0; i<header->namesize; i++) if (log->namedata[i]=='\0') log->nnames++;
+
+        log->names=MORPHO_MALLOC(sizeof(char *)*(log->nnames+1));
+        success=(log->names!=NULL);
+        for (uint32_t i=0, k=0; success && i<log->nnames; i++) {
+            log->names[i]=log->namedata+k;
+            k+=(uint32_t) strlen(log->namedata+k)+1;
+        }
+    }
+
+    if (!success) clitrace_logclear(log);
+    return success;
+}
+
+/** @brief Reads a trace log and displays a summary: calls and lines executed by each function, and the final events
+ *  @returns true on success */
+bool clitrace_summary(const char *file) {
+    clitracelog log;
+    if (!clitrace_read(file, &log)) return false;
+    clitraceheader *header=&log.header;
+
+    clitracetotal *totals=MORPHO_MALLOC(sizeof(clitracetotal)*(log.nnames+1));
+    if (!totals) {
+        clitrace_logclear(&log);
+        return false;
+    }
+    for (uint32_t i=0; i<log.nnames; i++) {
+        totals[i].name=i;
+        totals[i].calls=totals[i].lines=0;
+    }
+
+    for (uint64_t i=0; i<header->nevents; i++) {
+        clitraceevent *e=&log.events[i];
+        if (e->id>=log.nnames) continue;
+        if (e->type==CLITRACE_CALL) totals[e->id].calls++;
+        else if (e->type==CLITRACE_LINE) totals[e->id].lines++;
+    }
+    qsort(totals, log.nnames, sizeof(clitracetotal), clitrace_totalcmp);
+
+    printf("Trace '%s': %llu events recorded", file, (unsigned long long) header->total);
+    if (header->nevents<header->total) printf(", of which the last %llu were kept", (unsigned long long) header->nevents);
+    printf(".\n");
+    if (header->signal) printf("The run was ended by signal %u.\n", header->signal);
+
+    printf("\n%12s %12s  %s\n", "Calls", "Lines", "Function");
+    for (uint32_t i=0; i<log.nnames && i<CLITRACE_SUMMARYFUNCTIONS; i++) {
+        if (!totals[i].lines && !totals[i].calls) break;
+        printf("%12llu %12llu  %s\n", (unsigned long long) totals[i].calls,
+               (unsigned long long) totals[i].lines, log.names[totals[i].name]);
+    }
+
+    uint64_t start=(header->nevents>CLITRACE_SUMMARYEVENTS ? header->nevents-CLITRACE_SUMMARYEVENTS : 0);
+    printf("\nLast %llu events:\n", (unsigned long long) (header->nevents-start));
+    for (uint64_t i=start; i<header->nevents; i++) clitrace_showevent(&log.events[i], log.names, log.nnames);
+
+    MORPHO_FREE(totals);
+    clitrace_logclear(&log);
+    return true;
+}
@@ -0,0 +1,84 @@
+/** @file trace.h
+ *  @author T J Atherton
+ *
+ *  @brief Records an execution trace without stopping the program
+*/
+
+#ifndef trace_h
+#define trace_h
+
+#include <stdint.h>
+
+#include <morpho.h>
+
+#define CLITRACE_OPTION "trace"
+#define CLITRACE_REGISTERSOPTION "traceregisters"
+#define CLITRACE_SUMMARYOPTION "tracesummary"
+
+#define CLITRACE_DEFAULTOUTPUT "morpho.trace"
+
+#define CLITRACE_MAGIC "MRPTRACE"
+#define CLITRACE_VERSION 1
+
+#define CLITRACE_CAPACITY (1<<20)      // Events kept in the ring buffer; must be a power of two
+#define CLITRACE_MAXREGISTERS 8        // Registers recorded in each snapshot
+#define CLITRACE_SUMMARYFUNCTIONS 20   // Functions listed by a summary
+#define CLITRACE_SUMMARYEVENTS 40      // Events replayed by a summary
+
+#define CLITRACE_GLOBAL "(global)"
+#define CLITRACE_ANONYMOUS "(anonymous)"
+
+/** Kinds of event */
+enum {
+    CLITRACE_CALL,      // A function was entered
+    CLITRACE_RETURN,    // Control returned to a function
+    CLITRACE_LINE,      // Execution reached a new source line
+    CLITRACE_REGISTER,  // Contents of a register when the line was reached
+    CLITRACE_ERROR      // The run ended with an error
+};
+
+/** Kinds of value held in a register snapshot */
+enum {
+    CLITRACE_NIL,
+    CLITRACE_INTEGER,
+    CLITRACE_FLOAT,
+    CLITRACE_BOOL,
+    CLITRACE_OBJECT
+};
+
+/** An event; events are a fixed size so that the log is written from a signal handler as it stands */
+typedef struct {
+    uint8_t type;        /** Kind of event */
+    uint8_t tag;         /** For a register snapshot, the kind of value held */
+    uint16_t depth;      /** Call depth, the global function being at depth 0 */
+    uint32_t id;         /** Name of the function, or of the error; for a register snapshot, the register */
+    union {
+        struct {
+            uint32_t module; /** Name of the module */
+            uint32_t line;   /** Source line */
+        } at;
+        double number;       /** Value held in a register */
+    } data;
+} clitraceevent;
+
+/** Header of a trace log. It is followed by the events, oldest first, and then by the zero terminated names that events refer to; name n is the nth of these */
+typedef struct {
+    char magic[8];       /** CLITRACE_MAGIC */
+    uint32_t version;    /** CLITRACE_VERSION */
+    uint32_t eventsize;  /** Size of an event */
+    uint64_t total;      /** Events recorded during the run */
+    uint64_t nevents;    /** Events in the log, which are the most recent recorded */
+    uint64_t namesize;   /** Size of the names in bytes */
+    uint32_t signal;     /** Signal that ended the run, or 0 */
+    uint32_t registers;  /** Whether register snapshots were recorded */
+} clitraceheader;
+
+void clitrace_setoutput(const char *file);
+void clitrace_setregisters(bool registers);
+
+bool clitrace_start(vm *v, program *p, const char *in);
+void clitrace_stop(error *err);
+
+bool clitrace_summary(const char *file);
+
+#endif /* trace_h */
@@ -0,0 +1,287 @@
+/** @file test.c
+ *  @author T J Atherton
+ *
+ *  @brief Tests for the cli
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cli.h"
+#include "jobs.h"
+#include "linedit.h"
+
+/** @brief Usage: morpho6-test [-filter=text]
+ *  @details Runs each test in turn, reporting those that fail on stderr. The exit status is the
+ *  number of tests that failed, so that the tests may be run with ctest. */
+
+#define TEST_MAXLENGTH 4096
+#define TEST_RANDOMEDITS 2000
+
+/* Functions internal to linedit that are tested */
+void linedit_syntaxcacheupdate(lineditor *edit, linedit_string *in);
+void linedit_stringinit(linedit_string *string);
+void linedit_stringclear(linedit_string *string);
+void linedit_stringappend(linedit_string *string, char *c, size_t nbytes);
+
+/* **********************************************************************
+ * Test runner
+ * ********************************************************************** */
+
+typedef bool (*testfn) (void);
+
+static const char *test_filter = NULL;
+static int test_nfailed = 0;
+
+/** Reports a failed check, along with where it was made */
+#define TEST_CHECK(cond) if (!(cond)) { fprintf(stderr, "  %s:%i: check '%s' failed\n", __FILE__, __LINE__, #cond); return false; }
+
+/** Runs a test */
+static void test_run(const char *name, testfn fn) {
+    if (test_filter && !strstr(name, test_filter)) return;
+    bool success=fn();
+    if (!success) test_nfailed++;
+    fprintf(stderr, "%-40s %s\n", name, (success ? "ok" : "FAILED"));
+}
+
+/* **********************************************************************
+ * Syntax coloring
+ * ********************************************************************** */
+
+/** Records the color of each byte of a string from the cached token stream */
+static void test_colors(lineditor *edit, size_t length, linedit_color *out) {
+    for (size_t i=0; i<length; i++) out[i]=LINEDIT_DEFAULTCOLOR;
+    
+    linedit_syntaxcache *cache=&edit->syntaxcache;
+    for (int i=0; i<cache->nlines; i++) {
+        linedit_syntaxline *line=&cache->lines[i];
+        for (int j=0; j<line->nspans; j++) {
+            linedit_tokenspan *span=&line->spans[j];
+            for (size_t k=0; k<span->length; k++) {
+                size_t offset=line->start+span->offset+k;
+                if (offset<length) out[offset]=span->col;
+            }
+        }
+    }
+}
+
+/** Brings an editor's cached token stream up to date with text, and checks it colors the text as an editor starting from scratch does */
+static bool test_syntaxmatches(lineditor *edit, const char *text) {
+    size_t length=strlen(text);
+    if (length>TEST_MAXLENGTH) return false;
+    
+    linedit_string in;
+    linedit_stringinit(&in);
+    linedit_stringappend(&in, (char *) text, length);
+    linedit_syntaxcacheupdate(edit, &in);
+    
+    lineditor fresh;
+    clilexer l;
+    linedit_init(&fresh);
+    cli_lexerinit(&l);
+    linedit_resumablesyntaxcolor(&fresh, cli_lex, &l, cli_tokencolors);
+    linedit_syntaxcacheupdate(&fresh, &in);
+    
+    linedit_color a[TEST_MAXLENGTH], b[TEST_MAXLENGTH];
+    test_colors(edit, length, a);
+    test_colors(&fresh, length, b);
+    bool success=(memcmp(a, b, length*sizeof(linedit_color))==0);
+    if (!success) fprintf(stderr, "  coloring differs from a fresh tokenization of:\n%s\n", text);
+    
+    linedit_clear(&fresh);
+    cli_lexerclear(&l);
+    linedit_stringclear(&in);
+    return success;
+}
+
+/** Edits inside a string that spans several lines and interpolates values, as typing into it would */
+static bool test_syntaxcolormultilinestring(void) {
+    const char *steps[] = {
+        "var a = 1\nprint \"x ${a} y\n z ${a}\n w\"\nprint a\n",
+        "var a = 1\nprint \"x ${a} y\n zq ${a}\n w\"\nprint a\n",
+        "var a = 1\nprint \"x ${a} y\n zq ${a\n}\n w\"\nprint a\n",
+        "var a = 1\nprint \"x ${a} y\n zq ${a\n} \"b\nc\" ${\n a} \n w\"\nprint a\n",
+        "var a = 1\nprint \"x ${a} y\n zq ${a\n} \"b\nc\" ${\n a} \n w\n\"print a\n",
+        "var a = 1\nprint \"x ${\na} y\n zq ${a\n} \"b\nc\" ${\n ab} \n w\n\"print a\n",
+        "var a = 1\nprint x ${\na} y\n zq ${a\n} \"b\nc\" ${\n ab} \n w\n\"print a\n",
+        "var a = 1\nprint \"x ${\na} y\n zq ${a\n} \"b\nc\" ${\n ab} \n w\n\"print a\n"
+    };
+    
+    lineditor edit;
+    clilexer l;
+    linedit_init(&edit);
+    cli_lexerinit(&l);
+    linedit_resumablesyntaxcolor(&edit, cli_lex, &l, cli_tokencolors);
+    
+    bool success=true;
+    for (int i=0; i<(int) (sizeof(steps)/sizeof(steps[0])) && success; i++) success=test_syntaxmatches(&edit, steps[i]);
+    
+    /* Make random single character edits using characters that open and close strings and interpolations */
+    const char *alphabet="\"${}\n ab";
+    char text[TEST_MAXLENGTH];
+    snprintf(text, sizeof(text), "%s", steps[3]);
+    srand(1);
+    for (int i=0; i<TEST_RANDOMEDITS && success; i++) {
+        size_t length=strlen(text), posn=(size_t) rand()%(length+1);
+        char c=alphabet[rand()%strlen(alphabet)];
+        switch (rand()%3) {
+            case 0: /* Insert */
+                if (length+1<sizeof(text)/2) {
+                    memmove(text+posn+1, text+posn, length-posn+1);
+                    text[posn]=c;
+                }
+                break;
+            case 1: /* Delete */
+                if (posn<length) memmove(text+posn, text+posn+1, length-posn);
+                break;
+            default: /* Replace */
+                if (posn<length) text[posn]=c;
+        }
+        success=test_syntaxmatches(&edit, text);
+    }
+    
+    linedit_clear(&edit);
+    cli_lexerclear(&l);
+    TEST_CHECK(success);
+    return true;
+}
+
+/* **********************************************************************
+ * JSON records
+ * ********************************************************************** */
+
+static bool test_jsonvalue(const char **c);
+
+/** Skips whitespace within a record */
+static void test_jsonspace(const char **c) {
+    while (**c==' ' || **c=='\t') (*c)++;
+}
+
+/** Checks for a string */
+static bool test_jsonstring(const char **c) {
+    if (**c!='"') return false;
+    for ((*c)++; **c!='"'; (*c)++) {
+        if (**c=='\0' || **c=='\n') return false;
+        if (**c=='\\' && *(++(*c))=='\0') return false;
+    }
+    (*c)++;
+    return true;
+}
+
+/** Checks for an object or array, whose opening bracket has been found */
+static bool test_jsoncontainer(const char **c, char close, bool keys) {
+    (*c)++;
+    test_jsonspace(c);
+    if (**c==close) { (*c)++; return true; }
+    for (;;) {
+        if (keys) {
+            if (!test_jsonstring(c)) return false;
+            test_jsonspace(c);
+            if (**c!=':') return false;
+            (*c)++;
+        }
+        if (!test_jsonvalue(c)) return false;
+        test_jsonspace(c);
+        if (**c==close) { (*c)++; return true; }
+        if (**c!=',') return false;
+        (*c)++;
+    }
+}
+
+/** Checks for a value of any kind */
+static bool test_jsonvalue(const char **c) {
+    test_jsonspace(c);
+    if (**c=='{') return test_jsoncontainer(c, '}', true);
+    if (**c=='[') return test_jsoncontainer(c, ']', false);
+    if (**c=='"') return test_jsonstring(c);
+    
+    const char *words[] = { "true", "false", "null" };
+    for (int i=0; i<3; i++) {
+        if (strncmp(*c, words[i], strlen(words[i]))==0) { *c+=strlen(words[i]); return true; }
+    }
+    
+    char *end;
+    strtod(*c, &end);
+    if (end==*c) return false;
+    *c=end;
+    return true;
+}
+
+/** Checks that a line holds exactly one JSON object */
+static bool test_jsonrecord(const char *line) {
+    const char *c=line;
+    if (*c!='{' || !test_jsonvalue(&c)) return false;
+    test_jsonspace(&c);
+    return (*c=='\0');
+}
+
+/** Runs a batch job that prints several times, and checks each line of its output is a JSON record */
+static bool test_jsonlbatch(void) {
+    char script[]="/tmp/morpho6-testXXXXXX.m";
+    int fd=mkstemps(script, 2);
+    TEST_CHECK(fd>=0);
+    const char *src="print \"first\"\nprint \"second \\\"quoted\\\"\"\nfor (i in 1..3) print i\nvar a = [1]\nprint a[5]\n";
+    bool written=(write(fd, src, strlen(src))==(ssize_t) strlen(src));
+    close(fd);
+    
+    /* Collect the job's output from stdout */
+    char *out=NULL;
+    size_t size=0;
+    FILE *f=(written ? tmpfile() : NULL);
+    if (f) {
+        fflush(stdout);
+        int saved=dup(STDOUT_FILENO);
+        dup2(fileno(f), STDOUT_FILENO);
+        const char *files[] = { script };
+        clijobs_run(1, files, CLI_RUN | CLI_JSONL, 1, 1);
+        fflush(stdout);
+        dup2(saved, STDOUT_FILENO);
+        close(saved);
+        
+        long length=ftell(f);
+        if (length>0 && (out=malloc(length+1))) {
+            rewind(f);
+            size=fread(out, 1, length, f);
+            out[size]='\0';
+        }
+        fclose(f);
+    }
+    unlink(script);
+    TEST_CHECK(out);
+    
+    int nlines=0;
+    bool success=true;
+    for (char *line=strtok(out, "\n"); line && success; line=strtok(NULL, "\n"), nlines++) {
+        success=test_jsonrecord(line);
+        if (!success) fprintf(stderr, "  not a JSON record: %s\n", line);
+    }
+    free(out);
+    
+    TEST_CHECK(success);
+    TEST_CHECK(nlines==7); // Five prints, the error and the result
+    return true;
+}
+
+/* **********************************************************************
+ * Main
+ * ********************************************************************** */
+
+int main(int argc, const char *argv[]) {
+    for (int i=1; i<argc; i++) {
+        if (strncmp(argv[i], "-filter=", strlen("-filter="))==0) test_filter=argv[i]+strlen("-filter=");
+        else {
+            fprintf(stderr, "Usage: morpho6-test [-filter=text]\n");
+            return 1;
+        }
+    }
+    
+    morpho_initialize();
+    
+    test_run("syntaxcolor_multilinestring", test_syntaxcolormultilinestring);
+    test_run("jsonl_batch", test_jsonlbatch);
+    
+    morpho_finalize();
+    return test_nfailed;
+}